@@ -0,0 +1,74 @@
+# Helpers shared by the tests: running the binary, a scratch directory and MBR disk images built from scratch.
+import os
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+
+SECTOR = 512
+BIN = os.environ.get("WDDX32") or os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "wddx32")
+
+
+def fail(msg):
+    print("  " + msg)
+    sys.exit(1)
+
+
+def check(cond, msg):
+    if not cond:
+        fail(msg)
+
+
+def run(*args, rc=0):
+    """Runs wddx32 with args; fails the test unless it exits with rc (None accepts any). Returns stdout."""
+    p = subprocess.run([BIN] + [str(a) for a in args], stdout=subprocess.PIPE, stderr=subprocess.STDOUT, text=True)
+    if rc is not None and p.returncode != rc:
+        fail("wddx32 %s exited %d, expected %d:\n%s" % (" ".join(map(str, args)), p.returncode, rc, p.stdout))
+    return p.stdout
+
+
+class Scratch:
+    """A temporary directory the test works in; removed on success, kept on failure for a look."""
+
+    def __enter__(self):
+        self.dir = tempfile.mkdtemp(prefix="wddx32-test-")
+        return self
+
+    def path(self, name):
+        return os.path.join(self.dir, name)
+
+    def __exit__(self, kind, value, tb):
+        if kind is None:
+            shutil.rmtree(self.dir)
+        else:
+            print("  scratch kept in " + self.dir)
+        return False
+
+
+def read(path, offset=0, length=None):
+    with open(path, "rb") as f:
+        f.seek(offset)
+        return f.read() if length is None else f.read(length)
+
+
+def mbr_entry(kind, lba, sectors, boot=0):
+    return struct.pack("<B3sB3sII", boot, b"\0\0\0", kind, b"\0\0\0", lba, sectors)
+
+
+def mbr(entries):
+    """A boot sector holding up to four (type, lba, sectors) entries."""
+    m = bytearray(SECTOR)
+    for i, e in enumerate(entries):
+        m[446 + 16 * i:462 + 16 * i] = mbr_entry(*e)
+    m[510:512] = b"\x55\xaa"
+    return m
+
+
+def make_disk(path, size, sectors):
+    """Creates a size-byte image and writes {lba: bytes} into it."""
+    with open(path, "wb") as f:
+        f.truncate(size)
+        for lba, data in sectors.items():
+            f.seek(lba * SECTOR)
+            f.write(data)
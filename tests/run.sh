@@ -0,0 +1,20 @@
+#!/bin/sh
+# Builds wddx32 and runs every tests/test_*.py against it. Needs gcc, zlib and python3; the tests work on image
+# files in a scratch directory and never touch a real disk.
+set -u
+here=$(cd "$(dirname "$0")" && pwd)
+bin=${WDDX32:-}
+if [ -z "$bin" ]; then
+    bin=$(mktemp -d)/wddx32
+    gcc -O2 -Wall -Wextra -o "$bin" "$here/../wddx32.c" -lpthread -lz || exit 1
+fi
+failed=0
+for t in "$here"/test_*.py; do
+    if WDDX32="$bin" python3 "$t"; then
+        echo "PASS $(basename "$t")"
+    else
+        echo "FAIL $(basename "$t")"
+        failed=1
+    fi
+done
+exit $failed
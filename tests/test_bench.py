@@ -0,0 +1,31 @@
+# bench --quick on the smallest size: every source, format and engine in the quick matrix runs and succeeds, the
+# results file is a host record followed by one well-formed JSON object per run, and each run names the engine that
+# actually copied its data.
+import json
+from common import Scratch, check, run
+
+SOURCES = {"zero", "random", "mixed", "fat32", "ntfs", "ext4"}
+FIELDS = {"op", "source", "on", "format", "engine", "bs", "qd", "run", "ok", "bytes", "seconds", "mbps",
+          "cpuSecPerGB", "syscalls", "readP50Us", "readP99Us", "writeP99Us"}
+
+with Scratch() as s:
+    text = run("bench", "--dir", s.path("b"), "--size", "64M", "--runs", 1, "--quick")
+    check(" 0 failed" in text, "bench runs failed:\n" + text[-2000:])
+    lines = [json.loads(l) for l in open(s.path("b/bench.jsonl"))]
+    host, runs = lines[0], lines[1:]
+    check(host["type"] == "host" and host["size"] == 64 * 1024 * 1024 and host["quick"] is True, "host record %s" % host)
+    check(runs and all(r["type"] == "run" for r in runs), "records after the host record are not all runs")
+    missing = [sorted(FIELDS - set(r)) for r in runs if FIELDS - set(r)]
+    check(not missing, "run records lack fields: %s" % missing[:2])
+    check(all(r["ok"] and r["bytes"] > 0 and r["seconds"] > 0 for r in runs), "a run failed or moved no data")
+    for op in ("create", "write"):
+        check({r["source"] for r in runs if r["op"] == op} == SOURCES, "%s did not cover every source" % op)
+    check("%d runs, 0 failed" % len(runs) in text, "summary does not count the recorded runs")
+
+    # The engine is the one that ran: both for the raw block size cases, none for containers, which do not go through
+    # the raw copy.
+    for op in ("create", "write"):
+        for source in SOURCES:
+            ran = {r["engine"] for r in runs if r["op"] == op and r["source"] == source and r["format"] == "raw" and r["bs"]}
+            check(ran == {"uring", "threaded"}, "%s %s raw runs report engines %s" % (op, source, ran))
+    check(all(r["engine"] is None for r in runs if r["format"] != "raw"), "a container run reports a raw copy engine")
@@ -0,0 +1,44 @@
+# write --changed-only over a target that already holds most of the image: the target ends up byte for byte equal to
+# the image, and only the grains that differed are rewritten. Raw images go through the copy pipeline, wdx images
+# through the chunk restore workers, so both are covered.
+import os
+import re
+from common import Scratch, check, read, run
+
+MB = 1024 * 1024
+SIZE = 16 * MB
+EDITS = [(5000000, b"ZZZZ"), (9000000, os.urandom(8192)), (SIZE - 4096, b"\0" * 4096)]
+CHANGED = 4096 + 3 * 4096 + 4096       # the grains the edits touch
+
+
+def rewritten(text):
+    m = re.search(r"Changed only: ([0-9.]+) MB rewritten, ([0-9.]+) MB already matched", text)
+    check(m, "no changed-only summary in:\n" + text)
+    return float(m.group(1)) * MB, float(m.group(2)) * MB
+
+
+with Scratch() as s:
+    disk = s.path("disk.img")
+    with open(disk, "wb") as f:
+        f.write(os.urandom(SIZE))
+    raw, wdx = s.path("image.img"), s.path("image.wdx")
+    run("create", "--disk", disk, "--output", raw)
+    run("create", "--disk", disk, "--output", wdx, "--format", "wdx")
+
+    for image in (raw, wdx):
+        target = s.path("target.img")
+        with open(target, "wb") as f:
+            f.write(read(disk))
+            for offset, data in EDITS:
+                f.seek(offset)
+                f.write(data)
+        text = run("write", "--disk", target, "--input", image, "--changed-only")
+        check(read(target) == read(disk), "%s: target differs from the image after --changed-only" % image)
+        done, matched = rewritten(text)
+        check(abs(done - CHANGED) < 0.01 * MB, "%s: rewrote %d bytes, expected %d:\n%s" % (image, done, CHANGED, text))
+        check(abs(matched - (SIZE - CHANGED)) < 0.01 * MB, "%s: %d bytes matched:\n%s" % (image, matched, text))
+
+        # A second pass finds nothing left to rewrite.
+        done, _ = rewritten(run("write", "--disk", target, "--input", image, "--changed-only"))
+        check(done == 0, "%s: second --changed-only pass rewrote %d bytes" % (image, done))
+        check(read(target) == read(disk), "%s: second pass changed the target" % image)
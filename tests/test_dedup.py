@@ -0,0 +1,28 @@
+# Dedup store: two runs storing the same disk into one store at the same time must both produce manifests that
+# restore the disk, and leave no temporary chunk files behind.
+import os
+import subprocess
+from common import BIN, SECTOR, Scratch, check, make_disk, mbr, read, run
+
+with Scratch() as s:
+    disk = s.path("disk.img")
+    chunk = os.urandom(1024 * 1024)
+    data = b"".join(chunk if i % 3 == 0 else os.urandom(1024 * 1024) for i in range(24))
+    make_disk(disk, 32 * 1024 * 1024, {0: mbr([(0x83, 2048, 24 * 2048)]), 2048: data})
+    store = s.path("store")
+
+    runs = [subprocess.Popen([BIN, "create", "--disk", disk, "--output", s.path("d%d.man" % i), "--format", "dedup",
+                              "--store", store, "--threads", "4"], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+            for i in range(2)]
+    for i, p in enumerate(runs):
+        check(p.wait() == 0, "concurrent dedup run %d failed" % i)
+
+    leftovers = [n for _, _, names in os.walk(store) for n in names if n.endswith(".tmp")]
+    check(not leftovers, "temporary chunk files left in the store: %s" % leftovers[:3])
+    for i in range(2):
+        target = s.path("t%d.img" % i)
+        open(target, "wb").close()
+        run("write", "--disk", target, "--input", s.path("d%d.man" % i))
+        check(read(target) == read(disk), "manifest %d does not restore the disk" % i)
+    check("0 new chunks" in run("create", "--disk", disk, "--output", s.path("d2.man"), "--format", "dedup",
+                                "--store", store), "a third run stored chunks the store already had")
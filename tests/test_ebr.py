@@ -0,0 +1,82 @@
+# Logical drives: the EBR chain is followed link by link, a logical drive's image carries the MBR and every EBR up to
+# its own, write puts them back in place, and a chain that loops back is cut instead of followed.
+import os
+import struct
+from common import SECTOR, Scratch, check, make_disk, mbr, read, run
+
+MB = 1024 * 1024
+EXT = 4096                          # extended partition LBA
+EXT_SECTORS = 12288
+EBRS = [EXT, EXT + 4096, EXT + 8192]
+DATA = 1024                         # logical data starts this far after its EBR
+SECTORS = 2048
+
+
+def ebr(i, link=None):
+    """The EBR at EBRS[i]: its logical drive, and a link to the next EBR relative to the extended partition."""
+    e = bytearray(SECTOR)
+    e[446:462] = struct.pack("<B3sB3sII", 0, b"\0\0\0", 0x83, b"\0\0\0", DATA, SECTORS)
+    if link is None and i + 1 < len(EBRS):
+        link = EBRS[i + 1] - EXT
+    if link is not None:
+        e[462:478] = struct.pack("<B3sB3sII", 0, b"\0\0\0", 0x05, b"\0\0\0", link, 4096)
+    e[510:512] = b"\x55\xaa"
+    return bytes(e)
+
+
+def layout(path, data, last_link=None):
+    sectors = {0: mbr([(0x83, 2048, 2048), (0x0F, EXT, EXT_SECTORS)])}
+    for i, at in enumerate(EBRS):
+        sectors[at] = ebr(i, last_link if i == len(EBRS) - 1 else None)
+        if data:
+            sectors[at + DATA] = data[i]
+    make_disk(path, (EXT + EXT_SECTORS) * SECTOR, sectors)
+
+
+with Scratch() as s:
+    data = [os.urandom(SECTORS * SECTOR) for _ in EBRS]
+    disk = s.path("disk.img")
+    layout(disk, data)
+    src = read(disk)
+
+    # The third logical drive: its image holds the MBR, all three EBRs and its data, and ends where it ends.
+    image = s.path("p6.img")
+    text = run("create", "--disk", disk, "--part", 6, "--output", image)
+    check("EBR at LBA %d" % EBRS[2] in text, "logical drive 6 not found in the chain:\n" + text)
+    end = (EBRS[2] + DATA + SECTORS) * SECTOR
+    check(os.path.getsize(image) == end, "image size %d, expected %d" % (os.path.getsize(image), end))
+    check(read(image, 0, SECTOR)[446:] == src[446:SECTOR], "image MBR differs")
+    for at in EBRS:                 # the drive's own EBR entry comes out flagged bootable, like an MBR entry
+        got = bytearray(read(image, at * SECTOR, SECTOR))
+        check(got[446] == (0x80 if at == EBRS[2] else 0), "boot flag of the EBR at %d" % at)
+        got[446] = 0
+        check(got == src[at * SECTOR:(at + 1) * SECTOR], "EBR at %d not in the image" % at)
+    check(read(image, (EBRS[2] + DATA) * SECTOR) == data[2], "logical drive data differs")
+    for i in (0, 1):
+        check(not read(image, (EBRS[i] + DATA) * SECTOR, SECTORS * SECTOR).strip(b"\0"),
+              "data of logical drive %d leaked into the image" % (4 + i))
+
+    # The extended entry stands for its first logical drive; past the last one is refused.
+    check("using its first logical drive (4)" in run("create", "--disk", disk, "--part", 1, "--output", s.path("p1.img")),
+          "extended partition not taken as logical drive 4")
+    check(read(s.path("p1.img"), (EBRS[0] + DATA) * SECTOR) == data[0], "logical drive 4 data differs")
+    check("4-6" in run("create", "--disk", disk, "--part", 7, "--output", s.path("p7.img"), rc=1),
+          "logical drive 7 of 3 not refused")
+
+    # Written back to a disk with the same chain and other data, only the EBRs and the drive's own sectors change.
+    target = s.path("target.img")
+    layout(target, [os.urandom(SECTORS * SECTOR) for _ in EBRS])
+    before = bytearray(read(target))
+    before[EBRS[2] * SECTOR + 446] = 0x80           # the EBR comes back as the image has it, bootable
+    run("write", "--disk", target, "--part", 6, "--input", image)
+    after = read(target)
+    lo, hi = (EBRS[2] + DATA) * SECTOR, end
+    check(after[lo:hi] == data[2], "logical drive data not written")
+    check(after[:lo] == before[:lo] and after[hi:] == before[hi:], "write touched more than the chain and the drive")
+
+    # A chain whose last link points back at an earlier EBR is cut with a warning, not followed forever.
+    looped = s.path("looped.img")
+    layout(looped, data, last_link=EBRS[1] - EXT)
+    text = run("create", "--disk", looped, "--part", 6, "--output", s.path("l6.img"))
+    check("chain cut there" in text, "looping EBR link not reported:\n" + text)
+    check(read(s.path("l6.img"), (EBRS[2] + DATA) * SECTOR) == data[2], "logical drive of a looped chain differs")
@@ -0,0 +1,64 @@
+# --used-only on ext2/3/4: images of filesystems made by mkfs.ext4 in several layouts must fsck clean and hold every
+# file. Skipped when e2fsprogs is not installed.
+import filecmp
+import os
+import shutil
+import subprocess
+import sys
+from common import SECTOR, Scratch, check, make_disk, mbr, run
+
+START = 2048
+SIZE = 128 * 1024 * 1024
+LAYOUTS = [("ext4", []), ("ext4 no flex_bg", ["-O", "^flex_bg"]), ("ext4 1k blocks", ["-b", "1024"]),
+           ("ext4 no 64bit", ["-O", "^64bit"]), ("ext4 sparse_super2", ["-O", "sparse_super2"]),
+           ("ext2", ["-t", "ext2"]), ("ext3", ["-t", "ext3"])]
+
+if not all(shutil.which(t) for t in ("mkfs.ext4", "e2fsck", "debugfs")):
+    print("  skipped: e2fsprogs not installed")
+    sys.exit(0)
+
+
+def same_tree(a, b):
+    cmp = filecmp.dircmp(a, b, ignore=["lost+found"])
+    if cmp.left_only or cmp.right_only or cmp.funny_files:
+        return False
+    _, mismatch, errors = filecmp.cmpfiles(a, b, cmp.common_files, shallow=False)
+    return not mismatch and not errors and all(same_tree(os.path.join(a, d), os.path.join(b, d)) for d in cmp.common_dirs)
+
+
+with Scratch() as s:
+    src = s.path("src")
+    os.makedirs(os.path.join(src, "sub", "deeper"))
+    for i in range(40):
+        with open(os.path.join(src, "sub" if i % 2 else "", "f%d.bin" % i), "wb") as f:
+            f.write(os.urandom(1000 * (i * 37 % 900 + 1)))
+    with open(os.path.join(src, "sub", "deeper", "big.bin"), "wb") as f:
+        f.write(os.urandom(9 * 1024 * 1024))
+
+    for name, options in LAYOUTS:
+        fs = s.path("fs.img")
+        subprocess.run(["mkfs.ext4", "-q", "-F"] + options + ["-d", src, fs, str(SIZE // 1024)], check=True,
+                       stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        with open(fs, "rb") as f:
+            data = f.read()
+        disk = s.path("disk.img")
+        make_disk(disk, START * SECTOR + SIZE, {0: mbr([(0x83, START, SIZE // SECTOR)]), START: data})
+        out = s.path("p0.img")
+        text = run("create", "--disk", disk, "--part", 0, "--output", out, "--used-only")
+        check("In use:" in text, "%s: no allocation map was used:\n%s" % (name, text))
+
+        with open(out, "rb") as f:
+            f.seek(START * SECTOR)
+            part = f.read()
+        with open(fs, "wb") as f:
+            f.write(part)
+        fsck = subprocess.run(["e2fsck", "-fn", fs], stdout=subprocess.PIPE, stderr=subprocess.STDOUT, text=True)
+        check(fsck.returncode == 0, "%s: e2fsck found errors in the image:\n%s" % (name, fsck.stdout))
+        dump = s.path("dump")
+        os.mkdir(dump)
+        subprocess.run(["debugfs", "-R", "rdump / " + dump, fs], check=True, stdout=subprocess.DEVNULL,
+                       stderr=subprocess.DEVNULL)
+        check(same_tree(src, dump), "%s: files read back from the image differ" % name)
+        shutil.rmtree(dump)
+        for path in (fs, disk, out, out + ".wdh"):
+            os.remove(path)
@@ -0,0 +1,40 @@
+# Partition extraction from an image file in the kernel reuses the source image's sidecar digests for chunks it
+# copied whole, but only while that sidecar still describes the image: after the image changes, the extracted
+# partition must hash the same as one copied through the journaled pipeline.
+import os
+import re
+from common import Scratch, check, make_disk, mbr, read, run
+
+MB = 1024 * 1024
+
+
+def chunk_list(text):
+    m = re.search(r"SHA-256 \(chunk list\): ([0-9a-f]{64})", text)
+    check(m, "no chunk list digest in:\n" + text)
+    return m.group(1)
+
+
+with Scratch() as s:
+    disk = s.path("disk.img")
+    make_disk(disk, 16 * MB, {0: mbr([(0x83, 2048, 12 * 2048)]), 2048: os.urandom(12 * MB)})
+    source = s.path("source.img")
+    run("create", "--disk", disk, "--output", source)           # a disk image with its sidecar
+
+    def extract(name, *extra):
+        out = s.path(name)
+        text = run("create", "--disk", source, "--part", 0, "--output", out, *extra)
+        return chunk_list(text), read(out)
+
+    fresh, data = extract("p0.img")
+    check(fresh == extract("p0r.img", "--resume")[0], "kernel and pipeline extraction hash differently")
+
+    # Change a whole chunk of the partition behind the sidecar's back.
+    st = os.stat(source)
+    with open(source, "r+b") as f:
+        f.seek(4 * MB)
+        f.write(os.urandom(MB))
+    os.utime(source, ns=(st.st_atime_ns, st.st_mtime_ns + 5 * 10 ** 9))
+    kernel, data = extract("p1.img")
+    check(data[4 * MB:5 * MB] == read(source, 4 * MB, MB), "extracted partition lacks the change")
+    check(kernel != fresh, "the stale sidecar's digests were reused")
+    check(kernel == extract("p1r.img", "--resume")[0], "kernel extraction hashes unlike the pipeline after a change")
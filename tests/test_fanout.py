@@ -0,0 +1,38 @@
+# write to several disks at once: every target gets the image, and an image that no longer matches its sidecar
+# fails the write for all of them.
+import os
+from common import Scratch, check, make_disk, mbr, read, run
+
+MB = 1024 * 1024
+
+with Scratch() as s:
+    disk = s.path("disk.img")
+    make_disk(disk, 16 * MB, {0: mbr([(0x83, 2048, 15 * 2048)]), 2048: os.urandom(15 * MB)})
+    image = s.path("d.img")
+    run("create", "--disk", disk, "--output", image)
+    targets = [s.path("t%d.img" % i) for i in range(3)]
+
+    def write(rc):
+        for t in targets:
+            open(t, "wb").close()
+        args = ["write"]
+        for t in targets:
+            args += ["--disk", t]
+        return run(*args, "--input", image, "--verify", rc=rc)
+
+    text = write(0)
+    check(text.count("Verify OK") == len(targets), "not every target verified:\n" + text)
+    for t in targets:
+        check(read(t) == read(disk), "%s differs from the disk" % os.path.basename(t))
+
+    # Flip a byte without changing the image's size or time, as a bad read would.
+    st = os.stat(image)
+    with open(image, "r+b") as f:
+        f.seek(5 * MB)
+        b = f.read(1)
+        f.seek(5 * MB)
+        f.write(bytes([b[0] ^ 0xFF]))
+    os.utime(image, ns=(st.st_atime_ns, st.st_mtime_ns))
+    text = write(1)
+    check("Image check FAILED" in text, "corrupt image not caught:\n" + text)
+    check("Verifying" not in text, "targets verified against a corrupt image:\n" + text)
@@ -0,0 +1,124 @@
+# --used-only on FAT12/16/32 and exFAT: the reserved area, FATs and root directory plus the clusters the FAT (or
+# the exFAT allocation bitmap) marks in use are copied, free and bad clusters are not. A broken exFAT chain falls
+# back to copying the whole partition rather than trusting a made-up map.
+import os
+import struct
+from common import SECTOR, Scratch, check, make_disk, mbr, read, run
+
+START = 2048
+CLUSTER = 4096
+SPC = CLUSTER // SECTOR
+
+
+def fat_partition(bits):
+    sectors = (70000 if bits == 32 else 5000 if bits == 16 else 400) * SPC
+    part = bytearray(os.urandom(sectors * SECTOR))
+    reserved = 32 if bits == 32 else 1
+    fats = 2
+    root_entries = 0 if bits == 32 else 512
+    fat_sectors = (sectors // SPC + 2) * bits // 8 // SECTOR + 1
+
+    vbr = bytearray(SECTOR)
+    vbr[0:3] = b"\xeb\x58\x90"
+    vbr[3:11] = b"MSWIN4.1"
+    struct.pack_into("<HBHBHH", vbr, 0x0B, SECTOR, SPC, reserved, fats, root_entries, 0)
+    struct.pack_into("<I", vbr, 0x20, sectors)
+    if bits == 32:
+        struct.pack_into("<I", vbr, 0x24, fat_sectors)
+    else:
+        struct.pack_into("<H", vbr, 0x16, fat_sectors)
+    vbr[510:512] = b"\x55\xaa"
+    part[0:SECTOR] = vbr
+
+    first = reserved + fats * fat_sectors + (root_entries * 32 + SECTOR - 1) // SECTOR
+    clusters = (sectors - first) // SPC
+    check((12 if clusters < 4085 else 16 if clusters < 65525 else 32) == bits, "fixture is not FAT%d" % bits)
+    used = {2, 3, 4, 10, 11, clusters + 1, clusters // 2}
+    fat = bytearray(fat_sectors * SECTOR)
+
+    def set_entry(n, v):
+        if bits == 12:
+            at = n + n // 2
+            w = struct.unpack_from("<H", fat, at)[0]
+            w = (w & 0x000F) | (v << 4) if n & 1 else (w & 0xF000) | v
+            struct.pack_into("<H", fat, at, w)
+        elif bits == 16:
+            struct.pack_into("<H", fat, n * 2, v)
+        else:
+            struct.pack_into("<I", fat, n * 4, v)
+
+    for n in used:
+        set_entry(n, {12: 0xFFF, 16: 0xFFFF, 32: 0x0FFFFFFF}[bits])
+    set_entry(20, {12: 0xFF7, 16: 0xFFF7, 32: 0x0FFFFFF7}[bits])     # bad cluster: not copied
+    part[reserved * SECTOR:reserved * SECTOR + len(fat)] = fat
+
+    exp = bytearray(len(part))
+    exp[:first * SECTOR] = part[:first * SECTOR]
+    for n in used:
+        at = (first + (n - 2) * SPC) * SECTOR
+        exp[at:at + CLUSTER] = part[at:at + CLUSTER]
+    return part, exp
+
+
+def exfat_partition(broken=False):
+    sectors = 40000 * SPC
+    part = bytearray(os.urandom(sectors * SECTOR))
+    fat_offset, fat_length, heap = 128, 64, 256
+    clusters = (sectors - heap) // SPC
+    vbr = bytearray(SECTOR)
+    vbr[0:3] = b"\xeb\x76\x90"
+    vbr[3:11] = b"EXFAT   "
+    struct.pack_into("<QQIIIII", vbr, 0x40, START, sectors, fat_offset, fat_length, heap, clusters, 5)
+    vbr[0x6C] = 9                                                   # 512-byte sectors
+    vbr[0x6D] = 3                                                   # 8 sectors per cluster
+    vbr[0x6E] = 1
+    vbr[510:512] = b"\x55\xaa"
+    part[0:SECTOR] = vbr
+
+    # The allocation bitmap takes clusters 2 -> 3 (its FAT chain), the root directory is cluster 5. A broken volume
+    # has a free entry in the middle of the bitmap's chain.
+    fat = bytearray(fat_length * SECTOR)
+    struct.pack_into("<III", fat, 8, 0 if broken else 3, 0xFFFFFFFF, 0)
+    struct.pack_into("<I", fat, 20, 0xFFFFFFFF)
+    part[fat_offset * SECTOR:fat_offset * SECTOR + len(fat)] = fat
+
+    def cluster(n):
+        return heap * SECTOR + (n - 2) * CLUSTER
+
+    root = bytearray(CLUSTER)
+    root[0] = 0x83
+    root[32] = 0x81
+    struct.pack_into("<IQ", root, 32 + 20, 2, (clusters + 7) // 8)
+    root[64] = 0
+    part[cluster(5):cluster(5) + CLUSTER] = root
+    used = {2, 3, 5, 100, 101, 102, clusters + 1}
+    bitmap = bytearray((clusters + 7) // 8)
+    for n in used:
+        bitmap[(n - 2) >> 3] |= 1 << ((n - 2) & 7)
+    part[cluster(2):cluster(2) + len(bitmap)] = bitmap
+
+    if broken:
+        return part, part                                           # no map: the whole partition is copied
+    exp = bytearray(len(part))
+    exp[:heap * SECTOR] = part[:heap * SECTOR]
+    for n in used:
+        exp[cluster(n):cluster(n) + CLUSTER] = part[cluster(n):cluster(n) + CLUSTER]
+    return part, exp
+
+
+with Scratch() as s:
+    cases = [("FAT12", 0x01) + fat_partition(12), ("FAT16", 0x06) + fat_partition(16),
+             ("FAT32", 0x0C) + fat_partition(32), ("exFAT", 0x07) + exfat_partition(),
+             ("broken exFAT", 0x07) + exfat_partition(broken=True)]
+    for name, kind, part, exp in cases:
+        disk = s.path("disk.img")
+        out = s.path("p0.img")
+        make_disk(disk, START * SECTOR + len(part) + 65536, {0: mbr([(kind, START, len(part) // SECTOR)]), START: part})
+        text = run("create", "--disk", disk, "--part", 0, "--output", out, "--used-only")
+        if part is exp:
+            check("no allocation map" in text, "%s: a map was built from a broken chain:\n%s" % (name, text))
+        else:
+            check("In use:" in text, "%s: no allocation map was used:\n%s" % (name, text))
+        check(read(out, START * SECTOR) == exp, "%s: partition data differs from the clusters in use" % name)
+        for path in (disk, out, out + ".wdh"):
+            os.remove(path)
@@ -0,0 +1,132 @@
+# GPT partitions: create by number or GUID carries the protective MBR and the primary table, write puts a fresh
+# GPT sized to a blank target (protective MBR, primary and backup headers with valid CRCs), writes into the same
+# partition of an existing GPT, leaves an MBR-partitioned target alone and falls back to the backup GPT of a disk
+# whose primary header is damaged.
+import os
+import struct
+import uuid
+import zlib
+from common import SECTOR, Scratch, check, make_disk, read, run
+
+MB = 1024 * 1024
+HEADER = "<8sIIIIQQQQ16sQIII"
+PARTS = {0: (2048, 10239), 2: (10240, 30719)}
+
+
+def entries(parts):
+    e = bytearray(128 * 128)
+    for i, (first, last) in parts.items():
+        unique = uuid.UUID(int=(i + 1) << 64 | 0xabcdef).bytes_le
+        e[i * 128:(i + 1) * 128] = (uuid.UUID("0FC63DAF-8483-4772-8E79-3D69D8477DE4").bytes_le + unique +
+                                    struct.pack("<QQQ", first, last, 0) + ("p%d" % i).encode("utf-16le").ljust(72, b"\0"))
+    return bytes(e)
+
+
+def header(my, alt, entriesLBA, sectors, ent):
+    h = bytearray(struct.pack(HEADER, b"EFI PART", 0x10000, 92, 0, 0, my, alt, 34, sectors - 34, bytes(range(16)),
+                              entriesLBA, 128, 128, zlib.crc32(ent)))
+    h[16:20] = struct.pack("<I", zlib.crc32(h))
+    return bytes(h).ljust(SECTOR, b"\0")
+
+
+def protective(sectors):
+    m = bytearray(SECTOR)
+    m[446:462] = bytes([0, 0, 2, 0, 0xEE, 0xFF, 0xFF, 0xFF]) + struct.pack("<II", 1, min(sectors - 1, 0xFFFFFFFF))
+    m[510:512] = b"\x55\xaa"
+    return bytes(m)
+
+
+def gpt_disk(path, size, parts, data):
+    sectors = size // SECTOR
+    ent = entries(parts)
+    make_disk(path, size, {0: protective(sectors), 1: header(1, sectors - 1, 2, sectors, ent), 2: ent,
+                           sectors - 33: ent, sectors - 1: header(sectors - 1, 1, sectors - 33, sectors, ent), **data})
+
+
+def check_gpt(path, sectors, what):
+    """Both headers and entry arrays of a GPT on a disk of sectors sectors are valid and agree."""
+    disk = read(path)
+    check(disk[446:462] == protective(sectors)[446:462] and disk[510:512] == b"\x55\xaa",
+          "%s: protective MBR does not cover the disk: %s" % (what, disk[446:462].hex()))
+    found = []
+    for lba in (1, sectors - 1):
+        h = bytearray(disk[lba * SECTOR:lba * SECTOR + 92])
+        f = struct.unpack(HEADER, h)
+        crc = f[3]
+        h[16:20] = bytes(4)
+        check(f[0] == b"EFI PART" and crc == zlib.crc32(h), "%s: header at LBA %d or its CRC" % (what, lba))
+        check(f[5] == lba and f[6] == (sectors - 1 if lba == 1 else 1), "%s: my/alternate LBA at %d" % (what, lba))
+        check(f[8] <= sectors - 34, "%s: last usable LBA %d past the backup table" % (what, f[8]))
+        ent = disk[f[10] * SECTOR:f[10] * SECTOR + f[11] * f[12]]
+        check(zlib.crc32(ent) == f[13], "%s: entry array CRC at LBA %d" % (what, f[10]))
+        found.append(ent)
+    check(found[0] == found[1], "%s: primary and backup entries differ" % what)
+    return found[0]
+
+
+with Scratch() as s:
+    size = 32 * MB
+    disk = s.path("disk.img")
+    data = {first: os.urandom((last - first + 1) * SECTOR) for first, last in PARTS.values()}
+    gpt_disk(disk, size, PARTS, data)
+    src = read(disk)
+
+    # By number and by GUID: the image ends with the partition and carries the tables ahead of it.
+    image = s.path("p2.img")
+    run("create", "--disk", disk, "--part", 2, "--output", image)
+    by_guid = s.path("g2.img")
+    run("create", "--disk", disk, "--part", str(uuid.UUID(int=3 << 64 | 0xabcdef)).upper(), "--output", by_guid)
+    first, last = PARTS[2]
+    check(read(image) == read(by_guid), "partition by GUID differs from partition by number")
+    check(os.path.getsize(image) == (last + 1) * SECTOR, "image size %d" % os.path.getsize(image))
+    check(read(image, 0, 34 * SECTOR) == src[:34 * SECTOR], "image tables differ from the disk's")
+    check(read(image, first * SECTOR) == data[first], "image partition data differs")
+
+    # A blank target of another size gets a GPT of its own size.
+    target = s.path("blank.img")
+    with open(target, "wb") as f:
+        f.truncate(48 * MB)
+    run("write", "--disk", target, "--part", 2, "--input", image)
+    ent = check_gpt(target, 48 * MB // SECTOR, "blank target")
+    check(ent == entries(PARTS), "entries written to the blank target differ")
+    check(read(target, first * SECTOR, (last - first + 1) * SECTOR) == data[first], "partition data on blank target")
+
+    # The same GPT: only the partition's range is written.
+    same = s.path("same.img")
+    gpt_disk(same, size, PARTS, {})
+    before = read(same)
+    run("write", "--disk", same, "--part", 2, "--input", image)
+    after = read(same)
+    check(after[first * SECTOR:(last + 1) * SECTOR] == data[first], "partition data on the GPT target")
+    check(after[:first * SECTOR] == before[:first * SECTOR] and after[(last + 1) * SECTOR:] == before[(last + 1) * SECTOR:],
+          "writing a GPT partition touched more than its range")
+
+    # An MBR disk, or one whose only trace is a stray entry, is not overwritten with a GPT.
+    for name, boot in (("mbr", protective(1)[:446] + struct.pack("<BBBBBBBBII", 0, 0, 2, 0, 0x83, 0, 0, 0, 2048, 4096) +
+                        bytes(48) + b"\x55\xaa"),
+                       ("entry", bytes(446) + struct.pack("<BBBBBBBBII", 0, 0, 0, 0, 0x07, 0, 0, 0, 63, 100) + bytes(50))):
+        t = s.path(name + ".img")
+        make_disk(t, size, {0: boot})
+        before = read(t)
+        text = run("write", "--disk", t, "--part", 2, "--input", image, rc=1)
+        check("not blank" in text, "%s target not refused:\n%s" % (name, text))
+        check(read(t) == before, "%s target was written" % name)
+
+    # An entry outside the usable LBAs is not imaged.
+    bad = s.path("bad.img")
+    gpt_disk(bad, size, {0: (2048, size // SECTOR - 20)}, {})
+    text = run("create", "--disk", bad, "--part", 0, "--output", s.path("bad.out"), rc=1)
+    check("outside the usable area" in text, "partition past the last usable LBA accepted:\n" + text)
+
+    # A damaged primary header falls back to the backup, found through the primary's alternate LBA or, when that
+    # field is damaged too, in the last sector of the disk. The image gets the backup rewritten as its primary.
+    for name, offset, value in (("crc", 16, b"\0\0\0\0"), ("alternate", 32, struct.pack("<Q", 100))):
+        damaged = s.path("damaged-%s.img" % name)
+        with open(damaged, "wb") as f:
+            f.write(src)
+            f.seek(SECTOR + offset)
+            f.write(value)
+        out = s.path("damaged-%s.out" % name)
+        text = run("create", "--disk", damaged, "--part", 2, "--output", out)
+        check("using the backup table" in text, "%s: backup table not used:\n%s" % (name, text))
+        check(read(out) == read(image), "%s: image from the backup table differs" % name)
@@ -0,0 +1,85 @@
+# --used-only on NTFS: only the clusters set in $Bitmap (plus the backup boot sector) are copied, the rest of the
+# partition reads back as zeros, and with --no-sparse those zeros are written rather than left as holes.
+import os
+import struct
+from common import SECTOR, Scratch, check, make_disk, mbr, read, run
+
+START = 2048                # partition LBA
+CLUSTER = 4096
+CLUSTERS = 1024
+SIZE = CLUSTER * CLUSTERS
+ALLOCATED = set(range(0, 16)) | set(range(100, 200)) | {500}
+
+
+def ntfs_partition():
+    part = bytearray(os.urandom(SIZE))
+    vbr = bytearray(SECTOR)
+    vbr[0:3] = b"\xebR\x90"
+    vbr[3:11] = b"NTFS    "
+    struct.pack_into("<HB", vbr, 0x0B, SECTOR, CLUSTER // SECTOR)
+    struct.pack_into("<QQ", vbr, 0x28, SIZE // SECTOR - 1, 4)      # total sectors, $MFT cluster
+    vbr[0x40] = 0xF6                                                # 2^10 = 1024-byte MFT records
+    vbr[510:512] = b"\x55\xaa"
+    part[0:SECTOR] = vbr
+
+    # MFT record 6 ($Bitmap): a non-resident $DATA attribute whose single run is cluster 10.
+    rec = bytearray(1024)
+    rec[0:4] = b"FILE"
+    struct.pack_into("<HH", rec, 4, 0x30, 3)                        # update sequence array at 0x30, 3 entries
+    struct.pack_into("<H", rec, 0x14, 0x38)                         # first attribute
+    attr = bytearray(0x48)
+    struct.pack_into("<II", attr, 0, 0x80, 0x48)
+    attr[8] = 1
+    struct.pack_into("<H", attr, 0x20, 0x40)                        # runlist offset
+    struct.pack_into("<Q", attr, 0x30, CLUSTERS // 8)               # data size
+    attr[0x40:0x44] = bytes([0x11, 1, 10, 0])
+    rec[0x38:0x38 + len(attr)] = attr
+    struct.pack_into("<I", rec, 0x38 + len(attr), 0xFFFFFFFF)
+    rec[0x30:0x32] = b"\x01\x00"
+    for i in (1, 2):                                                # fixups
+        rec[0x30 + 2 * i:0x32 + 2 * i] = rec[i * SECTOR - 2:i * SECTOR]
+        rec[i * SECTOR - 2:i * SECTOR] = b"\x01\x00"
+    part[4 * CLUSTER + 6 * 1024:4 * CLUSTER + 7 * 1024] = rec
+
+    bitmap = bytearray(CLUSTERS // 8)
+    for c in ALLOCATED:
+        bitmap[c >> 3] |= 1 << (c & 7)
+    part[10 * CLUSTER:10 * CLUSTER + len(bitmap)] = bitmap
+    return part
+
+
+def expected(part):
+    exp = bytearray(SIZE)
+    for c in ALLOCATED | {CLUSTERS - 1}:                            # the last cluster holds the backup boot sector
+        exp[c * CLUSTER:(c + 1) * CLUSTER] = part[c * CLUSTER:(c + 1) * CLUSTER]
+    return exp
+
+
+with Scratch() as s:
+    part = ntfs_partition()
+    disk = s.path("disk.img")
+    make_disk(disk, START * SECTOR + SIZE + 1024 * 1024, {0: mbr([(0x07, START, SIZE // SECTOR)]), START: part})
+    exp = expected(part)
+
+    # --resume takes the copy pipeline instead of the in-kernel extraction and keeps an existing output file, so
+    # the stale bytes planted there must be overwritten with zeros wherever the partition is not in use.
+    # Every path must also hash the same image: gaps count as zeros wherever they are skipped.
+    chunks = (START * SECTOR + SIZE + 1024 * 1024 - 1) // (1024 * 1024)
+    digests = set()
+    for extra in ([], ["--no-sparse"], ["--resume"], ["--resume", "--no-sparse"]):
+        out = s.path("p0.img")
+        if "--resume" in extra:
+            with open(out, "wb") as f:
+                f.write(b"\xa5" * (START * SECTOR + SIZE))
+        text = run("create", "--disk", disk, "--part", 0, "--output", out, "--used-only", *extra)
+        check("In use:" in text, "no allocation map was used %s:\n%s" % (extra, text))
+        check(os.path.getsize(out) == START * SECTOR + SIZE, "image size %d %s" % (os.path.getsize(out), extra))
+        check(read(out, START * SECTOR) == exp, "partition data differs from the allocated clusters %s" % extra)
+        check(read(out, 446 + 4, 12) == read(disk, 446 + 4, 12) and read(out, 510, 2) == b"\x55\xaa",
+              "partition table not copied %s" % extra)
+        if "--no-sparse" in extra:
+            check(os.stat(out).st_blocks * 512 >= os.path.getsize(out), "--no-sparse left holes %s" % extra)
+        digests.add(read(out + ".wdh", 64, chunks * 32))
+        os.remove(out)
+        os.remove(out + ".wdh")
+    check(len(digests) == 1, "the copy paths hash the same image differently")
@@ -0,0 +1,60 @@
+# WDX overlays (create --base): an overlay restores the disk through its base, and refuses a base that was
+# modified or replaced after the overlay was made on it instead of reading wrong PARENT chunks from it.
+import os
+from common import SECTOR, Scratch, check, make_disk, mbr, read, run
+
+MB = 1024 * 1024
+
+
+def patch(path, offset, data):
+    with open(path, "r+b") as f:
+        f.seek(offset)
+        f.write(data)
+
+
+def restore(s, overlay, rc=0):
+    target = s.path("target.img")
+    open(target, "wb").close()
+    text = run("write", "--disk", target, "--input", overlay, rc=rc)
+    return text, read(target)
+
+
+with Scratch() as s:
+    disk = s.path("disk.img")
+    make_disk(disk, 16 * MB, {0: mbr([(0x83, 2048, 14 * 2048)]), 2048: os.urandom(14 * MB)})
+    base = s.path("base.wdx")
+    run("create", "--disk", disk, "--output", base, "--format", "wdx")
+
+    patch(disk, 5 * MB + 100, b"CHANGED!")
+    overlay = s.path("over.wdx")
+    text = run("create", "--disk", disk, "--output", overlay, "--base", base)
+    check("1 chunks changed" in text, "overlay did not store exactly the changed chunk:\n" + text)
+    text, data = restore(s, overlay)
+    check(data == read(disk), "overlay does not restore the disk")
+
+    # A touched base cannot be told from a modified one until it has been checked against its sidecar again, which
+    # any write from it does.
+    os.utime(base, (1, 1))
+    text, data = restore(s, overlay, rc=1)
+    check("has changed since overlay" in text, "a touched, unchecked base was accepted:\n" + text)
+    text, data = restore(s, base)
+    check("Image check OK" in text, "the base does not match its own sidecar:\n" + text)
+    text, data = restore(s, overlay)
+    check(data == read(disk), "a rechecked base is still refused:\n" + text)
+
+    # Replacing the base with another image of the same disk geometry must be refused.
+    other = s.path("other.img")
+    make_disk(other, 16 * MB, {0: mbr([(0x83, 2048, 14 * 2048)]), 2048: os.urandom(14 * MB)})
+    run("create", "--disk", other, "--output", base, "--format", "wdx")
+    text, data = restore(s, overlay, rc=1)
+    check("has changed since overlay" in text, "a replaced base was accepted:\n" + text)
+    check(data != read(disk)[:len(data)] or not data, "a replaced base produced data")
+
+    # A raw base modified after its sidecar was written: the stale sidecar must not be used for the new overlay.
+    raw = s.path("raw.img")
+    run("create", "--disk", disk, "--output", raw)
+    patch(raw, 9 * MB, b"EDITED IN PLACE")
+    patch(disk, 9 * MB, b"EDITED IN PLACE")
+    text = run("create", "--disk", disk, "--output", s.path("over2.wdx"), "--base", raw)
+    check("No current hash sidecar" in text and "0 chunks changed" in text,
+          "a stale base sidecar was trusted:\n" + text)
@@ -0,0 +1,80 @@
+# qcow2 output: the header, L1/L2 tables and refcounts are walked here as QEMU would, the data read through them
+# must be the disk, every cluster in use must be counted once, and write must restore the disk from the image.
+import os
+import struct
+from common import Scratch, check, make_disk, mbr, read, run
+
+MB = 1024 * 1024
+
+
+def be(fmt, data, offset):
+    return struct.unpack_from(">" + fmt, data, offset)[0]
+
+
+def qcow2_read(path):
+    """Returns the virtual disk of a qcow2 v3 image, checking its structure on the way."""
+    img = read(path)
+    check(img[0:4] == b"QFI\xfb" and be("I", img, 4) == 3, "not a qcow2 v3 header")
+    bits = be("I", img, 20)
+    cluster = 1 << bits
+    size, l1Size, l1Offset = be("Q", img, 24), be("I", img, 36), be("Q", img, 40)
+    rtOffset, rtClusters = be("Q", img, 48), be("I", img, 56)
+    check(be("Q", img, 8) == 0 and be("I", img, 32) == 0 and be("I", img, 60) == 0, "backing file, crypt or snapshots")
+    check(be("I", img, 96) == 4 and be("I", img, 100) >= 104, "refcount order or header length")
+    check(len(img) % cluster == 0, "file is not a whole number of clusters")
+    check(l1Size * (cluster // 8) * cluster >= size, "L1 table too small for the disk")
+
+    used = {0}
+    used.update(range(l1Offset // cluster, (l1Offset + l1Size * 8 + cluster - 1) // cluster))
+    used.update(range(rtOffset // cluster, rtOffset // cluster + rtClusters))
+    disk = bytearray(size)
+    for i in range(l1Size):
+        l2 = be("Q", img, l1Offset + 8 * i)
+        if l2 == 0:
+            continue
+        check(l2 >> 63, "L1 entry %d lacks the copied flag" % i)
+        l2 &= 0x00FFFFFFFFFFFE00
+        used.add(l2 // cluster)
+        for j in range(cluster // 8):
+            e = be("Q", img, l2 + 8 * j)
+            if e == 0 or e == 1:
+                continue
+            check(e >> 63 and not (e >> 62) & 1, "L2 entry %d/%d is not a plain copied cluster" % (i, j))
+            host = e & 0x00FFFFFFFFFFFE00
+            check(host % cluster == 0 and host + cluster <= len(img), "L2 entry %d/%d points outside" % (i, j))
+            check(host // cluster not in used, "cluster %d mapped twice" % (host // cluster))
+            used.add(host // cluster)
+            at = (i * (cluster // 8) + j) * cluster
+            disk[at:at + cluster] = img[host:host + cluster][:max(0, size - at)]
+
+    for k in range(rtClusters * cluster // 8):
+        block = be("Q", img, rtOffset + 8 * k)
+        if block:
+            used.add(block // cluster)
+    counts = {}
+    for k in range(rtClusters * cluster // 8):
+        block = be("Q", img, rtOffset + 8 * k)
+        for e in range(cluster // 2 if block else 0):
+            n = be("H", img, block + 2 * e)
+            if n:
+                counts[k * (cluster // 2) + e] = n
+    check(set(counts) == used and set(counts.values()) == {1},
+          "refcounts do not count each cluster in use once: %d counted, %d used" % (len(counts), len(used)))
+    return bytes(disk)
+
+
+with Scratch() as s:
+    disk = s.path("disk.img")
+    data = b"".join(os.urandom(MB) if i % 4 else bytes(MB) for i in range(20))      # some chunks all zeros
+    size = 21 * MB + 3 * 512                                                        # not a cluster multiple
+    make_disk(disk, size, {0: mbr([(0x83, 2048, 20 * 2048)]), 2048: data})
+
+    image = s.path("d.qcow2")
+    run("create", "--disk", disk, "--output", image, "--format", "qcow2")
+    check(qcow2_read(image) == read(disk), "qcow2 image does not read back as the disk")
+    check(os.path.getsize(image) < size - 4 * MB, "zero clusters were stored")
+
+    target = s.path("t.img")
+    open(target, "wb").close()
+    run("write", "--disk", target, "--input", image, "--verify")
+    check(read(target) == read(disk), "disk restored from qcow2 differs")
@@ -0,0 +1,51 @@
+# create --rescue: a disk that reads cleanly comes out identical with a map marking all of it rescued, and --resume
+# picks an interrupted rescue up from its map, reading only what the map has not marked rescued.
+import os
+from common import Scratch, check, make_disk, mbr, read, run
+
+MB = 1024 * 1024
+SIZE = 24 * MB
+
+
+def map_areas(path):
+    """The (offset, length, status) lines of a rescue map, after the current position line."""
+    lines = [l.split() for l in open(path) if l.strip() and not l.startswith("#")]
+    return lines[0], [(int(a, 16), int(b, 16), c) for a, b, c in lines[1:]]
+
+
+with Scratch() as s:
+    disk = s.path("disk.img")
+    make_disk(disk, SIZE, {0: mbr([(0x83, 2048, SIZE // 512 - 2048)]), 2048: os.urandom(SIZE - MB)})
+
+    out = s.path("r.img")
+    text = run("create", "--disk", disk, "--output", out, "--rescue")
+    check(read(out) == read(disk), "rescued image differs from the disk")
+    pos, areas = map_areas(out + ".wdm")
+    check(pos[1] == "+", "map not marked finished: %s" % pos)
+    check(areas == [(0, SIZE, "+")], "map of a clean disk: %s" % areas)
+    check(os.path.exists(out + ".wdh"), "no hash sidecar after a rescue:\n" + text)
+
+    # An interrupted rescue: the first half is in the image and marked rescued, a failed block in the middle and
+    # the rest untried. Planted bytes in the rescued half show it is not read again.
+    half = SIZE // 2
+    with open(out, "wb") as f:
+        f.write(b"\x5a" * half)
+    with open(out + ".wdm", "w") as f:
+        f.write("0x%08X  ?\n" % half)
+        f.write("0x%08X  0x%08X  +\n" % (0, half))
+        f.write("0x%08X  0x%08X  *\n" % (half, MB))
+        f.write("0x%08X  0x%08X  ?\n" % (half + MB, SIZE - half - MB))
+    text = run("create", "--disk", disk, "--output", out, "--rescue", "--resume")
+    check("Resuming rescue" in text, "map not picked up:\n" + text)
+    check(read(out, 0, half) == b"\x5a" * half, "resume read again what the map had as rescued")
+    check(read(out, half) == read(disk, half), "resume did not rescue the rest of the disk")
+    pos, areas = map_areas(out + ".wdm")
+    check(pos[1] == "+" and all(a[2] == "+" for a in areas), "resumed map not finished: %s %s" % (pos, areas))
+    check(sum(a[1] for a in areas) == SIZE, "resumed map does not cover the disk: %s" % areas)
+
+    # A map for another range is not resumed from.
+    with open(out + ".wdm", "w") as f:
+        f.write("0x00000000  ?\n0x00000000  0x%08X  ?\n" % MB)
+    text = run("create", "--disk", disk, "--output", out, "--rescue", "--resume")
+    check("Nothing to resume" in text, "a map of the wrong size was resumed from:\n" + text)
+    check(read(out) == read(disk), "fresh rescue after a bad map differs from the disk")
@@ -0,0 +1,79 @@
+# Partition copies that stop early are failures: a partition table that claims more than the disk holds makes both
+# create --part and write --part exit nonzero instead of warning and reporting success. An interrupted create resumes
+# from its journal without copying the finished segments again.
+import os
+import resource
+import signal
+import subprocess
+from common import BIN, Scratch, check, fail, make_disk, mbr, read, run
+
+MB = 1024 * 1024
+STEP = 256 * MB             # JOURNAL_STEP
+SIZE = 640 * MB
+LIMIT = 576 * MB            # output size past the second checkpoint where the interrupted run stops
+
+
+def limited():
+    signal.signal(signal.SIGXFSZ, signal.SIG_IGN)          # writes past the limit fail with EFBIG instead
+    resource.setrlimit(resource.RLIMIT_FSIZE, (LIMIT, resource.RLIM_INFINITY))
+
+
+def interrupted(disk, out):
+    """Runs a create that fails writing past LIMIT, leaving the journal of two finished segments."""
+    p = subprocess.run([BIN, "create", "--disk", disk, "--output", out], preexec_fn=limited,
+                       stdout=subprocess.PIPE, stderr=subprocess.STDOUT, text=True)
+    if p.returncode != 1 or not os.path.exists(out + ".wdj"):
+        fail("create past the size limit exited %d and left no journal:\n%s" % (p.returncode, p.stdout))
+
+
+def same(a, b, offset, length):
+    with open(a, "rb") as fa, open(b, "rb") as fb:
+        fa.seek(offset)
+        fb.seek(offset)
+        while length > 0:
+            n = min(length, 16 * MB)
+            if fa.read(n) != fb.read(n):
+                return False
+            length -= n
+    return True
+
+
+with Scratch() as s:
+    short = s.path("short.img")
+    make_disk(short, 16 * MB, {0: mbr([(0x83, 2048, 40 * 2048)]), 2048: os.urandom(15 * MB)})
+    run("create", "--disk", short, "--part", 0, "--output", s.path("p.img"), rc=1)
+    run("create", "--disk", short, "--part", 0, "--output", s.path("pr.img"), "--resume", rc=1)
+    target = s.path("target.img")
+    with open(target, "wb") as f:
+        f.truncate(64 * MB)
+    run("write", "--disk", target, "--part", 0, "--input", short, rc=1)
+
+with Scratch() as s:
+    disk = s.path("disk.img")
+    block = os.urandom(MB)
+    with open(disk, "wb") as f:
+        for i in range(SIZE // MB):
+            f.write(block[i:] + block[:i])
+    out = s.path("out.img")
+
+    # An interrupted create leaves its journal behind, and --resume carries on from the last checkpoint. A journal
+    # whose last record was torn off resumes from the checkpoint before it.
+    interrupted(disk, out)
+    with open(out + ".wdj", "r+b") as f:
+        f.truncate(os.path.getsize(out + ".wdj") - 100)
+    text = run("create", "--disk", disk, "--output", out, "--resume")
+    check("Resuming at offset %d" % STEP in text, "torn journal not resumed from the first checkpoint:\n" + text)
+    check(same(out, disk, 0, SIZE), "resumed image differs from the disk")
+    check(not os.path.exists(out + ".wdj"), "journal left behind after the resumed create succeeded")
+
+    # Bytes planted in a finished segment survive the resume: what the journal has as done is not copied again.
+    interrupted(disk, out)
+    marker = b"\x5a" * MB
+    with open(out, "r+b") as f:
+        f.seek(100 * MB)
+        f.write(marker)
+    text = run("create", "--disk", disk, "--output", out, "--resume")
+    check("Resuming at offset %d" % (2 * STEP) in text, "not resumed from the second checkpoint:\n" + text)
+    check(read(out, 100 * MB, MB) == marker, "resume copied a finished segment again")
+    check(same(out, disk, 0, 100 * MB) and same(out, disk, 101 * MB, SIZE - 101 * MB),
+          "resumed image differs from the disk outside the planted bytes")
@@ -0,0 +1,75 @@
+# --telemetry streams JSON lines: a start record, progress records at the interval and an end record with the outcome,
+# the engine and the latency histograms, to a file or to an inherited fd:N. An fd that is not a number or not open
+# is refused before anything runs.
+import json
+import os
+import subprocess
+from common import BIN, Scratch, check, run
+
+MB = 1024 * 1024
+SIZE = 64 * MB
+STAGES = ("read", "compute", "write")
+
+
+def records(path):
+    with open(path) as f:
+        lines = f.read().splitlines()
+    try:
+        return [json.loads(l) for l in lines]
+    except ValueError as e:
+        check(False, "telemetry line is not JSON (%s):\n%s" % (e, "\n".join(lines[:5])))
+
+
+def check_stream(recs, op, ok, what):
+    check(len(recs) >= 2, "%s: %d records" % (what, len(recs)))
+    start, progress, end = recs[0], recs[1:-1], recs[-1]
+    check(start["type"] == "start" and start["op"] == op and start["intervalMs"] == 20, "%s: start %s" % (what, start))
+    check(all(r["type"] == "progress" and r["op"] == op for r in progress), "%s: not all progress between" % what)
+    done = [r["bytes"] for r in progress]
+    check(done == sorted(done) and all(0 <= b <= r["total"] for b, r in zip(done, progress)),
+          "%s: progress bytes go backwards or past the total: %s" % (what, done))
+    check(all(set(r["latency"]) == set(STAGES) and set(r["queues"]) == set(STAGES) for r in progress),
+          "%s: progress record without per-stage latency and queues" % what)
+    check(end["type"] == "end" and end["op"] == op and end["ok"] is ok, "%s: end %s" % (what, end))
+    check(set(end["latency"]) == set(STAGES), "%s: end latency %s" % (what, end["latency"]))
+    return progress, end
+
+
+with Scratch() as s:
+    disk = s.path("disk.img")
+    with open(disk, "wb") as f:
+        f.write(os.urandom(SIZE))
+    image = s.path("image.img")
+
+    # To a file: a create with progress along the way.
+    log = s.path("create.jsonl")
+    run("create", "--disk", disk, "--output", image, "--telemetry", log, "--telemetry-interval", 20)
+    progress, end = check_stream(records(log), "create", True, "create")
+    check(progress and all(r["total"] == SIZE for r in progress), "create: progress total is not the disk size")
+    check(end["bytes"] == SIZE and end["engine"] in ("uring", "threaded", "mixed"), "create: end %s" % end)
+    check(end["latency"]["read"]["requests"] > 0 and end["latency"]["read"]["buckets"], "create: no read histogram")
+
+    # To an inherited descriptor: a write.
+    target = s.path("target.img")
+    with open(target, "wb") as f:
+        f.truncate(SIZE)
+    log = s.path("write.jsonl")
+    with open(log, "wb") as f:
+        p = subprocess.run([BIN, "write", "--disk", target, "--input", image, "--telemetry", "fd:%d" % f.fileno(),
+                            "--telemetry-interval", "20"], pass_fds=(f.fileno(),), stdout=subprocess.PIPE,
+                           stderr=subprocess.STDOUT, text=True)
+    check(p.returncode == 0, "write with telemetry to an fd exited %d:\n%s" % (p.returncode, p.stdout))
+    check_stream(records(log), "write", True, "write")
+
+    # A failed run still ends its stream, with ok false.
+    log = s.path("failed.jsonl")
+    run("create", "--disk", disk, "--output", s.path("missing/image.img"), "--telemetry", log,
+        "--telemetry-interval", 20, rc=1)
+    check_stream(records(log), "create", False, "failed create")
+
+    # Descriptors that are not numbers, negative or not open are refused before the create runs.
+    for fd in ("abc", "", "3x", "-1", "57"):
+        out = s.path("refused.img")
+        text = run("create", "--disk", disk, "--output", out, "--telemetry", "fd:" + fd, rc=1)
+        check("not an open file descriptor" in text, "fd:%s accepted:\n%s" % (fd, text))
+        check(not os.path.exists(out), "fd:%s refused only after the create ran" % fd)
@@ -0,0 +1,21 @@
+# Device tuning before a raw write probes by rewriting the target in place, except for --changed-only and --resume
+# writes, which leave most of the target alone and so are probed with reads only.
+import os
+from common import Scratch, check, make_disk, mbr, run
+
+MB = 1024 * 1024
+
+with Scratch() as s:
+    os.environ["HOME"] = s.dir                  # the tuning profile goes here, not into the real home
+    disk = s.path("disk.img")
+    size = 300 * MB                             # the probe needs a range of at least 256 MB
+    make_disk(disk, size, {0: mbr([(0x83, 2048, size // 512 - 2048)]), 4096: os.urandom(MB)})
+    image = s.path("d.img")
+    run("create", "--disk", disk, "--output", image)
+    target = s.path("t.img")
+    with open(target, "wb") as f:
+        f.truncate(size)
+
+    for extra, mode in (([], "writes"), (["--changed-only"], "reads"), (["--resume"], "reads")):
+        text = run("write", "--disk", target, "--input", image, "--retune", *extra)
+        check("Tuning %s for %s" % (target, mode) in text, "%s write not probed with %s:\n%s" % (extra, mode, text))
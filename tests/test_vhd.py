@@ -0,0 +1,116 @@
+# VHD and VHDX output: checksums, headers and region tables are checked as Hyper-V would, and the disk read through
+# the block allocation table must be the source disk, with all-zero blocks left out.
+import os
+import struct
+from common import Scratch, check, make_disk, mbr, read, run
+
+MB = 1024 * 1024
+BLOCK = 2 * MB
+CRC32C = []
+for n in range(256):
+    for _ in range(8):
+        n = (n >> 1) ^ (0x82F63B78 if n & 1 else 0)
+    CRC32C.append(n)
+
+
+def crc32c(data):
+    crc = 0xFFFFFFFF
+    for b in data:
+        crc = CRC32C[(crc ^ b) & 0xFF] ^ (crc >> 8)
+    return crc ^ 0xFFFFFFFF
+
+
+def ones_sum(data, field):
+    """The one's complement sum VHD footers and headers carry, with the checksum field taken as zero."""
+    d = bytearray(data)
+    d[field:field + 4] = bytes(4)
+    return (~sum(d)) & 0xFFFFFFFF
+
+
+def vhd_read(path, size):
+    img = read(path)
+    footer = img[-512:]
+    check(img[:512] == footer, "footer copy differs from the footer")
+    check(footer[0:8] == b"conectix" and struct.unpack_from(">I", footer, 60)[0] == 3, "not a dynamic VHD footer")
+    check(struct.unpack_from(">I", footer, 64)[0] == ones_sum(footer, 64), "footer checksum")
+    check(struct.unpack_from(">QQ", footer, 40) == (size, size), "footer disk size")
+    header = img[512:1536]
+    check(header[0:8] == b"cxsparse" and struct.unpack_from(">I", header, 36)[0] == ones_sum(header, 36),
+          "dynamic header or its checksum")
+    batOffset, _, blocks, blockSize = struct.unpack_from(">QIII", header, 16)
+    check(blockSize == BLOCK and blocks == (size + BLOCK - 1) // BLOCK, "block size or count")
+    disk, stored = bytearray(size), 0
+    for i in range(blocks):
+        sector = struct.unpack_from(">I", img, batOffset + 4 * i)[0]
+        if sector == 0xFFFFFFFF:
+            continue
+        at = sector * 512
+        check(img[at:at + 512] == b"\xff" * 512, "block %d sector bitmap" % i)
+        disk[i * BLOCK:(i + 1) * BLOCK] = img[at + 512:at + 512 + BLOCK][:size - i * BLOCK]
+        stored += 1
+    return bytes(disk), stored
+
+
+def vhdx_read(path, size):
+    img = read(path)
+    check(img[0:8] == b"vhdxfile", "file identifier")
+    seqs = []
+    for off in (64 * 1024, 128 * 1024):
+        h = bytearray(img[off:off + 4096])
+        check(h[0:4] == b"head", "header signature at %d" % off)
+        crc = struct.unpack_from("<I", h, 4)[0]
+        h[4:8] = bytes(4)
+        check(crc == crc32c(h), "header checksum at %d" % off)
+        check(h[48:64] == bytes(16), "log not empty")
+        seqs.append(struct.unpack_from("<Q", h, 8)[0])
+    check(seqs[0] != seqs[1], "both headers have the same sequence number")
+    regions = {}
+    for off in (192 * 1024, 256 * 1024):
+        t = bytearray(img[off:off + 64 * 1024])
+        crc = struct.unpack_from("<I", t, 4)[0]
+        t[4:8] = bytes(4)
+        check(t[0:4] == b"regi" and crc == crc32c(t), "region table or its checksum at %d" % off)
+        for i in range(struct.unpack_from("<I", t, 8)[0]):
+            guid, offset, length, _ = struct.unpack_from("<16sQII", t, 16 + 32 * i)
+            check(offset % MB == 0 and length % MB == 0, "region not 1 MB aligned")
+            regions[guid] = (offset, length)
+    bat = regions[bytes.fromhex("6677c22d23f600429d64115e9bfd4a08")]
+    meta = regions[bytes.fromhex("06a27c8b90479a4bb8fe575f050f886e")]
+
+    m = img[meta[0]:meta[0] + meta[1]]
+    check(m[0:8] == b"metadata", "metadata table signature")
+    items = {}
+    for i in range(struct.unpack_from("<H", m, 10)[0]):
+        guid, offset, length, _ = struct.unpack_from("<16sIII", m, 32 + 32 * i)
+        items[guid] = m[offset:offset + length]
+    check(struct.unpack("<I", items[bytes.fromhex("3767a1ca36fa434db3b633f0aa44e76b")][:4])[0] == BLOCK, "block size")
+    check(struct.unpack("<Q", items[bytes.fromhex("2442a52f1bcd7648b2115dbed83bf4b8")])[0] == size, "disk size")
+    check(struct.unpack("<I", items[bytes.fromhex("1dbf41816fa90947ba47f233a8faab5f")])[0] == 512, "logical sector")
+
+    ratio = (1 << 23) * 512 // BLOCK
+    disk, stored, blocks = bytearray(size), 0, (size + BLOCK - 1) // BLOCK
+    for i in range(blocks):
+        e = struct.unpack_from("<Q", img, bat[0] + 8 * (i + i // ratio))[0]
+        state, at = e & 7, e & ~(MB - 1)
+        check(state in (0, 6), "block %d state %d" % (i, state))
+        if state == 6:
+            check(at % MB == 0 and at + BLOCK <= len(img), "block %d offset" % i)
+            disk[i * BLOCK:(i + 1) * BLOCK] = img[at:at + BLOCK][:size - i * BLOCK]
+            stored += 1
+    return bytes(disk), stored
+
+
+with Scratch() as s:
+    disk = s.path("disk.img")
+    data = b"".join(os.urandom(BLOCK) if i % 3 else bytes(BLOCK) for i in range(9))
+    size = 19 * MB + 512                                # a partial last block
+    make_disk(disk, size, {0: mbr([(0x83, 2048, 18 * 2048)]), 2048: data})
+    src = read(disk)
+    nonzero = sum(1 for i in range(0, size, BLOCK) if src[i:i + BLOCK].strip(b"\0"))
+
+    for fmt, reader in (("vhd", vhd_read), ("vhdx", vhdx_read)):
+        image = s.path("d." + fmt)
+        run("create", "--disk", disk, "--output", image, "--format", fmt)
+        got, stored = reader(image, size)
+        check(got == src, "%s does not read back as the disk" % fmt)
+        check(stored == nonzero, "%s stored %d blocks, %d hold data" % (fmt, stored, nonzero))
@@ -0,0 +1,87 @@
+# streamOptimized VMDK output: the stream is walked marker by marker as an importer reads it, the grains are
+# resolved through the grain tables and the directory the footer names, and the disk they give must be the source.
+import os
+import struct
+import zlib
+from common import Scratch, check, fail, make_disk, mbr, read, run
+
+MB = 1024 * 1024
+GRAIN = 64 * 1024
+HEADER = "<IIIQQQQIQQQB4cH"
+
+
+def header(data, what):
+    f = struct.unpack_from(HEADER, data, 0)
+    check(data[0:4] == b"KDMV" and f[1] == 3, "%s magic or version" % what)
+    check(f[2] & (1 << 16) and f[2] & (1 << 17) and f[-1] == 1, "%s lacks compressed grains and markers" % what)
+    return {"capacity": f[3], "grain": f[4] * 512, "descOffset": f[5], "descSize": f[6], "gtes": f[7],
+            "gdOffset": f[9], "overhead": f[10]}
+
+
+def vmdk_read(path):
+    img = read(path)
+    h = header(img, "header")
+    check(h["grain"] == GRAIN and h["gdOffset"] == 0xFFFFFFFFFFFFFFFF, "stream header fields")
+    desc = img[h["descOffset"] * 512:(h["descOffset"] + h["descSize"]) * 512].rstrip(b"\0").decode()
+    check('createType="streamOptimized"' in desc and "RW %d SPARSE" % h["capacity"] in desc, "descriptor:\n" + desc)
+
+    # Walk the stream: every grain starts a sector, metadata markers give the sectors that follow them.
+    grains, tables, footer, pos = {}, {}, None, h["overhead"] * 512
+    while True:
+        check(pos % 512 == 0 and pos + 512 <= len(img), "stream runs past the end of the file")
+        value, size = struct.unpack_from("<QI", img, pos)
+        if size:
+            check(value % (GRAIN // 512) == 0 and value * 512 < h["capacity"] * 512, "grain LBA %d" % value)
+            check(value not in grains, "grain at LBA %d stored twice" % value)
+            grains[value] = (pos // 512, zlib.decompress(img[pos + 12:pos + 12 + size]))
+            pos += (12 + size + 511) // 512 * 512
+            continue
+        kind = struct.unpack_from("<I", img, pos + 12)[0]
+        if kind == 0:
+            check(pos + 512 == len(img), "data after the end-of-stream marker")
+            break
+        body = img[pos + 512:pos + 512 + value * 512]
+        if kind == 1:
+            tables[pos // 512 + 1] = struct.unpack_from("<%dI" % h["gtes"], body)
+        elif kind == 2:
+            gd = (pos // 512 + 1, body)
+        elif kind == 3:
+            footer = header(body, "footer")
+        else:
+            fail("unknown marker type %d" % kind)
+        pos += 512 + value * 512
+
+    check(footer is not None and footer["capacity"] == h["capacity"], "footer missing or for another size")
+    check(footer["gdOffset"] == gd[0], "footer does not name the grain directory")
+    entries = (h["capacity"] * 512 + GRAIN * h["gtes"] - 1) // (GRAIN * h["gtes"])
+    directory = struct.unpack_from("<%dI" % entries, gd[1])
+    disk, seen = bytearray(h["capacity"] * 512), set()
+    for i, gt in enumerate(directory):
+        if gt == 0:
+            continue
+        check(gt in tables, "directory entry %d does not point at a grain table" % i)
+        for j, sector in enumerate(tables[gt]):
+            if sector == 0:
+                continue
+            lba = (i * h["gtes"] + j) * GRAIN // 512
+            check(lba in grains and grains[lba][0] == sector, "table entry for LBA %d is not its grain" % lba)
+            seen.add(lba)
+            disk[lba * 512:lba * 512 + GRAIN] = grains[lba][1][:len(disk) - lba * 512]
+    check(seen == set(grains), "grains not reachable through the tables: %s" % sorted(set(grains) - seen)[:4])
+    return bytes(disk), len(grains)
+
+
+with Scratch() as s:
+    disk = s.path("disk.img")
+    data = bytearray(os.urandom(40 * MB))
+    data[8 * MB:24 * MB] = bytes(16 * MB)                       # a whole grain table's worth of empty grains
+    size = 41 * MB + 5 * 512                                    # a partial last grain
+    make_disk(disk, size, {0: mbr([(0x83, 2048, 40 * 2048)]), 2048: bytes(data)})
+    src = read(disk)
+
+    image = s.path("d.vmdk")
+    run("create", "--disk", disk, "--output", image, "--format", "vmdk", "--threads", 4)
+    got, stored = vmdk_read(image)
+    check(got[:size] == src and not got[size:].strip(b"\0"), "VMDK does not read back as the disk")
+    nonzero = sum(1 for i in range(0, size, GRAIN) if src[i:i + GRAIN].strip(b"\0"))
+    check(stored == nonzero, "%d grains stored, %d hold data" % (stored, nonzero))
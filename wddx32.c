@@ -1,10 +1,50 @@
+#ifndef _WIN32
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include <stdlib.h>
-#include <windows.h>
 #include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <zlib.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+#endif
+typedef uint8_t  BYTE;
+typedef uint16_t WORD;
+typedef uint32_t DWORD;
+typedef int      BOOL;
+typedef long long LONGLONG;
+typedef unsigned long long ULONGLONG;
+#define TRUE  1
+#define FALSE 0
+#endif
 
 #define SECTOR_SIZE 512
 #define BUFFER_SIZE (16 * 1024 * 1024)
+#define DIRECT_ALIGN 4096       // buffer/offset/length alignment that satisfies O_DIRECT and FILE_FLAG_NO_BUFFERING
 
 #pragma pack(push, 1)
 typedef struct {
@@ -30,8 +70,10 @@ typedef struct {
     BYTE bootCode[446];
     PARTITION_ENTRY partition;
     PARTITION_ENTRY nextPartition;
+    PARTITION_ENTRY unused[2];
     WORD signature; // 0xAA55
 } EBR;
+#pragma pack(pop)
 
 const char* get_fs_type_mbr(BYTE systemID) {
     switch (systemID) {
@@ -43,460 +85,7953 @@ const char* get_fs_type_mbr(BYTE systemID) {
         case 0x0C: return "FAT32 (LBA)";
         case 0x0E: return "FAT16 (LBA)";
         case 0x0F: return "Extended (LBA)";
+        case 0x82: return "Linux swap";
+        case 0x83: return "Linux";
         case 0xEE: return "GPT Protective MBR";
         default: return "Unknown";
     }
 }
 //================================================================================================================
+// I/O statistics. While g_iostat.enabled (bench and --telemetry turn it on) every device request, and every
+// block hashed, compressed or decompressed, is timed into a latency histogram; otherwise a request costs one extra
+// branch. Buckets are log-linear, four per power of two, so a percentile read back from them is within 25% of the
+// true value. Stage gauges count the blocks sitting in each stage of whatever pipeline is running, and g_progress
+// the bytes the command has finished; both are kept up to date whether or not anyone is collecting.
 
+#define LAT_BUCKETS 256
 
+#define STAGE_READ    0         // requests out to the source
+#define STAGE_COMPUTE 1         // blocks waiting for or going through hashing, compression or decompression
+#define STAGE_WRITE   2         // blocks read and waiting for or being written to the target
+#define STAGES        3
 
-void crtFullDiskImage(int diskNum, const char* outFile) {
-    printf("\n--------------crtFullDiskImage----------------\n Disk=%d   %s\n", diskNum, outFile);
-    //return;
+#define PROGRESS_INTERVAL_NS 100000000ULL      // console progress lines at most ten times a second
+
+typedef struct {
+    volatile LONGLONG count[LAT_BUCKETS];
+    volatile LONGLONG requests;
+    volatile LONGLONG bytes;
+} LAT_HIST;
 
-   char diskPath[64];
-    sprintf(diskPath, "\\\\.\\PhysicalDrive%d", diskNum);
+typedef struct {
+    BOOL enabled;
+    LAT_HIST read;
+    LAT_HIST write;
+    LAT_HIST compute;
+    volatile LONGLONG submits;      // io_uring_enter calls, which /proc/self/io does not see
+    volatile LONGLONG engines;      // bit 1 << ENGINE_* for every engine a raw copy ran on
+    volatile LONGLONG stage[STAGES];
+} IO_STATS;
 
-    HANDLE hDisk = CreateFileA(diskPath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
-    if (hDisk == INVALID_HANDLE_VALUE) {
-        printf("Failed to open disk %d. Error: %lu\n", diskNum, GetLastError());
-        return;
+typedef struct {
+    volatile LONGLONG done;         // bytes of the command's range finished
+    ULONGLONG total;                // bytes it covers, 0 while unknown
+    volatile LONGLONG shown;        // now_ns() of the last console progress line
+} PROGRESS;
+
+IO_STATS g_iostat;
+PROGRESS g_progress;
+
+ULONGLONG now_ns(void) {
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER t;
+    if (freq.QuadPart == 0) QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&t);
+    return (ULONGLONG)(t.QuadPart / freq.QuadPart) * 1000000000ULL +
+           (ULONGLONG)(t.QuadPart % freq.QuadPart) * 1000000000ULL / (ULONGLONG)freq.QuadPart;
+#else
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (ULONGLONG)t.tv_sec * 1000000000ULL + (ULONGLONG)t.tv_nsec;
+#endif
+}
+
+static void stat_add(volatile LONGLONG* p, LONGLONG v) {
+#ifdef _WIN32
+    InterlockedExchangeAdd64(p, v);
+#else
+    __atomic_fetch_add(p, v, __ATOMIC_RELAXED);
+#endif
+}
+
+static void stat_or(volatile LONGLONG* p, LONGLONG v) {
+#ifdef _WIN32
+    InterlockedOr64(p, v);
+#else
+    __atomic_fetch_or(p, v, __ATOMIC_RELAXED);
+#endif
+}
+
+// Start time of a request, 0 when nobody is collecting.
+ULONGLONG iostat_clock(void) {
+    return g_iostat.enabled ? now_ns() : 0;
+}
+
+static int lat_bucket(ULONGLONG ns) {
+    if (ns < 4) return (int)ns;
+    int msb = 63;
+    while (!(ns >> msb)) msb--;
+    return msb * 4 + (int)((ns >> (msb - 2)) & 3);
+}
+
+// Largest latency that lands in bucket b.
+static ULONGLONG lat_bucket_top(int b) {
+    if (b < 4) return (ULONGLONG)b;
+    int msb = b / 4;
+    return ((ULONGLONG)(4 + b % 4 + 1) << (msb - 2)) - 1;
+}
+
+void lat_record(LAT_HIST* h, ULONGLONG start, size_t bytes) {
+    if (!start) return;
+    stat_add(&h->count[lat_bucket(now_ns() - start)], 1);
+    stat_add(&h->requests, 1);
+    stat_add(&h->bytes, (LONGLONG)bytes);
+}
+
+// Latency in ns below which fraction p (0.5, 0.99) of the requests completed; 0 without requests.
+ULONGLONG lat_percentile(const LAT_HIST* h, double p) {
+    LONGLONG total = 0;
+    for (int b = 0; b < LAT_BUCKETS; b++) total += h->count[b];
+    if (total == 0) return 0;
+    LONGLONG want = (LONGLONG)(p * (double)total + 0.5), seen = 0;
+    if (want < 1) want = 1;
+    for (int b = 0; b < LAT_BUCKETS; b++) {
+        seen += h->count[b];
+        if (seen >= want) return lat_bucket_top(b);
+    }
+    return lat_bucket_top(LAT_BUCKETS - 1);
+}
+
+void iostat_reset(void) {
+    BOOL enabled = g_iostat.enabled;
+    memset((void*)&g_iostat, 0, sizeof(g_iostat));
+    g_iostat.enabled = enabled;
+}
+
+void stage_add(int stage, LONGLONG n) {
+    stat_add(&g_iostat.stage[stage], n);
+}
+
+void stage_set(int stage, LONGLONG n) {
+    g_iostat.stage[stage] = n;
+}
+
+// Starts counting a command's progress over total bytes.
+void progress_begin(ULONGLONG total) {
+    g_progress.done = 0;
+    g_progress.total = total;
+    g_progress.shown = 0;
+}
+
+void progress_add(ULONGLONG n) {
+    stat_add(&g_progress.done, (LONGLONG)n);
+}
+
+void progress_set(ULONGLONG done) {
+    g_progress.done = (LONGLONG)done;
+}
+
+// TRUE when a console progress line is due, at most every PROGRESS_INTERVAL_NS and for one caller only. Printing
+// after every block costs measurable time on fast devices; whoever finishes prints the final line unconditionally.
+BOOL progress_due(void) {
+    ULONGLONG now = now_ns();
+    LONGLONG shown = g_progress.shown;
+    if (shown && now - (ULONGLONG)shown < PROGRESS_INTERVAL_NS) return FALSE;
+#ifdef _WIN32
+    return InterlockedCompareExchange64(&g_progress.shown, (LONGLONG)now, shown) == shown;
+#else
+    return __atomic_compare_exchange_n(&g_progress.shown, &shown, (LONGLONG)now, FALSE, __ATOMIC_RELAXED,
+                                       __ATOMIC_RELAXED);
+#endif
+}
+
+void progress_print(void) {
+    printf("\rProgress: %.2f MB", g_progress.done / (1024.0 * 1024.0));
+    fflush(stdout);
+}
+//================================================================================================================
+// Block device backend.
+// A DISK_DEV is a physical drive (\\.\PhysicalDriveN, /dev/sdX, /dev/nvmeXnY, /dev/loopN) or a plain image file.
+// All access is positional (pread/pwrite, OVERLAPPED offsets), so no call depends on an implicit file pointer.
+// With DEV_DIRECT the page cache is bypassed (O_DIRECT / FILE_FLAG_NO_BUFFERING) for every request whose buffer,
+// offset and length are DIRECT_ALIGN aligned; anything else (a 512-byte MBR, an odd tail) goes through a second,
+// buffered handle on the same file.
+
+#define DEV_READ   0x01
+#define DEV_WRITE  0x02
+#define DEV_CREATE 0x04     // create or truncate a regular file
+#define DEV_DIRECT 0x08     // bypass the page cache where possible
+#define DEV_EXCL   0x10     // with DEV_CREATE: fail if the file already exists
+
+typedef struct {
+#ifdef _WIN32
+    HANDLE h;               // buffered handle
+    HANDLE hDirect;         // FILE_FLAG_NO_BUFFERING handle, INVALID_HANDLE_VALUE if unavailable
+#else
+    int fd;                 // buffered descriptor
+    int fdDirect;           // O_DIRECT descriptor, -1 if unavailable
+#endif
+    ULONGLONG size;         // device or file size in bytes at open time
+    BOOL isFile;            // regular file rather than a block device
+    BOOL fresh;             // created (truncated) by this open: unwritten ranges already read back as zeros
+} DISK_DEV;
+
+void dev_close(DISK_DEV* dev);
+
+unsigned long dev_last_error(void) {
+#ifdef _WIN32
+    return GetLastError();
+#else
+    return (unsigned long)errno;
+#endif
+}
+
+void* alloc_aligned(size_t size) {
+#ifdef _WIN32
+    return _aligned_malloc(size, DIRECT_ALIGN);
+#else
+    void* p = NULL;
+    if (posix_memalign(&p, DIRECT_ALIGN, size) != 0) return NULL;
+    return p;
+#endif
+}
+
+void free_aligned(void* p) {
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+#define DISK_INDEX_MAX (26 + 26 * 26 + 26 * 26 * 26 - 1)     // sdzzz, the last three-letter name
+
+// "--disk 0" keeps working as a drive number; anything else is taken as a device or image path. Drive numbers past
+// 25 name /dev/sdaa, /dev/sdab, ... the way the kernel does. Returns NULL (after saying why) for a negative or
+// out-of-range drive number.
+const char* disk_path(const char* arg, char* out, size_t outSize) {
+    const char* digits = *arg == '-' ? arg + 1 : arg;
+    const char* p = digits;
+    while (*p >= '0' && *p <= '9') p++;
+    if (*digits == '\0' || *p != '\0') {
+        snprintf(out, outSize, "%s", arg);
+        return out;
+    }
+    errno = 0;
+    unsigned long index = strtoul(digits, NULL, 10);
+    if (digits != arg || errno == ERANGE || index > DISK_INDEX_MAX) {
+        printf("Invalid drive number %s (0 to %d)\n", arg, DISK_INDEX_MAX);
+        return NULL;
+    }
+#ifdef _WIN32
+    snprintf(out, outSize, "\\\\.\\PhysicalDrive%lu", index);
+#else
+    char name[4];
+    int len = 3;
+    name[len] = '\0';
+    for (unsigned long n = index + 1; n > 0; n = (n - 1) / 26) {       // bijective base 26: a..z, aa..zz, aaa..
+        name[--len] = (char)('a' + (n - 1) % 26);
+    }
+    snprintf(out, outSize, "/dev/sd%s", name + len);
+#endif
+    return out;
+}
+
+int dev_open(DISK_DEV* dev, const char* path, int flags) {
+    memset(dev, 0, sizeof(*dev));
+#ifdef _WIN32
+    DWORD access = 0;
+    if (flags & DEV_READ)  access |= GENERIC_READ;
+    if (flags & DEV_WRITE) access |= GENERIC_WRITE;
+    DWORD share = FILE_SHARE_READ | FILE_SHARE_WRITE;
+    DWORD attr = (flags & DEV_CREATE) ? FILE_ATTRIBUTE_NORMAL : 0;
+
+    dev->hDirect = INVALID_HANDLE_VALUE;
+    DWORD disposition = !(flags & DEV_CREATE) ? OPEN_EXISTING : (flags & DEV_EXCL) ? CREATE_NEW : CREATE_ALWAYS;
+    dev->h = CreateFileA(path, access, share, NULL, disposition, attr, NULL);
+    if (dev->h == INVALID_HANDLE_VALUE) {
+        return 1;
+    }
+    if (flags & DEV_CREATE) {
+        DWORD ignored;
+        DeviceIoControl(dev->h, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &ignored, NULL);     // best effort; holes need it
+        dev->fresh = TRUE;
+    }
+    if (flags & DEV_DIRECT) {
+        dev->hDirect = CreateFileA(path, access, share, NULL, OPEN_EXISTING,
+                                   attr | FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH, NULL);
     }
 
-    // Get disk size
     GET_LENGTH_INFORMATION info;
     DWORD bytesReturned;
-    if (!DeviceIoControl(hDisk, IOCTL_DISK_GET_LENGTH_INFO, NULL, 0, &info, sizeof(info), &bytesReturned, NULL)) {
-        printf("Failed to get disk size. Error: %lu\n", GetLastError());
-        CloseHandle(hDisk);
-        return;
+    LARGE_INTEGER fileSize;
+    if (DeviceIoControl(dev->h, IOCTL_DISK_GET_LENGTH_INFO, NULL, 0, &info, sizeof(info), &bytesReturned, NULL)) {
+        dev->size = info.Length.QuadPart;
+    } else if (GetFileSizeEx(dev->h, &fileSize)) {
+        dev->size = fileSize.QuadPart;
+        dev->isFile = TRUE;
+    } else {
+        dev_close(dev);
+        return 1;
+    }
+#else
+    int oflags = O_CLOEXEC;
+    if ((flags & DEV_READ) && (flags & DEV_WRITE)) oflags |= O_RDWR;
+    else if (flags & DEV_WRITE) oflags |= O_WRONLY;
+    else oflags |= O_RDONLY;
+    if (flags & DEV_CREATE) oflags |= O_CREAT | O_TRUNC;
+    if (flags & DEV_EXCL) oflags |= O_EXCL;
+
+    dev->fdDirect = -1;
+    dev->fd = open(path, oflags, 0644);
+    if (dev->fd < 0) {
+        return 1;
+    }
+    dev->fresh = (flags & DEV_CREATE) != 0;
+#ifdef O_DIRECT
+    if (flags & DEV_DIRECT) {
+        // Some filesystems (tmpfs, older FUSE) refuse O_DIRECT; the buffered descriptor then carries everything.
+        dev->fdDirect = open(path, (oflags & ~(O_CREAT | O_TRUNC | O_EXCL)) | O_DIRECT);
     }
-    ULONGLONG diskSize = info.Length.QuadPart;
+#endif
 
-    // Open output file
-    FILE* f = fopen(outFile, "wb");
-    if (!f) {
-        printf("Failed to open output file %s. Error: %d\n", outFile, errno);
-        CloseHandle(hDisk);
-        return;
+    struct stat st;
+    if (fstat(dev->fd, &st) != 0) {
+        dev_close(dev);
+        return 1;
+    }
+    if (S_ISBLK(st.st_mode)) {
+#ifdef BLKGETSIZE64
+        uint64_t bytes = 0;
+        if (ioctl(dev->fd, BLKGETSIZE64, &bytes) != 0) {
+            dev_close(dev);
+            return 1;
+        }
+        dev->size = bytes;
+#else
+        off_t end = lseek(dev->fd, 0, SEEK_END);
+        if (end < 0) {
+            dev_close(dev);
+            return 1;
+        }
+        dev->size = (ULONGLONG)end;
+#endif
+    } else {
+        dev->size = (ULONGLONG)st.st_size;
+        dev->isFile = TRUE;
+    }
+#endif
+    return 0;
+}
+
+void dev_close(DISK_DEV* dev) {
+#ifdef _WIN32
+    if (dev->hDirect != INVALID_HANDLE_VALUE && dev->hDirect != NULL) CloseHandle(dev->hDirect);
+    if (dev->h != INVALID_HANDLE_VALUE && dev->h != NULL) CloseHandle(dev->h);
+    dev->h = dev->hDirect = INVALID_HANDLE_VALUE;
+#else
+    if (dev->fdDirect >= 0) close(dev->fdDirect);
+    if (dev->fd >= 0) close(dev->fd);
+    dev->fd = dev->fdDirect = -1;
+#endif
+}
+
+static BOOL dev_is_aligned(const void* buf, size_t len, ULONGLONG offset) {
+    return ((uintptr_t)buf % DIRECT_ALIGN) == 0 && (len % DIRECT_ALIGN) == 0 && (offset % DIRECT_ALIGN) == 0;
+}
+
+// Reads up to len bytes at offset. Returns the number of bytes read (short only at end of device) or -1.
+long long dev_pread(DISK_DEV* dev, void* buf, size_t len, ULONGLONG offset) {
+    size_t done = 0;
+    ULONGLONG start = iostat_clock();
+#ifdef _WIN32
+    HANDLE h = (dev->hDirect != INVALID_HANDLE_VALUE && dev_is_aligned(buf, len, offset)) ? dev->hDirect : dev->h;
+    while (done < len) {
+        OVERLAPPED ov;
+        memset(&ov, 0, sizeof(ov));
+        ULONGLONG pos = offset + done;
+        ov.Offset = (DWORD)pos;
+        ov.OffsetHigh = (DWORD)(pos >> 32);
+        DWORD chunk = (len - done) > 0x40000000 ? 0x40000000 : (DWORD)(len - done);
+        DWORD got = 0;
+        if (!ReadFile(h, (BYTE*)buf + done, chunk, &got, &ov)) {
+            if (GetLastError() == ERROR_HANDLE_EOF) break;
+            return -1;
+        }
+        if (got == 0) break;
+        done += got;
+    }
+#else
+    int fd = (dev->fdDirect >= 0 && dev_is_aligned(buf, len, offset)) ? dev->fdDirect : dev->fd;
+    while (done < len) {
+        ssize_t got = pread(fd, (BYTE*)buf + done, len - done, (off_t)(offset + done));
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (got == 0) break;
+        done += (size_t)got;
+    }
+#endif
+    lat_record(&g_iostat.read, start, done);
+    return (long long)done;
+}
+
+// Writes exactly len bytes at offset. Returns len or -1.
+long long dev_pwrite(DISK_DEV* dev, const void* buf, size_t len, ULONGLONG offset) {
+    size_t done = 0;
+    ULONGLONG start = iostat_clock();
+#ifdef _WIN32
+    HANDLE h = (dev->hDirect != INVALID_HANDLE_VALUE && dev_is_aligned(buf, len, offset)) ? dev->hDirect : dev->h;
+    while (done < len) {
+        OVERLAPPED ov;
+        memset(&ov, 0, sizeof(ov));
+        ULONGLONG pos = offset + done;
+        ov.Offset = (DWORD)pos;
+        ov.OffsetHigh = (DWORD)(pos >> 32);
+        DWORD chunk = (len - done) > 0x40000000 ? 0x40000000 : (DWORD)(len - done);
+        DWORD put = 0;
+        if (!WriteFile(h, (const BYTE*)buf + done, chunk, &put, &ov) || put == 0) {
+            return -1;
+        }
+        done += put;
+    }
+#else
+    int fd = (dev->fdDirect >= 0 && dev_is_aligned(buf, len, offset)) ? dev->fdDirect : dev->fd;
+    while (done < len) {
+        ssize_t put = pwrite(fd, (const BYTE*)buf + done, len - done, (off_t)(offset + done));
+        if (put < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (put == 0) return -1;
+        done += (size_t)put;
+    }
+#endif
+    lat_record(&g_iostat.write, start, done);
+    return (long long)done;
+}
+
+// Writes count bytes of zeros starting at offset, a buffer at a time instead of a sector at a time.
+int dev_write_zeros(DISK_DEV* dev, ULONGLONG offset, ULONGLONG count) {
+    size_t zsize = count > (1024 * 1024) ? (1024 * 1024) : (size_t)count;
+    if (zsize == 0) return 0;
+    BYTE* zeros = (BYTE*)alloc_aligned((zsize + DIRECT_ALIGN - 1) & ~(size_t)(DIRECT_ALIGN - 1));
+    if (!zeros) return 1;
+    memset(zeros, 0, zsize);
+    while (count > 0) {
+        size_t n = count > zsize ? zsize : (size_t)count;
+        if (dev_pwrite(dev, zeros, n, offset) != (long long)n) {
+            free_aligned(zeros);
+            return 1;
+        }
+        offset += n;
+        count -= n;
+    }
+    free_aligned(zeros);
+    return 0;
+}
+
+int dev_flush(DISK_DEV* dev) {
+#ifdef _WIN32
+    return FlushFileBuffers(dev->h) ? 0 : 1;
+#else
+    return fsync(dev->fd) == 0 ? 0 : 1;
+#endif
+}
+
+// Leaves [offset, offset+count) of a regular file reading as zeros without storing data there. A file this run
+// created has nothing there yet; an existing one gets the range punched out. Returns 1 when that is not possible
+// (block devices, filesystems without hole support) and the caller has to write real zeros.
+// The file is not extended here: with requests still in flight that could race a later write, so callers grow it
+// with dev_extend() once the copy is done.
+int dev_make_hole(DISK_DEV* dev, ULONGLONG offset, ULONGLONG count) {
+    if (!dev->isFile) return 1;
+    if (dev->fresh || count == 0) return 0;
+#ifdef _WIN32
+    FILE_ZERO_DATA_INFORMATION zdi;
+    DWORD bytesReturned;
+    zdi.FileOffset.QuadPart = offset;
+    zdi.BeyondFinalZero.QuadPart = offset + count;
+    return DeviceIoControl(dev->h, FSCTL_SET_ZERO_DATA, &zdi, sizeof(zdi), NULL, 0, &bytesReturned, NULL) ? 0 : 1;
+#elif defined(FALLOC_FL_PUNCH_HOLE)
+    return fallocate(dev->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)offset, (off_t)count) == 0 ? 0 : 1;
+#else
+    (void)offset;
+    return 1;
+#endif
+}
+
+// Grows a regular file to at least size bytes; never shrinks it.
+int dev_extend(DISK_DEV* dev, ULONGLONG size) {
+    if (!dev->isFile) return 0;
+#ifdef _WIN32
+    LARGE_INTEGER cur;
+    if (!GetFileSizeEx(dev->h, &cur)) return 1;
+    if ((ULONGLONG)cur.QuadPart >= size) return 0;
+    FILE_END_OF_FILE_INFO eof;
+    eof.EndOfFile.QuadPart = size;
+    return SetFileInformationByHandle(dev->h, FileEndOfFileInfo, &eof, sizeof(eof)) ? 0 : 1;
+#else
+    struct stat st;
+    if (fstat(dev->fd, &st) != 0) return 1;
+    if ((ULONGLONG)st.st_size >= size) return 0;
+    return ftruncate(dev->fd, (off_t)size) == 0 ? 0 : 1;
+#endif
+}
+
+// Zeros a range, as a hole when sparse output is allowed and the target supports it.
+int dev_zero_fill(DISK_DEV* dev, ULONGLONG offset, ULONGLONG count, BOOL sparse) {
+    if (sparse && dev_make_hole(dev, offset, count) == 0) {
+        return dev_extend(dev, offset + count);
+    }
+    return dev_write_zeros(dev, offset, count);
+}
+//================================================================================================================
+// All-zero block detection, dispatched once at runtime to the widest vector unit the CPU has.
+
+static BOOL is_zero_scalar(const BYTE* p, size_t len) {
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t v;
+        memcpy(&v, p + i, 8);
+        if (v) return FALSE;
+    }
+    for (; i < len; i++) {
+        if (p[i]) return FALSE;
+    }
+    return TRUE;
+}
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define ZERO_SIMD_X86 1
+#include <immintrin.h>
+
+__attribute__((target("sse2")))
+static BOOL is_zero_sse2(const BYTE* p, size_t len) {
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i*)(p + i)),      _mm_loadu_si128((const __m128i*)(p + i + 16)));
+        __m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i*)(p + i + 32)), _mm_loadu_si128((const __m128i*)(p + i + 48)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_or_si128(a, b), _mm_setzero_si128())) != 0xFFFF) return FALSE;
+    }
+    return is_zero_scalar(p + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static BOOL is_zero_avx2(const BYTE* p, size_t len) {
+    size_t i = 0;
+    for (; i + 128 <= len; i += 128) {
+        __m256i a = _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(p + i)),      _mm256_loadu_si256((const __m256i*)(p + i + 32)));
+        __m256i b = _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(p + i + 64)), _mm256_loadu_si256((const __m256i*)(p + i + 96)));
+        __m256i acc = _mm256_or_si256(a, b);
+        if (!_mm256_testz_si256(acc, acc)) return FALSE;
+    }
+    return is_zero_scalar(p + i, len - i);
+}
+
+__attribute__((target("avx512f")))
+static BOOL is_zero_avx512(const BYTE* p, size_t len) {
+    size_t i = 0;
+    for (; i + 256 <= len; i += 256) {
+        __m512i a = _mm512_or_si512(_mm512_loadu_si512((const void*)(p + i)),       _mm512_loadu_si512((const void*)(p + i + 64)));
+        __m512i b = _mm512_or_si512(_mm512_loadu_si512((const void*)(p + i + 128)), _mm512_loadu_si512((const void*)(p + i + 192)));
+        __m512i acc = _mm512_or_si512(a, b);
+        if (_mm512_test_epi64_mask(acc, acc)) return FALSE;
+    }
+    return is_zero_scalar(p + i, len - i);
+}
+#endif
+
+static BOOL is_zero_dispatch(const BYTE* p, size_t len);
+static BOOL (*is_zero_impl)(const BYTE*, size_t) = is_zero_dispatch;
+
+const char* zero_detect_isa(void) {
+#ifdef ZERO_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return "avx512";
+    if (__builtin_cpu_supports("avx2"))    return "avx2";
+    if (__builtin_cpu_supports("sse2"))    return "sse2";
+#endif
+    return "scalar";
+}
+
+static BOOL is_zero_dispatch(const BYTE* p, size_t len) {
+    const char* isa = zero_detect_isa();
+    BOOL (*impl)(const BYTE*, size_t) = is_zero_scalar;
+#ifdef ZERO_SIMD_X86
+    if (strcmp(isa, "avx512") == 0)    impl = is_zero_avx512;
+    else if (strcmp(isa, "avx2") == 0) impl = is_zero_avx2;
+    else if (strcmp(isa, "sse2") == 0) impl = is_zero_sse2;
+#endif
+    is_zero_impl = impl;        // every thread computes the same answer, so the unsynchronised store is benign
+    return impl(p, len);
+}
+
+BOOL is_zero_block(const BYTE* p, size_t len) {
+    return is_zero_impl(p, len);
+}
+//================================================================================================================
+// Threads. Thin wrappers so the pipeline code reads the same on Win32 and POSIX.
+
+#ifdef _WIN32
+typedef HANDLE             WD_THREAD;
+typedef CRITICAL_SECTION   WD_MUTEX;
+typedef CONDITION_VARIABLE WD_COND;
+
+typedef struct {
+    void* (*fn)(void*);
+    void* arg;
+} THREAD_START;
+
+static DWORD WINAPI thread_trampoline(LPVOID p) {
+    THREAD_START s = *(THREAD_START*)p;
+    free(p);
+    s.fn(s.arg);
+    return 0;
+}
+
+int thread_start(WD_THREAD* t, void* (*fn)(void*), void* arg) {
+    THREAD_START* s = (THREAD_START*)malloc(sizeof(THREAD_START));
+    if (!s) return 1;
+    s->fn = fn;
+    s->arg = arg;
+    *t = CreateThread(NULL, 0, thread_trampoline, s, 0, NULL);
+    if (*t == NULL) {
+        free(s);
+        return 1;
+    }
+    return 0;
+}
+void thread_join(WD_THREAD t)      { WaitForSingleObject(t, INFINITE); CloseHandle(t); }
+void mutex_init(WD_MUTEX* m)       { InitializeCriticalSection(m); }
+void mutex_destroy(WD_MUTEX* m)    { DeleteCriticalSection(m); }
+void mutex_lock(WD_MUTEX* m)       { EnterCriticalSection(m); }
+void mutex_unlock(WD_MUTEX* m)     { LeaveCriticalSection(m); }
+void cond_init(WD_COND* c)         { InitializeConditionVariable(c); }
+void cond_destroy(WD_COND* c)      { (void)c; }
+void cond_wait(WD_COND* c, WD_MUTEX* m) { SleepConditionVariableCS(c, m, INFINITE); }
+void cond_signal(WD_COND* c)       { WakeConditionVariable(c); }
+void cond_broadcast(WD_COND* c)    { WakeAllConditionVariable(c); }
+unsigned long process_id(void)     { return GetCurrentProcessId(); }
+#else
+typedef pthread_t       WD_THREAD;
+typedef pthread_mutex_t WD_MUTEX;
+typedef pthread_cond_t  WD_COND;
+
+int thread_start(WD_THREAD* t, void* (*fn)(void*), void* arg) { return pthread_create(t, NULL, fn, arg) != 0; }
+void thread_join(WD_THREAD t)      { pthread_join(t, NULL); }
+void mutex_init(WD_MUTEX* m)       { pthread_mutex_init(m, NULL); }
+void mutex_destroy(WD_MUTEX* m)    { pthread_mutex_destroy(m); }
+void mutex_lock(WD_MUTEX* m)       { pthread_mutex_lock(m); }
+void mutex_unlock(WD_MUTEX* m)     { pthread_mutex_unlock(m); }
+void cond_init(WD_COND* c)         { pthread_cond_init(c, NULL); }
+void cond_destroy(WD_COND* c)      { pthread_cond_destroy(c); }
+void cond_wait(WD_COND* c, WD_MUTEX* m) { pthread_cond_wait(c, m); }
+void cond_signal(WD_COND* c)       { pthread_cond_signal(c); }
+void cond_broadcast(WD_COND* c)    { pthread_cond_broadcast(c); }
+unsigned long process_id(void)     { return (unsigned long)getpid(); }
+#endif
+//================================================================================================================
+// Job options shared by create and write. Zero means "pick the engine's default".
+
+#define ENGINE_THREADED 0       // reader thread + ring of buffers, portable
+#define ENGINE_URING    1       // io_uring with registered buffers and files (Linux)
+
+#define PIPELINE_BUFFERS 4
+#define URING_DEPTH      32
+#define URING_BLOCK_SIZE (1024 * 1024)
+
+typedef struct {
+    int engine;
+    size_t blockSize;           // --bs
+    int queueDepth;             // --qd: ring size for the threaded engine, requests in flight for io_uring
+    BOOL sparse;                // leave all-zero ranges of file outputs as holes (--no-sparse turns it off)
+    BOOL usedOnly;              // --used-only: partition images copy only what the filesystem has allocated
+    int format;                 // --format: FORMAT_* of the image create writes
+    int threads;                // --threads: compression/decompression workers, 0 = one per CPU
+    int level;                  // --level: compression level, 0 = format default
+    const char* store;          // --store: chunk store directory of --format dedup
+    const char* base;           // --base: previous image; create writes a WDX overlay of the chunks that changed
+    BOOL verify;                // --verify: write reads the target back and compares it with what it wrote
+    BOOL changedOnly;           // --changed-only: write reads the target first and rewrites only what differs
+    BOOL resume;                // --resume: continue a failed raw create/write from its checkpoint journal
+    BOOL rescue;                // --rescue: raw create from a failing drive, carrying on past read errors
+    int fill;                   // --fill: byte unreadable sectors are filled with, -1 for a marker text
+    BOOL eject;                 // --eject: a write to several disks drops a target that fails instead of stopping
+    int tune;                   // TUNE_*: --tune, --retune, --no-tune
+    const char* telemetry;      // --telemetry: fd:N, unix:PATH or a file for JSON-lines metrics, NULL for none
+    int telemetryInterval;      // --telemetry-interval: ms between progress records, 0 = TELEMETRY_INTERVAL_MS
+    size_t tunedBlockSize;      // picked by tune_device() for the job at hand, 0 = not tuned
+    int tunedQueueDepth;
+    int tunedEngine;            // the engine the tuned values were measured with
+} IMAGE_OPTS;
+
+#define TUNE_AUTO   0           // probe block devices (or use their cached profile), leave files on the defaults
+#define TUNE_OFF    1
+#define TUNE_ON     2           // probe files as well
+#define TUNE_RETUNE 3           // probe even when a cached profile exists, and replace it
+
+#define FORMAT_RAW 0            // plain disk-shaped .img
+#define FORMAT_WDX 1            // chunked, compressed container with a trailing index
+#define FORMAT_DEDUP 2          // manifest of chunk digests into a shared content-addressed store
+#define FORMAT_QCOW2 3          // QEMU copy-on-write v3, readable by VMs and qemu-img as is
+#define FORMAT_VHD 4            // dynamic VHD for Hyper-V, Azure and VirtualBox (output only)
+#define FORMAT_VHDX 5           // dynamic VHDX (output only)
+#define FORMAT_VMDK 6           // streamOptimized VMDK for ESXi and VirtualBox import (output only)
+
+#ifdef __linux__
+#define DEFAULT_ENGINE ENGINE_URING
+#else
+#define DEFAULT_ENGINE ENGINE_THREADED
+#endif
+
+IMAGE_OPTS g_opts = { .engine = DEFAULT_ENGINE, .sparse = TRUE, .format = FORMAT_RAW, .fill = -1 };
+
+int cpu_count(void) {
+#ifdef _WIN32
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return si.dwNumberOfProcessors > 0 ? (int)si.dwNumberOfProcessors : 1;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
+int worker_count(void) {
+    return g_opts.threads > 0 ? g_opts.threads : cpu_count();
+}
+
+// Accepts 4096, 64K, 1M, 2G. Returns 0 for anything unparsable.
+ULONGLONG parse_size(const char* text) {
+    char* end = NULL;
+    ULONGLONG value = strtoull(text, &end, 10);
+    if (end == text) return 0;
+    switch (*end) {
+        case 'k': case 'K': value <<= 10; end++; break;
+        case 'm': case 'M': value <<= 20; end++; break;
+        case 'g': case 'G': value <<= 30; end++; break;
+        default: break;
+    }
+    return *end == '\0' ? value : 0;
+}
+
+// Handles the I/O tuning options of create/write. Returns how many extra arguments it consumed, -1 on a bad value.
+int parse_io_option(int argc, char* argv[], int i) {
+    if (strcmp(argv[i], "--no-sparse") == 0) {
+        g_opts.sparse = FALSE;
+        return 0;
+    }
+    if (strcmp(argv[i], "--used-only") == 0) {
+        g_opts.usedOnly = TRUE;
+        return 0;
+    }
+    if (strcmp(argv[i], "--verify") == 0) {
+        g_opts.verify = TRUE;
+        return 0;
+    }
+    if (strcmp(argv[i], "--changed-only") == 0) {
+        g_opts.changedOnly = TRUE;
+        return 0;
+    }
+    if (strcmp(argv[i], "--resume") == 0) {
+        g_opts.resume = TRUE;
+        return 0;
+    }
+    if (strcmp(argv[i], "--rescue") == 0) {
+        g_opts.rescue = TRUE;
+        return 0;
+    }
+    if (strcmp(argv[i], "--eject") == 0) {
+        g_opts.eject = TRUE;
+        return 0;
+    }
+    if (strcmp(argv[i], "--tune") == 0) {
+        g_opts.tune = TUNE_ON;
+        return 0;
+    }
+    if (strcmp(argv[i], "--retune") == 0) {
+        g_opts.tune = TUNE_RETUNE;
+        return 0;
+    }
+    if (strcmp(argv[i], "--no-tune") == 0) {
+        g_opts.tune = TUNE_OFF;
+        return 0;
+    }
+    if (i + 1 >= argc) return 0;
+    if (strcmp(argv[i], "--engine") == 0) {
+        if (strcmp(argv[i + 1], "uring") == 0)         g_opts.engine = ENGINE_URING;
+        else if (strcmp(argv[i + 1], "threaded") == 0) g_opts.engine = ENGINE_THREADED;
+        else if (strcmp(argv[i + 1], "auto") == 0)     g_opts.engine = DEFAULT_ENGINE;
+        else { printf("Unknown engine %s (auto, uring, threaded)\n", argv[i + 1]); return -1; }
+        return 1;
+    }
+    if (strcmp(argv[i], "--bs") == 0) {
+        ULONGLONG bs = parse_size(argv[i + 1]);
+        if (bs == 0 || bs % DIRECT_ALIGN != 0 || bs > (1ULL << 30)) {
+            printf("Block size must be a multiple of %d bytes, up to 1G\n", DIRECT_ALIGN);
+            return -1;
+        }
+        g_opts.blockSize = (size_t)bs;
+        return 1;
+    }
+    if (strcmp(argv[i], "--qd") == 0) {
+        int qd = atoi(argv[i + 1]);
+        if (qd < 1 || qd > 4096) {
+            printf("Queue depth must be 1-4096\n");
+            return -1;
+        }
+        g_opts.queueDepth = qd;
+        return 1;
+    }
+    if (strcmp(argv[i], "--format") == 0) {
+        if (strcmp(argv[i + 1], "raw") == 0)      g_opts.format = FORMAT_RAW;
+        else if (strcmp(argv[i + 1], "wdx") == 0) g_opts.format = FORMAT_WDX;
+        else if (strcmp(argv[i + 1], "dedup") == 0) g_opts.format = FORMAT_DEDUP;
+        else if (strcmp(argv[i + 1], "qcow2") == 0) g_opts.format = FORMAT_QCOW2;
+        else if (strcmp(argv[i + 1], "vhd") == 0) g_opts.format = FORMAT_VHD;
+        else if (strcmp(argv[i + 1], "vhdx") == 0) g_opts.format = FORMAT_VHDX;
+        else if (strcmp(argv[i + 1], "vmdk") == 0) g_opts.format = FORMAT_VMDK;
+        else { printf("Unknown format %s (raw, wdx, dedup, qcow2, vhd, vhdx, vmdk)\n", argv[i + 1]); return -1; }
+        return 1;
+    }
+    if (strcmp(argv[i], "--store") == 0) {
+        g_opts.store = argv[i + 1];
+        return 1;
+    }
+    if (strcmp(argv[i], "--telemetry") == 0) {
+        g_opts.telemetry = argv[i + 1];
+        return 1;
+    }
+    if (strcmp(argv[i], "--telemetry-interval") == 0) {
+        g_opts.telemetryInterval = atoi(argv[i + 1]);
+        if (g_opts.telemetryInterval < 10 || g_opts.telemetryInterval > 3600000) {
+            printf("Telemetry interval must be 10-3600000 ms\n");
+            return -1;
+        }
+        return 1;
+    }
+    if (strcmp(argv[i], "--base") == 0) {
+        g_opts.base = argv[i + 1];
+        return 1;
+    }
+    if (strcmp(argv[i], "--threads") == 0) {
+        g_opts.threads = atoi(argv[i + 1]);
+        if (g_opts.threads < 1 || g_opts.threads > 256) {
+            printf("Threads must be 1-256\n");
+            return -1;
+        }
+        return 1;
+    }
+    if (strcmp(argv[i], "--fill") == 0) {
+        char* end = NULL;
+        long fill = strtol(argv[i + 1], &end, 0);
+        if (end == argv[i + 1] || *end != '\0' || fill < 0 || fill > 255) {
+            printf("Fill must be a byte value, 0-255 or 0x00-0xFF\n");
+            return -1;
+        }
+        g_opts.fill = (int)fill;
+        return 1;
+    }
+    if (strcmp(argv[i], "--level") == 0) {
+        g_opts.level = atoi(argv[i + 1]);
+        if (g_opts.level < 1 || g_opts.level > 9) {
+            printf("Compression level must be 1-9\n");
+            return -1;
+        }
+        return 1;
+    }
+    return 0;
+}
+//================================================================================================================
+// SHA-256 (FIPS 180-4): chunk digests for the dedup store, hash sidecars and read-back verification.
+
+typedef struct {
+    DWORD state[8];
+    ULONGLONG length;           // bytes hashed so far
+    BYTE block[64];
+    size_t fill;
+} SHA256_CTX;
+
+static const DWORD sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define SHA_ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(SHA256_CTX* ctx, const BYTE* p) {
+    DWORD w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = ((DWORD)p[i * 4] << 24) | ((DWORD)p[i * 4 + 1] << 16) | ((DWORD)p[i * 4 + 2] << 8) | p[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        DWORD s0 = SHA_ROR(w[i - 15], 7) ^ SHA_ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        DWORD s1 = SHA_ROR(w[i - 2], 17) ^ SHA_ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    DWORD a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3];
+    DWORD e = ctx->state[4], f = ctx->state[5], g = ctx->state[6], h = ctx->state[7];
+    for (int i = 0; i < 64; i++) {
+        DWORD t1 = h + (SHA_ROR(e, 6) ^ SHA_ROR(e, 11) ^ SHA_ROR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        DWORD t2 = (SHA_ROR(a, 2) ^ SHA_ROR(a, 13) ^ SHA_ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+    ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+void sha256_init(SHA256_CTX* ctx) {
+    static const DWORD iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(ctx->state, iv, sizeof(iv));
+    ctx->length = 0;
+    ctx->fill = 0;
+}
+
+void sha256_update(SHA256_CTX* ctx, const void* data, size_t len) {
+    const BYTE* p = (const BYTE*)data;
+    ctx->length += len;
+    if (ctx->fill > 0) {
+        size_t n = 64 - ctx->fill < len ? 64 - ctx->fill : len;
+        memcpy(ctx->block + ctx->fill, p, n);
+        ctx->fill += n;
+        p += n;
+        len -= n;
+        if (ctx->fill < 64) return;
+        sha256_block(ctx, ctx->block);
+        ctx->fill = 0;
+    }
+    for (; len >= 64; p += 64, len -= 64) sha256_block(ctx, p);
+    memcpy(ctx->block, p, len);
+    ctx->fill = len;
+}
+
+void sha256_final(SHA256_CTX* ctx, BYTE digest[32]) {
+    ULONGLONG bits = ctx->length * 8;
+    BYTE pad[72];
+    size_t padLen = (ctx->fill < 56 ? 56 : 120) - ctx->fill;
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    for (int i = 0; i < 8; i++) pad[padLen + i] = (BYTE)(bits >> (56 - 8 * i));
+    sha256_update(ctx, pad, padLen + 8);
+    for (int i = 0; i < 8; i++) {
+        digest[i * 4]     = (BYTE)(ctx->state[i] >> 24);
+        digest[i * 4 + 1] = (BYTE)(ctx->state[i] >> 16);
+        digest[i * 4 + 2] = (BYTE)(ctx->state[i] >> 8);
+        digest[i * 4 + 3] = (BYTE)ctx->state[i];
+    }
+}
+
+void sha256(const void* data, size_t len, BYTE digest[32]) {
+    SHA256_CTX ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, data, len);
+    sha256_final(&ctx, digest);
+}
+
+void hex_string(const BYTE* data, size_t len, char* out) {
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < len; i++) {
+        out[i * 2]     = digits[data[i] >> 4];
+        out[i * 2 + 1] = digits[data[i] & 15];
+    }
+    out[len * 2] = '\0';
+}
+//================================================================================================================
+// Hash sidecar: <image>.wdh holds the SHA-256 of every chunk of a chunked image, so the next incremental create
+// can tell which chunks changed without reading the base image back.
+//
+//   HASH_HEADER | BYTE digest[chunkCount][32] | BYTE node[treeNodes][32]
+//
+// An all-zero digest is an all-zero chunk, same as a dedup manifest. The nodes are the upper levels of a Merkle
+// tree over the chunk digests, bottom up and ending in the root: a node is SHA-256(left || right) of two nodes of
+// the level below, and an odd last node is carried up unchanged. diff walks it to skip identical subtrees.
+
+#define HASH_MAGIC       "WDDXHSH1"
+#define HASH_VERSION     2
+#define HASH_TREE_LEVELS 64
+
+#pragma pack(push, 1)
+typedef struct {
+    char magic[8];
+    DWORD version;
+    DWORD chunkSize;
+    ULONGLONG imageSize;
+    ULONGLONG chunkCount;
+    ULONGLONG treeNodes;        // nodes above the leaves, 0 in version 1 sidecars
+    ULONGLONG imageFileSize;    // file_stamp() of the image when the digests were written or last checked against
+    ULONGLONG imageMtime;       // it, 0 when unknown; see hash_sidecar_current()
+    BYTE reserved[8];
+} HASH_HEADER;
+#pragma pack(pop)
+
+void hash_sidecar_path(const char* imagePath, char* out, size_t size) {
+    snprintf(out, size, "%s.wdh", imagePath);
+}
+
+// Size and last modification time of a file, the time in nanoseconds on POSIX and 100 ns ticks on Windows.
+// Returns 0, or 1 when the file cannot be examined.
+int file_stamp(const char* path, ULONGLONG* size, ULONGLONG* mtime) {
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA info;
+    if (!GetFileAttributesExA(path, GetFileExInfoStandard, &info)) return 1;
+    *size = ((ULONGLONG)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+    *mtime = ((ULONGLONG)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime;
+#else
+    struct stat st;
+    if (stat(path, &st) != 0) return 1;
+    *size = (ULONGLONG)st.st_size;
+    *mtime = (ULONGLONG)st.st_mtim.tv_sec * 1000000000ULL + (ULONGLONG)st.st_mtim.tv_nsec;
+#endif
+    return 0;
+}
+
+// Whether the sidecar of imagePath can be trusted to describe it without reading the image: the image must be the
+// file its digests were computed from, or last checked against. An image modified or replaced since then is not.
+BOOL hash_sidecar_current(const char* imagePath) {
+    char path[600];
+    ULONGLONG size, mtime;
+    hash_sidecar_path(imagePath, path, sizeof(path));
+    if (file_stamp(imagePath, &size, &mtime)) return FALSE;
+    DISK_DEV f;
+    if (dev_open(&f, path, DEV_READ)) return FALSE;
+    HASH_HEADER header;
+    BOOL current = dev_pread(&f, &header, sizeof(header), 0) == sizeof(header) &&
+                   memcmp(header.magic, HASH_MAGIC, 8) == 0 && header.imageMtime != 0 &&
+                   header.imageFileSize == size && header.imageMtime == mtime;
+    dev_close(&f);
+    return current;
+}
+
+// Records the image as it is now as the file the sidecar describes, once its digests are known to match it.
+void hash_sidecar_stamp(const char* imagePath) {
+    char path[600];
+    hash_sidecar_path(imagePath, path, sizeof(path));
+    DISK_DEV f;
+    HASH_HEADER header;
+    if (dev_open(&f, path, DEV_READ | DEV_WRITE)) return;
+    if (dev_pread(&f, &header, sizeof(header), 0) == sizeof(header) && memcmp(header.magic, HASH_MAGIC, 8) == 0 &&
+        file_stamp(imagePath, &header.imageFileSize, &header.imageMtime) == 0) {
+        dev_pwrite(&f, &header, sizeof(header), 0);
+    }
+    dev_close(&f);
+}
+
+// Hashes a chunk the way sidecars and manifests record it.
+void chunk_digest(const BYTE* data, size_t len, BYTE digest[32]) {
+    if (is_zero_block(data, len)) {
+        memset(digest, 0, 32);
+    } else {
+        sha256(data, len, digest);
+    }
+}
+
+// Loads the sidecar of imagePath if it describes an image of imageSize bytes in *chunkSize chunks (any chunk size
+// when *chunkSize is 0, which then receives it). Returns 0 and a malloc'd digest array, or 1 when there is no
+// usable sidecar.
+int hash_sidecar_load(const char* imagePath, ULONGLONG imageSize, ULONGLONG* chunkSize, BYTE (**digests)[32]) {
+    char path[600];
+    hash_sidecar_path(imagePath, path, sizeof(path));
+    DISK_DEV f;
+    if (dev_open(&f, path, DEV_READ)) return 1;
+
+    HASH_HEADER header;
+    int rc = 1;
+    if (dev_pread(&f, &header, sizeof(header), 0) != sizeof(header) || memcmp(header.magic, HASH_MAGIC, 8) != 0 ||
+        header.chunkSize == 0 || (*chunkSize != 0 && header.chunkSize != *chunkSize)) {
+        dev_close(&f);
+        return 1;
+    }
+    ULONGLONG chunks = (imageSize + header.chunkSize - 1) / header.chunkSize;
+    if (header.imageSize == imageSize && header.chunkCount == chunks && f.size >= sizeof(header) + chunks * 32) {
+        *chunkSize = header.chunkSize;
+        *digests = (BYTE (*)[32])malloc((size_t)chunks * 32 + 1);
+        if (*digests && dev_pread(&f, *digests, (size_t)chunks * 32, sizeof(header)) == (long long)(chunks * 32)) {
+            rc = 0;
+        } else {
+            free(*digests);
+            *digests = NULL;
+        }
+    }
+    dev_close(&f);
+    return rc;
+}
+
+// Fills the first node (counted from the first leaf) and node count of every tree level, leaves first. Returns
+// the number of levels.
+int hash_tree_levels(ULONGLONG chunks, ULONGLONG start[HASH_TREE_LEVELS], ULONGLONG count[HASH_TREE_LEVELS]) {
+    int levels = 0;
+    ULONGLONG pos = 0;
+    for (;;) {
+        start[levels] = pos;
+        count[levels] = chunks;
+        levels++;
+        if (chunks <= 1) break;
+        pos += chunks;
+        chunks = (chunks + 1) / 2;
+    }
+    return levels;
+}
+
+// Nodes of the whole tree over chunks leaves, leaves included.
+ULONGLONG hash_tree_size(ULONGLONG chunks) {
+    ULONGLONG start[HASH_TREE_LEVELS], count[HASH_TREE_LEVELS];
+    int levels = hash_tree_levels(chunks, start, count);
+    return start[levels - 1] + count[levels - 1];
+}
+
+// Computes the upper levels of a tree whose leaves are already in nodes.
+void hash_tree_build(BYTE (*nodes)[32], ULONGLONG chunks) {
+    ULONGLONG start[HASH_TREE_LEVELS], count[HASH_TREE_LEVELS];
+    int levels = hash_tree_levels(chunks, start, count);
+    for (int l = 1; l < levels; l++) {
+        BYTE (*below)[32] = nodes + start[l - 1];
+        for (ULONGLONG i = 0; i < count[l]; i++) {
+            if (2 * i + 1 < count[l - 1]) {
+                sha256(below[2 * i], 64, nodes[start[l] + i]);
+            } else {
+                memcpy(nodes[start[l] + i], below[2 * i], 32);
+            }
+        }
+    }
+}
+
+// Appends the tree over leaves to a sidecar whose header and leaves are written, and records it in the header.
+// Returns 0 on success; on failure the sidecar stays valid, just without a tree.
+int hash_tree_append(DISK_DEV* f, HASH_HEADER* header, const BYTE (*leaves)[32]) {
+    ULONGLONG chunks = header->chunkCount;
+    ULONGLONG total = hash_tree_size(chunks);
+    if (total == chunks) return 0;
+    BYTE (*nodes)[32] = (BYTE (*)[32])malloc((size_t)total * 32);
+    if (!nodes) return 1;
+    memcpy(nodes, leaves, (size_t)chunks * 32);
+    hash_tree_build(nodes, chunks);
+
+    size_t bytes = (size_t)(total - chunks) * 32;
+    int rc = 1;
+    if (dev_pwrite(f, nodes + chunks, bytes, sizeof(*header) + chunks * 32) == (long long)bytes) {
+        header->treeNodes = total - chunks;
+        if (dev_pwrite(f, header, sizeof(*header), 0) == sizeof(*header)) {
+            rc = 0;
+        } else {
+            header->treeNodes = 0;
+        }
+    }
+    free(nodes);
+    return rc;
+}
+//================================================================================================================
+// Inline hashing.
+// A HASHER is fed every block a copy moves, in whatever order the engine completes them, and hashes the image
+// chunk by chunk on worker threads. The caller's copy thread only copies each block into its chunk buffer, so
+// hashing runs beside the copy instead of after it.
+
+#define HASH_CHUNK_SIZE (1024 * 1024)
+
+typedef struct HASH_BUF {
+    ULONGLONG chunk;
+    size_t filled;              // bytes of the chunk accounted for (data copied in or known zeros)
+    size_t copying;             // copies into data still in progress
+    BYTE* data;
+    struct HASH_BUF* next;
+} HASH_BUF;
+
+typedef struct {
+    ULONGLONG base;             // offset of chunk 0
+    ULONGLONG length;
+    size_t chunkSize;
+    ULONGLONG chunks;
+    BYTE (*digests)[32];
+
+    HASH_BUF* active;           // chunks being filled
+    HASH_BUF* queue;            // complete chunks waiting for a worker
+    HASH_BUF* queueTail;
+    int queued;
+    int busy;                   // workers hashing right now
+    BOOL stop;
+    BOOL failed;                // out of memory; the digests are incomplete
+    ULONGLONG complete;         // chunks whose digest is final
+    ULONGLONG restored;         // chunks [0, restored) came from a checkpoint journal; data fed for them is ignored
+
+    WD_THREAD* threads;
+    int started;
+    WD_MUTEX lock;
+    WD_COND changed;
+} HASHER;
+
+static size_t hasher_chunk_len(const HASHER* h, ULONGLONG c) {
+    ULONGLONG left = h->length - c * h->chunkSize;
+    return (size_t)(left < h->chunkSize ? left : h->chunkSize);
+}
+
+static void* hasher_worker(void* arg) {
+    HASHER* h = (HASHER*)arg;
+    mutex_lock(&h->lock);
+    for (;;) {
+        while (!h->queue && !h->stop) cond_wait(&h->changed, &h->lock);
+        if (!h->queue) break;
+        HASH_BUF* b = h->queue;
+        h->queue = b->next;
+        if (!h->queue) h->queueTail = NULL;
+        h->queued--;
+        h->busy++;
+        mutex_unlock(&h->lock);
+
+        ULONGLONG start = iostat_clock();
+        chunk_digest(b->data, hasher_chunk_len(h, b->chunk), h->digests[b->chunk]);
+        lat_record(&g_iostat.compute, start, hasher_chunk_len(h, b->chunk));
+        stage_add(STAGE_COMPUTE, -1);
+        free(b->data);
+        free(b);
+
+        mutex_lock(&h->lock);
+        h->busy--;
+        h->complete++;
+        cond_broadcast(&h->changed);
+    }
+    mutex_unlock(&h->lock);
+    return NULL;
+}
+
+// Hashes [base, base+length) in chunkSize chunks. Returns 0, or 1 when out of memory.
+int hasher_init(HASHER* h, ULONGLONG base, ULONGLONG length, size_t chunkSize) {
+    memset(h, 0, sizeof(*h));
+    h->base = base;
+    h->length = length;
+    h->chunkSize = chunkSize;
+    h->chunks = (length + chunkSize - 1) / chunkSize;
+    h->digests = (BYTE (*)[32])calloc((size_t)h->chunks + 1, 32);
+    int workers = worker_count();
+    h->threads = (WD_THREAD*)calloc(workers, sizeof(WD_THREAD));
+    if (!h->digests || !h->threads) {
+        free(h->digests);
+        free(h->threads);
+        h->digests = NULL;
+        return 1;
+    }
+    mutex_init(&h->lock);
+    cond_init(&h->changed);
+    for (int i = 0; i < workers; i++) {
+        if (thread_start(&h->threads[h->started], hasher_worker, h) == 0) h->started++;
+    }
+    if (h->started == 0) {
+        cond_destroy(&h->changed);
+        mutex_destroy(&h->lock);
+        free(h->digests);
+        free(h->threads);
+        h->digests = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+// Finds or creates the buffer of chunk c. Called with the lock held.
+static HASH_BUF* hasher_buf(HASHER* h, ULONGLONG c) {
+    for (;;) {
+        for (HASH_BUF* b = h->active; b; b = b->next) {
+            if (b->chunk == c) return b;
+        }
+        if (h->failed) return NULL;
+        if (h->queued <= 4 * h->started) break;
+        cond_wait(&h->changed, &h->lock);       // do not run ahead of the workers by more than a few chunks
+    }
+    HASH_BUF* b = (HASH_BUF*)calloc(1, sizeof(HASH_BUF));
+    BYTE* data = (BYTE*)calloc(1, hasher_chunk_len(h, c));
+    if (!b || !data) {
+        free(b);
+        free(data);
+        h->failed = TRUE;
+        cond_broadcast(&h->changed);
+        return NULL;
+    }
+    b->chunk = c;
+    b->data = data;
+    b->next = h->active;
+    h->active = b;
+    return b;
+}
+
+// Accounts n more bytes of chunk c; queues the chunk once all of it is there. Called with the lock held.
+static void hasher_fill(HASHER* h, HASH_BUF* b, size_t n) {
+    b->filled += n;
+    if (b->filled < hasher_chunk_len(h, b->chunk) || b->copying > 0) return;
+    HASH_BUF** link = &h->active;
+    while (*link != b) link = &(*link)->next;
+    *link = b->next;
+    b->next = NULL;
+    if (h->queueTail) h->queueTail->next = b;
+    else h->queue = b;
+    h->queueTail = b;
+    h->queued++;
+    stage_add(STAGE_COMPUTE, 1);
+    cond_broadcast(&h->changed);
+}
+
+// Feeds len bytes that belong at offset. Safe to call from several threads for disjoint ranges.
+void hasher_add(HASHER* h, const BYTE* data, size_t len, ULONGLONG offset) {
+    if (!h) return;
+    ULONGLONG end = offset + len;
+    ULONGLONG start = h->base + h->restored * h->chunkSize;
+    if (end > h->base + h->length) end = h->base + h->length;
+    if (offset < start) {
+        if (end <= start) return;
+        data += start - offset;
+        offset = start;
+    }
+    while (offset < end) {
+        ULONGLONG c = (offset - h->base) / h->chunkSize;
+        size_t in = (size_t)((offset - h->base) % h->chunkSize);
+        size_t n = hasher_chunk_len(h, c) - in;
+        if (n > end - offset) n = (size_t)(end - offset);
+
+        mutex_lock(&h->lock);
+        HASH_BUF* b = hasher_buf(h, c);
+        if (b) b->copying++;
+        mutex_unlock(&h->lock);
+        if (!b) return;
+
+        memcpy(b->data + in, data, n);
+        mutex_lock(&h->lock);
+        b->copying--;
+        hasher_fill(h, b, n);
+        mutex_unlock(&h->lock);
+        data += n;
+        offset += n;
+    }
+}
+
+// Records [offset, offset+len) as zeros without data.
+void hasher_zero(HASHER* h, ULONGLONG offset, ULONGLONG len) {
+    if (!h) return;
+    ULONGLONG end = offset + len;
+    ULONGLONG start = h->base + h->restored * h->chunkSize;
+    if (offset < start) offset = start;
+    if (end > h->base + h->length) end = h->base + h->length;
+    mutex_lock(&h->lock);
+    while (offset < end && !h->failed) {
+        ULONGLONG c = (offset - h->base) / h->chunkSize;
+        size_t in = (size_t)((offset - h->base) % h->chunkSize);
+        size_t chunkLen = hasher_chunk_len(h, c);
+        size_t n = chunkLen - in;
+        if (n > end - offset) n = (size_t)(end - offset);
+
+        HASH_BUF* b = NULL;
+        for (b = h->active; b && b->chunk != c; b = b->next) {}
+        if (!b && n == chunkLen) {
+            memset(h->digests[c], 0, 32);       // a whole chunk of zeros needs no hashing
+            h->complete++;
+        } else if ((b = hasher_buf(h, c)) != NULL) {
+            hasher_fill(h, b, n);
+        }
+        offset += n;
+    }
+    mutex_unlock(&h->lock);
+}
+
+// Takes digest as the final digest of chunk c, for data known to match a chunk hashed elsewhere.
+void hasher_digest(HASHER* h, ULONGLONG c, const BYTE digest[32]) {
+    if (!h || c < h->restored) return;
+    mutex_lock(&h->lock);
+    memcpy(h->digests[c], digest, 32);
+    h->complete++;
+    mutex_unlock(&h->lock);
+}
+
+// Takes the digests of chunks [0, chunks) as final; they must already be in h->digests. Called before any data is fed.
+void hasher_restore(HASHER* h, ULONGLONG chunks) {
+    mutex_lock(&h->lock);
+    h->complete = chunks;
+    h->restored = chunks;
+    mutex_unlock(&h->lock);
+}
+
+// Waits for the queued chunks, then returns how many leading chunks (up to limit) are final, assuming everything
+// before chunk limit has been fed.
+ULONGLONG hasher_settle(HASHER* h, ULONGLONG limit) {
+    mutex_lock(&h->lock);
+    while ((h->queue || h->busy > 0) && !h->failed) cond_wait(&h->changed, &h->lock);
+    for (HASH_BUF* b = h->active; b; b = b->next) {
+        if (b->chunk < limit) limit = b->chunk;
+    }
+    if (h->failed) limit = 0;
+    mutex_unlock(&h->lock);
+    return limit;
+}
+
+// Waits for the queued chunks and stops the workers. Returns 0 when every chunk was hashed.
+int hasher_finish(HASHER* h) {
+    mutex_lock(&h->lock);
+    while ((h->queue || h->busy > 0) && !h->failed) cond_wait(&h->changed, &h->lock);
+    h->stop = TRUE;
+    cond_broadcast(&h->changed);
+    mutex_unlock(&h->lock);
+    for (int i = 0; i < h->started; i++) thread_join(h->threads[i]);
+
+    while (h->active) {                             // chunks the copy never finished
+        HASH_BUF* b = h->active;
+        h->active = b->next;
+        free(b->data);
+        free(b);
+    }
+    while (h->queue) {
+        HASH_BUF* b = h->queue;
+        h->queue = b->next;
+        stage_add(STAGE_COMPUTE, -1);
+        free(b->data);
+        free(b);
+    }
+    cond_destroy(&h->changed);
+    mutex_destroy(&h->lock);
+    free(h->threads);
+    h->threads = NULL;
+    return !h->failed && h->complete == h->chunks ? 0 : 1;
+}
+
+void hasher_free(HASHER* h) {
+    free(h->digests);
+    h->digests = NULL;
+}
+
+// The digest an image is identified by: SHA-256 over its chunk digests in order.
+void image_digest(const BYTE (*digests)[32], ULONGLONG chunks, char hex[65]) {
+    BYTE digest[32];
+    sha256(digests, (size_t)chunks * 32, digest);
+    hex_string(digest, 32, hex);
+}
+
+// Writes <imagePath>.wdh for the digests of an image of imageSize bytes. Returns 0 on success.
+int hash_sidecar_write(const char* imagePath, ULONGLONG imageSize, size_t chunkSize, const BYTE (*digests)[32]) {
+    char path[600];
+    hash_sidecar_path(imagePath, path, sizeof(path));
+    HASH_HEADER header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, HASH_MAGIC, 8);
+    header.version = HASH_VERSION;
+    header.chunkSize = (DWORD)chunkSize;
+    header.imageSize = imageSize;
+    header.chunkCount = (imageSize + chunkSize - 1) / chunkSize;
+    if (file_stamp(imagePath, &header.imageFileSize, &header.imageMtime)) header.imageFileSize = header.imageMtime = 0;
+
+    DISK_DEV f;
+    if (dev_open(&f, path, DEV_WRITE | DEV_CREATE)) return 1;
+    size_t bytes = (size_t)header.chunkCount * 32;
+    int rc = dev_pwrite(&f, &header, sizeof(header), 0) == sizeof(header) &&
+             dev_pwrite(&f, digests, bytes, sizeof(header)) == (long long)bytes ? 0 : 1;
+    if (rc == 0 && hash_tree_append(&f, &header, digests)) {
+        printf("Warning: no Merkle tree in %s, diff will rebuild it\n", path);
+    }
+    dev_close(&f);
+    if (rc) remove(path);
+    return rc;
+}
+
+// Prints the digest of a finished image and stores its sidecar; hasher is NULL when hashing was not possible.
+void image_hash_report(const char* imagePath, ULONGLONG imageSize, const HASHER* hasher) {
+    if (!hasher) {
+        printf("Warning: the image could not be hashed, no digest recorded\n");
+        return;
+    }
+    char hex[65], path[600];
+    image_digest((const BYTE (*)[32])hasher->digests, hasher->chunks, hex);
+    hash_sidecar_path(imagePath, path, sizeof(path));
+    if (hash_sidecar_write(imagePath, imageSize, hasher->chunkSize, (const BYTE (*)[32])hasher->digests)) {
+        printf("Warning: failed to write %s. Error: %lu\n", path, dev_last_error());
+    }
+    printf("SHA-256 (chunk list): %s  %s\n", hex, path);
+}
+//================================================================================================================
+// Read-back verification: worker threads read a range of the target back (bypassing the page cache where the
+// device allows it) and compare every chunk against the digests recorded while it was written. The same pool
+// hashes a device that has no sidecar for diff.
+
+typedef struct {
+    DISK_DEV* dev;
+    ULONGLONG base;
+    ULONGLONG length;
+    size_t chunkSize;
+    ULONGLONG chunks;
+    const BYTE (*digests)[32];  // digests to compare against, or
+    BYTE (*out)[32];            // where to store the digests instead
+    const char* label;
+    ULONGLONG next;
+    ULONGLONG done;
+    ULONGLONG mismatches;
+    ULONGLONG firstBad;
+    BOOL readError;
+    WD_MUTEX lock;
+} VERIFY_POOL;
+
+static void* verify_worker(void* arg) {
+    VERIFY_POOL* v = (VERIFY_POOL*)arg;
+    BYTE* buf = (BYTE*)alloc_aligned(v->chunkSize);
+    BYTE digest[32];
+    for (;;) {
+        mutex_lock(&v->lock);
+        if (v->next >= v->chunks || v->readError || !buf) {
+            if (!buf) v->readError = TRUE;
+            mutex_unlock(&v->lock);
+            break;
+        }
+        ULONGLONG c = v->next++;
+        mutex_unlock(&v->lock);
+
+        ULONGLONG offset = v->base + c * v->chunkSize;
+        size_t len = (size_t)(v->length - c * v->chunkSize < v->chunkSize ? v->length - c * v->chunkSize : v->chunkSize);
+        BOOL ok = dev_pread(v->dev, buf, len, offset) == (long long)len;
+        if (ok) chunk_digest(buf, len, v->out ? v->out[c] : digest);
+
+        mutex_lock(&v->lock);
+        if (!ok) {
+            v->readError = TRUE;
+            v->firstBad = offset;
+        } else if (!v->out && memcmp(digest, v->digests[c], 32) != 0) {
+            if (v->mismatches == 0 || offset < v->firstBad) v->firstBad = offset;
+            v->mismatches++;
+        }
+        v->done += len;
+        if (progress_due() || v->done == v->length) {
+            printf("\r%s: %.2f MB", v->label, v->done / (1024.0 * 1024.0));
+            fflush(stdout);
+        }
+        mutex_unlock(&v->lock);
+    }
+    if (buf) free_aligned(buf);
+    return NULL;
+}
+
+static void verify_pool_run(VERIFY_POOL* v, DISK_DEV* dev, ULONGLONG base, ULONGLONG length, size_t chunkSize) {
+    v->dev = dev;
+    v->base = base;
+    v->length = length;
+    v->chunkSize = chunkSize;
+    v->chunks = (length + chunkSize - 1) / chunkSize;
+    mutex_init(&v->lock);
+
+    int workers = worker_count();
+    WD_THREAD* threads = (WD_THREAD*)calloc(workers, sizeof(WD_THREAD));
+    int started = 0;
+    for (int i = 0; threads && i < workers; i++) {
+        if (thread_start(&threads[started], verify_worker, v) == 0) started++;
+    }
+    if (started == 0) verify_worker(v);
+    for (int i = 0; i < started; i++) thread_join(threads[i]);
+    free(threads);
+    mutex_destroy(&v->lock);
+}
+
+// Reads [base, base+length) of dev back and compares it with digests. Returns 0 when everything matches.
+int verify_range(DISK_DEV* dev, ULONGLONG base, ULONGLONG length, size_t chunkSize, const BYTE (*digests)[32]) {
+    VERIFY_POOL v;
+    memset(&v, 0, sizeof(v));
+    v.digests = digests;
+    v.label = "Verify";
+    verify_pool_run(&v, dev, base, length, chunkSize);
+
+    if (v.readError) {
+        printf("\nVerify: read error at offset %llu. Error: %lu\n", v.firstBad, dev_last_error());
+        return 1;
+    }
+    if (v.mismatches > 0) {
+        printf("\nVerify FAILED: %llu of %llu chunks differ, first at offset %llu\n", v.mismatches, v.chunks, v.firstBad);
+        return 1;
+    }
+    printf("\nVerify OK: %.2f MB read back and matched\n", length / (1024.0 * 1024.0));
+    return 0;
+}
+
+// Hashes [base, base+length) of dev in chunkSize chunks into out. Returns 0 on success.
+int hash_range(DISK_DEV* dev, ULONGLONG base, ULONGLONG length, size_t chunkSize, BYTE (*out)[32]) {
+    VERIFY_POOL v;
+    memset(&v, 0, sizeof(v));
+    v.out = out;
+    v.label = "Hash";
+    verify_pool_run(&v, dev, base, length, chunkSize);
+    printf("\n");
+    if (v.readError) {
+        printf("Hash: read error at offset %llu. Error: %lu\n", v.firstBad, dev_last_error());
+        return 1;
+    }
+    return 0;
+}
+
+// Compares what was read from an image with its sidecar (expected may be NULL). Returns 0 unless they differ.
+int image_hash_check(const HASHER* hasher, const BYTE (*expected)[32], const char* imagePath) {
+    char hex[65];
+    image_digest((const BYTE (*)[32])hasher->digests, hasher->chunks, hex);
+    printf("SHA-256 (chunk list): %s\n", hex);
+
+    if (expected) {
+        ULONGLONG bad = 0, first = 0;
+        for (ULONGLONG c = 0; c < hasher->chunks; c++) {
+            if (memcmp(hasher->digests[c], expected[c], 32) != 0 && bad++ == 0) first = c;
+        }
+        if (bad > 0) {
+            printf("Image check FAILED: %llu chunks read from %s differ from its sidecar, first at offset %llu\n",
+                   bad, imagePath, hasher->base + first * hasher->chunkSize);
+            return 1;
+        }
+        printf("Image check OK: every chunk matches the sidecar of %s\n", imagePath);
+        hash_sidecar_stamp(imagePath);
+    }
+    return 0;
+}
+
+// After a write: checks what was read from the image against its sidecar and, with --verify, reads the target
+// back. Returns 0 unless a check failed.
+int write_hash_check(DISK_DEV* target, const HASHER* hasher, const BYTE (*expected)[32], const char* imagePath) {
+    if (!hasher) {
+        printf("Warning: the data could not be hashed%s\n", g_opts.verify ? ", nothing verified" : "");
+        return g_opts.verify ? 1 : 0;
+    }
+    if (image_hash_check(hasher, expected, imagePath)) return 1;
+    if (g_opts.verify) {
+        dev_flush(target);
+        return verify_range(target, hasher->base, hasher->length, hasher->chunkSize, (const BYTE (*)[32])hasher->digests);
+    }
+    return 0;
+}
+
+// The engine the raw copies since the last iostat_reset() ran on: "uring", "threaded", "mixed" after a fallback
+// part way, or NULL when none ran.
+const char* iostat_engine(void) {
+    LONGLONG e = g_iostat.engines;
+    if (e == 0) return NULL;
+    if (e == (1LL << ENGINE_URING)) return "uring";
+    if (e == (1LL << ENGINE_THREADED)) return "threaded";
+    return "mixed";
+}
+//================================================================================================================
+// Telemetry: with --telemetry a create or write streams JSON lines to a file descriptor (fd:3), a Unix socket
+// (unix:/run/wddx32.sock) or a file. A "start" record opens the stream, a "progress" record follows every
+// --telemetry-interval ms (default 1000) and an "end" record closes it:
+//
+//   progress: bytes done and total, throughput over the last interval and since the start, ETA, read/compute/write
+//             latency percentiles of the last interval, and the average and peak number of blocks in each stage
+//   end:      the outcome, the engine the raw copy ran on (null when none did) and the whole run's latency
+//             histograms as [upper bound ns, count] buckets
+//
+// A full write queue with an idle read stage means the target is the bottleneck, and the other way round. A
+// stream that goes away is dropped with a warning; it never fails the job.
+
+#define TELEMETRY_INTERVAL_MS 1000
+#define TELEMETRY_SAMPLE_MS   10            // how often the stage gauges are sampled
+#define TELEMETRY_LINE        32768
+
+typedef struct {
+    BOOL active;
+    const char* op;
+    int fd;
+    BOOL ownFd;                 // opened here (a file or socket), closed by telemetry_stop()
+    BOOL failed;
+    ULONGLONG started;          // now_ns() at telemetry_start()
+    ULONGLONG lastAt;           // now_ns() of the previous progress record
+    LONGLONG lastDone;
+    LAT_HIST last[3];           // read, compute, write histograms at the previous progress record
+    double stageSum[STAGES];    // gauge samples since the previous record
+    LONGLONG stageMax[STAGES];
+    int samples;
+    volatile BOOL stop;
+    WD_THREAD thread;
+    char line[TELEMETRY_LINE];
+} TELEMETRY;
+
+TELEMETRY g_telemetry;
+
+static const char* const stage_names[STAGES] = { "read", "compute", "write" };
+
+static void sleep_ms(int ms) {
+#ifdef _WIN32
+    Sleep((DWORD)ms);
+#else
+    struct timespec t = { ms / 1000, (long)(ms % 1000) * 1000000L };
+    nanosleep(&t, NULL);
+#endif
+}
+
+static void telemetry_send(TELEMETRY* t, size_t len) {
+    if (t->failed) return;
+    size_t sent = 0;
+    while (sent < len) {
+#ifdef _WIN32
+        int n = _write(t->fd, t->line + sent, (unsigned)(len - sent));
+#else
+        ssize_t n = write(t->fd, t->line + sent, len - sent);
+        if (n < 0 && errno == EINTR) continue;
+#endif
+        if (n <= 0) {
+            t->failed = TRUE;
+            printf("\nWarning: telemetry stream closed (error %d), carrying on without it\n", errno);
+            return;
+        }
+        sent += (size_t)n;
+    }
+}
+
+// Appends "name":{...} for the requests in h since *last (all of them when last is NULL) to t->line at n.
+static size_t telemetry_hist(TELEMETRY* t, size_t n, const char* name, const LAT_HIST* h, LAT_HIST* last) {
+    LAT_HIST d;
+    memset((void*)&d, 0, sizeof(d));
+    for (int b = 0; b < LAT_BUCKETS; b++) d.count[b] = h->count[b] - (last ? last->count[b] : 0);
+    d.requests = h->requests - (last ? last->requests : 0);
+    d.bytes = h->bytes - (last ? last->bytes : 0);
+    if (last) memcpy((void*)last, (const void*)h, sizeof(*last));
+
+    size_t size = sizeof(t->line);
+    n += (size_t)snprintf(t->line + n, size - n, "\"%s\":{\"requests\":%lld,\"bytes\":%lld,\"p50Us\":%.1f,"
+                          "\"p90Us\":%.1f,\"p99Us\":%.1f,\"maxUs\":%.1f", name, (LONGLONG)d.requests,
+                          (LONGLONG)d.bytes, lat_percentile(&d, 0.5) / 1e3, lat_percentile(&d, 0.9) / 1e3,
+                          lat_percentile(&d, 0.99) / 1e3, lat_percentile(&d, 1.0) / 1e3);
+    if (!last) {
+        n += (size_t)snprintf(t->line + n, size - n, ",\"buckets\":[");
+        BOOL first = TRUE;
+        for (int b = 0; b < LAT_BUCKETS && n < size - 64; b++) {
+            if (d.count[b] == 0) continue;
+            n += (size_t)snprintf(t->line + n, size - n, "%s[%llu,%lld]", first ? "" : ",", lat_bucket_top(b),
+                                  (LONGLONG)d.count[b]);
+            first = FALSE;
+        }
+        n += (size_t)snprintf(t->line + n, size - n, "]");
+    }
+    n += (size_t)snprintf(t->line + n, size - n, "}");
+    return n;
+}
+
+static void telemetry_progress(TELEMETRY* t) {
+    ULONGLONG now = now_ns();
+    LONGLONG done = g_progress.done;
+    ULONGLONG total = g_progress.total;
+    double seconds = (now - t->started) / 1e9;
+    double interval = (now - t->lastAt) / 1e9;
+    double mbps = interval > 0 ? (done - t->lastDone) / (1024.0 * 1024.0) / interval : 0;
+    double avg = seconds > 0 ? done / (1024.0 * 1024.0) / seconds : 0;
+    t->lastAt = now;
+    t->lastDone = done;
+
+    size_t size = sizeof(t->line);
+    size_t n = (size_t)snprintf(t->line, size, "{\"type\":\"progress\",\"op\":\"%s\",\"t\":%.3f,\"bytes\":%lld,\"total\":",
+                                t->op, seconds, done);
+    n += total ? (size_t)snprintf(t->line + n, size - n, "%llu", total) : (size_t)snprintf(t->line + n, size - n, "null");
+    n += (size_t)snprintf(t->line + n, size - n, ",\"mbps\":%.1f,\"avgMbps\":%.1f,\"etaSec\":", mbps, avg);
+    if (total && avg > 0) {
+        ULONGLONG left = (ULONGLONG)done < total ? total - (ULONGLONG)done : 0;
+        n += (size_t)snprintf(t->line + n, size - n, "%.1f", left / (1024.0 * 1024.0) / avg);
+    } else {
+        n += (size_t)snprintf(t->line + n, size - n, "null");
+    }
+    n += (size_t)snprintf(t->line + n, size - n, ",\"latency\":{");
+    n = telemetry_hist(t, n, "read", &g_iostat.read, &t->last[0]);
+    n += (size_t)snprintf(t->line + n, size - n, ",");
+    n = telemetry_hist(t, n, "compute", &g_iostat.compute, &t->last[1]);
+    n += (size_t)snprintf(t->line + n, size - n, ",");
+    n = telemetry_hist(t, n, "write", &g_iostat.write, &t->last[2]);
+    n += (size_t)snprintf(t->line + n, size - n, "},\"queues\":{");
+    for (int s = 0; s < STAGES; s++) {
+        n += (size_t)snprintf(t->line + n, size - n, "%s\"%s\":{\"avg\":%.2f,\"max\":%lld}", s ? "," : "",
+                              stage_names[s], t->samples ? t->stageSum[s] / t->samples : 0.0, t->stageMax[s]);
+        t->stageSum[s] = 0;
+        t->stageMax[s] = 0;
+    }
+    t->samples = 0;
+    n += (size_t)snprintf(t->line + n, size - n, "}}\n");
+    telemetry_send(t, n);
+}
+
+static void* telemetry_thread(void* arg) {
+    TELEMETRY* t = (TELEMETRY*)arg;
+    while (!t->stop) {
+        sleep_ms(TELEMETRY_SAMPLE_MS);
+        for (int s = 0; s < STAGES; s++) {
+            LONGLONG v = g_iostat.stage[s];
+            t->stageSum[s] += (double)v;
+            if (v > t->stageMax[s]) t->stageMax[s] = v;
+        }
+        t->samples++;
+        int interval = g_opts.telemetryInterval > 0 ? g_opts.telemetryInterval : TELEMETRY_INTERVAL_MS;
+        if (now_ns() - t->lastAt >= (ULONGLONG)interval * 1000000ULL) telemetry_progress(t);
+    }
+    return NULL;
+}
+
+// Opens the --telemetry stream for command op and starts reporting. Returns 0, or 1 when the stream cannot be
+// opened. Does nothing without --telemetry.
+int telemetry_start(const char* op) {
+    TELEMETRY* t = &g_telemetry;
+    const char* dest = g_opts.telemetry;
+    if (!dest) return 0;
+    memset(t, 0, sizeof(*t));
+    t->op = op;
+    if (strncmp(dest, "fd:", 3) == 0) {
+        char* end;
+        errno = 0;
+        long fd = strtol(dest + 3, &end, 10);
+        BOOL valid = end != dest + 3 && *end == '\0' && errno == 0 && fd >= 0 && fd <= INT_MAX;
+#ifdef _WIN32
+        valid = valid && _get_osfhandle((int)fd) != -1;
+#else
+        valid = valid && fcntl((int)fd, F_GETFD) != -1;
+#endif
+        if (!valid) {
+            printf("Telemetry fd %s is not an open file descriptor\n", dest + 3);
+            return 1;
+        }
+        t->fd = (int)fd;
+    } else if (strncmp(dest, "unix:", 5) == 0) {
+#ifdef _WIN32
+        printf("Telemetry to a Unix socket is not supported on Windows; use fd:N or a file\n");
+        return 1;
+#else
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(dest + 5) >= sizeof(addr.sun_path)) {
+            printf("Telemetry socket path too long: %s\n", dest + 5);
+            return 1;
+        }
+        strcpy(addr.sun_path, dest + 5);
+        t->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (t->fd < 0 || connect(t->fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+            printf("Cannot connect to telemetry socket %s. Error: %d\n", dest + 5, errno);
+            if (t->fd >= 0) close(t->fd);
+            return 1;
+        }
+        t->ownFd = TRUE;
+#endif
+    } else {
+#ifdef _WIN32
+        t->fd = _open(dest, _O_WRONLY | _O_CREAT | _O_APPEND | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+        t->fd = open(dest, O_WRONLY | O_CREAT | O_APPEND, 0644);
+#endif
+        if (t->fd < 0) {
+            printf("Cannot open telemetry file %s. Error: %d\n", dest, errno);
+            return 1;
+        }
+        t->ownFd = TRUE;
+    }
+#ifndef _WIN32
+    signal(SIGPIPE, SIG_IGN);           // a reader that goes away shows up as a failed write instead
+#endif
+
+    g_iostat.enabled = TRUE;
+    iostat_reset();
+    t->started = t->lastAt = now_ns();
+    int interval = g_opts.telemetryInterval > 0 ? g_opts.telemetryInterval : TELEMETRY_INTERVAL_MS;
+    size_t n = (size_t)snprintf(t->line, sizeof(t->line), "{\"type\":\"start\",\"op\":\"%s\",\"time\":%lld,"
+                                "\"intervalMs\":%d}\n", op, (long long)time(NULL), interval);
+    telemetry_send(t, n);
+    if (thread_start(&t->thread, telemetry_thread, t)) {
+        printf("Warning: cannot start the telemetry thread, only the end record will be sent\n");
+        t->stop = TRUE;
+    }
+    t->active = TRUE;
+    return 0;
+}
+
+// Sends the last progress record and the end record for a command that returned rc, and closes the stream.
+// Returns rc.
+int telemetry_stop(int rc) {
+    TELEMETRY* t = &g_telemetry;
+    if (!t->active) return rc;
+    if (!t->stop) {
+        t->stop = TRUE;
+        thread_join(t->thread);
+    }
+    telemetry_progress(t);
+
+    size_t size = sizeof(t->line);
+    double seconds = (now_ns() - t->started) / 1e9;
+    const char* engine = iostat_engine();
+    size_t n = (size_t)snprintf(t->line, size, "{\"type\":\"end\",\"op\":\"%s\",\"ok\":%s,\"t\":%.3f,\"bytes\":%lld,"
+                                "\"avgMbps\":%.1f,\"engine\":%s%s%s,\"latency\":{", t->op, rc == 0 ? "true" : "false",
+                                seconds, (LONGLONG)g_progress.done,
+                                seconds > 0 ? g_progress.done / (1024.0 * 1024.0) / seconds : 0.0,
+                                engine ? "\"" : "", engine ? engine : "null", engine ? "\"" : "");
+    n = telemetry_hist(t, n, "read", &g_iostat.read, NULL);
+    n += (size_t)snprintf(t->line + n, size - n, ",");
+    n = telemetry_hist(t, n, "compute", &g_iostat.compute, NULL);
+    n += (size_t)snprintf(t->line + n, size - n, ",");
+    n = telemetry_hist(t, n, "write", &g_iostat.write, NULL);
+    n += (size_t)snprintf(t->line + n, size - n, "}}\n");
+    telemetry_send(t, n);
+
+    if (t->ownFd) {
+#ifdef _WIN32
+        _close(t->fd);
+#else
+        close(t->fd);
+#endif
+    }
+    t->active = FALSE;
+    g_iostat.enabled = FALSE;
+    return rc;
+}
+//================================================================================================================
+// Copy pipeline.
+// A reader thread fills a ring of preallocated, aligned buffers from the source while the calling thread drains
+// them to the destination, so a copy runs at the speed of the slower device rather than the sum of both.
+
+#define COPY_OK          0
+#define COPY_READ_ERROR  1
+#define COPY_WRITE_ERROR 2
+#define COPY_NO_MEMORY   3
+
+typedef struct {
+    ULONGLONG offset;
+    ULONGLONG length;
+} EXTENT;
+
+typedef struct {
+    EXTENT* items;
+    int count;
+    int capacity;
+} EXTENT_LIST;
+
+// Appends [offset, offset+length), merging it into the last extent when they touch. Returns 1 when out of memory.
+int extent_add(EXTENT_LIST* list, ULONGLONG offset, ULONGLONG length) {
+    if (length == 0) return 0;
+    if (list->count > 0) {
+        EXTENT* last = &list->items[list->count - 1];
+        if (last->offset + last->length == offset) {
+            last->length += length;
+            return 0;
+        }
+    }
+    if (list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 64;
+        EXTENT* items = (EXTENT*)realloc(list->items, capacity * sizeof(EXTENT));
+        if (!items) return 1;
+        list->items = items;
+        list->capacity = capacity;
+    }
+    list->items[list->count].offset = offset;
+    list->items[list->count].length = length;
+    list->count++;
+    return 0;
+}
+
+void extent_free(EXTENT_LIST* list) {
+    free(list->items);
+    memset(list, 0, sizeof(*list));
+}
+
+ULONGLONG extent_total(const EXTENT_LIST* list) {
+    ULONGLONG total = 0;
+    for (int i = 0; i < list->count; i++) total += list->items[i].length;
+    return total;
+}
+
+typedef struct {
+    DISK_DEV* src;
+    ULONGLONG srcOffset;
+    DISK_DEV* dst;
+    ULONGLONG dstOffset;
+    ULONGLONG length;           // bytes covered by the job
+    const EXTENT* extents;      // job-relative ranges to copy, sorted; NULL copies all of [0, length)
+    int extentCount;
+    int engine;                 // ENGINE_*
+    size_t blockSize;           // bytes per request, a multiple of DIRECT_ALIGN
+    int queueDepth;             // ring size / requests in flight
+    BOOL sparse;                // skip all-zero grains instead of writing them (dst must be a regular file)
+    BOOL compare;               // read dst first and write only the grains that differ (excludes sparse)
+    BOOL quiet;                 // no progress line
+    BOOL discard;               // read only: blocks are dropped once read, dst is never written (tuning probes)
+    HASHER* hasher;             // fed every block read, at its dst offset; NULL for none
+
+    // results
+    ULONGLONG bytesDone;        // bytes written to dst; less than length after an error or a short source
+    ULONGLONG failOffset;       // job-relative offset of the failing request
+    unsigned long error;        // dev_last_error() of the failing request
+    ULONGLONG bytesSparse;      // zero bytes left as holes instead of written
+    ULONGLONG bytesSkipped;     // bytes dst already held, not rewritten (compare jobs)
+    BOOL shortSource;           // the source ended before length
+} COPY_JOB;
+
+typedef struct {
+    int ext;
+    ULONGLONG pos;
+} JOB_CURSOR;
+
+// Steps a cursor through the job's extents (or the whole range) one request at a time. The gaps between extents
+// are hashed as zeros as soon as the cursor passes them, so the chunks they share with data complete in order
+// instead of waiting in the hasher until the whole job is done.
+static BOOL job_next_block(const COPY_JOB* job, JOB_CURSOR* c, ULONGLONG* pos, size_t* len) {
+    ULONGLONG end = job->length;
+    if (job->extents) {
+        while (c->ext < job->extentCount && c->pos >= job->extents[c->ext].offset + job->extents[c->ext].length) c->ext++;
+        if (c->ext >= job->extentCount) {
+            if (c->pos < job->length) hasher_zero(job->hasher, job->dstOffset + c->pos, job->length - c->pos);
+            c->pos = job->length;
+            return FALSE;
+        }
+        if (c->pos < job->extents[c->ext].offset) {
+            hasher_zero(job->hasher, job->dstOffset + c->pos, job->extents[c->ext].offset - c->pos);
+            c->pos = job->extents[c->ext].offset;
+        }
+        if (job->extents[c->ext].offset + job->extents[c->ext].length < end) {
+            end = job->extents[c->ext].offset + job->extents[c->ext].length;
+        }
+    }
+    if (c->pos >= end) return FALSE;
+    *pos = c->pos;
+    *len = (size_t)((end - c->pos) > job->blockSize ? job->blockSize : (end - c->pos));
+    c->pos += *len;
+    return TRUE;
+}
+
+typedef struct {
+    BYTE* data;
+    size_t len;
+    ULONGLONG pos;              // job-relative offset
+    BYTE* old;                  // compare jobs: what dst holds there
+    size_t oldLen;
+} PIPE_SLOT;
+
+typedef struct {
+    COPY_JOB* job;
+    PIPE_SLOT* slots;
+    int count;
+    int head, tail, filled;
+    BOOL eof, abort;
+    int status;
+    WD_MUTEX lock;
+    WD_COND notEmpty, notFull;
+} PIPELINE;
+
+// Runs the part [offset, offset+length) (target offsets) of a job; see journal_run().
+typedef int (*SEGMENT_FN)(void* ctx, ULONGLONG offset, ULONGLONG length, BOOL quiet, COPY_JOB* result);
+
+void copy_job_init(COPY_JOB* job, DISK_DEV* src, ULONGLONG srcOffset, DISK_DEV* dst, ULONGLONG dstOffset, ULONGLONG length) {
+    memset(job, 0, sizeof(*job));
+    job->src = src;
+    job->srcOffset = srcOffset;
+    job->dst = dst;
+    job->dstOffset = dstOffset;
+    job->length = length;
+    job->engine = g_opts.engine;
+    job->sparse = g_opts.sparse && dst->isFile;
+    if (g_opts.tunedBlockSize && g_opts.tunedEngine == job->engine) {
+        job->blockSize = g_opts.blockSize ? g_opts.blockSize : g_opts.tunedBlockSize;
+        job->queueDepth = g_opts.queueDepth ? g_opts.queueDepth : g_opts.tunedQueueDepth;
+    } else if (job->engine == ENGINE_URING) {
+        job->blockSize = g_opts.blockSize ? g_opts.blockSize : URING_BLOCK_SIZE;
+        job->queueDepth = g_opts.queueDepth ? g_opts.queueDepth : URING_DEPTH;
+    } else {
+        job->blockSize = g_opts.blockSize ? g_opts.blockSize : BUFFER_SIZE;
+        job->queueDepth = g_opts.queueDepth ? g_opts.queueDepth : PIPELINE_BUFFERS;
+    }
+}
+
+#define SPARSE_GRAIN (64 * 1024)
+
+// Finds the next run of non-zero grains in data[from, len), grains counted from the start of the block. Returns
+// the run's start (len when the rest is all zeros) and stores its length in *runLen.
+static size_t next_data_run(const BYTE* data, size_t len, size_t from, size_t* runLen) {
+    size_t start = from;
+    while (start < len) {
+        size_t g = SPARSE_GRAIN - (start % SPARSE_GRAIN);
+        if (g > len - start) g = len - start;
+        if (!is_zero_block(data + start, g)) break;
+        start += g;
+    }
+    size_t end = start;
+    while (end < len) {
+        size_t g = SPARSE_GRAIN - (end % SPARSE_GRAIN);
+        if (g > len - end) g = len - end;
+        if (is_zero_block(data + end, g)) break;
+        end += g;
+    }
+    *runLen = end - start;
+    return start;
+}
+
+#define COMPARE_GRAIN 4096
+
+// Finds the next run of grains in data[from, len) that differ from old, of which only the first oldLen bytes are
+// valid (the rest counts as different). Returns the run's start (len when nothing differs) and its length in *runLen.
+static size_t next_changed_run(const BYTE* data, const BYTE* old, size_t oldLen, size_t len, size_t from, size_t* runLen) {
+    size_t start = from;
+    while (start < len) {
+        size_t g = COMPARE_GRAIN - (start % COMPARE_GRAIN);
+        if (g > len - start) g = len - start;
+        if (start + g > oldLen || memcmp(data + start, old + start, g) != 0) break;
+        start += g;
+    }
+    size_t end = start;
+    while (end < len) {
+        size_t g = COMPARE_GRAIN - (end % COMPARE_GRAIN);
+        if (g > len - end) g = len - end;
+        if (end + g <= oldLen && memcmp(data + end, old + end, g) == 0) break;
+        end += g;
+    }
+    *runLen = end - start;
+    return start;
+}
+
+// Writes the grains of data[0, len) that differ from old to dst at offset, adding the bytes left alone to *skipped.
+static int write_changed(DISK_DEV* dst, ULONGLONG offset, const BYTE* data, const BYTE* old, size_t oldLen, size_t len,
+                         ULONGLONG* skipped) {
+    size_t at = 0;
+    while (at < len) {
+        size_t run;
+        size_t start = next_changed_run(data, old, oldLen, len, at, &run);
+        *skipped += start - at;
+        if (start == len) break;
+        if (dev_pwrite(dst, data + start, run, offset + start) != (long long)run) return 1;
+        at = start + run;
+    }
+    return 0;
+}
+
+// Makes a zero gap of the destination read back as zeros, as a hole where possible.
+static int sparse_gap(COPY_JOB* job, ULONGLONG dstOffset, size_t len) {
+    if (dev_make_hole(job->dst, dstOffset, len) == 0) {
+        job->bytesSparse += len;
+        return 0;
+    }
+    return dev_write_zeros(job->dst, dstOffset, len);
+}
+
+// Writes one block at job-relative pos, skipping all-zero grains when the job is sparse.
+static int write_block(COPY_JOB* job, const BYTE* data, size_t len, ULONGLONG pos) {
+    if (!job->sparse) {
+        return dev_pwrite(job->dst, data, len, job->dstOffset + pos) == (long long)len ? 0 : 1;
+    }
+    size_t at = 0;
+    while (at < len) {
+        size_t run;
+        size_t start = next_data_run(data, len, at, &run);
+        if (start > at && sparse_gap(job, job->dstOffset + pos + at, start - at)) return 1;
+        if (start == len) break;
+        if (dev_pwrite(job->dst, data + start, run, job->dstOffset + pos + start) != (long long)run) return 1;
+        at = start + run;
+    }
+    return 0;
+}
+
+static void pipeline_fail(PIPELINE* p, int status, ULONGLONG pos, unsigned long error) {
+    mutex_lock(&p->lock);
+    if (p->status == COPY_OK) {
+        p->status = status;
+        p->job->failOffset = pos;
+        p->job->error = error;
+    }
+    p->abort = TRUE;
+    cond_broadcast(&p->notEmpty);
+    cond_broadcast(&p->notFull);
+    mutex_unlock(&p->lock);
+}
+
+static void* pipeline_reader(void* arg) {
+    PIPELINE* p = (PIPELINE*)arg;
+    COPY_JOB* job = p->job;
+    JOB_CURSOR cursor = { 0, 0 };
+    ULONGLONG pos;
+    size_t want;
+
+    while (job_next_block(job, &cursor, &pos, &want)) {
+        mutex_lock(&p->lock);
+        while (p->filled == p->count && !p->abort) cond_wait(&p->notFull, &p->lock);
+        if (p->abort) {
+            mutex_unlock(&p->lock);
+            return NULL;
+        }
+        PIPE_SLOT* slot = &p->slots[p->head];
+        mutex_unlock(&p->lock);
+
+        stage_add(STAGE_READ, 1);
+        long long got = dev_pread(job->src, slot->data, want, job->srcOffset + pos);
+        stage_add(STAGE_READ, -1);
+        if (got < 0) {
+            pipeline_fail(p, COPY_READ_ERROR, pos, dev_last_error());
+            return NULL;
+        }
+        slot->len = (size_t)got;
+        slot->pos = pos;
+        if (job->compare && got > 0) {
+            // Unreadable target bytes count as changed and get rewritten.
+            long long had = dev_pread(job->dst, slot->old, (size_t)got, job->dstOffset + pos);
+            slot->oldLen = had > 0 ? (size_t)had : 0;
+        }
+
+        mutex_lock(&p->lock);
+        if (got > 0) {
+            p->head = (p->head + 1) % p->count;
+            p->filled++;
+            stage_add(STAGE_WRITE, 1);
+            cond_signal(&p->notEmpty);
+        }
+        mutex_unlock(&p->lock);
+
+        if ((size_t)got != want) {              // end of source
+            job->shortSource = TRUE;
+            break;
+        }
+    }
+
+    mutex_lock(&p->lock);
+    p->eof = TRUE;
+    cond_broadcast(&p->notEmpty);
+    mutex_unlock(&p->lock);
+    return NULL;
+}
+
+static int copy_range_threaded(COPY_JOB* job) {
+    PIPELINE p;
+    memset(&p, 0, sizeof(p));
+    p.job = job;
+    p.count = job->queueDepth > 0 ? job->queueDepth : 1;
+    job->bytesDone = 0;
+
+    p.slots = (PIPE_SLOT*)calloc(p.count, sizeof(PIPE_SLOT));
+    if (!p.slots) return COPY_NO_MEMORY;
+    for (int i = 0; i < p.count; i++) {
+        p.slots[i].data = (BYTE*)alloc_aligned(job->blockSize);
+        p.slots[i].old = job->compare ? (BYTE*)alloc_aligned(job->blockSize) : NULL;
+        if (!p.slots[i].data || (job->compare && !p.slots[i].old)) {
+            for (int j = 0; j <= i; j++) {
+                if (p.slots[j].data) free_aligned(p.slots[j].data);
+                if (p.slots[j].old) free_aligned(p.slots[j].old);
+            }
+            free(p.slots);
+            return COPY_NO_MEMORY;
+        }
+    }
+    mutex_init(&p.lock);
+    cond_init(&p.notEmpty);
+    cond_init(&p.notFull);
+
+    WD_THREAD reader;
+    BOOL started = thread_start(&reader, pipeline_reader, &p) == 0;
+    if (!started) {
+        p.status = COPY_NO_MEMORY;
+        p.abort = TRUE;
+    }
+
+    for (;;) {                              // abort is only read under the lock, the reader sets it
+        mutex_lock(&p.lock);
+        while (p.filled == 0 && !p.eof && !p.abort) cond_wait(&p.notEmpty, &p.lock);
+        if (p.abort || (p.filled == 0 && p.eof)) {
+            mutex_unlock(&p.lock);
+            break;
+        }
+        PIPE_SLOT* slot = &p.slots[p.tail];
+        mutex_unlock(&p.lock);
+
+        int failed = job->discard ? 0
+            : job->compare
+            ? write_changed(job->dst, job->dstOffset + slot->pos, slot->data, slot->old, slot->oldLen, slot->len,
+                            &job->bytesSkipped)
+            : write_block(job, slot->data, slot->len, slot->pos);
+        if (failed) {
+            pipeline_fail(&p, COPY_WRITE_ERROR, slot->pos, dev_last_error());
+            break;
+        }
+        hasher_add(job->hasher, slot->data, slot->len, job->dstOffset + slot->pos);
+        job->bytesDone = slot->pos + slot->len;
+        progress_add(slot->len);
+
+        mutex_lock(&p.lock);
+        p.tail = (p.tail + 1) % p.count;
+        p.filled--;
+        stage_add(STAGE_WRITE, -1);
+        cond_signal(&p.notFull);
+        mutex_unlock(&p.lock);
+
+        if (!job->quiet && progress_due()) progress_print();
+    }
+
+    if (started) thread_join(reader);
+    stage_add(STAGE_WRITE, -p.filled);      // blocks a failed job never wrote
+
+    cond_destroy(&p.notFull);
+    cond_destroy(&p.notEmpty);
+    mutex_destroy(&p.lock);
+    for (int i = 0; i < p.count; i++) {
+        free_aligned(p.slots[i].data);
+        if (p.slots[i].old) free_aligned(p.slots[i].old);
+    }
+    free(p.slots);
+    return p.status;
+}
+//================================================================================================================
+// io_uring engine.
+// Keeps queueDepth reads and writes in flight against source and destination. Buffers and descriptors are
+// registered once (IORING_REGISTER_BUFFERS/FILES) so the kernel does not map them per request. Talks to the
+// kernel through raw syscalls, so there is no liburing dependency.
+
+#ifdef __linux__
+typedef struct {
+    int fd;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    struct io_uring_sqe* sqes;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    struct io_uring_cqe* cqes;
+    void* sqRing;
+    size_t sqRingSize;
+    void* cqRing;
+    size_t cqRingSize;
+    size_t sqesSize;
+    unsigned toSubmit;
+} URING;
+
+static int uring_init(URING* r, unsigned entries) {
+    struct io_uring_params params;
+    memset(r, 0, sizeof(*r));
+    memset(&params, 0, sizeof(params));
+
+    r->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (r->fd < 0) return 1;
+
+    r->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    r->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cqRingSize > r->sqRingSize) r->sqRingSize = r->cqRingSize;
+        r->cqRingSize = r->sqRingSize;
+    }
+    r->sqRing = mmap(NULL, r->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sqRing == MAP_FAILED) {
+        close(r->fd);
+        return 1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cqRing = r->sqRing;
+    } else {
+        r->cqRing = mmap(NULL, r->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cqRing == MAP_FAILED) {
+            munmap(r->sqRing, r->sqRingSize);
+            close(r->fd);
+            return 1;
+        }
+    }
+    r->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = (struct io_uring_sqe*)mmap(NULL, r->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        if (r->cqRing != r->sqRing) munmap(r->cqRing, r->cqRingSize);
+        munmap(r->sqRing, r->sqRingSize);
+        close(r->fd);
+        return 1;
+    }
+
+    BYTE* sq = (BYTE*)r->sqRing;
+    BYTE* cq = (BYTE*)r->cqRing;
+    r->sqHead  = (unsigned*)(sq + params.sq_off.head);
+    r->sqTail  = (unsigned*)(sq + params.sq_off.tail);
+    r->sqMask  = (unsigned*)(sq + params.sq_off.ring_mask);
+    r->sqArray = (unsigned*)(sq + params.sq_off.array);
+    r->cqHead  = (unsigned*)(cq + params.cq_off.head);
+    r->cqTail  = (unsigned*)(cq + params.cq_off.tail);
+    r->cqMask  = (unsigned*)(cq + params.cq_off.ring_mask);
+    r->cqes    = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+static void uring_exit(URING* r) {
+    munmap(r->sqes, r->sqesSize);
+    if (r->cqRing != r->sqRing) munmap(r->cqRing, r->cqRingSize);
+    munmap(r->sqRing, r->sqRingSize);
+    close(r->fd);
+}
+
+// Returns a zeroed SQE queued for the next uring_submit(); the ring is sized so this cannot run out.
+static struct io_uring_sqe* uring_get_sqe(URING* r) {
+    unsigned tail = *r->sqTail;
+    unsigned index = tail & *r->sqMask;
+    struct io_uring_sqe* sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sqArray[index] = index;
+    __atomic_store_n(r->sqTail, tail + 1, __ATOMIC_RELEASE);
+    r->toSubmit++;
+    return sqe;
+}
+
+static int uring_submit_and_wait(URING* r, unsigned waitNr) {
+    for (;;) {
+        int ret = (int)syscall(__NR_io_uring_enter, r->fd, r->toSubmit, waitNr, waitNr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (g_iostat.enabled) stat_add(&g_iostat.submits, 1);
+        if (ret >= 0) {
+            r->toSubmit -= (unsigned)ret < r->toSubmit ? (unsigned)ret : r->toSubmit;
+            return 0;
+        }
+        if (errno != EINTR) return 1;
+    }
+}
+
+#define URING_FREE      0
+#define URING_READING   1
+#define URING_WRITING   2
+#define URING_COMPARING 3       // compare jobs: reading what dst holds
+
+typedef struct {
+    BYTE* data;
+    BYTE* old;                  // compare jobs: what dst holds there
+    size_t oldLen;
+    ULONGLONG pos;              // job-relative offset
+    size_t len;                 // bytes in this block
+    size_t done;                // write cursor within the block
+    size_t runEnd;              // end of the data run being written (sparse jobs skip zero grains between runs)
+    int state;
+    ULONGLONG issued;           // iostat_clock() when the request in flight was queued
+} URING_SLOT;
+
+// Moves a slot's write cursor to the next run of data to write. Returns FALSE when the block is finished.
+static BOOL uring_next_run(COPY_JOB* job, URING_SLOT* slot) {
+    if (job->compare) {
+        size_t run;
+        size_t start = next_changed_run(slot->data, slot->old, slot->oldLen, slot->len, slot->done, &run);
+        job->bytesSkipped += start - slot->done;
+        slot->done = start;
+        slot->runEnd = start + run;
+        return start < slot->len;
+    }
+    if (!job->sparse) {
+        slot->runEnd = slot->len;
+        return slot->done < slot->len;
+    }
+    size_t run;
+    size_t start = next_data_run(slot->data, slot->len, slot->done, &run);
+    if (start > slot->done && sparse_gap(job, job->dstOffset + slot->pos + slot->done, start - slot->done)) {
+        return FALSE;   // reported by the caller through slot->done < slot->len
+    }
+    slot->done = start;
+    slot->runEnd = start + run;
+    return start < slot->len;
+}
+
+// Registered file indexes
+#define UFILE_SRC        0
+#define UFILE_SRC_DIRECT 1
+#define UFILE_DST        2
+#define UFILE_DST_DIRECT 3
+
+static void uring_prep(URING* r, int op, BOOL fixedBufs, BOOL fixedFiles, int files[4], int fileIndex,
+                       int slotIndex, int bufIndex, void* addr, size_t len, ULONGLONG offset) {
+    struct io_uring_sqe* sqe = uring_get_sqe(r);
+    if (fixedBufs) {
+        sqe->opcode = op == IORING_OP_READ ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+        sqe->buf_index = (unsigned short)bufIndex;
+    } else {
+        sqe->opcode = (BYTE)op;
+    }
+    if (fixedFiles) {
+        sqe->fd = fileIndex;
+        sqe->flags |= IOSQE_FIXED_FILE;
+    } else {
+        sqe->fd = files[fileIndex];
+    }
+    sqe->addr = (unsigned long long)(uintptr_t)addr;
+    sqe->len = (unsigned)len;
+    sqe->off = offset;
+    sqe->user_data = (unsigned long long)slotIndex;
+}
+
+// Returns a COPY_* status, or -1 when io_uring is not usable here and the caller should fall back.
+static int copy_range_uring(COPY_JOB* job) {
+    int depth = job->queueDepth;
+    unsigned entries = 1;
+    while (entries < (unsigned)depth) entries <<= 1;
+
+    URING ring;
+    if (uring_init(&ring, entries)) return -1;
+
+    int buffers = job->compare ? depth * 2 : depth;     // compare jobs: buffer depth + i holds what dst has
+    BYTE* pool = (BYTE*)alloc_aligned(job->blockSize * buffers);
+    URING_SLOT* slots = (URING_SLOT*)calloc(depth, sizeof(URING_SLOT));
+    struct iovec* iov = (struct iovec*)calloc(buffers, sizeof(struct iovec));
+    if (!pool || !slots || !iov) {
+        if (pool) free_aligned(pool);
+        free(slots);
+        free(iov);
+        uring_exit(&ring);
+        return COPY_NO_MEMORY;
+    }
+    for (int i = 0; i < buffers; i++) {
+        iov[i].iov_base = pool + (size_t)i * job->blockSize;
+        iov[i].iov_len = job->blockSize;
+    }
+    for (int i = 0; i < depth; i++) {
+        slots[i].data = (BYTE*)iov[i].iov_base;
+        if (job->compare) slots[i].old = (BYTE*)iov[depth + i].iov_base;
+    }
+
+    int files[4];
+    files[UFILE_SRC] = job->src->fd;
+    files[UFILE_SRC_DIRECT] = job->src->fdDirect >= 0 ? job->src->fdDirect : job->src->fd;
+    files[UFILE_DST] = job->dst->fd;
+    files[UFILE_DST_DIRECT] = job->dst->fdDirect >= 0 ? job->dst->fdDirect : job->dst->fd;
+
+    // Registration can fail under a tight RLIMIT_MEMLOCK or on old kernels; plain requests still work then.
+    BOOL fixedBufs = syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, iov, buffers) == 0;
+    BOOL fixedFiles = syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_FILES, files, 4) == 0;
+
+    int status = COPY_OK;
+    JOB_CURSOR cursor = { 0, 0 };       // next block to read
+    BOOL drained = FALSE;               // no more blocks to read
+    ULONGLONG end = job->length;        // shrinks when a read finds the end of the source
+    ULONGLONG written = 0;
+    int inflight = 0;
+    BOOL stop = FALSE;
+    job->bytesDone = 0;
+
+    for (;;) {
+        for (int i = 0; i < depth && !stop && !drained; i++) {
+            if (slots[i].state != URING_FREE) continue;
+            URING_SLOT* slot = &slots[i];
+            if (!job_next_block(job, &cursor, &slot->pos, &slot->len) || slot->pos >= end) {
+                drained = TRUE;
+                break;
+            }
+            if (slot->pos + slot->len > end) slot->len = (size_t)(end - slot->pos);
+            slot->done = 0;
+            slot->state = URING_READING;
+            ULONGLONG offset = job->srcOffset + slot->pos;
+            int fi = dev_is_aligned(slot->data, slot->len, offset) ? UFILE_SRC_DIRECT : UFILE_SRC;
+            uring_prep(&ring, IORING_OP_READ, fixedBufs, fixedFiles, files, fi, i, i, slot->data, slot->len, offset);
+            slot->issued = iostat_clock();
+            stage_add(STAGE_READ, 1);
+            inflight++;
+        }
+        if (inflight == 0) break;
+
+        if (uring_submit_and_wait(&ring, 1)) {
+            // Nothing can be reaped reliably any more; the kernel may still own the buffers, so do not free them.
+            job->error = dev_last_error();
+            job->failOffset = written;
+            printf("\nio_uring_enter failed. Error: %lu\n", job->error);
+            return COPY_READ_ERROR;
+        }
+
+        unsigned head = *ring.cqHead;
+        unsigned tail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cqMask];
+            int i = (int)cqe->user_data;
+            int res = cqe->res;
+            URING_SLOT* slot = &slots[i];
+            lat_record(slot->state == URING_WRITING ? &g_iostat.write : &g_iostat.read, slot->issued,
+                       res > 0 ? (size_t)res : 0);
+
+            if (slot->state == URING_READING) {
+                stage_add(STAGE_READ, -1);
+                if (res < 0) {
+                    if (status == COPY_OK) {
+                        status = COPY_READ_ERROR;
+                        job->failOffset = slot->pos;
+                        job->error = (unsigned long)-res;
+                    }
+                    stop = TRUE;
+                    slot->state = URING_FREE;
+                    inflight--;
+                    continue;
+                }
+                slot->done += (size_t)res;
+                if (res > 0 && slot->done < slot->len && !stop) {
+                    // A short read is not the end of the source (a device or network file may return less than
+                    // asked): read the rest of the block. Only a read that returns nothing is the end.
+                    ULONGLONG offset = job->srcOffset + slot->pos + slot->done;
+                    BYTE* rest = slot->data + slot->done;
+                    size_t left = slot->len - slot->done;
+                    int fi = dev_is_aligned(rest, left, offset) ? UFILE_SRC_DIRECT : UFILE_SRC;
+                    uring_prep(&ring, IORING_OP_READ, fixedBufs, fixedFiles, files, fi, i, i, rest, left, offset);
+                    slot->issued = iostat_clock();
+                    stage_add(STAGE_READ, 1);
+                    continue;
+                }
+                if (res == 0 && slot->done < slot->len) {   // end of source
+                    job->shortSource = TRUE;
+                    if (slot->pos + slot->done < end) end = slot->pos + slot->done;
+                    slot->len = slot->done;
+                }
+                if (stop || slot->len == 0 || slot->pos >= end) {
+                    slot->state = URING_FREE;
+                    inflight--;
+                    continue;
+                }
+                slot->done = 0;
+                slot->runEnd = 0;
+                hasher_add(job->hasher, slot->data, slot->len, job->dstOffset + slot->pos);
+                if (job->discard) {
+                    written += slot->len;
+                    progress_add(slot->len);
+                    slot->state = URING_FREE;
+                    inflight--;
+                    continue;
+                }
+                stage_add(STAGE_WRITE, 1);
+                if (job->compare) {
+                    slot->state = URING_COMPARING;
+                    ULONGLONG offset = job->dstOffset + slot->pos;
+                    int fi = dev_is_aligned(slot->old, slot->len, offset) ? UFILE_DST_DIRECT : UFILE_DST;
+                    uring_prep(&ring, IORING_OP_READ, fixedBufs, fixedFiles, files, fi, i, depth + i, slot->old,
+                               slot->len, offset);
+                    slot->issued = iostat_clock();
+                    continue;
+                }
+                slot->state = URING_WRITING;
+            } else if (slot->state == URING_COMPARING) {
+                // Unreadable target bytes count as changed and get rewritten.
+                slot->oldLen = res > 0 ? (size_t)res : 0;
+                slot->state = URING_WRITING;
+                res = (int)slot->len;           // carry on as if the block had just been read
+            } else {
+                slot->done += res > 0 ? (size_t)res : 0;
+            }
+
+            BOOL more = slot->state == URING_WRITING && res > 0 && slot->done < slot->runEnd;
+            if (res > 0 && !more) {
+                more = uring_next_run(job, slot);
+                if (!more && slot->done < slot->len) {
+                    res = -(int)dev_last_error();       // the zero gap could not be filled
+                }
+            }
+            if (res <= 0 && slot->state == URING_WRITING) {
+                if (status == COPY_OK) {
+                    status = COPY_WRITE_ERROR;
+                    job->failOffset = slot->pos + slot->done;
+                    job->error = res < 0 ? (unsigned long)-res : (unsigned long)EIO;
+                }
+                stop = TRUE;
+                slot->state = URING_FREE;
+                stage_add(STAGE_WRITE, -1);
+                inflight--;
+                continue;
+            }
+            if (!more) {
+                written += slot->len;
+                progress_add(slot->len);
+                slot->state = URING_FREE;
+                stage_add(STAGE_WRITE, -1);
+                inflight--;
+                if (!job->quiet && progress_due()) progress_print();
+                continue;
+            }
+
+            // Issue (or continue) the write of this block's current run.
+            ULONGLONG offset = job->dstOffset + slot->pos + slot->done;
+            size_t len = slot->runEnd - slot->done;
+            int fi = dev_is_aligned(slot->data + slot->done, len, offset) ? UFILE_DST_DIRECT : UFILE_DST;
+            uring_prep(&ring, IORING_OP_WRITE, fixedBufs, fixedFiles, files, fi, i, i, slot->data + slot->done, len, offset);
+            slot->issued = iostat_clock();
+        }
+        __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+    }
+
+    job->bytesDone = written;
+    uring_exit(&ring);
+    free(iov);
+    free(slots);
+    free_aligned(pool);
+    return status;
+}
+#endif
+
+// Copies job->length bytes from src to dst. Returns COPY_OK or the first error; job->bytesDone says how far it got.
+int copy_range(COPY_JOB* job) {
+    int status = -1;
+#ifdef __linux__
+    if (job->engine == ENGINE_URING) {
+        status = copy_range_uring(job);
+        if (status < 0) {
+            printf("io_uring unavailable (error %lu), using the threaded engine\n", dev_last_error());
+            job->engine = ENGINE_THREADED;
+            if (!g_opts.blockSize) job->blockSize = BUFFER_SIZE;
+            if (!g_opts.queueDepth) job->queueDepth = PIPELINE_BUFFERS;
+        }
+    }
+#endif
+    if (status < 0) {
+        status = copy_range_threaded(job);
+    }
+    stat_or(&g_iostat.engines, 1LL << job->engine);
+    if (status == COPY_OK && job->extents && !job->shortSource) {
+        job->bytesDone = job->length;       // everything outside the extents was skipped on purpose
+        // The skipped ranges must read back as zeros: a new file already does when holes are allowed, anything
+        // else (--no-sparse, a device, a file being resumed) gets them written. They were hashed as the copy
+        // passed them.
+        ULONGLONG at = 0;
+        for (int i = 0; i <= job->extentCount && (!job->sparse || !job->dst->fresh); i++) {
+            ULONGLONG next = i < job->extentCount ? job->extents[i].offset : job->length;
+            if (next > at && dev_zero_fill(job->dst, job->dstOffset + at, next - at, job->sparse)) {
+                status = COPY_WRITE_ERROR;
+                job->bytesDone = at;
+                job->failOffset = at;
+                job->error = dev_last_error();
+                break;
+            }
+            if (i < job->extentCount) at = job->extents[i].offset + job->extents[i].length;
+        }
+    }
+
+    // Trailing holes are not backed by any write, so the file has to be grown to its full length explicitly.
+    if (status == COPY_OK && job->sparse && dev_extend(job->dst, job->dstOffset + job->bytesDone)) {
+        status = COPY_WRITE_ERROR;
+        job->failOffset = job->bytesDone;
+        job->error = dev_last_error();
+    }
+    if (!job->quiet) progress_print();
+    if (job->bytesSparse > 0 && !job->quiet) {
+        printf("\nSparse: %.2f MB of zeros left as holes", job->bytesSparse / (1024.0 * 1024.0));
+    }
+    return status;
+}
+
+#ifdef __linux__
+#define KERNEL_COPY_STEP (64ULL * 1024 * 1024)     // per copy_file_range() call, so progress keeps moving
+
+typedef struct {
+    BOOL noClone;               // FICLONERANGE was refused once; do not ask again
+    ULONGLONG cloned;           // bytes shared with the source by reflink
+    ULONGLONG copied;           // bytes copied by copy_file_range()
+} KERNEL_COPY;
+
+static int kernel_copy_file_range(KERNEL_COPY* k, DISK_DEV* src, DISK_DEV* dst, ULONGLONG offset, ULONGLONG length) {
+    while (length > 0) {
+        loff_t in = (loff_t)offset, out = (loff_t)offset;
+        size_t want = (size_t)(length < KERNEL_COPY_STEP ? length : KERNEL_COPY_STEP);
+        ssize_t n = copy_file_range(src->fd, &in, dst->fd, &out, want, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n == 0) errno = EIO;            // the source ended early
+            BOOL unsupported = n < 0 && k->copied == 0 && k->cloned == 0 &&
+                               (errno == ENOSYS || errno == EXDEV || errno == EOPNOTSUPP || errno == EINVAL);
+            return unsupported ? -1 : 1;
+        }
+        k->copied += (ULONGLONG)n;
+        offset += (ULONGLONG)n;
+        length -= (ULONGLONG)n;
+        progress_add((ULONGLONG)n);
+        if (progress_due()) progress_print();
+    }
+    return 0;
+}
+
+// Copies [offset, offset+length) of src to the same offsets of dst without the data passing through this process:
+// the block-aligned middle is shared by reflink (FICLONERANGE) where the filesystem can (XFS, btrfs), everything
+// else goes through copy_file_range(). Returns 0, 1 on an error, or -1 when the kernel cannot copy between these
+// files at all (old kernel, different filesystems) and nothing has been copied yet.
+int kernel_copy(KERNEL_COPY* k, DISK_DEV* src, DISK_DEV* dst, ULONGLONG offset, ULONGLONG length) {
+    struct stat st;
+    ULONGLONG unit = fstat(dst->fd, &st) == 0 && st.st_blksize > 0 ? (ULONGLONG)st.st_blksize : DIRECT_ALIGN;
+    ULONGLONG end = offset + length;
+    ULONGLONG a = (offset + unit - 1) / unit * unit, b = end / unit * unit;
+    if (!k->noClone && a < b) {
+        struct file_clone_range range = { (__s64)src->fd, a, b - a, a };
+        if (ioctl(dst->fd, FICLONERANGE, &range) == 0) {
+            k->cloned += b - a;
+            progress_add(b - a);
+            int rc = kernel_copy_file_range(k, src, dst, offset, a - offset);
+            return rc ? rc : kernel_copy_file_range(k, src, dst, b, end - b);
+        }
+        k->noClone = TRUE;
+    }
+    return kernel_copy_file_range(k, src, dst, offset, length);
+}
+#endif
+//================================================================================================================
+// Device tuning.
+// The best block size and queue depth depend on the device far more than on the job: a USB stick wants a few
+// large requests, an NVMe drive many small ones in flight. Before a raw create or write, tune_device() reads (or,
+// for writes, rewrites in place) a short stretch of the device with a handful of combinations and keeps the
+// fastest. Results are cached per device in a profile file, so only the first job on a device pays for the probe.
+//
+// Profile lines: <device key> TAB <read|write> TAB <blockSize> TAB <queueDepth> TAB <MB/s> TAB <unix time>
+
+#define TUNE_MIN_SAMPLE  (16ULL * 1024 * 1024)
+#define TUNE_MAX_SAMPLE  (64ULL * 1024 * 1024)
+#define TUNE_MAX_BUFS    (64ULL * 1024 * 1024)      // largest blockSize * queueDepth tried
+#define TUNE_BUDGET_NS   (4000000000ULL)            // stop probing after this much time, keeping the best so far
+#define TUNE_CLOSE       0.03                       // within 3% of the fastest, the smaller memory footprint wins
+
+typedef struct {
+    size_t blockSize;
+    int queueDepth;
+    double mbps;
+} TUNE_RESULT;
+
+void tune_profile_path(char* out, size_t size) {
+#ifdef _WIN32
+    const char* dir = getenv("LOCALAPPDATA");
+    snprintf(out, size, "%s\\wddx32.tune", dir ? dir : ".");
+#else
+    const char* dir = getenv("HOME");
+    snprintf(out, size, "%s/.wddx32.tune", dir ? dir : ".");
+#endif
+}
+
+// Names the device well enough that a different drive showing up under the same path gets its own profile.
+static void tune_key(const DISK_DEV* dev, const char* path, int engine, char* out, size_t size) {
+    char model[128] = "";
+#ifdef __linux__
+    const char* name = strrchr(path, '/');
+    char modelPath[300];
+    snprintf(modelPath, sizeof(modelPath), "/sys/block/%s/device/model", name ? name + 1 : path);
+    FILE* mf = dev->isFile ? NULL : fopen(modelPath, "r");
+    if (mf) {
+        if (fgets(model, sizeof(model), mf)) model[strcspn(model, "\n")] = '\0';
+        fclose(mf);
+        size_t n = strlen(model);
+        while (n > 0 && model[n - 1] == ' ') model[--n] = '\0';
+    }
+#endif
+    snprintf(out, size, "%s|%llu|%s|%s", path, dev->size, model, engine == ENGINE_URING ? "uring" : "threaded");
+    for (char* p = out; *p; p++) {
+        if (*p == '\t' || *p == '\n') *p = ' ';
+    }
+}
+
+// Looks up the cached result for key and mode. Returns 0 when there is one.
+static int tune_profile_load(const char* key, const char* mode, TUNE_RESULT* r) {
+    char path[600], line[800];
+    tune_profile_path(path, sizeof(path));
+    FILE* f = fopen(path, "r");
+    if (!f) return 1;
+    int rc = 1;
+    size_t keyLen = strlen(key);
+    while (rc && fgets(line, sizeof(line), f)) {
+        if (strncmp(line, key, keyLen) != 0 || line[keyLen] != '\t') continue;
+        char m[8];
+        unsigned long long bs;
+        int qd;
+        double mbps;
+        if (sscanf(line + keyLen + 1, "%7[a-z]\t%llu\t%d\t%lf", m, &bs, &qd, &mbps) == 4 && strcmp(m, mode) == 0 &&
+            bs >= DIRECT_ALIGN && bs % DIRECT_ALIGN == 0 && qd > 0) {
+            r->blockSize = (size_t)bs;
+            r->queueDepth = qd;
+            r->mbps = mbps;
+            rc = 0;
+        }
+    }
+    fclose(f);
+    return rc;
+}
+
+// Records r for key and mode, replacing an older entry. A profile that cannot be written only costs a probe later.
+static void tune_profile_save(const char* key, const char* mode, const TUNE_RESULT* r) {
+    char path[600], tmp[620], line[800];
+    tune_profile_path(path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE* out = fopen(tmp, "w");
+    if (!out) return;
+    FILE* in = fopen(path, "r");
+    size_t keyLen = strlen(key), modeLen = strlen(mode);
+    while (in && fgets(line, sizeof(line), in)) {
+        BOOL same = strncmp(line, key, keyLen) == 0 && line[keyLen] == '\t' &&
+                    strncmp(line + keyLen + 1, mode, modeLen) == 0 && line[keyLen + 1 + modeLen] == '\t';
+        if (!same) fputs(line, out);
+    }
+    if (in) fclose(in);
+    fprintf(out, "%s\t%s\t%llu\t%d\t%.1f\t%lld\n", key, mode, (ULONGLONG)r->blockSize, r->queueDepth, r->mbps,
+            (long long)time(NULL));
+    BOOL ok = fclose(out) == 0;
+#ifdef _WIN32
+    if (ok) remove(path);                       // rename does not replace an existing file on Windows
+#endif
+    if (!ok || rename(tmp, path) != 0) {
+        printf("Warning: cannot write tuning profile %s\n", path);
+        remove(tmp);
+    }
+}
+
+typedef struct {
+    DISK_DEV* dev;
+    ULONGLONG base;             // device range the job covers
+    ULONGLONG length;
+    ULONGLONG at;               // where the next sample starts
+    BOOL write;
+    int engine;
+    ULONGLONG started;
+    double baseline;            // MB/s of the defaults
+    TUNE_RESULT best;
+    TUNE_RESULT tried[32];
+    int triedCount;
+} TUNE_PROBE;
+
+// Times one combination over the next stretch of the range: reads only, or reads and rewrites of the same bytes.
+// Each sample starts where the previous one ended, so none of them is served from a cache the last one filled.
+static double tune_measure(TUNE_PROBE* t, size_t blockSize, int queueDepth) {
+    for (int i = 0; i < t->triedCount; i++) {
+        if (t->tried[i].blockSize == blockSize && t->tried[i].queueDepth == queueDepth) return t->tried[i].mbps;
+    }
+    if ((ULONGLONG)blockSize * queueDepth > TUNE_MAX_BUFS || t->triedCount == 32 ||
+        now_ns() - t->started > TUNE_BUDGET_NS) {
+        return 0;
+    }
+    ULONGLONG sample = (ULONGLONG)blockSize * queueDepth;
+    if (sample < TUNE_MIN_SAMPLE) sample = TUNE_MIN_SAMPLE;
+    if (sample > TUNE_MAX_SAMPLE) sample = TUNE_MAX_SAMPLE;
+    sample -= sample % blockSize;
+    if (t->at + sample > t->base + t->length) t->at = t->base;
+
+    COPY_JOB job;
+    copy_job_init(&job, t->dev, t->at, t->dev, t->at, sample);
+    job.engine = t->engine;
+    job.blockSize = blockSize;
+    job.queueDepth = queueDepth;
+    job.sparse = FALSE;
+    job.quiet = TRUE;
+    job.discard = !t->write;
+    ULONGLONG t0 = now_ns();
+    int status = copy_range(&job);
+    double seconds = (now_ns() - t0) / 1e9;
+    t->engine = job.engine;                     // io_uring may have fallen back to the threaded engine
+    t->at += sample;
+
+    double mbps = status == COPY_OK && job.bytesDone > 0 && seconds > 0 ? job.bytesDone / (1024.0 * 1024.0) / seconds : 0;
+    TUNE_RESULT* r = &t->tried[t->triedCount++];
+    r->blockSize = blockSize;
+    r->queueDepth = queueDepth;
+    r->mbps = mbps;
+    printf("  bs %6lluK  qd %3d  %9.1f MB/s\n", (ULONGLONG)blockSize / 1024, queueDepth, mbps);
+    fflush(stdout);
+
+    BOOL faster = mbps > t->best.mbps * (1 + TUNE_CLOSE);
+    BOOL leaner = mbps >= t->best.mbps * (1 - TUNE_CLOSE) &&
+                  (ULONGLONG)blockSize * queueDepth < (ULONGLONG)t->best.blockSize * t->best.queueDepth;
+    if (mbps > 0 && (t->best.mbps == 0 || faster || leaner)) t->best = *r;
+    return mbps;
+}
+
+// Probes [base, base+length) of dev. Block sizes are tried first at a middling depth, then depths at the best
+// size; an explicit --bs or --qd pins that half. Returns 0 with the winner in t->best.
+static int tune_probe(DISK_DEV* dev, ULONGLONG base, ULONGLONG length, BOOL write, TUNE_PROBE* t) {
+    static const size_t uringSizes[] = { 128 * 1024, 256 * 1024, 1024 * 1024, 4 * 1024 * 1024 };
+    static const int uringDepths[] = { 1, 4, 8, 16, 32, 64 };
+    static const size_t threadedSizes[] = { 1024 * 1024, 4 * 1024 * 1024, 16 * 1024 * 1024 };
+    static const int threadedDepths[] = { 2, 4, 8 };
+
+    memset(t, 0, sizeof(*t));
+    t->dev = dev;
+    t->base = base;
+    t->length = length;
+    t->at = base + (length / 4) - (length / 4) % DIRECT_ALIGN;
+    t->write = write;
+    t->engine = g_opts.engine;
+    t->started = now_ns();
+
+    // Warm up (spin the drive up, fault in the engine) with a read nobody measures.
+    COPY_JOB warm;
+    copy_job_init(&warm, dev, t->at, dev, t->at, 4 * 1024 * 1024);
+    warm.quiet = TRUE;
+    warm.sparse = FALSE;
+    warm.discard = TRUE;
+    if (copy_range(&warm) != COPY_OK) return 1;
+    t->engine = warm.engine;
+    t->at += 4 * 1024 * 1024;
+
+    BOOL uring = t->engine == ENGINE_URING;
+    const size_t* sizes = uring ? uringSizes : threadedSizes;
+    int sizeCount = uring ? 4 : 3;
+    const int* depths = uring ? uringDepths : threadedDepths;
+    int depthCount = uring ? 6 : 3;
+    size_t defaultSize = uring ? URING_BLOCK_SIZE : BUFFER_SIZE;
+    int defaultDepth = uring ? URING_DEPTH : PIPELINE_BUFFERS;
+    int firstDepth = uring ? 16 : PIPELINE_BUFFERS;
+    if (g_opts.blockSize) {
+        sizes = &g_opts.blockSize;
+        sizeCount = 1;
+        defaultSize = g_opts.blockSize;
+    }
+    if (g_opts.queueDepth) {
+        depths = &g_opts.queueDepth;
+        depthCount = 1;
+        defaultDepth = firstDepth = g_opts.queueDepth;
+    }
+
+    t->baseline = tune_measure(t, defaultSize, defaultDepth);
+    for (int s = 0; s < sizeCount; s++) tune_measure(t, sizes[s], firstDepth);
+    size_t size = t->best.mbps > 0 ? t->best.blockSize : defaultSize;
+    for (int d = 0; d < depthCount; d++) tune_measure(t, size, depths[d]);
+    return t->best.mbps > 0 ? 0 : 1;
+}
+
+// Picks the block size and queue depth of the raw copy about to run over [base, base+length) of dev: from the
+// cached profile when there is one, otherwise by probing. write probes rewrite the range in place, so they only
+// ever touch bytes the job is about to overwrite anyway. A --changed-only or --resume write leaves most of the range
+// alone, so it is probed with reads instead. Leaves the defaults in place when it cannot tune.
+void tune_device(DISK_DEV* dev, const char* path, ULONGLONG base, ULONGLONG length, BOOL write) {
+    g_opts.tunedBlockSize = 0;
+    g_opts.tunedQueueDepth = 0;
+    if (g_opts.tune == TUNE_OFF || (g_opts.blockSize && g_opts.queueDepth)) return;
+    if (dev->isFile && g_opts.tune == TUNE_AUTO) return;
+    if (write && (g_opts.changedOnly || g_opts.resume)) write = FALSE;
+    if (write && dev->isFile) {                 // a file target can only be rewritten where it already has data
+        ULONGLONG have = dev->size > base ? dev->size - base : 0;
+        if (length > have) length = have;
+    }
+    const char* mode = write ? "write" : "read";
+    if (length < 4 * TUNE_MAX_SAMPLE) {
+        if (g_opts.tune != TUNE_AUTO) printf("Tuning %s: %s range too small to probe, using defaults\n", path, mode);
+        return;
+    }
+
+    char key[700];
+    tune_key(dev, path, g_opts.engine, key, sizeof(key));
+    TUNE_RESULT r;
+    if (g_opts.tune != TUNE_RETUNE && tune_profile_load(key, mode, &r) == 0) {
+        printf("Tuned %s for %ss (cached profile): bs %lluK, qd %d, %.1f MB/s\n", path, mode,
+               (ULONGLONG)r.blockSize / 1024, r.queueDepth, r.mbps);
+    } else {
+        printf("Tuning %s for %ss:\n", path, mode);
+        TUNE_PROBE t;
+        LONGLONG done = g_progress.done;
+        int failed = tune_probe(dev, base, length, write, &t);
+        progress_set((ULONGLONG)done);          // the probe's bytes are not the job's
+        if (failed) {
+            printf("Tuning %s failed, using defaults\n", path);
+            return;
+        }
+        r = t.best;
+        printf("Tuned %s for %ss: bs %lluK, qd %d, %.1f MB/s (default %.1f MB/s, %d combinations in %.1f s)\n",
+               path, mode, (ULONGLONG)r.blockSize / 1024, r.queueDepth, r.mbps, t.baseline, t.triedCount,
+               (now_ns() - t.started) / 1e9);
+        if (t.engine != g_opts.engine) return;  // measured on the fallback engine; the job falls back on its own
+        tune_profile_save(key, mode, &r);
+    }
+    g_opts.tunedBlockSize = r.blockSize;
+    g_opts.tunedQueueDepth = r.queueDepth;
+    g_opts.tunedEngine = g_opts.engine;
+}
+//================================================================================================================
+// Checkpoint journal: raw creates and writes run in JOURNAL_STEP segments. After each one the target is flushed and
+// a record of how far the job got, with the digests of the chunks it completed, is appended to the journal and
+// flushed too. --resume reads the journal back, re-reads the last segment to make sure it reached the target, and
+// carries on from there. The journal is deleted once the job succeeds.
+//
+//   JOURNAL_HEADER | JOURNAL_RECORD, BYTE digest[chunks][32] | JOURNAL_RECORD, ... 
+
+#define JOURNAL_MAGIC   "WDDXJNL1"
+#define JOURNAL_VERSION 1
+#define JOURNAL_STEP    (256ULL * 1024 * 1024)
+
+#pragma pack(push, 1)
+typedef struct {
+    char magic[8];
+    DWORD version;
+    DWORD chunkSize;            // of the hasher, 0 without one
+    char source[256];
+    char target[256];
+    ULONGLONG sourceSize;
+    ULONGLONG offset;           // range of the target the job writes
+    ULONGLONG length;
+    ULONGLONG hashBase;         // range the hasher covers
+    ULONGLONG hashLength;
+    BYTE reserved[32];
+} JOURNAL_HEADER;
+
+typedef struct {
+    ULONGLONG end;              // everything of the job before this target offset is written and flushed
+    ULONGLONG firstChunk;       // hasher chunks whose digests follow the record
+    DWORD chunks;
+    DWORD pad;
+    BYTE check[32];             // SHA-256 of the record (check zeroed) and its digests, so a torn append is ignored
+} JOURNAL_RECORD;
+#pragma pack(pop)
+
+typedef struct {
+    DISK_DEV file;
+    BOOL active;                // FALSE when the journal could not be written: the job runs in one piece
+    char path[600];
+    HASHER* hasher;
+    ULONGLONG pos;              // where the next record goes
+    ULONGLONG chunks;           // hasher chunks journaled so far
+    ULONGLONG resumeAt;         // target offset the job continues from
+} JOURNAL;
+
+// <image>.wdj for a create; <image>.<target name>.wdj for a write, since one image may be written to several disks.
+void journal_path(const char* imagePath, const char* target, char* out, size_t size) {
+    if (!target) {
+        snprintf(out, size, "%s.wdj", imagePath);
+        return;
+    }
+    const char* name = target;
+    for (const char* p = target; *p; p++) {
+        if (*p == '/' || *p == '\\') name = p + 1;
+    }
+    snprintf(out, size, "%s.%s.wdj", imagePath, name);
+}
+
+static void journal_record_check(JOURNAL_RECORD* r, const BYTE (*digests)[32], BYTE check[32]) {
+    JOURNAL_RECORD copy = *r;
+    memset(copy.check, 0, sizeof(copy.check));
+    SHA256_CTX ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, &copy, sizeof(copy));
+    if (r->chunks) sha256_update(&ctx, digests, (size_t)r->chunks * 32);
+    sha256_final(&ctx, check);
+}
+
+// Reads back the journal a failed run left, restoring its digests into the hasher. Returns 0 when the job can
+// continue from it.
+static int journal_resume(JOURNAL* j, const JOURNAL_HEADER* want, DISK_DEV* dst) {
+    if (dev_open(&j->file, j->path, DEV_READ | DEV_WRITE)) return 1;
+    JOURNAL_HEADER header;
+    if (dev_pread(&j->file, &header, sizeof(header), 0) != sizeof(header) || memcmp(&header, want, sizeof(header)) != 0) {
+        printf("Journal %s belongs to a different job\n", j->path);
+        dev_close(&j->file);
+        return 1;
+    }
+
+    HASHER* h = j->hasher;
+    ULONGLONG pos = sizeof(header), end = want->offset, chunks = 0;
+    ULONGLONG lastPos = pos, lastEnd = end;           // state before the last record, in case it does not verify
+    for (;;) {
+        JOURNAL_RECORD r;
+        BYTE check[32];
+        if (dev_pread(&j->file, &r, sizeof(r), pos) != sizeof(r) || r.firstChunk != chunks || r.end <= end ||
+            r.end > want->offset + want->length || (h ? chunks + r.chunks > h->chunks : r.chunks != 0)) {
+            break;
+        }
+        size_t bytes = (size_t)r.chunks * 32;
+        if (bytes && dev_pread(&j->file, h->digests[chunks], bytes, pos + sizeof(r)) != (long long)bytes) break;
+        journal_record_check(&r, h ? (const BYTE (*)[32])h->digests[chunks] : NULL, check);
+        if (memcmp(check, r.check, 32) != 0) break;
+        lastPos = pos;
+        lastEnd = end;
+        pos += sizeof(r) + bytes;
+        end = r.end;
+        chunks += r.chunks;
+    }
+
+    // The last segment may not have reached the target after all: read it back before relying on it.
+    if (h && pos > sizeof(header)) {
+        JOURNAL_RECORD r;
+        dev_pread(&j->file, &r, sizeof(r), lastPos);
+        if (r.chunks > 0) {
+            ULONGLONG from = h->base + r.firstChunk * h->chunkSize;
+            ULONGLONG to = h->base + (r.firstChunk + r.chunks) * h->chunkSize;
+            if (to > h->base + h->length) to = h->base + h->length;
+            printf("Checking the last checkpoint (%.2f MB)\n", (to - from) / (1024.0 * 1024.0));
+            if (verify_range(dst, from, to - from, h->chunkSize, (const BYTE (*)[32])h->digests[r.firstChunk])) {
+                printf("Dropping the last checkpoint\n");
+                pos = lastPos;
+                end = lastEnd;
+                chunks = r.firstChunk;
+            }
+        }
+    }
+
+    j->pos = pos;
+    j->chunks = chunks;
+    j->resumeAt = end;
+    if (h) {
+        hasher_restore(h, chunks);
+        ULONGLONG at = h->base + chunks * h->chunkSize;       // re-copy the chunk the journal has no digest for
+        if (at < j->resumeAt) j->resumeAt = at > want->offset ? at : want->offset;
+    }
+    printf("Resuming at offset %llu: %.2f MB of %.2f MB already done (%s)\n", j->resumeAt,
+           (j->resumeAt - want->offset) / (1024.0 * 1024.0), want->length / (1024.0 * 1024.0), j->path);
+    return 0;
+}
+
+// Starts the journal of a job that writes [offset, offset+length) of dst, or with --resume picks up the one a
+// failed run left; j->resumeAt is where the job continues. Problems with the journal never fail the job itself.
+void journal_open(JOURNAL* j, const char* path, const char* source, ULONGLONG sourceSize, const char* target,
+                  DISK_DEV* dst, ULONGLONG offset, ULONGLONG length, HASHER* hasher) {
+    memset(j, 0, sizeof(*j));
+    snprintf(j->path, sizeof(j->path), "%s", path);
+    j->hasher = hasher;
+    j->resumeAt = offset;
+
+    JOURNAL_HEADER header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, JOURNAL_MAGIC, 8);
+    header.version = JOURNAL_VERSION;
+    snprintf(header.source, sizeof(header.source), "%s", source);
+    snprintf(header.target, sizeof(header.target), "%s", target);
+    header.sourceSize = sourceSize;
+    header.offset = offset;
+    header.length = length;
+    if (hasher) {
+        header.chunkSize = (DWORD)hasher->chunkSize;
+        header.hashBase = hasher->base;
+        header.hashLength = hasher->length;
+    }
+
+    if (g_opts.resume) {
+        if (journal_resume(j, &header, dst) == 0) {
+            j->active = TRUE;
+            return;
+        }
+        printf("Nothing to resume from %s, starting at the beginning\n", path);
+    }
+    if (dev_open(&j->file, path, DEV_READ | DEV_WRITE | DEV_CREATE)) {
+        printf("Warning: cannot create journal %s, this run cannot be resumed. Error: %lu\n", path, dev_last_error());
+        return;
+    }
+    if (dev_pwrite(&j->file, &header, sizeof(header), 0) != sizeof(header) || dev_flush(&j->file)) {
+        printf("Warning: cannot write journal %s, this run cannot be resumed. Error: %lu\n", path, dev_last_error());
+        dev_close(&j->file);
+        remove(path);
+        return;
+    }
+    j->pos = sizeof(header);
+    j->active = TRUE;
+}
+
+// Records that everything before target offset end is written and flushed.
+static void journal_checkpoint(JOURNAL* j, ULONGLONG end) {
+    HASHER* h = j->hasher;
+    JOURNAL_RECORD r;
+    memset(&r, 0, sizeof(r));
+    r.end = end;
+    r.firstChunk = j->chunks;
+    if (h) {
+        ULONGLONG limit = end >= h->base + h->length ? h->chunks : (end > h->base ? (end - h->base) / h->chunkSize : 0);
+        ULONGLONG done = hasher_settle(h, limit);
+        if (done > j->chunks) r.chunks = (DWORD)(done - j->chunks);
+    }
+    const BYTE (*digests)[32] = h ? (const BYTE (*)[32])h->digests[j->chunks] : NULL;
+    journal_record_check(&r, digests, r.check);
+    size_t bytes = (size_t)r.chunks * 32;
+    if (dev_pwrite(&j->file, &r, sizeof(r), j->pos) != sizeof(r) ||
+        (bytes && dev_pwrite(&j->file, digests, bytes, j->pos + sizeof(r)) != (long long)bytes) || dev_flush(&j->file)) {
+        printf("\nWarning: cannot write journal %s, this run cannot be resumed. Error: %lu\n", j->path, dev_last_error());
+        dev_close(&j->file);
+        j->active = FALSE;
+        return;
+    }
+    j->pos += sizeof(r) + bytes;
+    j->chunks += r.chunks;
+}
+
+// Deletes the journal of a job that succeeded; keeps it for --resume otherwise.
+void journal_close(JOURNAL* j, BOOL success) {
+    if (!j->active) return;
+    dev_close(&j->file);
+    if (success) {
+        remove(j->path);
+    } else {
+        printf("Progress journal kept in %s: run the same command with --resume to continue\n", j->path);
+    }
+    j->active = FALSE;
+}
+
+// Runs target range [offset, offset+length) of a job through fn in JOURNAL_STEP segments from j->resumeAt on, with
+// a checkpoint after each. result adds the segments up as if they were one job over the whole range.
+int journal_run(JOURNAL* j, DISK_DEV* dst, ULONGLONG offset, ULONGLONG length, BOOL quiet, SEGMENT_FN fn, void* ctx,
+                COPY_JOB* result) {
+    if (!j->active) {
+        return fn(ctx, offset, length, quiet, result);
+    }
+    COPY_JOB seg;
+    memset(result, 0, sizeof(*result));
+    ULONGLONG pos = j->resumeAt;
+    result->bytesDone = pos - offset;
+    progress_add(pos - offset);                     // done by the run that was interrupted
+    int status = COPY_OK;
+    while (pos < offset + length) {
+        ULONGLONG end = (pos / JOURNAL_STEP + 1) * JOURNAL_STEP;
+        if (end > offset + length) end = offset + length;
+        status = fn(ctx, pos, end - pos, TRUE, &seg);
+        result->bytesDone = pos - offset + seg.bytesDone;
+        result->bytesSparse += seg.bytesSparse;
+        result->bytesSkipped += seg.bytesSkipped;
+        result->compare = seg.compare;
+        if (status != COPY_OK) {
+            result->failOffset = pos - offset + seg.failOffset;
+            result->error = seg.error;
+            break;
+        }
+        if (seg.bytesDone < end - pos) {            // the source ended early
+            result->shortSource = TRUE;
+            break;
+        }
+        if (dev_flush(dst)) {
+            status = COPY_WRITE_ERROR;
+            result->failOffset = end - offset;
+            result->error = dev_last_error();
+            break;
+        }
+        journal_checkpoint(j, end);
+        pos = end;
+        if (!quiet) progress_print();
+    }
+    if (result->bytesSparse > 0 && !quiet) {
+        printf("\nSparse: %.2f MB of zeros left as holes", result->bytesSparse / (1024.0 * 1024.0));
+    }
+    return status;
+}
+
+// Segment function for a plain copy job: runs target range [offset, offset+length) of the job in ctx.
+int copy_segment(void* ctx, ULONGLONG offset, ULONGLONG length, BOOL quiet, COPY_JOB* result) {
+    COPY_JOB* job = (COPY_JOB*)ctx;
+    ULONGLONG from = offset - job->dstOffset;
+    *result = *job;
+    result->srcOffset = job->srcOffset + from;
+    result->dstOffset = offset;
+    result->length = length;
+    result->quiet = quiet;
+    result->bytesDone = result->failOffset = result->bytesSparse = result->bytesSkipped = 0;
+    result->error = 0;
+    result->shortSource = FALSE;
+
+    EXTENT* extents = NULL;
+    if (job->extents) {                     // the job's extents that fall in the segment, relative to it
+        extents = (EXTENT*)malloc((job->extentCount + 1) * sizeof(EXTENT));
+        if (!extents) return COPY_NO_MEMORY;
+        int n = 0;
+        for (int i = 0; i < job->extentCount; i++) {
+            ULONGLONG a = job->extents[i].offset, b = a + job->extents[i].length;
+            if (a < from) a = from;
+            if (b > from + length) b = from + length;
+            if (a >= b) continue;
+            extents[n].offset = a - from;
+            extents[n].length = b - a;
+            n++;
+        }
+        result->extents = extents;
+        result->extentCount = n;
+    }
+    int status = copy_range(result);
+    job->engine = result->engine;           // keep an engine fallback for the following segments
+    job->blockSize = result->blockSize;
+    job->queueDepth = result->queueDepth;
+    result->extents = NULL;
+    free(extents);
+    return status;
+}
+//================================================================================================================
+// Bad-sector rescue (create --rescue): a raw create from a failing drive that carries on past read errors.
+//   pass 1  copies forward in large blocks. A block that fails is only marked, and reading resumes further on, a
+//           longer stretch after every consecutive failure, so the healthy bulk of the disk is off it before the
+//           drive degrades any further.
+//   pass 2  reads the stretches pass 1 jumped over backwards, approaching each bad zone from its far side.
+//   pass 3  bisects the failed blocks: a half that reads is kept, a half that does not is split again, down to
+//           single sectors. Sectors that never read get the fill pattern in the image.
+// Progress is kept in a map file, <image>.wdm, laid out like a ddrescue mapfile, so --resume continues an
+// interrupted rescue and the bad areas can be inspected afterwards:
+//
+//   0x<pass position>  <pass>                      ? passes 1-2, / pass 3, + finished
+//   0x<offset>  0x<length>  <status>               + rescued, ? not tried, * failed as a block, - bad sector
+
+#define RESCUE_DONE    '+'
+#define RESCUE_UNTRIED '?'
+#define RESCUE_FAILED  '*'
+#define RESCUE_BAD     '-'
+
+#define RESCUE_BLOCK_SIZE (1024 * 1024)
+#define RESCUE_MAX_SKIP   (64ULL * 1024 * 1024)
+#define RESCUE_SAVE_STEP  (64ULL * 1024 * 1024)     // data rescued between map saves; failures save at once
+#define RESCUE_MARK       "WDDX BAD SECTOR\n"      // default fill, repeated over the sector
+
+typedef struct {
+    ULONGLONG offset;
+    ULONGLONG length;
+    char status;                // RESCUE_*
+} RESCUE_AREA;
+
+typedef struct {
+    RESCUE_AREA* areas;         // sorted and contiguous, covering [offset, offset+length)
+    int count;
+    int capacity;
+    ULONGLONG offset;
+    ULONGLONG length;
+    char path[600];
+    DISK_DEV* src;
+    COPY_JOB writer;            // the image, and whether zero grains may stay holes in it
+    BYTE* buf;
+    size_t blockSize;
+    BYTE fill[SECTOR_SIZE];
+    ULONGLONG pos;              // where the current pass is
+    char pass;                  // '?', '/' or '+', as recorded in the map
+    ULONGLONG unsaved;          // bytes rescued since the map was last written
+    BOOL mapFailed;             // the map cannot be written: the rescue goes on, but cannot be resumed
+} RESCUE;
+
+void rescue_map_path(const char* imagePath, char* out, size_t size) {
+    snprintf(out, size, "%s.wdm", imagePath);
+}
+
+static int rescue_push(RESCUE* r, ULONGLONG offset, ULONGLONG length, char status) {
+    if (r->count == r->capacity) {
+        int capacity = r->capacity ? r->capacity * 2 : 64;
+        RESCUE_AREA* areas = (RESCUE_AREA*)realloc(r->areas, capacity * sizeof(RESCUE_AREA));
+        if (!areas) return 1;
+        r->areas = areas;
+        r->capacity = capacity;
+    }
+    r->areas[r->count].offset = offset;
+    r->areas[r->count].length = length;
+    r->areas[r->count].status = status;
+    r->count++;
+    return 0;
+}
+
+// Index of the area that holds pos.
+static int rescue_find(const RESCUE* r, ULONGLONG pos) {
+    int lo = 0, hi = r->count - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (r->areas[mid].offset <= pos) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+// Makes pos the start of an area. Returns 1 when out of memory.
+static int rescue_cut(RESCUE* r, ULONGLONG pos) {
+    if (pos <= r->offset || pos >= r->offset + r->length) return 0;
+    int i = rescue_find(r, pos);
+    RESCUE_AREA a = r->areas[i];
+    if (a.offset == pos) return 0;
+    if (rescue_push(r, 0, 0, 0)) return 1;
+    memmove(&r->areas[i + 2], &r->areas[i + 1], (r->count - i - 2) * sizeof(RESCUE_AREA));
+    r->areas[i].length = pos - a.offset;
+    r->areas[i + 1].offset = pos;
+    r->areas[i + 1].length = a.offset + a.length - pos;
+    r->areas[i + 1].status = a.status;
+    return 0;
+}
+
+// Gives [offset, offset+length) status, merging it with neighbours that have the same. Returns 1 when out of memory.
+static int rescue_mark(RESCUE* r, ULONGLONG offset, ULONGLONG length, char status) {
+    if (length == 0) return 0;
+    if (rescue_cut(r, offset) || rescue_cut(r, offset + length)) return 1;
+    int first = rescue_find(r, offset), last = first;
+    while (last < r->count && r->areas[last].offset < offset + length) r->areas[last++].status = status;
+
+    int from = first > 0 ? first - 1 : 0, to = last < r->count ? last : r->count - 1, w = from;
+    for (int i = from + 1; i <= to; i++) {
+        if (r->areas[i].status == r->areas[w].status) r->areas[w].length += r->areas[i].length;
+        else r->areas[++w] = r->areas[i];
+    }
+    if (w < to) {
+        memmove(&r->areas[w + 1], &r->areas[to + 1], (r->count - to - 1) * sizeof(RESCUE_AREA));
+        r->count -= to - w;
+    }
+    return 0;
+}
+
+static ULONGLONG rescue_bytes(const RESCUE* r, char status) {
+    ULONGLONG total = 0;
+    for (int i = 0; i < r->count; i++) {
+        if (r->areas[i].status == status) total += r->areas[i].length;
+    }
+    return total;
+}
+
+// Rewrites the map, under a temporary name renamed into place. The image is flushed first so the map never
+// claims data the target does not hold yet. Returns 1 only when that flush fails.
+static int rescue_save(RESCUE* r) {
+    if (dev_flush(r->writer.dst)) return 1;
+    r->unsaved = 0;
+    if (r->mapFailed) return 0;
+
+    size_t size = 256 + (size_t)r->count * 48;
+    char* text = (char*)malloc(size);
+    char tmp[620];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", r->path);
+    BOOL ok = text != NULL;
+    if (ok) {
+        size_t n = (size_t)snprintf(text, size, "# Rescue map: %.2f MB rescued, %llu bad sectors\n"
+                                    "# current_pos  current_status\n0x%08llX     %c\n#      pos        size  status\n",
+                                    rescue_bytes(r, RESCUE_DONE) / (1024.0 * 1024.0),
+                                    (rescue_bytes(r, RESCUE_BAD) + SECTOR_SIZE - 1) / SECTOR_SIZE, r->pos, r->pass);
+        for (int i = 0; i < r->count; i++) {
+            n += (size_t)snprintf(text + n, size - n, "0x%08llX  0x%08llX  %c\n", r->areas[i].offset,
+                                  r->areas[i].length, r->areas[i].status);
+        }
+        DISK_DEV f;
+        ok = dev_open(&f, tmp, DEV_WRITE | DEV_CREATE) == 0;
+        if (ok) {
+            ok = dev_pwrite(&f, text, n, 0) == (long long)n && dev_flush(&f) == 0;
+            dev_close(&f);
+        }
+    }
+    free(text);
+#ifdef _WIN32
+    if (ok) remove(r->path);                    // rename does not replace an existing file on Windows
+#endif
+    if (ok && rename(tmp, r->path) != 0) ok = FALSE;
+    if (!ok) {
+        printf("\nWarning: cannot write rescue map %s, this rescue cannot be resumed. Error: %lu\n", r->path,
+               dev_last_error());
+        remove(tmp);
+        r->mapFailed = TRUE;
+    }
+    return 0;
+}
+
+// Reads back the map of an interrupted rescue. Returns 0 when it covers exactly the range being rescued.
+static int rescue_load(RESCUE* r) {
+    DISK_DEV f;
+    if (dev_open(&f, r->path, DEV_READ)) return 1;
+    char* text = (char*)malloc((size_t)f.size + 1);
+    BOOL ok = text && dev_pread(&f, text, (size_t)f.size, 0) == (long long)f.size;
+    dev_close(&f);
+    if (!ok) {
+        free(text);
+        return 1;
+    }
+    text[f.size] = '\0';
+
+    ULONGLONG next = r->offset;
+    BOOL havePos = FALSE;
+    for (char* line = strtok(text, "\r\n"); ok && line; line = strtok(NULL, "\r\n")) {
+        while (*line == ' ' || *line == '\t') line++;
+        if (*line == '#' || *line == '\0') continue;
+        unsigned long long offset, length;
+        char status;
+        if (!havePos) {                                 // the line with the current position comes first
+            havePos = sscanf(line, "%llx %c", &offset, &status) == 2;
+            ok = havePos;
+            continue;
+        }
+        ok = sscanf(line, "%llx %llx %c", &offset, &length, &status) == 3 && offset == next && length > 0 &&
+             strchr("+?*-", status) != NULL && rescue_push(r, offset, length, status) == 0;
+        next = offset + length;
+    }
+    free(text);
+    if (!ok || r->count == 0 || next != r->offset + r->length) {
+        r->count = 0;
+        return 1;
+    }
+    return 0;
+}
+
+static void rescue_progress(const RESCUE* r, const char* pass) {
+    progress_set(rescue_bytes(r, RESCUE_DONE) + rescue_bytes(r, RESCUE_FAILED) + rescue_bytes(r, RESCUE_BAD));
+    printf("\r%s at %.2f MB: %.2f MB rescued, %.2f MB failed, %llu bad sectors   ", pass,
+           r->pos / (1024.0 * 1024.0), rescue_bytes(r, RESCUE_DONE) / (1024.0 * 1024.0),
+           rescue_bytes(r, RESCUE_FAILED) / (1024.0 * 1024.0),
+           (rescue_bytes(r, RESCUE_BAD) + SECTOR_SIZE - 1) / SECTOR_SIZE);
+    fflush(stdout);
+}
+
+// Copies [offset, offset+len) of the source into the image, len at most one block. Returns COPY_OK,
+// COPY_READ_ERROR or COPY_WRITE_ERROR.
+static int rescue_read(RESCUE* r, ULONGLONG offset, size_t len) {
+    if (dev_pread(r->src, r->buf, len, offset) != (long long)len) return COPY_READ_ERROR;
+    if (write_block(&r->writer, r->buf, len, offset)) {
+        r->writer.failOffset = offset;
+        r->writer.error = dev_last_error();
+        return COPY_WRITE_ERROR;
+    }
+    return COPY_OK;
+}
+
+// Passes 1 and 2: reads the untried areas a block at a time, forward with skipping after failures or backward
+// without. Blocks are aligned to the device, not to the areas, so they stay aligned for unbuffered I/O.
+static int rescue_sweep(RESCUE* r, BOOL backward) {
+    ULONGLONG start = r->offset, end = r->offset + r->length, skip = 0;
+    const char* label = backward ? "Pass 2 (backward)" : "Pass 1 (forward)";
+    r->pass = RESCUE_UNTRIED;
+    r->pos = backward ? end : start;
+    while (backward ? r->pos > start : r->pos < end) {
+        const RESCUE_AREA* a = &r->areas[rescue_find(r, backward ? r->pos - 1 : r->pos)];
+        if (a->status != RESCUE_UNTRIED) {
+            r->pos = backward ? a->offset : a->offset + a->length;
+            continue;
+        }
+        ULONGLONG from, to;
+        if (backward) {
+            to = r->pos;
+            from = (to - 1) / r->blockSize * r->blockSize;
+            if (from < a->offset) from = a->offset;
+        } else {
+            from = r->pos;
+            to = (from / r->blockSize + 1) * r->blockSize;
+            if (to > a->offset + a->length) to = a->offset + a->length;
+        }
+        int status = rescue_read(r, from, (size_t)(to - from));
+        if (status == COPY_WRITE_ERROR) return status;
+        if (rescue_mark(r, from, to - from, status == COPY_OK ? RESCUE_DONE : RESCUE_FAILED)) return COPY_NO_MEMORY;
+        r->pos = backward ? from : to;
+        if (status == COPY_OK) {
+            skip = 0;
+            r->unsaved += to - from;
+        } else {
+            if (!backward) {                            // leave the next stretch for pass 2
+                skip = skip ? skip * 2 : r->blockSize;
+                if (skip > RESCUE_MAX_SKIP) skip = RESCUE_MAX_SKIP;
+                r->pos = end - r->pos > skip ? r->pos + skip : end;
+            }
+            r->unsaved = RESCUE_SAVE_STEP;
+        }
+        if (r->unsaved >= RESCUE_SAVE_STEP && rescue_save(r)) return COPY_WRITE_ERROR;
+        rescue_progress(r, label);
+    }
+    return COPY_OK;
+}
+
+// Pass 3 on [offset, offset+length), a range known not to read: tries each half on its own and splits the ones
+// that fail again, down to single sectors, which are filled and marked bad.
+static int rescue_bisect(RESCUE* r, ULONGLONG offset, ULONGLONG length) {
+    if (length <= SECTOR_SIZE) {
+        if (dev_pwrite(r->writer.dst, r->fill, (size_t)length, offset) != (long long)length) {
+            r->writer.failOffset = offset;
+            r->writer.error = dev_last_error();
+            return COPY_WRITE_ERROR;
+        }
+        return rescue_mark(r, offset, length, RESCUE_BAD) ? COPY_NO_MEMORY : COPY_OK;
+    }
+    ULONGLONG unit = length > 2 * DIRECT_ALIGN ? DIRECT_ALIGN : SECTOR_SIZE;     // keep halves aligned while possible
+    ULONGLONG half = length / 2 / unit * unit;
+    if (half == 0) half = SECTOR_SIZE;
+    ULONGLONG parts[2][2] = { { offset, half }, { offset + half, length - half } };
+    for (int i = 0; i < 2; i++) {
+        int status = rescue_read(r, parts[i][0], (size_t)parts[i][1]);
+        if (status == COPY_OK) {
+            if (rescue_mark(r, parts[i][0], parts[i][1], RESCUE_DONE)) return COPY_NO_MEMORY;
+        } else if (status == COPY_READ_ERROR) {
+            status = rescue_bisect(r, parts[i][0], parts[i][1]);
+        }
+        if (status == COPY_WRITE_ERROR || status == COPY_NO_MEMORY) return status;
+    }
+    return COPY_OK;
+}
+
+static int rescue_split(RESCUE* r) {
+    ULONGLONG end = r->offset + r->length;
+    r->pass = '/';
+    r->pos = r->offset;
+    while (r->pos < end) {
+        const RESCUE_AREA* a = &r->areas[rescue_find(r, r->pos)];
+        if (a->status != RESCUE_FAILED) {
+            r->pos = a->offset + a->length;
+            continue;
+        }
+        ULONGLONG from = r->pos, to = (from / r->blockSize + 1) * r->blockSize;
+        if (to > a->offset + a->length) to = a->offset + a->length;
+        int status = rescue_bisect(r, from, to - from);
+        if (status != COPY_OK) return status;
+        r->pos = to;
+        if (rescue_save(r)) return COPY_WRITE_ERROR;
+        rescue_progress(r, "Pass 3 (splitting)");
+    }
+    return COPY_OK;
+}
+
+// Rescues [offset, offset+length) of src into the same range of dst. extents (relative to offset, NULL for all of
+// it) limit the rescue to what is in use; the rest is zeroed. With --resume it carries on from the map a previous
+// run left. Returns COPY_OK once every sector has been tried, with the bytes that never read in *badBytes.
+int rescue_run(DISK_DEV* src, DISK_DEV* dst, ULONGLONG offset, ULONGLONG length, const EXTENT* extents,
+               int extentCount, const char* mapPath, ULONGLONG* badBytes) {
+    RESCUE r;
+    memset(&r, 0, sizeof(r));
+    snprintf(r.path, sizeof(r.path), "%s", mapPath);
+    r.offset = offset;
+    r.length = length;
+    r.src = src;
+    r.blockSize = g_opts.blockSize ? g_opts.blockSize : RESCUE_BLOCK_SIZE;
+    copy_job_init(&r.writer, src, 0, dst, 0, length);
+    for (int i = 0; i < SECTOR_SIZE; i++) {
+        r.fill[i] = g_opts.fill >= 0 ? (BYTE)g_opts.fill : (BYTE)RESCUE_MARK[i % (sizeof(RESCUE_MARK) - 1)];
+    }
+    *badBytes = 0;
+    r.buf = (BYTE*)alloc_aligned(r.blockSize);
+    if (!r.buf) return COPY_NO_MEMORY;
+
+    int status = COPY_OK;
+    if (g_opts.resume && rescue_load(&r) == 0) {
+        printf("Resuming rescue from %s: %.2f MB of %.2f MB rescued so far\n", mapPath,
+               rescue_bytes(&r, RESCUE_DONE) / (1024.0 * 1024.0), length / (1024.0 * 1024.0));
+    } else {
+        if (g_opts.resume) printf("Nothing to resume from %s, starting at the beginning\n", mapPath);
+        if (!extents && rescue_push(&r, offset, length, RESCUE_UNTRIED)) status = COPY_NO_MEMORY;
+        ULONGLONG at = 0;
+        for (int i = 0; extents && status == COPY_OK && i <= extentCount; i++) {
+            ULONGLONG a = i < extentCount ? extents[i].offset : length;
+            ULONGLONG b = i < extentCount ? a + extents[i].length : length;
+            if (a < at) a = at;
+            if (b > length) b = length;
+            if (a > at) {                               // not in use: zeros, nothing to rescue
+                if (dev_zero_fill(dst, offset + at, a - at, r.writer.sparse)) {
+                    status = COPY_WRITE_ERROR;
+                    r.writer.failOffset = offset + at;
+                } else if (rescue_push(&r, offset + at, a - at, RESCUE_DONE)) status = COPY_NO_MEMORY;
+            }
+            if (b > a && status == COPY_OK && rescue_push(&r, offset + a, b - a, RESCUE_UNTRIED)) status = COPY_NO_MEMORY;
+            if (b > at) at = b;
+        }
+        r.pass = RESCUE_UNTRIED;
+        r.pos = offset;
+        if (status == COPY_OK && rescue_save(&r)) status = COPY_WRITE_ERROR;
+        if (status == COPY_WRITE_ERROR) r.writer.error = dev_last_error();
+    }
+
+    if (status == COPY_OK) status = rescue_sweep(&r, FALSE);
+    if (status == COPY_OK) status = rescue_sweep(&r, TRUE);
+    if (status == COPY_OK) status = rescue_split(&r);
+    if (status == COPY_OK && r.writer.sparse && dev_extend(dst, offset + length)) {
+        status = COPY_WRITE_ERROR;
+        r.writer.failOffset = offset + length;
+        r.writer.error = dev_last_error();
+    }
+    if (status == COPY_OK) {
+        r.pass = RESCUE_DONE;
+        r.pos = offset + length;
+    }
+    if (r.count > 0 && rescue_save(&r) && status == COPY_OK) {
+        status = COPY_WRITE_ERROR;
+        r.writer.failOffset = offset + length;
+        r.writer.error = dev_last_error();
+    }
+
+    *badBytes = rescue_bytes(&r, RESCUE_BAD);
+    if (status == COPY_OK) {
+        printf("\nRescued %.2f MB of %.2f MB", rescue_bytes(&r, RESCUE_DONE) / (1024.0 * 1024.0),
+               length / (1024.0 * 1024.0));
+        if (*badBytes > 0) {
+            printf(", %llu unreadable sectors filled with %s", (*badBytes + SECTOR_SIZE - 1) / SECTOR_SIZE,
+                   g_opts.fill >= 0 ? "the fill byte" : "\"WDDX BAD SECTOR\"");
+        }
+        printf(" (map: %s)\n", mapPath);
+    } else if (status == COPY_WRITE_ERROR) {
+        printf("\nWrite error at offset %llu. Error: %lu\n", r.writer.failOffset, r.writer.error);
+    } else {
+        printf("\nMemory allocation failed\n");
+    }
+    if (status != COPY_OK && !r.mapFailed && r.count > 0) {
+        printf("Rescue map kept in %s: run the same command with --resume to continue\n", mapPath);
+    }
+    free_aligned(r.buf);
+    free(r.areas);
+    return status;
+}
+
+// Hashes a finished image by reading it back, for images that were not written front to back in one pass, and
+// stores its sidecar.
+void image_hash_readback(DISK_DEV* dev, const char* imagePath, ULONGLONG imageSize) {
+    HASHER h;
+    memset(&h, 0, sizeof(h));
+    h.length = imageSize;
+    h.chunkSize = HASH_CHUNK_SIZE;
+    h.chunks = (imageSize + HASH_CHUNK_SIZE - 1) / HASH_CHUNK_SIZE;
+    h.digests = (BYTE (*)[32])calloc((size_t)h.chunks + 1, 32);
+    BOOL ok = h.digests && hash_range(dev, 0, imageSize, HASH_CHUNK_SIZE, h.digests) == 0;
+    image_hash_report(imagePath, imageSize, ok ? &h : NULL);
+    free(h.digests);
+}
+//================================================================================================================
+// Filesystem allocation maps.
+// With --used-only, crtPartImage asks the filesystem which parts of the partition are in use and copies only
+// those; everything else stays a hole in the image. Extents are relative to the partition start.
+
+static WORD  le16(const BYTE* p) { return (WORD)(p[0] | (p[1] << 8)); }
+static DWORD le32(const BYTE* p) { return (DWORD)p[0] | ((DWORD)p[1] << 8) | ((DWORD)p[2] << 16) | ((DWORD)p[3] << 24); }
+static ULONGLONG le64(const BYTE* p) { return (ULONGLONG)le32(p) | ((ULONGLONG)le32(p + 4) << 32); }
+
+// Adds an extent for every run of set bits in bitmap[0, bits), each bit covering unitSize bytes from base.
+static int extents_from_bitmap(EXTENT_LIST* list, const BYTE* bitmap, ULONGLONG bits, ULONGLONG base, ULONGLONG unitSize) {
+    ULONGLONG i = 0;
+    while (i < bits) {
+        if (bitmap[i >> 3] == 0 && (i & 7) == 0 && i + 8 <= bits) {
+            i += 8;
+            continue;
+        }
+        if (!(bitmap[i >> 3] & (1 << (i & 7)))) {
+            i++;
+            continue;
+        }
+        ULONGLONG start = i;
+        while (i < bits && (bitmap[i >> 3] & (1 << (i & 7)))) {
+            if ((i & 7) == 0 && i + 8 <= bits && bitmap[i >> 3] == 0xFF) i += 8;
+            else i++;
+        }
+        if (extent_add(list, base + start * unitSize, (i - start) * unitSize)) return 1;
+    }
+    return 0;
+}
+
+// Undoes the NTFS update sequence protection of a multi-sector record in place.
+static int ntfs_apply_fixups(BYTE* rec, DWORD recSize, DWORD bytesPerSector) {
+    WORD usaOffset = le16(rec + 0x04);
+    WORD usaCount = le16(rec + 0x06);
+    if (usaCount == 0 || (DWORD)(usaCount - 1) * bytesPerSector > recSize || usaOffset + usaCount * 2u > recSize) return 1;
+    for (WORD i = 1; i < usaCount; i++) {
+        BYTE* tail = rec + i * bytesPerSector - 2;
+        if (tail[0] != rec[usaOffset] || tail[1] != rec[usaOffset + 1]) return 1;
+        tail[0] = rec[usaOffset + i * 2];
+        tail[1] = rec[usaOffset + i * 2 + 1];
+    }
+    return 0;
+}
+
+// Reads a non-resident attribute's data, following its run list, into a new buffer of dataSize bytes.
+static BYTE* ntfs_read_runs(DISK_DEV* dev, ULONGLONG partOffset, const BYTE* runs, const BYTE* runsEnd,
+                            ULONGLONG clusterSize, ULONGLONG dataSize) {
+    BYTE* data = (BYTE*)calloc(1, (size_t)dataSize + 1);
+    if (!data) return NULL;
+    ULONGLONG filled = 0;
+    LONGLONG lcn = 0;
+    const BYTE* p = runs;
+    while (p < runsEnd && *p != 0 && filled < dataSize) {
+        int lenSize = *p & 0x0F;
+        int offSize = *p >> 4;
+        if (lenSize == 0 || lenSize > 8 || offSize > 8 || p + 1 + lenSize + offSize > runsEnd) break;
+        ULONGLONG runLen = 0;
+        for (int i = 0; i < lenSize; i++) runLen |= (ULONGLONG)p[1 + i] << (8 * i);
+        LONGLONG delta = 0;
+        for (int i = 0; i < offSize; i++) delta |= (LONGLONG)((ULONGLONG)p[1 + lenSize + i] << (8 * i));
+        if (offSize > 0 && (p[lenSize + offSize] & 0x80)) delta -= (LONGLONG)1 << (8 * offSize);     // sign extend
+        p += 1 + lenSize + offSize;
+
+        ULONGLONG bytes = runLen * clusterSize;
+        if (bytes > dataSize - filled) bytes = dataSize - filled;
+        if (offSize != 0) {         // offSize == 0 is a sparse run: leave zeros
+            lcn += delta;
+            if (dev_pread(dev, data + filled, (size_t)bytes, partOffset + (ULONGLONG)lcn * clusterSize) != (long long)bytes) {
+                free(data);
+                return NULL;
+            }
+        }
+        filled += bytes;
+    }
+    if (filled < dataSize) {
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
+// Builds the extent list of an NTFS volume from its $Bitmap (MFT record 6).
+int ntfs_used_extents(DISK_DEV* dev, ULONGLONG partOffset, ULONGLONG partSize, const BYTE* vbr, EXTENT_LIST* out) {
+    DWORD bytesPerSector = le16(vbr + 0x0B);
+    DWORD sectorsPerCluster = vbr[0x0D];
+    ULONGLONG totalSectors = le64(vbr + 0x28);
+    ULONGLONG mftLcn = le64(vbr + 0x30);
+    signed char mftRecordCode = (signed char)vbr[0x40];
+
+    if (bytesPerSector < 512 || bytesPerSector > 4096 || (bytesPerSector & (bytesPerSector - 1))) return 1;
+    if (sectorsPerCluster > 0x80) sectorsPerCluster = 1u << (256 - sectorsPerCluster);     // large-cluster encoding
+    if (sectorsPerCluster == 0 || (sectorsPerCluster & (sectorsPerCluster - 1))) return 1;
+    ULONGLONG clusterSize = (ULONGLONG)bytesPerSector * sectorsPerCluster;
+    DWORD recSize = mftRecordCode < 0 ? (1u << -mftRecordCode) : (DWORD)(mftRecordCode * clusterSize);
+    if (recSize < 512 || recSize > 65536) return 1;
+    ULONGLONG clusters = totalSectors * bytesPerSector / clusterSize;
+
+    // $MFT's first records are always contiguous, so record 6 sits at a fixed distance from the MFT start.
+    BYTE* rec = (BYTE*)malloc(recSize);
+    if (!rec) return 1;
+    if (dev_pread(dev, rec, recSize, partOffset + mftLcn * clusterSize + 6ULL * recSize) != recSize ||
+        memcmp(rec, "FILE", 4) != 0 || ntfs_apply_fixups(rec, recSize, bytesPerSector)) {
+        printf("NTFS: cannot read $Bitmap record\n");
+        free(rec);
+        return 1;
+    }
+
+    BYTE* bitmap = NULL;
+    ULONGLONG bitmapSize = 0;
+    DWORD at = le16(rec + 0x14);
+    while (at + 16 <= recSize) {
+        DWORD type = le32(rec + at);
+        DWORD len = le32(rec + at + 4);
+        if (type == 0xFFFFFFFF || len < 16 || at + len > recSize) break;
+        if (type == 0x80 && rec[at + 9] == 0) {         // unnamed $DATA
+            if (rec[at + 8] == 0) {                     // resident
+                DWORD valueLen = le32(rec + at + 0x10);
+                WORD valueOffset = le16(rec + at + 0x14);
+                if (valueOffset + valueLen > len) break;
+                bitmap = (BYTE*)malloc(valueLen + 1);
+                if (bitmap) {
+                    memcpy(bitmap, rec + at + valueOffset, valueLen);
+                    bitmapSize = valueLen;
+                }
+            } else {
+                WORD runsOffset = le16(rec + at + 0x20);
+                bitmapSize = le64(rec + at + 0x30);
+                if (runsOffset < len && bitmapSize <= (clusters + 7) / 8 + clusterSize) {
+                    bitmap = ntfs_read_runs(dev, partOffset, rec + at + runsOffset, rec + at + len, clusterSize, bitmapSize);
+                }
+            }
+            break;
+        }
+        at += len;
+    }
+    free(rec);
+    if (!bitmap || bitmapSize * 8 < clusters) {
+        printf("NTFS: $Bitmap not found or too small\n");
+        free(bitmap);
+        return 1;
+    }
+
+    int rc = extents_from_bitmap(out, bitmap, clusters, 0, clusterSize);
+    // The backup boot sector lives past the last cluster.
+    ULONGLONG clusterEnd = clusters * clusterSize;
+    if (rc == 0 && clusterEnd < partSize) rc = extent_add(out, clusterEnd, partSize - clusterEnd);
+    free(bitmap);
+    return rc;
+}
+
+#define FAT_CHUNK (1024 * 1024)
+
+// Builds the extent list of a FAT12/16/32 volume: the reserved, FAT and root directory regions, then every
+// cluster whose FAT entry is neither free nor marked bad.
+int fat_used_extents(DISK_DEV* dev, ULONGLONG partOffset, const BYTE* vbr, EXTENT_LIST* out) {
+    DWORD bytesPerSector = le16(vbr + 0x0B);
+    DWORD sectorsPerCluster = vbr[0x0D];
+    DWORD reserved = le16(vbr + 0x0E);
+    DWORD numFats = vbr[0x10];
+    DWORD rootEntries = le16(vbr + 0x11);
+    DWORD totalSectors = le16(vbr + 0x13) ? le16(vbr + 0x13) : le32(vbr + 0x20);
+    DWORD fatSectors = le16(vbr + 0x16) ? le16(vbr + 0x16) : le32(vbr + 0x24);
+
+    if (bytesPerSector < 512 || bytesPerSector > 4096 || (bytesPerSector & (bytesPerSector - 1))) return 1;
+    if (sectorsPerCluster == 0 || (sectorsPerCluster & (sectorsPerCluster - 1))) return 1;
+    if (reserved == 0 || numFats == 0 || fatSectors == 0 || totalSectors == 0) return 1;
+
+    DWORD rootSectors = (rootEntries * 32 + bytesPerSector - 1) / bytesPerSector;
+    ULONGLONG firstData = (ULONGLONG)reserved + (ULONGLONG)numFats * fatSectors + rootSectors;
+    if (firstData >= totalSectors) return 1;
+    ULONGLONG clusterCount = (totalSectors - firstData) / sectorsPerCluster;
+    ULONGLONG clusterSize = (ULONGLONG)bytesPerSector * sectorsPerCluster;
+    int bits = clusterCount < 4085 ? 12 : (clusterCount < 65525 ? 16 : 32);
+    ULONGLONG fatBytes = (ULONGLONG)fatSectors * bytesPerSector;
+    if ((clusterCount + 2) * bits / 8 > fatBytes) return 1;
+    printf("FAT%d: %llu clusters of %llu bytes\n", bits, clusterCount, clusterSize);
+
+    if (extent_add(out, 0, firstData * bytesPerSector)) return 1;
+
+    // FAT32/16 entries are streamed a chunk at a time; a FAT12 table is at most 6 KB and read in one go.
+    size_t chunk = bits == 12 ? (size_t)fatBytes : FAT_CHUNK;
+    BYTE* fat = (BYTE*)alloc_aligned((chunk + DIRECT_ALIGN - 1) & ~(size_t)(DIRECT_ALIGN - 1));
+    if (!fat) return 1;
+    ULONGLONG fatOffset = partOffset + (ULONGLONG)reserved * bytesPerSector;
+    ULONGLONG chunkStart = 0, chunkLen = 0;
+    ULONGLONG heap = firstData * bytesPerSector;
+    ULONGLONG runStart = 0, runLen = 0;
+    int rc = 0;
+
+    for (ULONGLONG n = 2; n < clusterCount + 2 && rc == 0; n++) {
+        DWORD entry;
+        if (bits == 12) {
+            if (chunkLen == 0) {
+                if (dev_pread(dev, fat, (size_t)fatBytes, fatOffset) != (long long)fatBytes) { rc = 1; break; }
+                chunkLen = fatBytes;
+            }
+            ULONGLONG at = n + n / 2;
+            entry = le16(fat + at);
+            entry = (n & 1) ? (entry >> 4) : (entry & 0x0FFF);
+        } else {
+            ULONGLONG at = n * (bits / 8);
+            if (at < chunkStart || at + bits / 8 > chunkStart + chunkLen) {
+                chunkStart = at - (at % chunk);
+                chunkLen = fatBytes - chunkStart > chunk ? chunk : fatBytes - chunkStart;
+                if (dev_pread(dev, fat, (size_t)chunkLen, fatOffset + chunkStart) != (long long)chunkLen) { rc = 1; break; }
+            }
+            entry = bits == 16 ? le16(fat + (at - chunkStart)) : (le32(fat + (at - chunkStart)) & 0x0FFFFFFF);
+        }
+        DWORD bad = bits == 12 ? 0xFF7 : (bits == 16 ? 0xFFF7 : 0x0FFFFFF7);
+        BOOL inUse = entry != 0 && entry != bad;
+
+        if (inUse && runLen > 0 && runStart + runLen == n) {
+            runLen++;
+        } else if (inUse) {
+            if (runLen > 0) rc = extent_add(out, heap + (runStart - 2) * clusterSize, runLen * clusterSize);
+            runStart = n;
+            runLen = 1;
+        }
+    }
+    if (rc == 0 && runLen > 0) rc = extent_add(out, heap + (runStart - 2) * clusterSize, runLen * clusterSize);
+    free_aligned(fat);
+    return rc;
+}
+
+// Follows an exFAT cluster chain through the FAT and reads length bytes of it into a new buffer. The root directory
+// and the allocation bitmap always have their chain in the FAT (NoFatChain only applies to file streams), so a free
+// (zero) or out-of-range entry before length is reached means the volume is corrupt.
+static BYTE* exfat_read_chain(DISK_DEV* dev, ULONGLONG partOffset, ULONGLONG fatOffset, ULONGLONG heapOffset,
+                              ULONGLONG clusterSize, DWORD clusterCount, DWORD first, ULONGLONG length) {
+    BYTE* data = (BYTE*)malloc((size_t)length + 1);
+    if (!data) return NULL;
+    ULONGLONG filled = 0;
+    DWORD cluster = first;
+    while (filled < length) {
+        if (cluster < 2 || cluster >= clusterCount + 2) {
+            free(data);
+            return NULL;
+        }
+        ULONGLONG n = length - filled > clusterSize ? clusterSize : length - filled;
+        if (dev_pread(dev, data + filled, (size_t)n, partOffset + heapOffset + (ULONGLONG)(cluster - 2) * clusterSize) != (long long)n) {
+            free(data);
+            return NULL;
+        }
+        filled += n;
+        BYTE entry[4];
+        if (dev_pread(dev, entry, 4, partOffset + fatOffset + (ULONGLONG)cluster * 4) != 4) {
+            free(data);
+            return NULL;
+        }
+        cluster = le32(entry);
+        if (filled < length && cluster == 0) {
+            printf("exFAT: cluster chain from %lu runs into a free cluster\n", (unsigned long)first);
+            free(data);
+            return NULL;
+        }
+    }
+    return data;
+}
+
+// Builds the extent list of an exFAT volume from its allocation bitmap.
+int exfat_used_extents(DISK_DEV* dev, ULONGLONG partOffset, const BYTE* vbr, EXTENT_LIST* out) {
+    ULONGLONG fatOffset = le32(vbr + 0x50);
+    ULONGLONG heapOffset = le32(vbr + 0x58);
+    DWORD clusterCount = le32(vbr + 0x5C);
+    DWORD rootCluster = le32(vbr + 0x60);
+    int sectorShift = vbr[0x6C];
+    int clusterShift = vbr[0x6D];
+
+    if (sectorShift < 9 || sectorShift > 12 || clusterShift > 25 - sectorShift) return 1;
+    ULONGLONG bytesPerSector = 1ULL << sectorShift;
+    ULONGLONG clusterSize = bytesPerSector << clusterShift;
+    fatOffset *= bytesPerSector;
+    heapOffset *= bytesPerSector;
+    printf("exFAT: %lu clusters of %llu bytes\n", (unsigned long)clusterCount, clusterSize);
+
+    // The allocation bitmap's directory entry (type 0x81) sits near the start of the root directory.
+    BYTE* root = exfat_read_chain(dev, partOffset, fatOffset, heapOffset, clusterSize, clusterCount, rootCluster, clusterSize);
+    if (!root) return 1;
+    DWORD bitmapCluster = 0;
+    ULONGLONG bitmapLength = 0;
+    for (ULONGLONG at = 0; at + 32 <= clusterSize; at += 32) {
+        if (root[at] == 0x00) break;            // end of directory
+        if (root[at] == 0x81) {
+            bitmapCluster = le32(root + at + 20);
+            bitmapLength = le64(root + at + 24);
+            break;
+        }
+    }
+    free(root);
+    if (bitmapCluster == 0 || bitmapLength * 8 < clusterCount) {
+        printf("exFAT: allocation bitmap not found\n");
+        return 1;
+    }
+
+    BYTE* bitmap = exfat_read_chain(dev, partOffset, fatOffset, heapOffset, clusterSize, clusterCount, bitmapCluster, bitmapLength);
+    if (!bitmap) return 1;
+    int rc = extent_add(out, 0, heapOffset);
+    if (rc == 0) rc = extents_from_bitmap(out, bitmap, clusterCount, heapOffset, clusterSize);
+    free(bitmap);
+    return rc;
+}
+
+static int extent_compare(const void* a, const void* b) {
+    const EXTENT* x = (const EXTENT*)a;
+    const EXTENT* y = (const EXTENT*)b;
+    return x->offset < y->offset ? -1 : (x->offset > y->offset ? 1 : 0);
+}
+
+// Sorts a list built out of order and merges overlapping or touching extents.
+void extent_normalize(EXTENT_LIST* list) {
+    if (list->count < 2) return;
+    qsort(list->items, list->count, sizeof(EXTENT), extent_compare);
+    int w = 0;
+    for (int r = 1; r < list->count; r++) {
+        EXTENT* last = &list->items[w];
+        EXTENT* cur = &list->items[r];
+        if (cur->offset <= last->offset + last->length) {
+            ULONGLONG end = cur->offset + cur->length;
+            if (end > last->offset + last->length) last->length = end - last->offset;
+        } else {
+            list->items[++w] = *cur;
+        }
+    }
+    list->count = w + 1;
+}
+
+#define EXT_MAGIC                   0xEF53
+#define EXT_COMPAT_SPARSE_SUPER2    0x0200
+#define EXT_INCOMPAT_META_BG        0x0010
+#define EXT_INCOMPAT_64BIT          0x0080
+#define EXT_RO_COMPAT_SPARSE_SUPER  0x0001
+#define EXT_RO_COMPAT_GDT_CSUM      0x0010
+#define EXT_RO_COMPAT_METADATA_CSUM 0x0400
+#define EXT_BG_BLOCK_UNINIT         0x0002
+
+static BOOL ext_is_power_of(ULONGLONG n, ULONGLONG base) {
+    while (n > 1 && n % base == 0) n /= base;
+    return n == 1;
+}
+
+// Whether group g carries a superblock/descriptor backup.
+static BOOL ext_group_has_super(const BYTE* sb, ULONGLONG g) {
+    if (g == 0) return TRUE;
+    if (le32(sb + 0x5C) & EXT_COMPAT_SPARSE_SUPER2) {
+        return g == le32(sb + 0x24C) || g == le32(sb + 0x250);
+    }
+    if (!(le32(sb + 0x64) & EXT_RO_COMPAT_SPARSE_SUPER)) return TRUE;
+    return g == 1 || ext_is_power_of(g, 3) || ext_is_power_of(g, 5) || ext_is_power_of(g, 7);
+}
+
+// Builds the extent list of an ext2/3/4 volume from its block bitmaps. Groups flagged BLOCK_UNINIT are not read:
+// their only contents are a superblock backup and metadata that the descriptors locate anyway.
+int ext_used_extents(DISK_DEV* dev, ULONGLONG partOffset, ULONGLONG partSize, EXTENT_LIST* out) {
+    BYTE sb[1024];
+    if (dev_pread(dev, sb, sizeof(sb), partOffset + 1024) != sizeof(sb) || le16(sb + 0x38) != EXT_MAGIC) return 1;
+
+    DWORD logBlock = le32(sb + 0x18);
+    if (logBlock > 6) return 1;
+    ULONGLONG blockSize = 1024ULL << logBlock;
+    DWORD incompat = le32(sb + 0x60);
+    DWORD roCompat = le32(sb + 0x64);
+    ULONGLONG blocks = le32(sb + 0x04);
+    if (incompat & EXT_INCOMPAT_64BIT) blocks |= (ULONGLONG)le32(sb + 0x150) << 32;
+    ULONGLONG firstData = le32(sb + 0x14);
+    ULONGLONG perGroup = le32(sb + 0x20);
+    ULONGLONG inodesPerGroup = le32(sb + 0x28);
+    ULONGLONG inodeSize = le32(sb + 0x4C) >= 1 ? le16(sb + 0x58) : 128;     // revision 0 has fixed 128-byte inodes
+    ULONGLONG descSize = (incompat & EXT_INCOMPAT_64BIT) ? le16(sb + 0xFE) : 32;
+    ULONGLONG reservedGdt = le16(sb + 0xCE);
+    BOOL uninitValid = (roCompat & (EXT_RO_COMPAT_GDT_CSUM | EXT_RO_COMPAT_METADATA_CSUM)) != 0;
+
+    if (perGroup == 0 || perGroup > blockSize * 8 || descSize < 32 || blocks * blockSize > partSize) return 1;
+    if (incompat & EXT_INCOMPAT_META_BG) {
+        printf("ext: meta_bg layout not supported\n");
+        return 1;
+    }
+    ULONGLONG groups = (blocks - firstData + perGroup - 1) / perGroup;
+    ULONGLONG gdtBlocks = (groups * descSize + blockSize - 1) / blockSize;
+    ULONGLONG itableBlocks = (inodesPerGroup * inodeSize + blockSize - 1) / blockSize;
+    printf("ext: %llu blocks of %llu bytes in %llu groups\n", blocks, blockSize, groups);
+
+    BYTE* gdt = (BYTE*)malloc((size_t)(gdtBlocks * blockSize));
+    BYTE* bitmap = (BYTE*)malloc((size_t)blockSize);
+    if (!gdt || !bitmap) {
+        free(gdt);
+        free(bitmap);
+        return 1;
+    }
+    if (dev_pread(dev, gdt, (size_t)(gdtBlocks * blockSize), partOffset + (firstData + 1) * blockSize) != (long long)(gdtBlocks * blockSize)) {
+        free(gdt);
+        free(bitmap);
+        return 1;
+    }
+
+    // Boot block and primary superblock
+    int rc = extent_add(out, 0, (firstData + 1) * blockSize);
+    ULONGLONG skipped = 0;
+    for (ULONGLONG g = 0; g < groups && rc == 0; g++) {
+        const BYTE* d = gdt + g * descSize;
+        ULONGLONG blockBitmap = le32(d + 0x00);
+        ULONGLONG inodeBitmap = le32(d + 0x04);
+        ULONGLONG inodeTable = le32(d + 0x08);
+        WORD flags = le16(d + 0x12);
+        if (descSize >= 64) {
+            blockBitmap |= (ULONGLONG)le32(d + 0x20) << 32;
+            inodeBitmap |= (ULONGLONG)le32(d + 0x24) << 32;
+            inodeTable |= (ULONGLONG)le32(d + 0x28) << 32;
+        }
+        ULONGLONG groupStart = firstData + g * perGroup;
+        ULONGLONG groupBlocks = blocks - groupStart < perGroup ? blocks - groupStart : perGroup;
+        if (blockBitmap >= blocks || inodeBitmap >= blocks || inodeTable + itableBlocks > blocks) {
+            rc = 1;
+            break;
+        }
+
+        // With flex_bg these can live in another group, so they are always listed explicitly.
+        rc = extent_add(out, blockBitmap * blockSize, blockSize);
+        if (rc == 0) rc = extent_add(out, inodeBitmap * blockSize, blockSize);
+        if (rc == 0) rc = extent_add(out, inodeTable * blockSize, itableBlocks * blockSize);
+        if (rc) break;
+
+        if (uninitValid && (flags & EXT_BG_BLOCK_UNINIT)) {
+            if (ext_group_has_super(sb, g)) {
+                ULONGLONG n = 1 + gdtBlocks + reservedGdt;
+                if (n > groupBlocks) n = groupBlocks;
+                rc = extent_add(out, groupStart * blockSize, n * blockSize);
+            }
+            skipped++;
+            continue;
+        }
+
+        if (dev_pread(dev, bitmap, (size_t)blockSize, partOffset + blockBitmap * blockSize) != (long long)blockSize) {
+            rc = 1;
+            break;
+        }
+        rc = extents_from_bitmap(out, bitmap, groupBlocks, groupStart * blockSize, blockSize);
+    }
+    free(gdt);
+    free(bitmap);
+    if (rc == 0) {
+        extent_normalize(out);
+        if (skipped) printf("ext: %llu uninitialized groups skipped\n", skipped);
+    }
+    return rc;
+}
+
+// Fills out with the in-use ranges of the filesystem whose boot sector is vbr. Returns 1 when the filesystem is not
+// recognised or its metadata does not check out; the caller then copies the whole partition.
+int fs_used_extents(DISK_DEV* dev, ULONGLONG partOffset, ULONGLONG partSize, const BYTE* vbr, EXTENT_LIST* out) {
+    if (memcmp(vbr + 3, "NTFS    ", 8) == 0) {
+        return ntfs_used_extents(dev, partOffset, partSize, vbr, out);
+    }
+    if (memcmp(vbr + 3, "EXFAT   ", 8) == 0) {
+        return exfat_used_extents(dev, partOffset, vbr, out);
+    }
+    if (ext_used_extents(dev, partOffset, partSize, out) == 0) {
+        return 0;
+    }
+    extent_free(out);
+    if ((vbr[0] == 0xEB || vbr[0] == 0xE9) && le16(vbr + 510) == 0xAA55) {
+        return fat_used_extents(dev, partOffset, vbr, out);
+    }
+    return 1;
+}
+//================================================================================================================
+// Image sources.
+// Every non-raw output format is written from an IMAGE_SRC: the logical contents of the image, described as ranges
+// read from a device at the same offsets, a few patched sectors (the MBR/EBR crtPartImage marks bootable) and
+// zeros everywhere else.
+
+typedef struct {
+    ULONGLONG offset;           // sector-aligned image offset
+    BYTE data[SECTOR_SIZE];
+} SECTOR_PATCH;
+
+typedef struct {
+    DISK_DEV* dev;
+    ULONGLONG size;             // logical image size
+    const EXTENT* extents;      // ranges of dev that are part of the image, sorted; NULL means all of [0, size)
+    int extentCount;
+    const SECTOR_PATCH* patches;
+    int patchCount;
+} IMAGE_SRC;
+
+void image_src_init(IMAGE_SRC* src, DISK_DEV* dev, ULONGLONG size) {
+    memset(src, 0, sizeof(*src));
+    src->dev = dev;
+    src->size = size;
+}
+
+// Reads len bytes of the logical image at offset into buf. Returns 0, or 1 on a device error.
+int image_src_read(const IMAGE_SRC* src, BYTE* buf, size_t len, ULONGLONG offset) {
+    ULONGLONG end = offset + len;
+    if (!src->extents) {
+        if (dev_pread(src->dev, buf, len, offset) != (long long)len) return 1;
+    } else {
+        memset(buf, 0, len);
+        for (int i = 0; i < src->extentCount; i++) {
+            ULONGLONG a = src->extents[i].offset;
+            ULONGLONG b = a + src->extents[i].length;
+            if (b <= offset) continue;
+            if (a >= end) break;
+            if (a < offset) a = offset;
+            if (b > end) b = end;
+            if (dev_pread(src->dev, buf + (a - offset), (size_t)(b - a), a) != (long long)(b - a)) return 1;
+        }
+    }
+    for (int i = 0; i < src->patchCount; i++) {
+        ULONGLONG at = src->patches[i].offset;
+        if (at >= offset && at + SECTOR_SIZE <= end) memcpy(buf + (at - offset), src->patches[i].data, SECTOR_SIZE);
+    }
+    return 0;
+}
+//================================================================================================================
+// Chunk pipeline.
+// The chunked formats are all produced the same way: a reader thread cuts an IMAGE_SRC into fixed-size chunks,
+// worker threads encode them in parallel (compress, hash, store) and the calling thread emits the results in chunk
+// order, so the container itself is written strictly sequentially.
+
+#define SLOT_EMPTY 0
+#define SLOT_READ  1
+#define SLOT_BUSY  2
+#define SLOT_DONE  3
+
+typedef struct {
+    BYTE* in;
+    BYTE* out;
+    size_t inLen;
+    size_t outLen;
+    int type;                   // format-specific chunk type set by encode
+    BYTE digest[32];
+    ULONGLONG chunk;
+    int state;
+} CHUNK_SLOT;
+
+typedef struct CHUNK_POOL CHUNK_POOL;
+
+struct CHUNK_POOL {
+    const IMAGE_SRC* src;
+    size_t chunkSize;
+    ULONGLONG chunks;
+    size_t outSize;             // bytes of slot->out, 0 for none
+    int (*encode)(CHUNK_POOL* pool, CHUNK_SLOT* slot);     // on a worker thread; returns COPY_*
+    int (*emit)(CHUNK_POOL* pool, CHUNK_SLOT* slot);       // on the calling thread, in chunk order; returns COPY_*
+    void* ctx;
+
+    CHUNK_SLOT* slots;
+    int count;
+    ULONGLONG nextEncode;
+    BOOL abort;
+    int status;
+    ULONGLONG failChunk;
+    unsigned long error;
+    WD_MUTEX lock;
+    WD_COND changed;
+};
+
+static void chunk_pool_fail(CHUNK_POOL* pool, int status, ULONGLONG chunk) {
+    unsigned long error = dev_last_error();
+    mutex_lock(&pool->lock);
+    if (pool->status == COPY_OK) {
+        pool->status = status;
+        pool->failChunk = chunk;
+        pool->error = error;
+    }
+    pool->abort = TRUE;
+    cond_broadcast(&pool->changed);
+    mutex_unlock(&pool->lock);
+}
+
+static void* chunk_reader(void* arg) {
+    CHUNK_POOL* pool = (CHUNK_POOL*)arg;
+    for (ULONGLONG c = 0; c < pool->chunks; c++) {
+        CHUNK_SLOT* slot = &pool->slots[c % pool->count];
+        mutex_lock(&pool->lock);
+        while (slot->state != SLOT_EMPTY && !pool->abort) cond_wait(&pool->changed, &pool->lock);
+        BOOL stop = pool->abort;
+        mutex_unlock(&pool->lock);
+        if (stop) return NULL;
+
+        ULONGLONG offset = c * pool->chunkSize;
+        slot->inLen = (size_t)(pool->src->size - offset < pool->chunkSize ? pool->src->size - offset : pool->chunkSize);
+        stage_add(STAGE_READ, 1);
+        int failed = image_src_read(pool->src, slot->in, slot->inLen, offset);
+        stage_add(STAGE_READ, -1);
+        if (failed) {
+            chunk_pool_fail(pool, COPY_READ_ERROR, c);
+            return NULL;
+        }
+
+        mutex_lock(&pool->lock);
+        slot->chunk = c;
+        slot->state = SLOT_READ;
+        stage_add(STAGE_COMPUTE, 1);
+        cond_broadcast(&pool->changed);
+        mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+static void* chunk_encoder(void* arg) {
+    CHUNK_POOL* pool = (CHUNK_POOL*)arg;
+    for (;;) {
+        mutex_lock(&pool->lock);
+        CHUNK_SLOT* slot = NULL;
+        while (!pool->abort && pool->nextEncode < pool->chunks) {
+            slot = &pool->slots[pool->nextEncode % pool->count];
+            if (slot->state == SLOT_READ && slot->chunk == pool->nextEncode) break;
+            slot = NULL;
+            cond_wait(&pool->changed, &pool->lock);
+        }
+        if (!slot) {
+            mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        pool->nextEncode++;
+        slot->state = SLOT_BUSY;
+        mutex_unlock(&pool->lock);
+
+        ULONGLONG start = iostat_clock();
+        int status = pool->encode(pool, slot);
+        lat_record(&g_iostat.compute, start, slot->inLen);
+        if (status != COPY_OK) {
+            chunk_pool_fail(pool, status, slot->chunk);
+            return NULL;
+        }
+
+        mutex_lock(&pool->lock);
+        slot->state = SLOT_DONE;
+        stage_add(STAGE_COMPUTE, -1);
+        stage_add(STAGE_WRITE, 1);
+        cond_broadcast(&pool->changed);
+        mutex_unlock(&pool->lock);
+    }
+}
+
+// Runs the pipeline over pool->src with worker_count() encoders. Returns COPY_*; failChunk/error describe a failure.
+int chunk_pool_run(CHUNK_POOL* pool) {
+    int workers = worker_count();
+    pool->chunks = (pool->src->size + pool->chunkSize - 1) / pool->chunkSize;
+    pool->count = workers * 2;
+    pool->slots = (CHUNK_SLOT*)calloc(pool->count, sizeof(CHUNK_SLOT));
+    WD_THREAD* threads = (WD_THREAD*)calloc(workers + 1, sizeof(WD_THREAD));
+    BOOL ok = pool->slots && threads;
+    for (int i = 0; ok && i < pool->count; i++) {
+        pool->slots[i].in = (BYTE*)alloc_aligned(pool->chunkSize);
+        pool->slots[i].out = pool->outSize ? (BYTE*)malloc(pool->outSize) : NULL;
+        ok = pool->slots[i].in && (pool->slots[i].out || !pool->outSize);
+    }
+    mutex_init(&pool->lock);
+    cond_init(&pool->changed);
+
+    int started = 0;
+    if (ok && thread_start(&threads[started], chunk_reader, pool) == 0) started++;
+    for (int i = 0; i < workers && started > 0; i++) {
+        if (thread_start(&threads[started], chunk_encoder, pool) == 0) started++;
+    }
+    if (started < 2) chunk_pool_fail(pool, COPY_NO_MEMORY, 0);
+
+    for (ULONGLONG c = 0; c < pool->chunks; c++) {
+        CHUNK_SLOT* slot = &pool->slots[c % pool->count];
+        mutex_lock(&pool->lock);
+        while ((slot->state != SLOT_DONE || slot->chunk != c) && !pool->abort) cond_wait(&pool->changed, &pool->lock);
+        BOOL stop = pool->abort;
+        mutex_unlock(&pool->lock);
+        if (stop) break;
+
+        int status = pool->emit(pool, slot);
+        if (status != COPY_OK) {
+            chunk_pool_fail(pool, status, c);
+            break;
+        }
+
+        size_t done = slot->inLen;              // the reader refills the slot as soon as it is released
+        mutex_lock(&pool->lock);
+        slot->state = SLOT_EMPTY;
+        stage_add(STAGE_WRITE, -1);
+        cond_broadcast(&pool->changed);
+        mutex_unlock(&pool->lock);
+
+        progress_add(done);
+        if (progress_due() || c + 1 == pool->chunks) progress_print();
+    }
+    chunk_pool_fail(pool, COPY_OK, 0);          // releases idle encoders; keeps the status of an earlier failure
+    for (int i = 0; i < started; i++) thread_join(threads[i]);
+    for (int i = 0; pool->slots && i < pool->count; i++) {      // chunks a failed run left in flight
+        int state = pool->slots[i].state;
+        if (state == SLOT_READ || state == SLOT_BUSY) stage_add(STAGE_COMPUTE, -1);
+        if (state == SLOT_DONE) stage_add(STAGE_WRITE, -1);
+    }
+
+    cond_destroy(&pool->changed);
+    mutex_destroy(&pool->lock);
+    for (int i = 0; pool->slots && i < pool->count; i++) {
+        if (pool->slots[i].in) free_aligned(pool->slots[i].in);
+        free(pool->slots[i].out);
+    }
+    free(pool->slots);
+    free(threads);
+    pool->slots = NULL;
+    return pool->status;
+}
+
+static void chunk_pool_report(const CHUNK_POOL* pool, int status) {
+    if (status == COPY_READ_ERROR) {
+        printf("\nRead error at chunk %llu. Error: %lu\n", pool->failChunk, pool->error);
+    } else if (status == COPY_WRITE_ERROR) {
+        printf("\nWrite error at chunk %llu. Error: %lu\n", pool->failChunk, pool->error);
+    } else if (status == COPY_NO_MEMORY) {
+        printf("Memory allocation failed\n");
+    }
+}
+//================================================================================================================
+// WDX container: the image split into fixed-size chunks, each stored as zeros (no payload), raw, or deflated, with
+// an index of chunk offsets at the end so any LBA can be read by decompressing a single chunk.
+//
+//   WDX_HEADER | parent path | WDX_PARENT | chunk payloads ... | WDX_INDEX_ENTRY[chunkCount] | WDX_TRAILER
+//
+// An overlay (create --base) names its parent image after the header and stores only the chunks that changed;
+// the rest are WDX_CHUNK_PARENT and read through the parent, which may itself be an overlay. WDX_PARENT records
+// which parent that was, and opening the overlay refuses a parent that has changed since.
+
+#define WDX_MAGIC         "WDDXIMG1"
+#define WDX_TRAILER_MAGIC "WDDXIDX1"
+#define WDX_VERSION       1
+#define WDX_CHUNK_SIZE    (1024 * 1024)
+#define WDX_LEVEL         3
+#define WDX_MAX_CHAIN     64
+
+#define WDX_CHUNK_ZERO    0
+#define WDX_CHUNK_RAW     1
+#define WDX_CHUNK_DEFLATE 2
+#define WDX_CHUNK_PARENT  3
+
+#pragma pack(push, 1)
+typedef struct {
+    char magic[8];
+    DWORD version;
+    DWORD chunkSize;
+    ULONGLONG imageSize;
+    ULONGLONG chunkCount;
+    DWORD parentLength;         // bytes of parent path following the header, 0 for a standalone image
+    DWORD parentInfo;           // bytes of WDX_PARENT following the parent path, 0 in overlays that predate it
+    BYTE reserved[24];
+} WDX_HEADER;
+
+typedef struct {
+    ULONGLONG offset;           // payload offset in the container
+    DWORD length;               // payload bytes
+    BYTE type;                  // WDX_CHUNK_*
+    BYTE pad[3];
+} WDX_INDEX_ENTRY;
+
+typedef struct {
+    char magic[8];
+    ULONGLONG indexOffset;
+    ULONGLONG chunkCount;
+    DWORD indexCrc;             // crc32 of the index entries
+    DWORD pad;
+} WDX_TRAILER;
+#pragma pack(pop)
+
+typedef struct {
+    DISK_DEV out;
+    DISK_DEV hashes;            // sidecar, written alongside
+    WDX_INDEX_ENTRY* index;
+    ULONGLONG pos;
+    ULONGLONG hashPos;
+    ULONGLONG stored;
+    int level;
+    BYTE (*digests)[32];        // what the sidecar holds, for its tree
+    BYTE (*baseDigests)[32];    // per-chunk digests of the base image, NULL without --base
+    ULONGLONG baseChunks;
+    ULONGLONG inherited;
+    ULONGLONG changed;
+    SHA256_CTX imageHash;       // over the chunk digests, see image_digest()
+} WDX_WRITER;
+
+// The parent an overlay was made on, so a base image modified or replaced afterwards is caught on open instead of
+// silently supplying chunks that no longer match.
+#pragma pack(push, 1)
+typedef struct {
+    ULONGLONG fileSize;
+    ULONGLONG mtime;            // see file_stamp()
+    BYTE digest[32];            // SHA-256 over its chunk digests, see image_digest()
+} WDX_PARENT;
+#pragma pack(pop)
+
+typedef struct {
+    const char* path;           // recorded in the overlay as its parent
+    ULONGLONG chunkSize;
+    ULONGLONG imageSize;
+    BYTE (*digests)[32];        // per-chunk digests of the base
+    WDX_PARENT id;
+} WDX_BASE;
+
+// Deflates in into out. Returns WDX_CHUNK_DEFLATE, or WDX_CHUNK_RAW when the data does not shrink.
+static int deflate_chunk(const BYTE* in, size_t inLen, BYTE* out, size_t* outLen, int level) {
+    uLongf len = (uLongf)compressBound((uLong)inLen);
+    if (compress2(out, &len, in, (uLong)inLen, level) == Z_OK && len < inLen) {
+        *outLen = len;
+        return WDX_CHUNK_DEFLATE;
+    }
+    *outLen = inLen;
+    return WDX_CHUNK_RAW;
+}
+
+// uncompress(), timed into the compute histogram.
+static int inflate_chunk(BYTE* out, uLongf* outLen, const BYTE* in, uLong inLen) {
+    ULONGLONG start = iostat_clock();
+    int rc = uncompress(out, outLen, in, inLen);
+    lat_record(&g_iostat.compute, start, *outLen);
+    return rc;
+}
+
+static int wdx_encode(CHUNK_POOL* pool, CHUNK_SLOT* slot) {
+    WDX_WRITER* w = (WDX_WRITER*)pool->ctx;
+    chunk_digest(slot->in, slot->inLen, slot->digest);
+    slot->outLen = 0;
+    if (slot->inLen == 0 || is_zero_block(slot->digest, 32)) {
+        slot->type = WDX_CHUNK_ZERO;
+    } else if (slot->chunk < w->baseChunks && memcmp(slot->digest, w->baseDigests[slot->chunk], 32) == 0) {
+        slot->type = WDX_CHUNK_PARENT;
+    } else {
+        slot->type = deflate_chunk(slot->in, slot->inLen, slot->out, &slot->outLen, w->level);
+    }
+    return COPY_OK;
+}
+
+static int wdx_emit(CHUNK_POOL* pool, CHUNK_SLOT* slot) {
+    WDX_WRITER* w = (WDX_WRITER*)pool->ctx;
+    const BYTE* payload = slot->type == WDX_CHUNK_RAW ? slot->in : slot->out;
+    if (slot->outLen > 0 && dev_pwrite(&w->out, payload, slot->outLen, w->pos) != (long long)slot->outLen) {
+        return COPY_WRITE_ERROR;
+    }
+    if (dev_pwrite(&w->hashes, slot->digest, 32, w->hashPos) != 32) return COPY_WRITE_ERROR;
+    memcpy(w->digests[slot->chunk], slot->digest, 32);
+    sha256_update(&w->imageHash, slot->digest, 32);
+    w->index[slot->chunk].offset = w->pos;
+    w->index[slot->chunk].length = (DWORD)slot->outLen;
+    w->index[slot->chunk].type = (BYTE)slot->type;
+    w->pos += slot->outLen;
+    w->hashPos += 32;
+    w->stored += slot->outLen;
+    if (slot->type == WDX_CHUNK_PARENT) w->inherited++;
+    if (slot->outLen > 0) w->changed++;
+    return COPY_OK;
+}
+
+// Writes src as a WDX container, as an overlay on base when that is not NULL. Returns 0 on success.
+int wdx_create(const IMAGE_SRC* src, const char* outFile, const WDX_BASE* base) {
+    CHUNK_POOL pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.src = src;
+    pool.chunkSize = g_opts.blockSize ? g_opts.blockSize : WDX_CHUNK_SIZE;
+    pool.outSize = compressBound((uLong)pool.chunkSize);
+    pool.encode = wdx_encode;
+    pool.emit = wdx_emit;
+
+    WDX_WRITER w;
+    memset(&w, 0, sizeof(w));
+    w.level = g_opts.level ? g_opts.level : WDX_LEVEL;
+    sha256_init(&w.imageHash);
+    pool.ctx = &w;
+    size_t parentLength = 0;
+    if (base) {
+        pool.chunkSize = (size_t)base->chunkSize;        // chunks must line up to be inherited
+        pool.outSize = compressBound((uLong)pool.chunkSize);
+        w.baseDigests = base->digests;
+        w.baseChunks = (base->imageSize + base->chunkSize - 1) / base->chunkSize;
+        parentLength = strlen(base->path);
+    }
+
+    ULONGLONG chunks = (src->size + pool.chunkSize - 1) / pool.chunkSize;
+    w.index = (WDX_INDEX_ENTRY*)calloc((size_t)chunks + 1, sizeof(WDX_INDEX_ENTRY));
+    w.digests = (BYTE (*)[32])calloc((size_t)chunks + 1, 32);
+    if (!w.index || !w.digests) {
+        printf("Memory allocation failed\n");
+        free(w.index);
+        free(w.digests);
+        return 1;
+    }
+    char hashPath[600];
+    hash_sidecar_path(outFile, hashPath, sizeof(hashPath));
+    if (dev_open(&w.out, outFile, DEV_WRITE | DEV_CREATE)) {
+        printf("Failed to open output file %s. Error: %lu\n", outFile, dev_last_error());
+        free(w.index);
+        free(w.digests);
+        return 1;
+    }
+    if (dev_open(&w.hashes, hashPath, DEV_WRITE | DEV_CREATE)) {
+        printf("Failed to open hash sidecar %s. Error: %lu\n", hashPath, dev_last_error());
+        dev_close(&w.out);
+        free(w.index);
+        free(w.digests);
+        return 1;
+    }
+
+    WDX_HEADER header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, WDX_MAGIC, 8);
+    header.version = WDX_VERSION;
+    header.chunkSize = (DWORD)pool.chunkSize;
+    header.imageSize = src->size;
+    header.chunkCount = chunks;
+    header.parentLength = (DWORD)parentLength;
+    header.parentInfo = base ? sizeof(WDX_PARENT) : 0;
+    w.pos = sizeof(header) + parentLength + header.parentInfo;
+
+    HASH_HEADER hashHeader;
+    memset(&hashHeader, 0, sizeof(hashHeader));
+    memcpy(hashHeader.magic, HASH_MAGIC, 8);
+    hashHeader.version = HASH_VERSION;
+    hashHeader.chunkSize = (DWORD)pool.chunkSize;
+    hashHeader.imageSize = src->size;
+    hashHeader.chunkCount = chunks;
+    w.hashPos = sizeof(hashHeader);
+
+    int status = COPY_WRITE_ERROR;
+    if (dev_pwrite(&w.out, &header, sizeof(header), 0) == sizeof(header) &&
+        (parentLength == 0 || dev_pwrite(&w.out, base->path, parentLength, sizeof(header)) == (long long)parentLength) &&
+        (!base || dev_pwrite(&w.out, &base->id, sizeof(WDX_PARENT), sizeof(header) + parentLength) == sizeof(WDX_PARENT)) &&
+        dev_pwrite(&w.hashes, &hashHeader, sizeof(hashHeader), 0) == sizeof(hashHeader)) {
+        status = chunk_pool_run(&pool);
+    }
+    if (status == COPY_OK) {
+        WDX_TRAILER trailer;
+        memset(&trailer, 0, sizeof(trailer));
+        memcpy(trailer.magic, WDX_TRAILER_MAGIC, 8);
+        trailer.indexOffset = w.pos;
+        trailer.chunkCount = chunks;
+        size_t indexBytes = (size_t)chunks * sizeof(WDX_INDEX_ENTRY);
+        trailer.indexCrc = (DWORD)crc32(0L, (const Bytef*)w.index, (uInt)indexBytes);
+        if (dev_pwrite(&w.out, w.index, indexBytes, w.pos) != (long long)indexBytes ||
+            dev_pwrite(&w.out, &trailer, sizeof(trailer), w.pos + indexBytes) != sizeof(trailer)) {
+            status = COPY_WRITE_ERROR;
+            pool.failChunk = chunks;
+            pool.error = dev_last_error();
+        }
+    }
+    if (status == COPY_OK && hash_tree_append(&w.hashes, &hashHeader, (const BYTE (*)[32])w.digests)) {
+        printf("\nWarning: no Merkle tree in %s, diff will rebuild it", hashPath);
+    }
+    if (status == COPY_OK) {
+        printf("\nCompressed: %.2f MB stored for %.2f MB (%d threads)\n", w.stored / (1024.0 * 1024.0),
+               src->size / (1024.0 * 1024.0), worker_count());
+        if (base) {
+            printf("Overlay on %s: %llu chunks changed, %llu inherited\n", base->path, w.changed, w.inherited);
+        }
+        BYTE digest[32];
+        char hex[65];
+        sha256_final(&w.imageHash, digest);
+        hex_string(digest, 32, hex);
+        printf("SHA-256 (chunk list): %s  %s\n", hex, hashPath);
+    } else {
+        chunk_pool_report(&pool, status);
+    }
+
+    free(w.index);
+    free(w.digests);
+    dev_close(&w.hashes);
+    dev_close(&w.out);
+    if (status != COPY_OK) remove(hashPath);      // a sidecar must never describe an image that does not exist
+    else hash_sidecar_stamp(outFile);
+    return status == COPY_OK ? 0 : 1;
+}
+//================================================================================================================
+// Dedup store: a directory shared by many images in which every distinct chunk is stored once, named by its
+// SHA-256. An image is a manifest listing the digest of each chunk, so imaging a disk whose chunks the store
+// already holds writes little more than the manifest.
+//
+//   <store>/chunks/ab/abcdef...   chunk payload, deflated when that is smaller, raw otherwise
+//   manifest: DEDUP_HEADER | BYTE digest[chunkCount][32]    (all-zero digest = all-zero chunk, not stored)
+
+#define DEDUP_MAGIC      "WDDXMAN1"
+#define DEDUP_VERSION    1
+#define DEDUP_CHUNK_SIZE (1024 * 1024)
+
+#define DEDUP_CHUNK_ZERO  0
+#define DEDUP_CHUNK_KNOWN 1     // already in the store
+#define DEDUP_CHUNK_NEW   2     // added by this run
+
+#pragma pack(push, 1)
+typedef struct {
+    char magic[8];
+    DWORD version;
+    DWORD chunkSize;
+    ULONGLONG imageSize;
+    ULONGLONG chunkCount;
+    char store[256];            // store directory the chunks went to; --store on write overrides it
+    BYTE reserved[32];
+} DEDUP_HEADER;
+#pragma pack(pop)
+
+typedef struct {
+    const char* store;
+    DISK_DEV out;
+    ULONGLONG pos;
+    int level;
+    ULONGLONG newChunks, newBytes, knownChunks, zeroChunks;
+    SHA256_CTX imageHash;
+} DEDUP_WRITER;
+
+static int make_dir(const char* path) {
+#ifdef _WIN32
+    return CreateDirectoryA(path, NULL) || GetLastError() == ERROR_ALREADY_EXISTS ? 0 : 1;
+#else
+    return mkdir(path, 0777) == 0 || errno == EEXIST ? 0 : 1;
+#endif
+}
+
+static BOOL file_exists(const char* path) {
+#ifdef _WIN32
+    return GetFileAttributesA(path) != INVALID_FILE_ATTRIBUTES;
+#else
+    struct stat st;
+    return stat(path, &st) == 0;
+#endif
+}
+
+static void dedup_chunk_path(const char* store, const BYTE digest[32], char* path, size_t size) {
+    char hex[65];
+    hex_string(digest, 32, hex);
+    snprintf(path, size, "%s/chunks/%.2s/%s", store, hex, hex);
+}
+
+// Creates the store layout up front so workers never race on directory creation.
+static int dedup_store_init(const char* store) {
+    char path[600];
+    if (make_dir(store)) return 1;
+    snprintf(path, sizeof(path), "%s/chunks", store);
+    if (make_dir(path)) return 1;
+    for (int i = 0; i < 256; i++) {
+        snprintf(path, sizeof(path), "%s/chunks/%02x", store, i);
+        if (make_dir(path)) return 1;
+    }
+    return 0;
+}
+
+static int dedup_encode(CHUNK_POOL* pool, CHUNK_SLOT* slot) {
+    DEDUP_WRITER* w = (DEDUP_WRITER*)pool->ctx;
+    if (is_zero_block(slot->in, slot->inLen)) {
+        slot->type = DEDUP_CHUNK_ZERO;
+        memset(slot->digest, 0, sizeof(slot->digest));
+        return COPY_OK;
+    }
+    sha256(slot->in, slot->inLen, slot->digest);
+
+    char path[700], tmp[720];
+    dedup_chunk_path(w->store, slot->digest, path, sizeof(path));
+    if (file_exists(path)) {
+        slot->type = DEDUP_CHUNK_KNOWN;
+        return COPY_OK;
+    }
+
+    // Written under a private name and renamed into place, so a chunk file is either complete or absent even
+    // when two workers (or two imaging runs) store the same chunk at once. The name carries the process id and is
+    // created exclusively, so no other run can be writing the same temporary file; one left by a crashed run is
+    // stepped around.
+    int type = deflate_chunk(slot->in, slot->inLen, slot->out, &slot->outLen, w->level);
+    const BYTE* payload = type == WDX_CHUNK_RAW ? slot->in : slot->out;
+    DISK_DEV f;
+    for (int attempt = 0;; attempt++) {
+        snprintf(tmp, sizeof(tmp), "%s.%lu.%llu.%d.tmp", path, process_id(), slot->chunk, attempt);
+        if (dev_open(&f, tmp, DEV_WRITE | DEV_CREATE | DEV_EXCL) == 0) break;
+        if (attempt == 15) return COPY_WRITE_ERROR;
+    }
+    BOOL written = dev_pwrite(&f, payload, slot->outLen, 0) == (long long)slot->outLen;
+    dev_close(&f);
+    if (!written) {
+        remove(tmp);
+        return COPY_WRITE_ERROR;
+    }
+    if (rename(tmp, path) != 0) {
+        remove(tmp);
+        if (!file_exists(path)) return COPY_WRITE_ERROR;
+    }
+    slot->type = DEDUP_CHUNK_NEW;
+    return COPY_OK;
+}
+
+static int dedup_emit(CHUNK_POOL* pool, CHUNK_SLOT* slot) {
+    DEDUP_WRITER* w = (DEDUP_WRITER*)pool->ctx;
+    if (dev_pwrite(&w->out, slot->digest, 32, w->pos) != 32) return COPY_WRITE_ERROR;
+    sha256_update(&w->imageHash, slot->digest, 32);
+    w->pos += 32;
+    if (slot->type == DEDUP_CHUNK_NEW) {
+        w->newChunks++;
+        w->newBytes += slot->outLen;
+    } else if (slot->type == DEDUP_CHUNK_KNOWN) {
+        w->knownChunks++;
+    } else {
+        w->zeroChunks++;
+    }
+    return COPY_OK;
+}
+
+// Adds the chunks of src to the store and writes the manifest to outFile. Returns 0 on success.
+int dedup_create(const IMAGE_SRC* src, const char* store, const char* outFile) {
+    if (strlen(store) >= sizeof(((DEDUP_HEADER*)0)->store) || dedup_store_init(store)) {
+        printf("Cannot use %s as a chunk store. Error: %lu\n", store, dev_last_error());
+        return 1;
+    }
+
+    CHUNK_POOL pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.src = src;
+    pool.chunkSize = g_opts.blockSize ? g_opts.blockSize : DEDUP_CHUNK_SIZE;
+    pool.outSize = compressBound((uLong)pool.chunkSize);
+    pool.encode = dedup_encode;
+    pool.emit = dedup_emit;
+
+    DEDUP_WRITER w;
+    memset(&w, 0, sizeof(w));
+    w.store = store;
+    w.level = g_opts.level ? g_opts.level : WDX_LEVEL;
+    sha256_init(&w.imageHash);
+    pool.ctx = &w;
+    if (dev_open(&w.out, outFile, DEV_WRITE | DEV_CREATE)) {
+        printf("Failed to open output file %s. Error: %lu\n", outFile, dev_last_error());
+        return 1;
+    }
+
+    DEDUP_HEADER header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DEDUP_MAGIC, 8);
+    header.version = DEDUP_VERSION;
+    header.chunkSize = (DWORD)pool.chunkSize;
+    header.imageSize = src->size;
+    header.chunkCount = (src->size + pool.chunkSize - 1) / pool.chunkSize;
+    strcpy(header.store, store);
+    w.pos = sizeof(header);
+
+    int status = COPY_WRITE_ERROR;
+    if (dev_pwrite(&w.out, &header, sizeof(header), 0) == sizeof(header)) {
+        status = chunk_pool_run(&pool);
+    }
+    if (status == COPY_OK) {
+        printf("\nDedup: %llu new chunks (%.2f MB stored), %llu already in the store, %llu zero\n",
+               w.newChunks, w.newBytes / (1024.0 * 1024.0), w.knownChunks, w.zeroChunks);
+        BYTE digest[32];
+        char hex[65];
+        sha256_final(&w.imageHash, digest);
+        hex_string(digest, 32, hex);
+        printf("SHA-256 (chunk list): %s\n", hex);
+    } else {
+        chunk_pool_report(&pool, status);
+    }
+    dev_close(&w.out);
+    return status == COPY_OK ? 0 : 1;
+}
+//================================================================================================================
+// qcow2 output: the image as a QEMU copy-on-write v3 file that VMs and qemu-img use directly, without a convert
+// pass. Only clusters holding data are stored; unallocated ones read as zeros. Chunks arrive in order, so the L2
+// tables are filled one at a time and appended as soon as the next one starts, and the refcount table and blocks
+// (every cluster of the file is used exactly once) are laid out after the last one. The header goes in last.
+//
+//   header | L1 table | data clusters and L2 tables ... | refcount table | refcount blocks
+//
+// All qcow2 fields are big-endian.
+
+#define QCOW2_MAGIC         0x514649FBu     // "QFI\xfb"
+#define QCOW2_CLUSTER_BITS  16
+#define QCOW2_CLUSTER_SIZE  (1u << QCOW2_CLUSTER_BITS)
+#define QCOW2_CHUNK_SIZE    (1024 * 1024)   // clusters handled per chunk, also the sidecar chunk
+#define QCOW2_HEADER_LENGTH 104
+#define QCOW2_COPIED        (1ULL << 63)    // refcount is exactly one
+#define QCOW2_COMPRESSED    (1ULL << 62)
+#define QCOW2_ZERO          1ULL            // v3 L2 entry: cluster reads as zeros
+#define QCOW2_OFFSET_MASK   0x00FFFFFFFFFFFE00ULL
+
+static DWORD be32(const BYTE* p) { return ((DWORD)p[0] << 24) | ((DWORD)p[1] << 16) | ((DWORD)p[2] << 8) | p[3]; }
+static ULONGLONG be64(const BYTE* p) { return ((ULONGLONG)be32(p) << 32) | be32(p + 4); }
+static void put_be16(BYTE* p, WORD v) { p[0] = (BYTE)(v >> 8); p[1] = (BYTE)v; }
+static void put_be32(BYTE* p, DWORD v) { put_be16(p, (WORD)(v >> 16)); put_be16(p + 2, (WORD)v); }
+static void put_be64(BYTE* p, ULONGLONG v) { put_be32(p, (DWORD)(v >> 32)); put_be32(p + 4, (DWORD)v); }
+
+typedef struct {
+    DISK_DEV out;
+    ULONGLONG pos;              // end of the file, where the next cluster goes
+    BYTE* l1;                   // the L1 table as it will be written
+    DWORD l1Size;
+    ULONGLONG l1Offset;
+    BYTE* l2;                   // the L2 table being filled
+    LONGLONG l2Index;           // its L1 index, -1 before the first
+    BYTE (*digests)[32];        // per chunk, for the sidecar
+    ULONGLONG stored;           // data clusters written
+} QCOW2_WRITER;
+
+static int qcow2_encode(CHUNK_POOL* pool, CHUNK_SLOT* slot) {
+    (void)pool;
+    chunk_digest(slot->in, slot->inLen, slot->digest);
+    size_t padded = (slot->inLen + QCOW2_CLUSTER_SIZE - 1) / QCOW2_CLUSTER_SIZE * QCOW2_CLUSTER_SIZE;
+    memset(slot->in + slot->inLen, 0, padded - slot->inLen);      // the last cluster is stored whole
+    slot->type = 0;                                                 // bit i: cluster i of the chunk holds data
+    if (is_zero_block(slot->digest, 32)) return COPY_OK;
+    for (size_t i = 0; i * QCOW2_CLUSTER_SIZE < slot->inLen; i++) {
+        if (!is_zero_block(slot->in + i * QCOW2_CLUSTER_SIZE, QCOW2_CLUSTER_SIZE)) slot->type |= 1 << i;
+    }
+    return COPY_OK;
+}
+
+// Appends the L2 table being filled and points its L1 entry at it.
+static int qcow2_flush_l2(QCOW2_WRITER* w) {
+    if (w->l2Index < 0) return 0;
+    if (dev_pwrite(&w->out, w->l2, QCOW2_CLUSTER_SIZE, w->pos) != QCOW2_CLUSTER_SIZE) return 1;
+    put_be64(w->l1 + w->l2Index * 8, w->pos | QCOW2_COPIED);
+    w->pos += QCOW2_CLUSTER_SIZE;
+    w->l2Index = -1;
+    return 0;
+}
+
+static int qcow2_emit(CHUNK_POOL* pool, CHUNK_SLOT* slot) {
+    QCOW2_WRITER* w = (QCOW2_WRITER*)pool->ctx;
+    memcpy(w->digests[slot->chunk], slot->digest, 32);
+    if (slot->type == 0) return COPY_OK;
+
+    // A chunk never straddles two L2 tables: both are powers of two and the chunk is the smaller.
+    ULONGLONG first = slot->chunk * pool->chunkSize / QCOW2_CLUSTER_SIZE;
+    LONGLONG table = (LONGLONG)(first / (QCOW2_CLUSTER_SIZE / 8));
+    if (table != w->l2Index) {
+        if (qcow2_flush_l2(w)) return COPY_WRITE_ERROR;
+        memset(w->l2, 0, QCOW2_CLUSTER_SIZE);
+        w->l2Index = table;
+    }
+    size_t clusters = pool->chunkSize / QCOW2_CLUSTER_SIZE;
+    for (size_t i = 0; i < clusters;) {
+        if (!(slot->type & (1 << i))) {
+            i++;
+            continue;
+        }
+        size_t j = i;
+        while (j < clusters && (slot->type & (1 << j))) j++;       // one write per run of data clusters
+        size_t bytes = (j - i) * QCOW2_CLUSTER_SIZE;
+        if (dev_pwrite(&w->out, slot->in + i * QCOW2_CLUSTER_SIZE, bytes, w->pos) != (long long)bytes) {
+            return COPY_WRITE_ERROR;
+        }
+        for (; i < j; i++) {
+            ULONGLONG entry = (first + i) % (QCOW2_CLUSTER_SIZE / 8);
+            put_be64(w->l2 + entry * 8, w->pos | QCOW2_COPIED);
+            w->pos += QCOW2_CLUSTER_SIZE;
+            w->stored++;
+        }
+    }
+    return COPY_OK;
+}
+
+// Writes the last L2 table, the refcounts, the L1 table and finally the header of an image of size bytes.
+static int qcow2_finish(QCOW2_WRITER* w, ULONGLONG size) {
+    if (qcow2_flush_l2(w)) return 1;
+
+    // The refcount structures count themselves, so size them until they stop growing.
+    ULONGLONG perBlock = QCOW2_CLUSTER_SIZE / 2, used = w->pos / QCOW2_CLUSTER_SIZE, blocks = 0, tableClusters = 0;
+    for (;;) {
+        ULONGLONG total = used + blocks + tableClusters;
+        ULONGLONG b = (total + perBlock - 1) / perBlock, t = (b * 8 + QCOW2_CLUSTER_SIZE - 1) / QCOW2_CLUSTER_SIZE;
+        if (b == blocks && t == tableClusters) break;
+        blocks = b;
+        tableClusters = t;
+    }
+    ULONGLONG total = used + blocks + tableClusters;
+    ULONGLONG tableOffset = w->pos, blockOffset = tableOffset + tableClusters * QCOW2_CLUSTER_SIZE;
+    size_t tableBytes = (size_t)tableClusters * QCOW2_CLUSTER_SIZE;
+    BYTE* buf = (BYTE*)calloc(1, tableBytes > QCOW2_CLUSTER_SIZE ? tableBytes : QCOW2_CLUSTER_SIZE);
+    if (!buf) return 1;
+    int rc = 0;
+    for (ULONGLONG k = 0; k < blocks; k++) put_be64(buf + k * 8, blockOffset + k * QCOW2_CLUSTER_SIZE);
+    if (dev_pwrite(&w->out, buf, tableBytes, tableOffset) != (long long)tableBytes) rc = 1;
+    for (ULONGLONG k = 0; rc == 0 && k < blocks; k++) {
+        for (ULONGLONG e = 0; e < perBlock; e++) put_be16(buf + e * 2, k * perBlock + e < total ? 1 : 0);
+        if (dev_pwrite(&w->out, buf, QCOW2_CLUSTER_SIZE, blockOffset + k * QCOW2_CLUSTER_SIZE) != QCOW2_CLUSTER_SIZE) {
+            rc = 1;
+        }
+    }
+    free(buf);
+    w->pos = blockOffset + blocks * QCOW2_CLUSTER_SIZE;
+    if (rc || dev_pwrite(&w->out, w->l1, (size_t)w->l1Size * 8, w->l1Offset) != (long long)w->l1Size * 8) return 1;
+
+    BYTE header[QCOW2_HEADER_LENGTH + 8];
+    memset(header, 0, sizeof(header));                          // no backing file, encryption or snapshots
+    put_be32(header, QCOW2_MAGIC);
+    put_be32(header + 4, 3);
+    put_be32(header + 20, QCOW2_CLUSTER_BITS);
+    put_be64(header + 24, size);
+    put_be32(header + 36, w->l1Size);
+    put_be64(header + 40, w->l1Offset);
+    put_be64(header + 48, tableOffset);
+    put_be32(header + 56, (DWORD)tableClusters);
+    put_be32(header + 96, 4);                                   // 16-bit refcounts
+    put_be32(header + 100, QCOW2_HEADER_LENGTH);                // followed by the end-of-extensions marker
+    return dev_pwrite(&w->out, header, sizeof(header), 0) == sizeof(header) && dev_flush(&w->out) == 0 ? 0 : 1;
+}
+
+// Writes src as a qcow2 image. Returns 0 on success.
+int qcow2_create(const IMAGE_SRC* src, const char* outFile) {
+    CHUNK_POOL pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.src = src;
+    pool.chunkSize = QCOW2_CHUNK_SIZE;
+    pool.encode = qcow2_encode;
+    pool.emit = qcow2_emit;
+
+    QCOW2_WRITER w;
+    memset(&w, 0, sizeof(w));
+    pool.ctx = &w;
+    ULONGLONG tableSpan = (ULONGLONG)QCOW2_CLUSTER_SIZE * (QCOW2_CLUSTER_SIZE / 8);   // bytes one L2 table maps
+    ULONGLONG l1Size = (src->size + tableSpan - 1) / tableSpan;
+    ULONGLONG chunks = (src->size + pool.chunkSize - 1) / pool.chunkSize;
+    w.l1Size = (DWORD)(l1Size ? l1Size : 1);
+    w.l1Offset = QCOW2_CLUSTER_SIZE;
+    w.pos = w.l1Offset + ((ULONGLONG)w.l1Size * 8 + QCOW2_CLUSTER_SIZE - 1) / QCOW2_CLUSTER_SIZE * QCOW2_CLUSTER_SIZE;
+    w.l2Index = -1;
+    w.l1 = (BYTE*)calloc(w.l1Size, 8);
+    w.l2 = (BYTE*)malloc(QCOW2_CLUSTER_SIZE);
+    w.digests = (BYTE (*)[32])calloc((size_t)chunks + 1, 32);
+    if (!w.l1 || !w.l2 || !w.digests) {
+        printf("Memory allocation failed\n");
+        free(w.l1);
+        free(w.l2);
+        free(w.digests);
+        return 1;
+    }
+    if (dev_open(&w.out, outFile, DEV_WRITE | DEV_CREATE)) {
+        printf("Failed to open output file %s. Error: %lu\n", outFile, dev_last_error());
+        free(w.l1);
+        free(w.l2);
+        free(w.digests);
+        return 1;
+    }
+
+    int status = chunk_pool_run(&pool);
+    if (status == COPY_OK && qcow2_finish(&w, src->size)) {
+        status = COPY_WRITE_ERROR;
+        pool.failChunk = chunks;
+        pool.error = dev_last_error();
+    }
+    if (status == COPY_OK) {
+        printf("\nqcow2: %.2f MB of data clusters stored for %.2f MB (%.2f MB file, %d threads)\n",
+               w.stored * (double)QCOW2_CLUSTER_SIZE / (1024.0 * 1024.0), src->size / (1024.0 * 1024.0),
+               w.pos / (1024.0 * 1024.0), worker_count());
+    } else {
+        chunk_pool_report(&pool, status);
+    }
+    dev_close(&w.out);
+
+    if (status == COPY_OK) {
+        char hex[65], path[600];
+        image_digest((const BYTE (*)[32])w.digests, chunks, hex);
+        hash_sidecar_path(outFile, path, sizeof(path));
+        if (hash_sidecar_write(outFile, src->size, pool.chunkSize, (const BYTE (*)[32])w.digests)) {
+            printf("Warning: failed to write %s. Error: %lu\n", path, dev_last_error());
+        }
+        printf("SHA-256 (chunk list): %s  %s\n", hex, path);
+    }
+    free(w.l1);
+    free(w.l2);
+    free(w.digests);
+    return status == COPY_OK ? 0 : 1;
+}
+//================================================================================================================
+// VHD and VHDX output: dynamic virtual disks for Hyper-V, Azure staging and VirtualBox, without a convertfromraw
+// pass. Both map the disk in 2 MB blocks through a block allocation table (BAT); blocks that are all zeros are not
+// stored. The BAT is sized from the disk size, so its space is reserved ahead of the data, the blocks are appended
+// in order as they are encoded and the table is written once they are all down.
+//
+//   VHD:  footer copy | dynamic header | BAT | [sector bitmap | block] ... | footer      (big-endian)
+//   VHDX: file identifier | 2 headers | 2 region tables | log | metadata | BAT | block ...   (little-endian)
+
+#define VHD_BLOCK_SIZE      (2 * 1024 * 1024)
+#define VHD_DATA_ALIGN      4096
+#define VHD_MAX_SIZE        (2040ULL * 1024 * 1024 * 1024)
+#define VHD_TIME_BASE       946684800       // 2000-01-01 00:00:00 UTC, the epoch of VHD timestamps
+
+#define VHDX_ALIGN          (1024 * 1024)   // log, metadata, BAT and payload blocks are 1 MB aligned
+#define VHDX_HEADER_OFFSET  (64 * 1024)
+#define VHDX_REGION_OFFSET  (192 * 1024)
+#define VHDX_LOG_OFFSET     (1 * VHDX_ALIGN)
+#define VHDX_META_OFFSET    (2 * VHDX_ALIGN)
+#define VHDX_BAT_OFFSET     (3 * VHDX_ALIGN)
+#define VHDX_META_ITEMS     (64 * 1024)     // metadata items follow the 64 KB metadata table
+#define VHDX_FULLY_PRESENT  6
+
+// The VHDX region and metadata item GUIDs from the specification, in their on-disk byte order.
+static const BYTE VHDX_BAT_GUID[16] = { 0x66, 0x77, 0xC2, 0x2D, 0x23, 0xF6, 0x00, 0x42, 0x9D, 0x64, 0x11, 0x5E, 0x9B, 0xFD, 0x4A, 0x08 };
+static const BYTE VHDX_META_GUID[16] = { 0x06, 0xA2, 0x7C, 0x8B, 0x90, 0x47, 0x9A, 0x4B, 0xB8, 0xFE, 0x57, 0x5F, 0x05, 0x0F, 0x88, 0x6E };
+static const BYTE VHDX_FILE_PARAMS_GUID[16] = { 0x37, 0x67, 0xA1, 0xCA, 0x36, 0xFA, 0x43, 0x4D, 0xB3, 0xB6, 0x33, 0xF0, 0xAA, 0x44, 0xE7, 0x6B };
+static const BYTE VHDX_DISK_SIZE_GUID[16] = { 0x24, 0x42, 0xA5, 0x2F, 0x1B, 0xCD, 0x76, 0x48, 0xB2, 0x11, 0x5D, 0xBE, 0xD8, 0x3B, 0xF4, 0xB8 };
+static const BYTE VHDX_DISK_ID_GUID[16] = { 0xAB, 0x12, 0xCA, 0xBE, 0xE6, 0xB2, 0x23, 0x45, 0x93, 0xEF, 0xC3, 0x09, 0xE0, 0x00, 0xC7, 0x46 };
+static const BYTE VHDX_LOGICAL_SECTOR_GUID[16] = { 0x1D, 0xBF, 0x41, 0x81, 0x6F, 0xA9, 0x09, 0x47, 0xBA, 0x47, 0xF2, 0x33, 0xA8, 0xFA, 0xAB, 0x5F };
+static const BYTE VHDX_PHYSICAL_SECTOR_GUID[16] = { 0xC7, 0x48, 0xA3, 0xCD, 0x5D, 0x44, 0x71, 0x44, 0x9C, 0xC9, 0xE9, 0x88, 0x52, 0x51, 0xC5, 0x56 };
+
+#pragma pack(push, 1)
+typedef struct {
+    char signature[4];          // "head"
+    DWORD checksum;             // CRC-32C of the 4 KB header with this field zero
+    ULONGLONG sequenceNumber;   // the valid header with the higher number is current
+    BYTE fileWriteGuid[16];
+    BYTE dataWriteGuid[16];
+    BYTE logGuid[16];           // zero: the log is empty
+    WORD logVersion;
+    WORD version;
+    DWORD logLength;
+    ULONGLONG logOffset;
+    BYTE reserved[4016];
+} VHDX_HEADER;
+
+typedef struct {
+    BYTE guid[16];
+    ULONGLONG fileOffset;
+    DWORD length;
+    DWORD required;
+} VHDX_REGION_ENTRY;
+
+typedef struct {
+    BYTE guid[16];
+    DWORD offset;               // from the start of the metadata region
+    DWORD length;
+    DWORD flags;                // bit 1: describes the virtual disk, bit 2: required
+    DWORD reserved;
+} VHDX_META_ENTRY;
+#pragma pack(pop)
+
+typedef struct {
+    DISK_DEV out;
+    BOOL vhdx;
+    ULONGLONG pos;              // where the next block goes
+    BYTE* bat;
+    size_t batBytes;
+    ULONGLONG batOffset;
+    ULONGLONG chunkRatio;       // VHDX: payload blocks per sector bitmap entry in the BAT
+    BYTE footer[SECTOR_SIZE];   // VHD: written at the start and again at the end
+    BYTE (*digests)[32];
+    ULONGLONG stored;           // blocks written
+} VHD_WRITER;
+
+// CRC-32C (Castagnoli), the checksum of VHDX headers and region tables.
+static DWORD crc32c(const BYTE* p, size_t len) {
+    DWORD crc = 0xFFFFFFFFu;
+    while (len--) {
+        crc ^= *p++;
+        for (int k = 0; k < 8; k++) crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1)));
+    }
+    return ~crc;
+}
+
+// A version 4 GUID for a new virtual disk; unique enough when mixed from the clock, the file name and the size.
+static void new_guid(BYTE guid[16], const char* name, ULONGLONG size, int n) {
+    struct {
+        time_t now;
+        clock_t ticks;
+        ULONGLONG size;
+        int n;
+        const void* stack;
+        char name[256];
+    } seed;
+    BYTE digest[32];
+    memset(&seed, 0, sizeof(seed));
+    seed.now = time(NULL);
+    seed.ticks = clock();
+    seed.size = size;
+    seed.n = n;
+    seed.stack = &seed;
+    snprintf(seed.name, sizeof(seed.name), "%s", name);
+    sha256(&seed, sizeof(seed), digest);
+    memcpy(guid, digest, 16);
+    guid[7] = (BYTE)((guid[7] & 0x0F) | 0x40);
+    guid[8] = (BYTE)((guid[8] & 0x3F) | 0x80);
+}
+
+// The CHS geometry VHD footers carry, computed as in the VHD specification.
+static DWORD vhd_geometry(ULONGLONG size) {
+    ULONGLONG total = size / SECTOR_SIZE;
+    DWORD spt, heads, cylTimesHeads;
+    if (total > 65535ULL * 16 * 255) total = 65535ULL * 16 * 255;
+    if (total >= 65535ULL * 16 * 63) {
+        spt = 255;
+        heads = 16;
+        cylTimesHeads = (DWORD)(total / spt);
+    } else {
+        spt = 17;
+        cylTimesHeads = (DWORD)(total / spt);
+        heads = (cylTimesHeads + 1023) / 1024;
+        if (heads < 4) heads = 4;
+        if (cylTimesHeads >= heads * 1024 || heads > 16) {
+            spt = 31;
+            heads = 16;
+            cylTimesHeads = (DWORD)(total / spt);
+        }
+        if (cylTimesHeads >= heads * 1024) {
+            spt = 63;
+            heads = 16;
+            cylTimesHeads = (DWORD)(total / spt);
+        }
+    }
+    return ((cylTimesHeads / heads) << 16) | (heads << 8) | spt;
+}
+
+// Fills the 512-byte VHD footer of a dynamic disk of size bytes.
+static void vhd_footer(BYTE footer[SECTOR_SIZE], ULONGLONG size, const BYTE guid[16]) {
+    memset(footer, 0, SECTOR_SIZE);
+    memcpy(footer, "conectix", 8);
+    put_be32(footer + 8, 2);                            // features: reserved bit, always set
+    put_be32(footer + 12, 0x00010000);                  // format version 1.0
+    put_be64(footer + 16, SECTOR_SIZE);                 // dynamic header offset
+    put_be32(footer + 24, (DWORD)(time(NULL) - VHD_TIME_BASE));
+    memcpy(footer + 28, "wddx", 4);
+    put_be32(footer + 32, 0x00010000);
+    memcpy(footer + 36, "Wi2k", 4);
+    put_be64(footer + 40, size);
+    put_be64(footer + 48, size);
+    put_be32(footer + 56, vhd_geometry(size));
+    put_be32(footer + 60, 3);                           // dynamic disk
+    memcpy(footer + 68, guid, 16);
+    DWORD sum = 0;
+    for (int i = 0; i < SECTOR_SIZE; i++) sum += footer[i];
+    put_be32(footer + 64, ~sum);
+}
+
+// Writes everything ahead of the BAT. The structures depend only on the disk size.
+static int vhd_write_headers(VHD_WRITER* w, ULONGLONG size, ULONGLONG blocks, const char* outFile) {
+    BYTE guid[16];
+    new_guid(guid, outFile, size, 0);
+    if (!w->vhdx) {
+        BYTE header[1024];
+        vhd_footer(w->footer, size, guid);
+        memset(header, 0, sizeof(header));
+        memcpy(header, "cxsparse", 8);
+        put_be64(header + 8, ~0ULL);
+        put_be64(header + 16, w->batOffset);
+        put_be32(header + 24, 0x00010000);
+        put_be32(header + 28, (DWORD)blocks);
+        put_be32(header + 32, VHD_BLOCK_SIZE);
+        DWORD sum = 0;
+        for (size_t i = 0; i < sizeof(header); i++) sum += header[i];
+        put_be32(header + 36, ~sum);
+        return dev_pwrite(&w->out, w->footer, SECTOR_SIZE, 0) == SECTOR_SIZE &&
+               dev_pwrite(&w->out, header, sizeof(header), SECTOR_SIZE) == sizeof(header) ? 0 : 1;
+    }
+
+    BYTE* buf = (BYTE*)calloc(1, VHDX_ALIGN);
+    if (!buf) return 1;
+    int rc = 0;
+
+    // File identifier: signature and the creator in UTF-16.
+    memcpy(buf, "vhdxfile", 8);
+    for (int i = 0; "wddx32"[i]; i++) buf[8 + i * 2] = (BYTE)"wddx32"[i];
+
+    // Two copies of the header, the second one current.
+    for (int copy = 0; copy < 2; copy++) {
+        VHDX_HEADER* h = (VHDX_HEADER*)(buf + VHDX_HEADER_OFFSET * (copy + 1));
+        memcpy(h->signature, "head", 4);
+        h->sequenceNumber = copy + 1;
+        new_guid(h->fileWriteGuid, outFile, size, 1);
+        new_guid(h->dataWriteGuid, outFile, size, 2);
+        h->version = 1;
+        h->logLength = VHDX_ALIGN;
+        h->logOffset = VHDX_LOG_OFFSET;
+        h->checksum = crc32c((const BYTE*)h, sizeof(*h));
+    }
+
+    // Two copies of the region table: where the BAT and the metadata are.
+    for (int copy = 0; copy < 2; copy++) {
+        BYTE* t = buf + VHDX_REGION_OFFSET + copy * 64 * 1024;
+        VHDX_REGION_ENTRY* e = (VHDX_REGION_ENTRY*)(t + 16);
+        memcpy(t, "regi", 4);
+        *(DWORD*)(t + 8) = 2;
+        memcpy(e[0].guid, VHDX_BAT_GUID, 16);
+        e[0].fileOffset = w->batOffset;
+        e[0].length = (DWORD)w->batBytes;
+        e[0].required = 1;
+        memcpy(e[1].guid, VHDX_META_GUID, 16);
+        e[1].fileOffset = VHDX_META_OFFSET;
+        e[1].length = VHDX_ALIGN;
+        e[1].required = 1;
+        *(DWORD*)(t + 4) = crc32c(t, 64 * 1024);
+    }
+    if (dev_pwrite(&w->out, buf, VHDX_ALIGN, 0) != VHDX_ALIGN) rc = 1;
+
+    // Metadata: block size, disk size, disk id and sector sizes. The log stays empty and is never written.
+    static const struct { const BYTE* guid; DWORD length; DWORD flags; } items[] = {
+        { VHDX_FILE_PARAMS_GUID, 8, 4 }, { VHDX_DISK_SIZE_GUID, 8, 6 }, { VHDX_DISK_ID_GUID, 16, 6 },
+        { VHDX_LOGICAL_SECTOR_GUID, 4, 6 }, { VHDX_PHYSICAL_SECTOR_GUID, 4, 6 },
+    };
+    memset(buf, 0, VHDX_ALIGN);
+    memcpy(buf, "metadata", 8);
+    *(WORD*)(buf + 10) = (WORD)(sizeof(items) / sizeof(items[0]));
+    VHDX_META_ENTRY* m = (VHDX_META_ENTRY*)(buf + 32);
+    DWORD at = VHDX_META_ITEMS;
+    for (size_t i = 0; i < sizeof(items) / sizeof(items[0]); i++) {
+        memcpy(m[i].guid, items[i].guid, 16);
+        m[i].offset = at;
+        m[i].length = items[i].length;
+        m[i].flags = items[i].flags;
+        at += items[i].length;
+    }
+    BYTE* item = buf + VHDX_META_ITEMS;
+    *(DWORD*)item = VHD_BLOCK_SIZE;                     // no parent, blocks need not stay allocated
+    *(ULONGLONG*)(item + 8) = size;
+    memcpy(item + 16, guid, 16);
+    *(DWORD*)(item + 32) = SECTOR_SIZE;
+    *(DWORD*)(item + 36) = DIRECT_ALIGN;
+    if (rc == 0 && dev_pwrite(&w->out, buf, VHDX_ALIGN, VHDX_META_OFFSET) != VHDX_ALIGN) rc = 1;
+    free(buf);
+    return rc;
+}
+
+static int vhd_encode(CHUNK_POOL* pool, CHUNK_SLOT* slot) {
+    chunk_digest(slot->in, slot->inLen, slot->digest);
+    memset(slot->in + slot->inLen, 0, pool->chunkSize - slot->inLen);     // blocks are always stored whole
+    slot->type = !is_zero_block(slot->digest, 32);
+    return COPY_OK;
+}
+
+static int vhd_emit(CHUNK_POOL* pool, CHUNK_SLOT* slot) {
+    VHD_WRITER* w = (VHD_WRITER*)pool->ctx;
+    memcpy(w->digests[slot->chunk], slot->digest, 32);
+    if (!slot->type) return COPY_OK;
+    if (w->vhdx) {
+        ULONGLONG entry = slot->chunk + slot->chunk / w->chunkRatio;  // skips the sector bitmap entries
+        if (dev_pwrite(&w->out, slot->in, pool->chunkSize, w->pos) != (long long)pool->chunkSize) {
+            return COPY_WRITE_ERROR;
+        }
+        ((ULONGLONG*)w->bat)[entry] = w->pos | VHDX_FULLY_PRESENT;
+        w->pos += pool->chunkSize;
+    } else {
+        // Every sector of a stored block is present, so its sector bitmap is all ones.
+        BYTE bitmap[SECTOR_SIZE];
+        memset(bitmap, 0xFF, sizeof(bitmap));
+        if (dev_pwrite(&w->out, bitmap, SECTOR_SIZE, w->pos) != SECTOR_SIZE ||
+            dev_pwrite(&w->out, slot->in, pool->chunkSize, w->pos + SECTOR_SIZE) != (long long)pool->chunkSize) {
+            return COPY_WRITE_ERROR;
+        }
+        put_be32(w->bat + slot->chunk * 4, (DWORD)(w->pos / SECTOR_SIZE));
+        w->pos += SECTOR_SIZE + pool->chunkSize;
+    }
+    w->stored++;
+    return COPY_OK;
+}
+
+// Writes src as a dynamic VHD, or a VHDX when vhdx is set. Returns 0 on success.
+int vhd_create(const IMAGE_SRC* src, const char* outFile, BOOL vhdx) {
+    // Virtual disks are whole sectors; a partial last sector reads as zeros.
+    ULONGLONG size = (src->size + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+    if (!vhdx && size > VHD_MAX_SIZE) {
+        printf("VHD is limited to 2040 GB, use --format vhdx for this disk\n");
+        return 1;
+    }
+    CHUNK_POOL pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.src = src;
+    pool.chunkSize = VHD_BLOCK_SIZE;
+    pool.encode = vhd_encode;
+    pool.emit = vhd_emit;
+
+    VHD_WRITER w;
+    memset(&w, 0, sizeof(w));
+    pool.ctx = &w;
+    w.vhdx = vhdx;
+    ULONGLONG blocks = (size + VHD_BLOCK_SIZE - 1) / VHD_BLOCK_SIZE;
+    ULONGLONG chunks = (src->size + pool.chunkSize - 1) / pool.chunkSize;
+    if (vhdx) {
+        w.chunkRatio = (1ULL << 23) * SECTOR_SIZE / VHD_BLOCK_SIZE;
+        ULONGLONG entries = blocks + (blocks ? (blocks - 1) / w.chunkRatio : 0);
+        w.batOffset = VHDX_BAT_OFFSET;
+        w.batBytes = (size_t)((entries * 8 + VHDX_ALIGN - 1) / VHDX_ALIGN * VHDX_ALIGN);
+        w.pos = w.batOffset + w.batBytes;
+        w.bat = (BYTE*)calloc(1, w.batBytes);
+    } else {
+        w.batOffset = 3 * SECTOR_SIZE;
+        w.batBytes = (size_t)((blocks * 4 + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE);
+        w.pos = (w.batOffset + w.batBytes + VHD_DATA_ALIGN - 1) / VHD_DATA_ALIGN * VHD_DATA_ALIGN;
+        w.bat = (BYTE*)malloc(w.batBytes);
+        if (w.bat) memset(w.bat, 0xFF, w.batBytes);                    // 0xFFFFFFFF: block not stored
+    }
+    w.digests = (BYTE (*)[32])calloc((size_t)chunks + 1, 32);
+    if (!w.bat || !w.digests) {
+        printf("Memory allocation failed\n");
+        free(w.bat);
+        free(w.digests);
+        return 1;
+    }
+    if (dev_open(&w.out, outFile, DEV_WRITE | DEV_CREATE)) {
+        printf("Failed to open output file %s. Error: %lu\n", outFile, dev_last_error());
+        free(w.bat);
+        free(w.digests);
+        return 1;
+    }
+
+    int status = COPY_WRITE_ERROR;
+    if (vhd_write_headers(&w, size, blocks, outFile) == 0) status = chunk_pool_run(&pool);
+    if (status == COPY_OK) {
+        if ((!vhdx && dev_pwrite(&w.out, w.footer, SECTOR_SIZE, w.pos) != SECTOR_SIZE) ||
+            dev_pwrite(&w.out, w.bat, w.batBytes, w.batOffset) != (long long)w.batBytes ||
+            dev_flush(&w.out)) {
+            status = COPY_WRITE_ERROR;
+            pool.failChunk = chunks;
+            pool.error = dev_last_error();
+        }
+        if (!vhdx) w.pos += SECTOR_SIZE;
+    }
+    if (status == COPY_OK) {
+        printf("\n%s: %llu of %llu blocks stored, %.2f MB file for %.2f MB (%d threads)\n", vhdx ? "VHDX" : "VHD",
+               w.stored, blocks, w.pos / (1024.0 * 1024.0), size / (1024.0 * 1024.0), worker_count());
+    } else {
+        chunk_pool_report(&pool, status);
+    }
+    dev_close(&w.out);
+
+    if (status == COPY_OK) {
+        char hex[65], path[600];
+        image_digest((const BYTE (*)[32])w.digests, chunks, hex);
+        hash_sidecar_path(outFile, path, sizeof(path));
+        if (hash_sidecar_write(outFile, src->size, pool.chunkSize, (const BYTE (*)[32])w.digests)) {
+            printf("Warning: failed to write %s. Error: %lu\n", path, dev_last_error());
+        }
+        printf("SHA-256 (chunk list): %s  %s\n", hex, path);
+    }
+    free(w.bat);
+    free(w.digests);
+    return status == COPY_OK ? 0 : 1;
+}
+//================================================================================================================
+// streamOptimized VMDK output for ESXi, vSphere and VirtualBox import. The format is built for streaming: every
+// stored grain (64 KB) is deflated behind a marker naming its LBA, grain tables follow the grains they map, and
+// the grain directory and a footer copy of the header come last, so the file is written strictly front to back.
+// Empty grains are not stored; grains are compressed in parallel by the chunk pool workers. The output is still a
+// file rather than a pipe, since progress and messages go to stdout. Grain tables hold 32-bit sector numbers, so
+// a file that would grow past 2 TiB is refused.
+//
+//   header | descriptor | [grain marker | zlib data] ... [GT marker | GT] ... | GD marker | GD | footer | EOS
+//
+// All fields are little-endian; offsets and sizes in the header and markers are in sectors.
+
+#define VMDK_MAGIC          0x564D444Bu     // "KDMV"
+#define VMDK_GRAIN_SIZE     (64 * 1024)
+#define VMDK_GT_ENTRIES     512             // grains per grain table, 32 MB
+#define VMDK_CHUNK_SIZE     (1024 * 1024)   // grains compressed per chunk, also the sidecar chunk
+#define VMDK_DESC_OFFSET    1
+#define VMDK_DESC_SECTORS   20
+#define VMDK_OVERHEAD       128             // sectors ahead of the first grain
+#define VMDK_MAX_SECTOR     0xFFFFFFFFULL   // grain tables and the directory hold 32-bit sector numbers
+#define VMDK_GD_AT_END      0xFFFFFFFFFFFFFFFFULL
+#define VMDK_MARKER_EOS     0
+#define VMDK_MARKER_GT      1
+#define VMDK_MARKER_GD      2
+#define VMDK_MARKER_FOOTER  3
+#define VMDK_GRAIN_HEADER   12              // lba and compressed size ahead of the data
+
+#pragma pack(push, 1)
+typedef struct {
+    DWORD magic;
+    DWORD version;
+    DWORD flags;
+    ULONGLONG capacity;
+    ULONGLONG grainSize;
+    ULONGLONG descriptorOffset;
+    ULONGLONG descriptorSize;
+    DWORD numGTEsPerGT;
+    ULONGLONG rgdOffset;
+    ULONGLONG gdOffset;
+    ULONGLONG overHead;
+    BYTE uncleanShutdown;
+    char singleEndLineChar;
+    char nonEndLineChar;
+    char doubleEndLineChar1;
+    char doubleEndLineChar2;
+    WORD compressAlgorithm;
+    BYTE pad[433];
+} VMDK_HEADER;
+
+typedef struct {
+    ULONGLONG value;            // grain: its LBA; metadata: sectors that follow
+    DWORD size;                 // grain: compressed bytes; metadata: 0
+    DWORD type;                 // metadata: VMDK_MARKER_*
+    BYTE pad[496];
+} VMDK_MARKER;
+#pragma pack(pop)
+
+typedef struct {
+    DISK_DEV out;
+    ULONGLONG pos;              // bytes written so far
+    DWORD* gd;                  // sector of each grain table, 0 where none was written
+    ULONGLONG gdEntries;
+    DWORD gt[VMDK_GT_ENTRIES];  // the grain table being filled
+    LONGLONG gtIndex;           // its GD index, -1 before the first
+    int level;
+    BYTE (*digests)[32];
+    ULONGLONG stored;           // grains written
+    ULONGLONG compressed;       // bytes of grain data written
+    BOOL tooLarge;              // the file would have grown past what a grain table can address
+} VMDK_WRITER;
+
+// Whether bytes more can be appended with every sector still addressable by a grain table or the directory.
+static BOOL vmdk_fits(VMDK_WRITER* w, size_t bytes) {
+    if ((w->pos + bytes) / SECTOR_SIZE <= VMDK_MAX_SECTOR) return TRUE;
+    w->tooLarge = TRUE;
+    return FALSE;
+}
+
+static size_t vmdk_grain_bound(void) {
+    return (VMDK_GRAIN_HEADER + compressBound(VMDK_GRAIN_SIZE) + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+}
+
+// Deflates every grain of the chunk that holds data into slot->out, each behind its grain marker and padded to a
+// sector, ready to be appended as is.
+static int vmdk_encode(CHUNK_POOL* pool, CHUNK_SLOT* slot) {
+    VMDK_WRITER* w = (VMDK_WRITER*)pool->ctx;
+    chunk_digest(slot->in, slot->inLen, slot->digest);
+    slot->outLen = 0;
+    if (is_zero_block(slot->digest, 32)) return COPY_OK;
+    memset(slot->in + slot->inLen, 0, pool->chunkSize - slot->inLen);     // grains are always stored whole
+    for (size_t at = 0; at < slot->inLen; at += VMDK_GRAIN_SIZE) {
+        if (is_zero_block(slot->in + at, VMDK_GRAIN_SIZE)) continue;
+        BYTE* marker = slot->out + slot->outLen;
+        uLongf len = (uLongf)compressBound(VMDK_GRAIN_SIZE);
+        if (compress2(marker + VMDK_GRAIN_HEADER, &len, slot->in + at, VMDK_GRAIN_SIZE, w->level) != Z_OK) {
+            return COPY_NO_MEMORY;
+        }
+        *(ULONGLONG*)marker = (slot->chunk * pool->chunkSize + at) / SECTOR_SIZE;
+        *(DWORD*)(marker + 8) = (DWORD)len;
+        size_t padded = (VMDK_GRAIN_HEADER + len + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+        memset(marker + VMDK_GRAIN_HEADER + len, 0, padded - VMDK_GRAIN_HEADER - len);
+        slot->outLen += padded;
+    }
+    return COPY_OK;
+}
+
+// Appends a metadata marker and its table.
+static int vmdk_write_table(VMDK_WRITER* w, DWORD type, const void* table, size_t bytes) {
+    VMDK_MARKER marker;
+    memset(&marker, 0, sizeof(marker));
+    marker.value = (bytes + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    marker.type = type;
+    size_t padded = (size_t)marker.value * SECTOR_SIZE;
+    BYTE* buf = (BYTE*)calloc(1, padded + sizeof(marker));
+    if (!buf) return 1;
+    memcpy(buf, &marker, sizeof(marker));
+    memcpy(buf + sizeof(marker), table, bytes);
+    int rc = dev_pwrite(&w->out, buf, padded + sizeof(marker), w->pos) == (long long)(padded + sizeof(marker)) ? 0 : 1;
+    free(buf);
+    w->pos += padded + sizeof(marker);
+    return rc;
+}
+
+// Appends the grain table being filled and records it in the grain directory.
+static int vmdk_flush_gt(VMDK_WRITER* w) {
+    if (w->gtIndex < 0) return 0;
+    if (!vmdk_fits(w, sizeof(VMDK_MARKER) + sizeof(w->gt))) return 1;
+    w->gd[w->gtIndex] = (DWORD)(w->pos / SECTOR_SIZE + 1);
+    w->gtIndex = -1;
+    return vmdk_write_table(w, VMDK_MARKER_GT, w->gt, sizeof(w->gt));
+}
+
+static int vmdk_emit(CHUNK_POOL* pool, CHUNK_SLOT* slot) {
+    VMDK_WRITER* w = (VMDK_WRITER*)pool->ctx;
+    memcpy(w->digests[slot->chunk], slot->digest, 32);
+    if (slot->outLen == 0) return COPY_OK;
+
+    // A chunk never straddles two grain tables: both are powers of two and the chunk is the smaller.
+    LONGLONG table = (LONGLONG)(slot->chunk * pool->chunkSize / VMDK_GRAIN_SIZE / VMDK_GT_ENTRIES);
+    if (table != w->gtIndex) {
+        if (vmdk_flush_gt(w)) return COPY_WRITE_ERROR;
+        memset(w->gt, 0, sizeof(w->gt));
+        w->gtIndex = table;
+    }
+    if (!vmdk_fits(w, slot->outLen)) return COPY_WRITE_ERROR;
+    if (dev_pwrite(&w->out, slot->out, slot->outLen, w->pos) != (long long)slot->outLen) return COPY_WRITE_ERROR;
+    for (size_t at = 0; at < slot->outLen;) {
+        const BYTE* marker = slot->out + at;
+        ULONGLONG grain = *(const ULONGLONG*)marker * SECTOR_SIZE / VMDK_GRAIN_SIZE;
+        DWORD len = *(const DWORD*)(marker + 8);
+        w->gt[grain % VMDK_GT_ENTRIES] = (DWORD)((w->pos + at) / SECTOR_SIZE);
+        at += (VMDK_GRAIN_HEADER + len + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+        w->compressed += len;
+        w->stored++;
+    }
+    w->pos += slot->outLen;
+    return COPY_OK;
+}
+
+static void vmdk_header(VMDK_HEADER* h, ULONGLONG capacity, ULONGLONG gdOffset) {
+    memset(h, 0, sizeof(*h));
+    h->magic = VMDK_MAGIC;
+    h->version = 3;
+    h->flags = 1 | (1 << 16) | (1 << 17);       // newline test valid, compressed grains, markers
+    h->capacity = capacity;
+    h->grainSize = VMDK_GRAIN_SIZE / SECTOR_SIZE;
+    h->descriptorOffset = VMDK_DESC_OFFSET;
+    h->descriptorSize = VMDK_DESC_SECTORS;
+    h->numGTEsPerGT = VMDK_GT_ENTRIES;
+    h->gdOffset = gdOffset;
+    h->overHead = VMDK_OVERHEAD;
+    h->singleEndLineChar = '\n';
+    h->nonEndLineChar = ' ';
+    h->doubleEndLineChar1 = '\r';
+    h->doubleEndLineChar2 = '\n';
+    h->compressAlgorithm = 1;                   // deflate
+}
+
+// Writes the header and the text descriptor that name the disk.
+static int vmdk_write_start(VMDK_WRITER* w, ULONGLONG capacity, const char* outFile) {
+    BYTE* buf = (BYTE*)calloc(1, VMDK_OVERHEAD * SECTOR_SIZE);
+    if (!buf) return 1;
+    vmdk_header((VMDK_HEADER*)buf, capacity, VMDK_GD_AT_END);
+
+    BYTE id[16];
+    new_guid(id, outFile, capacity, 0);
+    const char* name = strrchr(outFile, '/');
+#ifdef _WIN32
+    const char* bslash = strrchr(outFile, '\\');
+    if (bslash > name) name = bslash;
+#endif
+    name = name ? name + 1 : outFile;
+    ULONGLONG cylinders = capacity / (255 * 63);
+    snprintf((char*)buf + VMDK_DESC_OFFSET * SECTOR_SIZE, VMDK_DESC_SECTORS * SECTOR_SIZE,
+             "# Disk DescriptorFile\nversion=1\nCID=%08lx\nparentCID=ffffffff\ncreateType=\"streamOptimized\"\n\n"
+             "# Extent description\nRW %llu SPARSE \"%s\"\n\n"
+             "# The Disk Data Base\n#DDB\n\nddb.virtualHWVersion = \"4\"\nddb.adapterType = \"lsilogic\"\n"
+             "ddb.geometry.cylinders = \"%llu\"\nddb.geometry.heads = \"255\"\nddb.geometry.sectors = \"63\"\n",
+             (unsigned long)(*(DWORD*)id), capacity, name, cylinders > 65535 ? 65535ULL : cylinders);
+    int rc = dev_pwrite(&w->out, buf, VMDK_OVERHEAD * SECTOR_SIZE, 0) == VMDK_OVERHEAD * SECTOR_SIZE ? 0 : 1;
+    w->pos = VMDK_OVERHEAD * SECTOR_SIZE;
+    free(buf);
+    return rc;
+}
+
+// Writes the last grain table, the grain directory, the footer and the end-of-stream marker.
+static int vmdk_finish(VMDK_WRITER* w, ULONGLONG capacity) {
+    if (vmdk_flush_gt(w)) return 1;
+    ULONGLONG gdOffset = w->pos / SECTOR_SIZE + 1;
+    if (vmdk_write_table(w, VMDK_MARKER_GD, w->gd, (size_t)w->gdEntries * 4)) return 1;
+
+    VMDK_HEADER footer;
+    vmdk_header(&footer, capacity, gdOffset);
+    if (vmdk_write_table(w, VMDK_MARKER_FOOTER, &footer, sizeof(footer))) return 1;
+    VMDK_MARKER eos;
+    memset(&eos, 0, sizeof(eos));
+    eos.type = VMDK_MARKER_EOS;
+    if (dev_pwrite(&w->out, &eos, sizeof(eos), w->pos) != sizeof(eos)) return 1;
+    w->pos += sizeof(eos);
+    return dev_flush(&w->out) ? 1 : 0;
+}
+
+// Writes src as a streamOptimized VMDK. Returns 0 on success.
+int vmdk_create(const IMAGE_SRC* src, const char* outFile) {
+    CHUNK_POOL pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.src = src;
+    pool.chunkSize = VMDK_CHUNK_SIZE;
+    pool.outSize = VMDK_CHUNK_SIZE / VMDK_GRAIN_SIZE * vmdk_grain_bound();
+    pool.encode = vmdk_encode;
+    pool.emit = vmdk_emit;
+
+    VMDK_WRITER w;
+    memset(&w, 0, sizeof(w));
+    pool.ctx = &w;
+    w.level = g_opts.level ? g_opts.level : WDX_LEVEL;
+    w.gtIndex = -1;
+    ULONGLONG capacity = (src->size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    ULONGLONG grains = (capacity * SECTOR_SIZE + VMDK_GRAIN_SIZE - 1) / VMDK_GRAIN_SIZE;
+    ULONGLONG chunks = (src->size + pool.chunkSize - 1) / pool.chunkSize;
+    w.gdEntries = (grains + VMDK_GT_ENTRIES - 1) / VMDK_GT_ENTRIES;
+    w.gd = (DWORD*)calloc((size_t)w.gdEntries + 1, 4);
+    w.digests = (BYTE (*)[32])calloc((size_t)chunks + 1, 32);
+    if (!w.gd || !w.digests) {
+        printf("Memory allocation failed\n");
+        free(w.gd);
+        free(w.digests);
+        return 1;
+    }
+    if (dev_open(&w.out, outFile, DEV_WRITE | DEV_CREATE)) {
+        printf("Failed to open output file %s. Error: %lu\n", outFile, dev_last_error());
+        free(w.gd);
+        free(w.digests);
+        return 1;
+    }
+
+    int status = COPY_WRITE_ERROR;
+    if (vmdk_write_start(&w, capacity, outFile) == 0) status = chunk_pool_run(&pool);
+    if (status == COPY_OK && vmdk_finish(&w, capacity)) {
+        status = COPY_WRITE_ERROR;
+        pool.failChunk = chunks;
+        pool.error = dev_last_error();
+    }
+    if (w.tooLarge) {
+        printf("\nVMDK grain tables address the file in 32-bit sectors: it cannot grow past 2 TiB. "
+               "Use --format vhdx or qcow2 for this disk\n");
+    } else if (status == COPY_OK) {
+        printf("\nVMDK: %llu of %llu grains stored, %.2f MB file for %.2f MB (%d threads)\n", w.stored, grains,
+               w.pos / (1024.0 * 1024.0), src->size / (1024.0 * 1024.0), worker_count());
+    } else {
+        chunk_pool_report(&pool, status);
+    }
+    dev_close(&w.out);
+
+    if (status == COPY_OK) {
+        char hex[65], path[600];
+        image_digest((const BYTE (*)[32])w.digests, chunks, hex);
+        hash_sidecar_path(outFile, path, sizeof(path));
+        if (hash_sidecar_write(outFile, src->size, pool.chunkSize, (const BYTE (*)[32])w.digests)) {
+            printf("Warning: failed to write %s. Error: %lu\n", path, dev_last_error());
+        }
+        printf("SHA-256 (chunk list): %s  %s\n", hex, path);
+    }
+    free(w.gd);
+    free(w.digests);
+    return status == COPY_OK ? 0 : 1;
+}
+//================================================================================================================
+// Image input.
+// write accepts raw images and every container create produces; IMAGE_IN gives random access to the logical
+// disk contents regardless of format.
+
+typedef struct IMAGE_IN {
+    DISK_DEV dev;
+    int format;                 // FORMAT_*
+    ULONGLONG size;             // logical image size
+    ULONGLONG chunkSize;        // chunked formats
+    BYTE* cache;                // last decompressed chunk
+    BYTE* payload;
+    ULONGLONG cachedChunk;
+
+    // FORMAT_WDX
+    WDX_INDEX_ENTRY* index;
+    struct IMAGE_IN* parent;    // overlays: the image WDX_CHUNK_PARENT chunks are read from
+
+    // FORMAT_DEDUP
+    BYTE (*digests)[32];
+    char store[512];
+
+    // FORMAT_QCOW2
+    ULONGLONG** l2;             // L2 tables per L1 entry in host byte order, NULL where none is allocated
+    ULONGLONG l1Size;
+    int clusterBits;
+} IMAGE_IN;
+
+static size_t image_chunk_len(const IMAGE_IN* img, ULONGLONG c) {
+    ULONGLONG left = img->size - c * img->chunkSize;
+    return (size_t)(left < img->chunkSize ? left : img->chunkSize);
+}
+
+// The L2 entry of guest cluster n of a qcow2 image, 0 when it is unallocated.
+static ULONGLONG qcow2_entry(const IMAGE_IN* img, ULONGLONG n) {
+    ULONGLONG perTable = (1ULL << img->clusterBits) / 8;
+    ULONGLONG table = n / perTable;
+    return table < img->l1Size && img->l2[table] ? img->l2[table][n % perTable] : 0;
+}
+
+static BOOL qcow2_entry_is_zero(ULONGLONG entry) {
+    return entry == 0 || (!(entry & QCOW2_COMPRESSED) && (entry & QCOW2_ZERO));
+}
+
+static BOOL image_chunk_is_zero(const IMAGE_IN* img, ULONGLONG c) {
+    static const BYTE zeroDigest[32];
+    if (img->format == FORMAT_RAW) return FALSE;
+    if (img->format == FORMAT_QCOW2) {
+        ULONGLONG first = (c * img->chunkSize) >> img->clusterBits;
+        ULONGLONG last = (c * img->chunkSize + image_chunk_len(img, c) - 1) >> img->clusterBits;
+        for (ULONGLONG n = first; n <= last; n++) {
+            if (!qcow2_entry_is_zero(qcow2_entry(img, n))) return FALSE;
+        }
+        return TRUE;
+    }
+    if (img->format == FORMAT_WDX) {
+        if (img->index[c].type == WDX_CHUNK_PARENT) return image_chunk_is_zero(img->parent, c);
+        return img->index[c].type == WDX_CHUNK_ZERO;
+    }
+    return memcmp(img->digests[c], zeroDigest, 32) == 0;
+}
+
+// Reads the clusters of chunk c of a qcow2 image into out. Only allocated clusters are read; compressed ones are
+// inflated through payload.
+static int qcow2_load_chunk(IMAGE_IN* img, ULONGLONG c, BYTE* out, BYTE* payload) {
+    size_t clusterSize = (size_t)1 << img->clusterBits, chunkLen = image_chunk_len(img, c);
+    ULONGLONG first = (c * img->chunkSize) >> img->clusterBits;
+    for (size_t at = 0; at < chunkLen; at += clusterSize) {
+        ULONGLONG entry = qcow2_entry(img, first + at / clusterSize);
+        size_t len = chunkLen - at < clusterSize ? chunkLen - at : clusterSize;
+        if (qcow2_entry_is_zero(entry)) {
+            memset(out + at, 0, len);
+        } else if (!(entry & QCOW2_COMPRESSED)) {
+            ULONGLONG offset = entry & QCOW2_OFFSET_MASK;
+            if (dev_pread(&img->dev, out + at, len, offset) != (long long)len) return 1;
+        } else {
+            // Compressed: a raw deflate stream of whole sectors, the first one possibly shared.
+            int shift = 62 - (img->clusterBits - 8);
+            ULONGLONG offset = entry & ((1ULL << shift) - 1);
+            ULONGLONG end = (offset & ~(ULONGLONG)(SECTOR_SIZE - 1)) +
+                            (((entry & ~QCOW2_COPIED & ~QCOW2_COMPRESSED) >> shift) + 1) * SECTOR_SIZE;
+            if (end > img->dev.size) end = img->dev.size;
+            if (end <= offset || end - offset > compressBound((uLong)img->chunkSize) ||
+                dev_pread(&img->dev, payload, (size_t)(end - offset), offset) != (long long)(end - offset)) {
+                return 1;
+            }
+            z_stream zs;
+            memset(&zs, 0, sizeof(zs));
+            if (inflateInit2(&zs, -12) != Z_OK) return 1;
+            zs.next_in = payload;
+            zs.avail_in = (uInt)(end - offset);
+            zs.next_out = out + at;
+            zs.avail_out = (uInt)clusterSize;
+            ULONGLONG start = iostat_clock();
+            int zr = inflate(&zs, Z_FINISH);
+            lat_record(&g_iostat.compute, start, clusterSize);
+            inflateEnd(&zs);
+            if ((zr != Z_STREAM_END && zr != Z_BUF_ERROR) || zs.avail_out != 0) {
+                printf("\nDamaged compressed cluster in chunk %llu\n", c);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Decodes chunk c into out (chunkSize bytes) using payload (compressBound(chunkSize) bytes) as scratch.
+static int image_load_chunk(IMAGE_IN* img, ULONGLONG c, BYTE* out, BYTE* payload) {
+    size_t chunkLen = image_chunk_len(img, c);
+    if (image_chunk_is_zero(img, c)) {
+        memset(out, 0, chunkLen);
+        return 0;
+    }
+
+    uLongf outLen = (uLongf)chunkLen;
+    if (img->format == FORMAT_QCOW2) return qcow2_load_chunk(img, c, out, payload);
+    if (img->format == FORMAT_WDX) {
+        const WDX_INDEX_ENTRY* e = &img->index[c];
+        if (e->type == WDX_CHUNK_PARENT) {
+            IMAGE_IN* parent = img->parent;
+            if (parent->format != FORMAT_RAW) return image_load_chunk(parent, c, out, payload);
+            return dev_pread(&parent->dev, out, chunkLen, c * img->chunkSize) == (long long)chunkLen ? 0 : 1;
+        }
+        if (e->type == WDX_CHUNK_RAW) {
+            return dev_pread(&img->dev, out, chunkLen, e->offset) == (long long)chunkLen ? 0 : 1;
+        }
+        if (e->length > compressBound((uLong)img->chunkSize)) return 1;
+        if (dev_pread(&img->dev, payload, e->length, e->offset) != (long long)e->length) return 1;
+        return inflate_chunk(out, &outLen, payload, e->length) == Z_OK && outLen == chunkLen ? 0 : 1;
+    }
+
+    char path[700];
+    dedup_chunk_path(img->store, img->digests[c], path, sizeof(path));
+    DISK_DEV f;
+    if (dev_open(&f, path, DEV_READ)) {
+        printf("\nChunk %llu missing from the store: %s\n", c, path);
+        return 1;
+    }
+    int rc = 1;
+    if (f.size == chunkLen) {
+        rc = dev_pread(&f, out, chunkLen, 0) == (long long)chunkLen ? 0 : 1;
+    } else if (f.size < chunkLen && dev_pread(&f, payload, (size_t)f.size, 0) == (long long)f.size) {
+        rc = inflate_chunk(out, &outLen, payload, (uLong)f.size) == Z_OK && outLen == chunkLen ? 0 : 1;
+    }
+    dev_close(&f);
+
+    // The name is the content's hash, so a damaged chunk file cannot go unnoticed.
+    BYTE digest[32];
+    if (rc == 0) {
+        sha256(out, chunkLen, digest);
+        if (memcmp(digest, img->digests[c], 32) != 0) {
+            printf("\nChunk %llu is damaged in the store: %s\n", c, path);
+            rc = 1;
+        }
+    }
+    return rc;
+}
+
+static int image_alloc_cache(IMAGE_IN* img) {
+    img->cache = (BYTE*)malloc((size_t)img->chunkSize);
+    img->payload = (BYTE*)malloc(compressBound((uLong)img->chunkSize));
+    img->cachedChunk = (ULONGLONG)-1;
+    return img->cache && img->payload ? 0 : 1;
+}
+
+static int image_open_chain(IMAGE_IN* img, const char* path, int depth);
+
+// Checks that parent is still the image id describes. The file stamp settles it when it is unchanged; a copied or
+// touched file is accepted when its chunk digests, from a current sidecar or a dedup manifest, still match.
+// Returns 0 when it is, 1 when it changed or cannot be shown to be the same.
+static int wdx_check_parent(const IMAGE_IN* parent, const char* path, ULONGLONG chunkSize, const WDX_PARENT* id) {
+    ULONGLONG size, mtime;
+    if (file_stamp(path, &size, &mtime) || size != id->fileSize) return 1;
+    if (mtime == id->mtime) return 0;
+
+    ULONGLONG chunks = (parent->size + chunkSize - 1) / chunkSize;
+    BYTE (*digests)[32] = NULL;
+    BYTE digest[32];
+    if (parent->format == FORMAT_DEDUP) {
+        sha256(parent->digests, (size_t)chunks * 32, digest);
+    } else if (hash_sidecar_current(path) && hash_sidecar_load(path, parent->size, &chunkSize, &digests) == 0) {
+        sha256(digests, (size_t)chunks * 32, digest);
+        free(digests);
+    } else {
+        return 1;
+    }
+    return memcmp(digest, id->digest, 32) != 0;
+}
+
+// Opens the parent of an overlay. A relative parent path is looked up next to the overlay first.
+static int wdx_open_parent(IMAGE_IN* img, const char* path, const WDX_HEADER* header, int depth) {
+    char parentPath[600], resolved[1200];
+    if (header->parentLength == 0 || header->parentLength >= sizeof(parentPath) ||
+        dev_pread(&img->dev, parentPath, header->parentLength, sizeof(WDX_HEADER)) != (long long)header->parentLength) {
+        printf("Damaged WDX overlay (bad parent reference)\n");
+        return 1;
+    }
+    parentPath[header->parentLength] = '\0';
+    if (depth >= WDX_MAX_CHAIN) {
+        printf("Overlay chain deeper than %d images at %s\n", WDX_MAX_CHAIN, parentPath);
+        return 1;
+    }
+
+    const char* slash = strrchr(path, '/');
+#ifdef _WIN32
+    const char* bslash = strrchr(path, '\\');
+    if (bslash > slash) slash = bslash;
+#endif
+    BOOL absolute = parentPath[0] == '/' || parentPath[0] == '\\' || (parentPath[0] && parentPath[1] == ':');
+    snprintf(resolved, sizeof(resolved), "%.*s%s", slash ? (int)(slash - path + 1) : 0, path, parentPath);
+    if (absolute || !slash || !file_exists(resolved)) snprintf(resolved, sizeof(resolved), "%s", parentPath);
+
+    img->parent = (IMAGE_IN*)calloc(1, sizeof(IMAGE_IN));
+    if (!img->parent || image_open_chain(img->parent, resolved, depth + 1)) {
+        printf("Cannot open parent image %s of %s\n", resolved, path);
+        return 1;
+    }
+    if (img->parent->format != FORMAT_RAW && img->parent->chunkSize != img->chunkSize) {
+        printf("Parent image %s uses %llu-byte chunks, %s uses %llu\n", resolved, img->parent->chunkSize, path,
+               img->chunkSize);
+        return 1;
+    }
+    if (header->parentInfo == 0) {
+        printf("Warning: %s does not record which %s it was made on, the parent is not checked\n", path, parentPath);
+        return 0;
+    }
+    WDX_PARENT id;
+    if (header->parentInfo != sizeof(id) ||
+        dev_pread(&img->dev, &id, sizeof(id), sizeof(WDX_HEADER) + header->parentLength) != sizeof(id)) {
+        printf("Damaged WDX overlay (bad parent reference)\n");
+        return 1;
+    }
+    if (wdx_check_parent(img->parent, resolved, img->chunkSize, &id)) {
+        printf("Parent image %s has changed since overlay %s was made on it\n", resolved, path);
+        return 1;
+    }
+    return 0;
+}
+
+static int wdx_open(IMAGE_IN* img, const char* path, int depth) {
+    WDX_HEADER header;
+    WDX_TRAILER trailer;
+    if (dev_pread(&img->dev, &header, sizeof(header), 0) != sizeof(header) ||
+        img->dev.size < sizeof(WDX_HEADER) + sizeof(WDX_TRAILER) ||
+        dev_pread(&img->dev, &trailer, sizeof(trailer), img->dev.size - sizeof(trailer)) != sizeof(trailer) ||
+        memcmp(trailer.magic, WDX_TRAILER_MAGIC, 8) != 0 || trailer.chunkCount != header.chunkCount ||
+        header.chunkSize == 0 || header.chunkSize > (1u << 30)) {
+        printf("Damaged WDX container (no valid trailer)\n");
+        return 1;
+    }
+    size_t indexBytes = (size_t)trailer.chunkCount * sizeof(WDX_INDEX_ENTRY);
+    img->size = header.imageSize;
+    img->chunkSize = header.chunkSize;
+    img->index = (WDX_INDEX_ENTRY*)malloc(indexBytes + 1);
+    if (!img->index || image_alloc_cache(img) ||
+        dev_pread(&img->dev, img->index, indexBytes, trailer.indexOffset) != (long long)indexBytes) {
+        return 1;
+    }
+    if ((DWORD)crc32(0L, (const Bytef*)img->index, (uInt)indexBytes) != trailer.indexCrc) {
+        printf("Damaged WDX container (index checksum mismatch)\n");
+        return 1;
+    }
+    return header.parentLength ? wdx_open_parent(img, path, &header, depth) : 0;
+}
+
+static int dedup_open(IMAGE_IN* img) {
+    DEDUP_HEADER header;
+    if (dev_pread(&img->dev, &header, sizeof(header), 0) != sizeof(header) ||
+        header.chunkSize == 0 || header.chunkSize > (1u << 30) ||
+        header.chunkCount != (header.imageSize + header.chunkSize - 1) / header.chunkSize ||
+        img->dev.size != sizeof(header) + header.chunkCount * 32) {
+        printf("Damaged dedup manifest\n");
+        return 1;
+    }
+    header.store[sizeof(header.store) - 1] = '\0';
+    snprintf(img->store, sizeof(img->store), "%s", g_opts.store ? g_opts.store : header.store);
+    img->size = header.imageSize;
+    img->chunkSize = header.chunkSize;
+    size_t digestBytes = (size_t)header.chunkCount * 32;
+    img->digests = (BYTE (*)[32])malloc(digestBytes + 1);
+    if (!img->digests || image_alloc_cache(img) ||
+        dev_pread(&img->dev, img->digests, digestBytes, sizeof(header)) != (long long)digestBytes) {
+        return 1;
+    }
+    printf("Manifest: %llu chunks from store %s\n", header.chunkCount, img->store);
+    return 0;
+}
+
+// Opens a qcow2 image. Every L2 table is loaded here, so restore workers look clusters up without locking.
+static int qcow2_open(IMAGE_IN* img) {
+    BYTE header[QCOW2_HEADER_LENGTH];
+    memset(header, 0, sizeof(header));
+    if (img->dev.size < 72 || dev_pread(&img->dev, header, 72, 0) != 72 || be32(header + 4) < 2 ||
+        be32(header + 4) > 3 || (be32(header + 4) == 3 && dev_pread(&img->dev, header, sizeof(header), 0) !=
+                                 sizeof(header))) {
+        printf("Damaged qcow2 image (bad header)\n");
+        return 1;
+    }
+    img->clusterBits = (int)be32(header + 20);
+    img->size = be64(header + 24);
+    img->l1Size = be32(header + 36);
+    ULONGLONG l1Offset = be64(header + 40);
+    if (img->clusterBits < 9 || img->clusterBits > 21 || img->size == 0) {
+        printf("Damaged qcow2 image (bad geometry)\n");
+        return 1;
+    }
+    if (be64(header + 8) != 0) {
+        printf("qcow2 images with a backing file are not supported, run qemu-img convert first\n");
+        return 1;
+    }
+    if (be32(header + 32) != 0 || (be64(header + 72) & ~1ULL) != 0) {  // only the dirty bit is harmless here
+        printf("qcow2 image uses encryption or features that are not supported\n");
+        return 1;
+    }
+    ULONGLONG clusterSize = 1ULL << img->clusterBits, perTable = clusterSize / 8;
+    ULONGLONG clusters = (img->size + clusterSize - 1) / clusterSize;
+    if (img->l1Size < (clusters + perTable - 1) / perTable || img->l1Size > (1u << 25) ||
+        l1Offset + img->l1Size * 8 > img->dev.size) {
+        printf("Damaged qcow2 image (bad L1 table)\n");
+        return 1;
+    }
+    img->chunkSize = clusterSize > QCOW2_CHUNK_SIZE ? clusterSize : QCOW2_CHUNK_SIZE;
+    BYTE* l1 = (BYTE*)malloc((size_t)img->l1Size * 8);
+    BYTE* table = (BYTE*)malloc((size_t)clusterSize);
+    img->l2 = (ULONGLONG**)calloc((size_t)img->l1Size, sizeof(ULONGLONG*));
+    int rc = !l1 || !table || !img->l2 || image_alloc_cache(img) ||
+             dev_pread(&img->dev, l1, (size_t)img->l1Size * 8, l1Offset) != (long long)img->l1Size * 8;
+    for (ULONGLONG i = 0; rc == 0 && i < img->l1Size; i++) {
+        ULONGLONG offset = be64(l1 + i * 8) & QCOW2_OFFSET_MASK;
+        if (offset == 0) continue;
+        img->l2[i] = (ULONGLONG*)malloc((size_t)clusterSize);
+        if (!img->l2[i] || dev_pread(&img->dev, table, (size_t)clusterSize, offset) != (long long)clusterSize) {
+            printf("Damaged qcow2 image (unreadable L2 table %llu)\n", i);
+            rc = 1;
+            break;
+        }
+        for (ULONGLONG e = 0; e < perTable; e++) img->l2[i][e] = be64(table + e * 8);
+    }
+    free(l1);
+    free(table);
+    return rc;
+}
+
+void image_close(IMAGE_IN* img) {
+    if (img->parent) {
+        image_close(img->parent);
+        free(img->parent);
+    }
+    for (ULONGLONG i = 0; img->l2 && i < img->l1Size; i++) free(img->l2[i]);
+    free(img->l2);
+    free(img->index);
+    free(img->digests);
+    free(img->cache);
+    free(img->payload);
+    dev_close(&img->dev);
+    memset(img, 0, sizeof(*img));
+}
+
+static int image_open_chain(IMAGE_IN* img, const char* path, int depth) {
+    memset(img, 0, sizeof(*img));
+    if (dev_open(&img->dev, path, DEV_READ | DEV_DIRECT)) return 1;
+    img->size = img->dev.size;
+    img->format = FORMAT_RAW;
+
+    char magic[8];
+    if (img->dev.size >= sizeof(magic) && dev_pread(&img->dev, magic, sizeof(magic), 0) == sizeof(magic)) {
+        int rc = 0;
+        if (memcmp(magic, WDX_MAGIC, 8) == 0) {
+            img->format = FORMAT_WDX;
+            rc = wdx_open(img, path, depth);
+        } else if (memcmp(magic, DEDUP_MAGIC, 8) == 0) {
+            img->format = FORMAT_DEDUP;
+            rc = dedup_open(img);
+        } else if (be32((const BYTE*)magic) == QCOW2_MAGIC) {
+            img->format = FORMAT_QCOW2;
+            rc = qcow2_open(img);
+        } else if (memcmp(magic, "conectix", 8) == 0 || memcmp(magic, "vhdxfile", 8) == 0 ||
+                   *(const DWORD*)magic == VMDK_MAGIC) {
+            // Written by create but not read back: restoring the container bytes would wreck the target.
+            printf("%s is a VHD/VHDX/VMDK; convert it to raw or qcow2 before writing it to a disk\n", path);
+            rc = 1;
+        }
+        if (rc) {
+            image_close(img);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Opens an image of any supported format, including the whole parent chain of an overlay. Returns 0 on success.
+int image_open(IMAGE_IN* img, const char* path) {
+    return image_open_chain(img, path, 0);
+}
+
+// Reads len bytes of the logical image at offset. Bytes past the end of the image read as zeros.
+// Returns the number of bytes read or -1.
+long long image_pread(IMAGE_IN* img, void* buf, size_t len, ULONGLONG offset) {
+    if (img->format == FORMAT_RAW) return dev_pread(&img->dev, buf, len, offset);
+
+    if (offset >= img->size) return 0;
+    if (offset + len > img->size) len = (size_t)(img->size - offset);
+    size_t done = 0;
+    while (done < len) {
+        ULONGLONG pos = offset + done;
+        ULONGLONG c = pos / img->chunkSize;
+        size_t in = (size_t)(pos % img->chunkSize);
+        size_t n = (size_t)img->chunkSize - in;
+        if (n > len - done) n = len - done;
+        if (c != img->cachedChunk) {
+            img->cachedChunk = (ULONGLONG)-1;
+            if (image_load_chunk(img, c, img->cache, img->payload)) return -1;
+            img->cachedChunk = c;
+        }
+        memcpy((BYTE*)buf + done, img->cache + in, n);
+        done += n;
+    }
+    return (long long)done;
+}
+
+typedef struct {
+    IMAGE_IN* img;
+    DISK_DEV* dst;
+    ULONGLONG first, last;      // chunk range [first, last)
+    ULONGLONG offset, length;   // image range being restored
+    ULONGLONG next;
+    BOOL sparse;
+    BOOL compare;
+    BOOL quiet;
+    HASHER* hasher;
+    ULONGLONG bytesDone;
+    ULONGLONG bytesSkipped;
+    int status;
+    unsigned long error;
+    ULONGLONG failOffset;
+    WD_MUTEX lock;
+} RESTORE_POOL;
+
+static void* image_restorer(void* arg) {
+    RESTORE_POOL* pool = (RESTORE_POOL*)arg;
+    IMAGE_IN* img = pool->img;
+    size_t chunkSize = (size_t)img->chunkSize;
+    BYTE* data = (BYTE*)alloc_aligned(chunkSize);
+    BYTE* payload = (BYTE*)malloc(compressBound((uLong)chunkSize));
+    BYTE* old = pool->compare ? (BYTE*)alloc_aligned(chunkSize) : NULL;
+    BOOL ready = data && payload && (old || !pool->compare);
+
+    for (;;) {
+        mutex_lock(&pool->lock);
+        if (pool->status != COPY_OK || pool->next >= pool->last || !ready) {
+            if (!ready && pool->status == COPY_OK) pool->status = COPY_NO_MEMORY;
+            mutex_unlock(&pool->lock);
+            break;
+        }
+        ULONGLONG c = pool->next++;
+        mutex_unlock(&pool->lock);
+
+        // Clip the chunk to the restored range.
+        ULONGLONG a = c * chunkSize, b = a + chunkSize;
+        if (b > img->size) b = img->size;
+        if (a < pool->offset) a = pool->offset;
+        if (b > pool->offset + pool->length) b = pool->offset + pool->length;
+
+        int status = COPY_OK;
+        unsigned long error = 0;
+        ULONGLONG skipped = 0;
+        const BYTE* at = data + (a - c * chunkSize);
+        size_t len = (size_t)(b - a);
+        stage_add(STAGE_READ, 1);
+        BOOL hole = image_chunk_is_zero(img, c) && pool->sparse && dev_make_hole(pool->dst, a, b - a) == 0;
+        BOOL loaded = !hole && image_load_chunk(img, c, data, payload) == 0;
+        stage_add(STAGE_READ, -1);
+        stage_add(STAGE_WRITE, 1);
+        if (hole) {
+            hasher_zero(pool->hasher, a, b - a);
+        } else if (!loaded) {
+            status = COPY_READ_ERROR;
+            error = dev_last_error();
+        } else if (pool->compare) {
+            long long had = dev_pread(pool->dst, old, len, a);      // unreadable bytes count as changed
+            if (write_changed(pool->dst, a, at, old, had > 0 ? (size_t)had : 0, len, &skipped)) {
+                status = COPY_WRITE_ERROR;
+                error = dev_last_error();
+            } else {
+                hasher_add(pool->hasher, at, len, a);
+            }
+        } else if (dev_pwrite(pool->dst, at, len, a) != (long long)len) {
+            status = COPY_WRITE_ERROR;
+            error = dev_last_error();
+        } else {
+            hasher_add(pool->hasher, at, len, a);
+        }
+        stage_add(STAGE_WRITE, -1);
+        progress_add(b - a);
+
+        mutex_lock(&pool->lock);
+        if (status != COPY_OK && pool->status == COPY_OK) {
+            pool->status = status;
+            pool->error = error;
+            pool->failOffset = a;
+        }
+        pool->bytesDone += b - a;
+        pool->bytesSkipped += skipped;
+        if (!pool->quiet && progress_due()) progress_print();
+        mutex_unlock(&pool->lock);
+    }
+    if (data) free_aligned(data);
+    if (old) free_aligned(old);
+    free(payload);
+    return NULL;
+}
+
+// Writes image bytes [offset, offset+length) to the same offsets of dst, feeding hasher (may be NULL) with what was
+// written. Raw images go through the copy pipeline; chunked images are decoded on worker threads that write their
+// chunks independently. With --changed-only both read what dst holds first and leave identical grains alone.
+int image_restore_range(IMAGE_IN* img, DISK_DEV* dst, ULONGLONG offset, ULONGLONG length, BOOL quiet, HASHER* hasher,
+                        COPY_JOB* result) {
+    copy_job_init(result, img->format == FORMAT_RAW ? &img->dev : NULL, offset, dst, offset, length);
+    result->quiet = quiet;
+    result->hasher = hasher;
+    if (g_opts.changedOnly) {
+        result->compare = TRUE;
+        result->sparse = FALSE;     // an unchanged hole already reads as zeros
+    }
+    if (img->format == FORMAT_RAW) {
+        return copy_range(result);
+    }
+
+    if (offset + length > img->size) length = img->size > offset ? img->size - offset : 0;
+    RESTORE_POOL pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.img = img;
+    pool.dst = dst;
+    pool.offset = offset;
+    pool.length = length;
+    pool.first = offset / img->chunkSize;
+    pool.last = length ? (offset + length + img->chunkSize - 1) / img->chunkSize : pool.first;
+    pool.next = pool.first;
+    pool.sparse = result->sparse;
+    pool.compare = result->compare;
+    pool.quiet = quiet;
+    pool.hasher = hasher;
+    mutex_init(&pool.lock);
+
+    int workers = worker_count();
+    WD_THREAD* threads = (WD_THREAD*)calloc(workers, sizeof(WD_THREAD));
+    int started = 0;
+    for (int i = 0; threads && i < workers; i++) {
+        if (thread_start(&threads[started], image_restorer, &pool) == 0) started++;
+    }
+    if (started == 0) {
+        image_restorer(&pool);
+    }
+    for (int i = 0; i < started; i++) thread_join(threads[i]);
+    free(threads);
+    mutex_destroy(&pool.lock);
+    if (!quiet) progress_print();
+
+    result->bytesDone = pool.bytesDone;
+    result->bytesSkipped = pool.bytesSkipped;
+    result->error = pool.error;
+    result->failOffset = pool.failOffset - offset;
+    if (pool.status == COPY_OK && pool.sparse && dev_extend(dst, offset + length)) {
+        pool.status = COPY_WRITE_ERROR;
+        result->error = dev_last_error();
+    }
+    return pool.status;
+}
+
+typedef struct {
+    IMAGE_IN* img;
+    DISK_DEV* dst;
+    HASHER* hasher;
+} RESTORE_SEGMENT;
+
+// Segment function for journal_run(): restores target range [offset, offset+length) of the image in ctx.
+int restore_segment(void* ctx, ULONGLONG offset, ULONGLONG length, BOOL quiet, COPY_JOB* result) {
+    RESTORE_SEGMENT* r = (RESTORE_SEGMENT*)ctx;
+    return image_restore_range(r->img, r->dst, offset, length, quiet, r->hasher, result);
+}
+
+// Prints how much of a --changed-only restore actually had to be written.
+void restore_compare_report(const COPY_JOB* job) {
+    if (!job->compare || job->bytesDone == 0) return;
+    ULONGLONG written = job->bytesDone - job->bytesSkipped;
+    printf("Changed only: %.2f MB rewritten, %.2f MB already matched (%.1f%% skipped)\n", written / (1024.0 * 1024.0),
+           job->bytesSkipped / (1024.0 * 1024.0), 100.0 * job->bytesSkipped / job->bytesDone);
+}
+
+// Prepares the base of an overlay: its chunk size, and a digest for every chunk from its hash sidecar, its dedup
+// manifest, or (for images without either) by reading it once.
+int overlay_base_open(const char* path, WDX_BASE* base) {
+    IMAGE_IN img;
+    memset(base, 0, sizeof(*base));
+    if (image_open(&img, path)) {
+        printf("Failed to open base image %s\n", path);
+        return 1;
+    }
+    base->path = path;
+    base->imageSize = img.size;
+    if (file_stamp(path, &base->id.fileSize, &base->id.mtime)) {
+        printf("Failed to examine base image %s. Error: %lu\n", path, dev_last_error());
+        image_close(&img);
+        return 1;
+    }
+    base->chunkSize = img.format == FORMAT_RAW ? (g_opts.blockSize ? g_opts.blockSize : WDX_CHUNK_SIZE) : img.chunkSize;
+    ULONGLONG chunks = (base->imageSize + base->chunkSize - 1) / base->chunkSize;
+
+    int rc = 0;
+    if (img.format == FORMAT_DEDUP) {
+        base->digests = (BYTE (*)[32])malloc((size_t)chunks * 32 + 1);
+        if (base->digests) memcpy(base->digests, img.digests, (size_t)chunks * 32);
+        else rc = 1;
+    } else if (!hash_sidecar_current(path) || hash_sidecar_load(path, base->imageSize, &base->chunkSize, &base->digests)) {
+        printf("No current hash sidecar for %s, hashing the base image\n", path);
+        base->digests = (BYTE (*)[32])malloc((size_t)chunks * 32 + 1);
+        BYTE* buf = (BYTE*)alloc_aligned((size_t)base->chunkSize);
+        rc = !base->digests || !buf;
+        for (ULONGLONG c = 0; rc == 0 && c < chunks; c++) {
+            ULONGLONG offset = c * base->chunkSize;
+            size_t len = (size_t)(base->imageSize - offset < base->chunkSize ? base->imageSize - offset : base->chunkSize);
+            if (image_pread(&img, buf, len, offset) != (long long)len) {
+                printf("Read error in base image at offset %llu\n", offset);
+                rc = 1;
+                break;
+            }
+            chunk_digest(buf, len, base->digests[c]);
+        }
+        if (buf) free_aligned(buf);
+    }
+    image_close(&img);
+    if (rc) {
+        free(base->digests);
+        base->digests = NULL;
+    } else {
+        sha256(base->digests, (size_t)chunks * 32, base->id.digest);
+    }
+    return rc;
+}
+
+// Writes src in the chunked format selected with --format, or as an overlay on --base. Returns 0 on success.
+int image_create(const IMAGE_SRC* src, const char* outFile) {
+    if (g_opts.base) {
+        if (g_opts.format == FORMAT_DEDUP) {
+            printf("--base makes a WDX overlay; a dedup store already shares unchanged chunks\n");
+            return 1;
+        }
+        if (g_opts.format != FORMAT_WDX && g_opts.format != FORMAT_RAW) {
+            printf("--base makes a WDX overlay and cannot be combined with another --format\n");
+            return 1;
+        }
+        WDX_BASE base;
+        if (overlay_base_open(g_opts.base, &base)) return 1;
+        int rc = wdx_create(src, outFile, &base);
+        free(base.digests);
+        return rc;
+    }
+    if (g_opts.format == FORMAT_DEDUP) {
+        if (!g_opts.store) {
+            printf("--format dedup needs --store <directory>\n");
+            return 1;
+        }
+        return dedup_create(src, g_opts.store, outFile);
+    }
+    if (g_opts.format == FORMAT_QCOW2) return qcow2_create(src, outFile);
+    if (g_opts.format == FORMAT_VHD || g_opts.format == FORMAT_VHDX) {
+        return vhd_create(src, outFile, g_opts.format == FORMAT_VHDX);
+    }
+    if (g_opts.format == FORMAT_VMDK) return vmdk_create(src, outFile);
+    return wdx_create(src, outFile, NULL);
+}
+//================================================================================================================
+// Diff: compares two images, or an image and a device, through the Merkle trees of their chunk digests. The trees
+// come from sidecars wherever there is one, so identical subtrees are skipped without reading any data; an operand
+// without a usable sidecar (a live device, a raw image from elsewhere) is hashed first.
+
+typedef struct {
+    DISK_DEV file;              // sidecar the nodes are read from on demand, or
+    BOOL inFile;
+    BYTE (*nodes)[32];          // every node in memory, leaves first
+    ULONGLONG imageSize;
+    ULONGLONG chunkSize;
+    ULONGLONG chunks;
+    int levels;
+    ULONGLONG start[HASH_TREE_LEVELS];
+    ULONGLONG count[HASH_TREE_LEVELS];
+} HASH_TREE;
+
+typedef struct {
+    int level;
+    ULONGLONG index;
+} TREE_NODE;
+
+static int hash_tree_node(HASH_TREE* t, int level, ULONGLONG i, BYTE out[32]) {
+    ULONGLONG n = t->start[level] + i;
+    if (!t->inFile) {
+        memcpy(out, t->nodes[n], 32);
+        return 0;
+    }
+    return dev_pread(&t->file, out, 32, sizeof(HASH_HEADER) + n * 32) == 32 ? 0 : 1;
+}
+
+// Builds the tree in memory over leaves (malloc'd, chunkSize and chunks already set), which it takes over.
+static int hash_tree_from_leaves(HASH_TREE* t, BYTE (*leaves)[32]) {
+    t->levels = hash_tree_levels(t->chunks, t->start, t->count);
+    ULONGLONG total = hash_tree_size(t->chunks);
+    t->nodes = (BYTE (*)[32])realloc(leaves, (size_t)total * 32 + 1);
+    if (!t->nodes) {
+        free(leaves);
+        printf("Memory allocation failed\n");
+        return 1;
+    }
+    hash_tree_build(t->nodes, t->chunks);
+    return 0;
+}
+
+// Uses the sidecar of imagePath when it still describes the image and matches imageSize and chunkSize (0 = any).
+// Returns 0 on success.
+static int hash_tree_sidecar(HASH_TREE* t, const char* imagePath, ULONGLONG chunkSize) {
+    char path[600];
+    if (!hash_sidecar_current(imagePath)) return 1;
+    hash_sidecar_path(imagePath, path, sizeof(path));
+    if (dev_open(&t->file, path, DEV_READ)) return 1;
+    HASH_HEADER header;
+    if (dev_pread(&t->file, &header, sizeof(header), 0) != sizeof(header) || memcmp(header.magic, HASH_MAGIC, 8) != 0 ||
+        header.chunkSize == 0 || (chunkSize != 0 && header.chunkSize != chunkSize) || header.imageSize != t->imageSize ||
+        header.chunkCount != (t->imageSize + header.chunkSize - 1) / header.chunkSize) {
+        dev_close(&t->file);
+        return 1;
+    }
+    t->chunkSize = header.chunkSize;
+    t->chunks = header.chunkCount;
+    t->levels = hash_tree_levels(t->chunks, t->start, t->count);
+    ULONGLONG total = hash_tree_size(t->chunks);
+    if (header.treeNodes == total - t->chunks && t->file.size >= sizeof(header) + total * 32) {
+        t->inFile = TRUE;
+        return 0;
+    }
+    dev_close(&t->file);
+
+    ULONGLONG size = t->chunkSize;          // a sidecar without a tree: build it from the leaves
+    BYTE (*leaves)[32] = NULL;
+    if (hash_sidecar_load(imagePath, t->imageSize, &size, &leaves)) return 1;
+    return hash_tree_from_leaves(t, leaves);
+}
+
+// Hashes a container image chunk by chunk through image_pread.
+static int image_hash_chunks(IMAGE_IN* img, size_t chunkSize, ULONGLONG chunks, BYTE (*out)[32]) {
+    BYTE* buf = (BYTE*)malloc(chunkSize);
+    if (!buf) return 1;
+    int rc = 0;
+    for (ULONGLONG c = 0; c < chunks && rc == 0; c++) {
+        ULONGLONG left = img->size - c * chunkSize;
+        size_t len = (size_t)(left < chunkSize ? left : chunkSize);
+        if (image_pread(img, buf, len, c * chunkSize) != (long long)len) {
+            printf("\nHash: read error at offset %llu\n", c * chunkSize);
+            rc = 1;
+            break;
+        }
+        chunk_digest(buf, len, out[c]);
+        if (progress_due() || c + 1 == chunks) {
+            printf("\rHash: %.2f MB", (c * chunkSize + len) / (1024.0 * 1024.0));
+            fflush(stdout);
+        }
+    }
+    printf("\n");
+    free(buf);
+    return rc;
+}
+
+// Opens the tree of an image or device in chunkSize chunks (0 = whatever its sidecar uses). Returns 0 on success,
+// 1 on error, or 2 when that would mean reading all of its data and hashData is FALSE.
+int hash_tree_open(HASH_TREE* t, const char* path, ULONGLONG chunkSize, BOOL hashData) {
+    memset(t, 0, sizeof(*t));
+    IMAGE_IN img;
+    if (image_open(&img, path)) {
+        printf("Cannot open %s. Error: %lu\n", path, dev_last_error());
+        return 1;
+    }
+    t->imageSize = img.size;
+    if (hash_tree_sidecar(t, path, chunkSize) == 0) {
+        image_close(&img);
+        return 0;
+    }
+
+    BYTE (*leaves)[32] = NULL;
+    int rc = 0;
+    if (img.format == FORMAT_DEDUP && (chunkSize == 0 || chunkSize == img.chunkSize)) {
+        t->chunkSize = img.chunkSize;               // a manifest is the list of leaves
+        leaves = img.digests;
+        img.digests = NULL;
+    } else if (!hashData) {
+        rc = 2;
+    } else {
+        t->chunkSize = chunkSize ? chunkSize : HASH_CHUNK_SIZE;
+        ULONGLONG chunks = (img.size + t->chunkSize - 1) / t->chunkSize;
+        printf("Hashing %s (%.2f MB, no usable sidecar)\n", path, img.size / (1024.0 * 1024.0));
+        leaves = (BYTE (*)[32])calloc((size_t)chunks + 1, 32);
+        if (!leaves) {
+            printf("Memory allocation failed\n");
+            rc = 1;
+        } else if (img.format == FORMAT_RAW) {
+            rc = hash_range(&img.dev, 0, img.size, (size_t)t->chunkSize, leaves);
+        } else {
+            rc = image_hash_chunks(&img, (size_t)t->chunkSize, chunks, leaves);
+        }
+    }
+    image_close(&img);
+    if (rc) {
+        free(leaves);
+        return rc;
+    }
+    t->chunks = (t->imageSize + t->chunkSize - 1) / t->chunkSize;
+    return hash_tree_from_leaves(t, leaves);
+}
+
+void hash_tree_close(HASH_TREE* t) {
+    if (t->inFile) dev_close(&t->file);
+    free(t->nodes);
+    memset(t, 0, sizeof(*t));
+}
+
+typedef struct {
+    HASH_TREE* a;
+    HASH_TREE* b;
+    ULONGLONG size;             // larger of the two image sizes
+    TREE_NODE* stack;           // nodes that still have to be compared
+    size_t depth;
+    size_t capacity;
+    int busy;                   // workers comparing a node right now
+    BOOL failed;
+    ULONGLONG compared;
+    EXTENT_LIST changed;
+    WD_MUTEX lock;
+    WD_COND more;
+} DIFF_POOL;
+
+// Queues a node. Called with the lock held.
+static void diff_push(DIFF_POOL* d, int level, ULONGLONG index) {
+    if (d->depth == d->capacity) {
+        size_t capacity = d->capacity ? d->capacity * 2 : 256;
+        TREE_NODE* stack = (TREE_NODE*)realloc(d->stack, capacity * sizeof(TREE_NODE));
+        if (!stack) {
+            d->failed = TRUE;
+            return;
+        }
+        d->stack = stack;
+        d->capacity = capacity;
+    }
+    d->stack[d->depth].level = level;
+    d->stack[d->depth].index = index;
+    d->depth++;
+}
+
+// Records leaf c as changed. Called with the lock held.
+static void diff_leaf(DIFF_POOL* d, ULONGLONG c) {
+    ULONGLONG offset = c * d->a->chunkSize;
+    ULONGLONG len = d->size - offset < d->a->chunkSize ? d->size - offset : d->a->chunkSize;
+    if (extent_add(&d->changed, offset, len)) d->failed = TRUE;
+}
+
+// Compares a node of both trees; descends into it when it differs. Workers share the stack of pending nodes.
+static void* diff_worker(void* arg) {
+    DIFF_POOL* d = (DIFF_POOL*)arg;
+    mutex_lock(&d->lock);
+    for (;;) {
+        while (d->depth == 0 && d->busy > 0 && !d->failed) cond_wait(&d->more, &d->lock);
+        if (d->depth == 0 || d->failed) break;
+        TREE_NODE node = d->stack[--d->depth];
+        d->busy++;
+        mutex_unlock(&d->lock);
+
+        BYTE x[32], y[32];
+        BOOL ok = hash_tree_node(d->a, node.level, node.index, x) == 0 &&
+                  hash_tree_node(d->b, node.level, node.index, y) == 0;
+        BOOL same = ok && memcmp(x, y, 32) == 0;
+
+        mutex_lock(&d->lock);
+        d->busy--;
+        d->compared++;
+        if (!ok) {
+            d->failed = TRUE;
+        } else if (!same && node.level == 0) {
+            diff_leaf(d, node.index);
+        } else if (!same) {
+            ULONGLONG child = node.index * 2;
+            diff_push(d, node.level - 1, child);
+            if (child + 1 < d->a->count[node.level - 1]) diff_push(d, node.level - 1, child + 1);
+        }
+        cond_broadcast(&d->more);
+    }
+    cond_broadcast(&d->more);
+    mutex_unlock(&d->lock);
+    return NULL;
+}
+
+// Compares two images or devices and prints the LBA ranges that differ. Returns 0 when they are identical, 1 when
+// they differ and 2 on error.
+int diff_images(const char* pathA, const char* pathB) {
+    HASH_TREE a, b;
+    int ra = hash_tree_open(&a, pathA, 0, FALSE);
+    if (ra == 1) return 2;
+    int rb = hash_tree_open(&b, pathB, ra == 0 ? a.chunkSize : 0, FALSE);
+    if (rb == 1) {
+        if (ra == 0) hash_tree_close(&a);
+        return 2;
+    }
+    if (ra == 2) ra = hash_tree_open(&a, pathA, rb == 0 ? b.chunkSize : 0, TRUE);
+    if (ra == 0 && rb == 2) rb = hash_tree_open(&b, pathB, a.chunkSize, TRUE);
+    if (ra != 0 || rb != 0) {
+        if (ra == 0) hash_tree_close(&a);
+        if (rb == 0) hash_tree_close(&b);
+        return 2;
+    }
+
+    DIFF_POOL d;
+    memset(&d, 0, sizeof(d));
+    d.a = &a;
+    d.b = &b;
+    d.size = a.imageSize > b.imageSize ? a.imageSize : b.imageSize;
+    printf("Diff %s <-> %s in %llu KB chunks\n", pathA, pathB, a.chunkSize / 1024);
+    if (a.chunks == b.chunks && a.chunks > 0) {
+        mutex_init(&d.lock);
+        cond_init(&d.more);
+        diff_push(&d, a.levels - 1, 0);
+        int workers = worker_count();
+        WD_THREAD* threads = (WD_THREAD*)calloc(workers, sizeof(WD_THREAD));
+        int started = 0;
+        for (int i = 0; threads && i < workers; i++) {
+            if (thread_start(&threads[started], diff_worker, &d) == 0) started++;
+        }
+        if (started == 0) diff_worker(&d);
+        for (int i = 0; i < started; i++) thread_join(threads[i]);
+        free(threads);
+        cond_destroy(&d.more);
+        mutex_destroy(&d.lock);
+    } else {
+        ULONGLONG common = a.chunks < b.chunks ? a.chunks : b.chunks;  // trees of different shapes: compare leaves
+        for (ULONGLONG c = 0; c < common && !d.failed; c++) {
+            BYTE x[32], y[32];
+            if (hash_tree_node(&a, 0, c, x) || hash_tree_node(&b, 0, c, y)) d.failed = TRUE;
+            else if (memcmp(x, y, 32) != 0) diff_leaf(&d, c);
+            d.compared++;
+        }
+    }
+    if (a.imageSize != b.imageSize) {
+        ULONGLONG shorter = a.imageSize < b.imageSize ? a.imageSize : b.imageSize;
+        if (extent_add(&d.changed, shorter, d.size - shorter)) d.failed = TRUE;
+        printf("Sizes differ: %llu and %llu bytes\n", a.imageSize, b.imageSize);
+    }
+    hash_tree_close(&a);
+    hash_tree_close(&b);
+    free(d.stack);
+    if (d.failed) {
+        printf("Diff failed: cannot read the hash trees. Error: %lu\n", dev_last_error());
+        extent_free(&d.changed);
+        return 2;
+    }
+
+    extent_normalize(&d.changed);
+    ULONGLONG total = 0;
+    for (int i = 0; i < d.changed.count; i++) {
+        const EXTENT* e = &d.changed.items[i];
+        ULONGLONG first = e->offset / 512;
+        ULONGLONG sectors = (e->offset + e->length + 511) / 512 - first;
+        printf("  LBA %llu - %llu  (%llu sectors, %.2f MB)\n", first, first + sectors - 1, sectors,
+               e->length / (1024.0 * 1024.0));
+        total += e->length;
+    }
+    if (d.changed.count == 0) {
+        printf("Identical: %.2f MB (%llu tree nodes compared)\n", d.size / (1024.0 * 1024.0), d.compared);
+    } else {
+        printf("%d ranges differ: %.2f MB of %.2f MB (%llu tree nodes compared)\n", d.changed.count,
+               total / (1024.0 * 1024.0), d.size / (1024.0 * 1024.0), d.compared);
+    }
+    int rc = d.changed.count == 0 ? 0 : 1;
+    extent_free(&d.changed);
+    return rc;
+}
+//================================================================================================================
+// Fan-out write: one image to several disks in a single pass. The calling thread reads each block of the image once
+// into a shared ring and every target has a writer thread of its own working through the ring at its own pace. A
+// slot is only refilled once every target still in the job has written it, so the job moves at the speed of the
+// slowest target rather than the sum of all of them. A target that fails stops the job, or with --eject is dropped
+// from it while the others carry on.
+
+#define FANOUT_MAX        32
+#define FANOUT_BLOCK_SIZE (4 * 1024 * 1024)
+#define FANOUT_BUFFERS    16
+
+typedef struct FANOUT FANOUT;
+
+typedef struct {
+    FANOUT* f;
+    const char* path;
+    DISK_DEV dev;
+    BOOL open;
+    COPY_JOB job;               // the target's write settings (sparse, compare) and results
+    ULONGLONG next;             // block it writes next
+    int status;                 // COPY_* once it stopped
+    BOOL ejected;
+    WD_THREAD thread;
+    BOOL started;
+} FANOUT_TARGET;
+
+struct FANOUT {
+    IMAGE_IN* img;
+    ULONGLONG length;
+    size_t blockSize;
+    int count;                  // ring slots; block n lives in slot n % count
+    PIPE_SLOT* slots;
+    ULONGLONG produced;         // blocks read so far
+    BOOL eof;
+    BOOL abort;
+    BOOL eject;                 // drop a failing target instead of stopping the job
+    FANOUT_TARGET* targets;
+    int targetCount;
+    int active;                 // targets that have not failed
+    ULONGLONG failOffset;       // read error of the image
+    unsigned long error;
+    WD_MUTEX lock;
+    WD_COND changed;
+};
+
+// Oldest block some target still in the job has not written. Called with the lock held.
+static ULONGLONG fanout_oldest(const FANOUT* f) {
+    ULONGLONG oldest = f->produced;
+    for (int i = 0; i < f->targetCount; i++) {
+        const FANOUT_TARGET* t = &f->targets[i];
+        if (t->status == COPY_OK && !t->ejected && t->next < oldest) oldest = t->next;
+    }
+    return oldest;
+}
+
+// Progress is where the slowest target is; the blocks between it and the reader wait to be written. Called with
+// the lock held.
+static void fanout_account(const FANOUT* f) {
+    ULONGLONG oldest = fanout_oldest(f);
+    ULONGLONG slowest = oldest * f->blockSize;
+    progress_set(slowest < f->length ? slowest : f->length);
+    stage_set(STAGE_WRITE, (LONGLONG)(f->produced - oldest));
+}
+
+// Takes a failed target out of the job, or stops the job when it cannot go on without it. Called with the lock held.
+static void fanout_drop(FANOUT* f, FANOUT_TARGET* t, int status) {
+    t->status = status;
+    f->active--;
+    fanout_account(f);
+    if (f->eject && f->active > 0) {
+        t->ejected = TRUE;
+        printf("\nEjected %s: %s at offset %llu. Error: %lu\n", t->path,
+               status == COPY_NO_MEMORY ? "out of memory" : "write error", t->job.failOffset, t->job.error);
+    } else {
+        f->abort = TRUE;
+    }
+    cond_broadcast(&f->changed);
+}
+
+static void* fanout_writer(void* arg) {
+    FANOUT_TARGET* t = (FANOUT_TARGET*)arg;
+    FANOUT* f = t->f;
+    COPY_JOB* job = &t->job;
+    BYTE* old = job->compare ? (BYTE*)alloc_aligned(f->blockSize) : NULL;
+    int status = job->compare && !old ? COPY_NO_MEMORY : COPY_OK;
+
+    while (status == COPY_OK) {
+        mutex_lock(&f->lock);
+        while (t->next >= f->produced && !f->eof && !f->abort) cond_wait(&f->changed, &f->lock);
+        if (f->abort || t->next >= f->produced) {
+            mutex_unlock(&f->lock);
+            break;
+        }
+        PIPE_SLOT* slot = &f->slots[t->next % f->count];
+        mutex_unlock(&f->lock);
+
+        if (job->compare) {
+            long long had = dev_pread(job->dst, old, slot->len, slot->pos);      // unreadable bytes count as changed
+            if (write_changed(job->dst, slot->pos, slot->data, old, had > 0 ? (size_t)had : 0, slot->len,
+                              &job->bytesSkipped)) {
+                status = COPY_WRITE_ERROR;
+            }
+        } else if (write_block(job, slot->data, slot->len, slot->pos)) {
+            status = COPY_WRITE_ERROR;
+        }
+
+        mutex_lock(&f->lock);
+        if (status == COPY_OK) {
+            t->next++;
+            job->bytesDone = slot->pos + slot->len;
+            fanout_account(f);
+            cond_broadcast(&f->changed);
+        } else {
+            job->failOffset = slot->pos;
+            job->error = dev_last_error();
+        }
+        mutex_unlock(&f->lock);
+    }
+
+    if (status != COPY_OK) {
+        mutex_lock(&f->lock);
+        fanout_drop(f, t, status);
+        mutex_unlock(&f->lock);
+    }
+    if (old) free_aligned(old);
+    return NULL;
+}
+
+// Writes the image to every open target at the same offsets, feeding hasher (may be NULL) with what was read.
+// Returns the status of the reading side; each target's own outcome is in its status and job.
+int fanout_run(FANOUT* f, HASHER* hasher) {
+    f->slots = (PIPE_SLOT*)calloc(f->count, sizeof(PIPE_SLOT));
+    for (int i = 0; f->slots && i < f->count; i++) {
+        f->slots[i].data = (BYTE*)alloc_aligned(f->blockSize);
+        if (!f->slots[i].data) {
+            for (int j = 0; j < i; j++) free_aligned(f->slots[j].data);
+            free(f->slots);
+            f->slots = NULL;
+        }
+    }
+    if (!f->slots) return COPY_NO_MEMORY;
+    mutex_init(&f->lock);
+    cond_init(&f->changed);
+
+    for (int i = 0; i < f->targetCount; i++) {
+        FANOUT_TARGET* t = &f->targets[i];
+        if (!t->open || t->ejected) continue;
+        t->f = f;
+        t->started = thread_start(&t->thread, fanout_writer, t) == 0;
+        if (!t->started) {
+            mutex_lock(&f->lock);
+            fanout_drop(f, t, COPY_NO_MEMORY);
+            mutex_unlock(&f->lock);
+        }
+    }
+
+    int status = COPY_OK;
+    for (ULONGLONG n = 0; n * f->blockSize < f->length; n++) {
+        ULONGLONG pos = n * f->blockSize;
+        size_t want = (size_t)(f->length - pos < f->blockSize ? f->length - pos : f->blockSize);
+        mutex_lock(&f->lock);
+        while (!f->abort && f->produced - fanout_oldest(f) >= (ULONGLONG)f->count) cond_wait(&f->changed, &f->lock);
+        BOOL stop = f->abort || f->active == 0;
+        mutex_unlock(&f->lock);
+        if (stop) break;
+
+        PIPE_SLOT* slot = &f->slots[n % f->count];
+        stage_add(STAGE_READ, 1);
+        long long got = image_pread(f->img, slot->data, want, pos);
+        stage_add(STAGE_READ, -1);
+        if (got < 0) {
+            status = COPY_READ_ERROR;
+            f->failOffset = pos;
+            f->error = dev_last_error();
+            mutex_lock(&f->lock);
+            f->abort = TRUE;
+            cond_broadcast(&f->changed);
+            mutex_unlock(&f->lock);
+            break;
+        }
+        hasher_add(hasher, slot->data, (size_t)got, pos);
+        slot->len = (size_t)got;
+        slot->pos = pos;
+
+        mutex_lock(&f->lock);
+        if (got > 0) f->produced++;
+        fanout_account(f);
+        cond_broadcast(&f->changed);
+        mutex_unlock(&f->lock);
+        if (progress_due()) {
+            printf("\rProgress: %.2f MB read, slowest target at %.2f MB", (pos + got) / (1024.0 * 1024.0),
+                   g_progress.done / (1024.0 * 1024.0));
+            fflush(stdout);
+        }
+        if ((size_t)got != want) {                  // end of image
+            f->length = pos + got;
+            break;
+        }
+    }
+
+    mutex_lock(&f->lock);
+    f->eof = TRUE;
+    cond_broadcast(&f->changed);
+    mutex_unlock(&f->lock);
+    for (int i = 0; i < f->targetCount; i++) {
+        if (f->targets[i].started) thread_join(f->targets[i].thread);
+    }
+    ULONGLONG read = f->produced * f->blockSize < f->length ? f->produced * f->blockSize : f->length;
+    printf("\rProgress: %.2f MB read, slowest target at %.2f MB", read / (1024.0 * 1024.0),
+           g_progress.done / (1024.0 * 1024.0));
+    fflush(stdout);
+    stage_set(STAGE_WRITE, 0);
+
+    cond_destroy(&f->changed);
+    mutex_destroy(&f->lock);
+    for (int i = 0; i < f->count; i++) free_aligned(f->slots[i].data);
+    free(f->slots);
+    f->slots = NULL;
+    return status;
+}
+//================================================================================================================
+
+
+
+// Opens the output of a raw create; with --resume an existing one is kept so the journal can carry on in it.
+static int output_open(DISK_DEV* out, const char* path) {
+    if (g_opts.resume && dev_open(out, path, DEV_READ | DEV_WRITE | DEV_DIRECT) == 0) return 0;
+    return dev_open(out, path, DEV_READ | DEV_WRITE | DEV_CREATE | DEV_DIRECT);
+}
+
+// Returns 0 once the image is complete.
+int crtFullDiskImage(const char* diskPath, const char* outFile) {
+    printf("\n--------------crtFullDiskImage----------------\n Disk=%s   %s\n", diskPath, outFile);
+    //return;
+
+    DISK_DEV disk;
+    if (dev_open(&disk, diskPath, DEV_READ | DEV_DIRECT)) {
+        printf("Failed to open disk %s. Error: %lu\n", diskPath, dev_last_error());
+        return 1;
+    }
+    ULONGLONG diskSize = disk.size;
+    progress_begin(diskSize);
+
+    if (g_opts.format != FORMAT_RAW || g_opts.base) {
+        IMAGE_SRC src;
+        image_src_init(&src, &disk, diskSize);
+        int rc = image_create(&src, outFile);
+        dev_close(&disk);
+        if (rc == 0) {
+            printf("Image created: %s (%.2f GB)\n", outFile, diskSize / (1024.0 * 1024 * 1024));
+        }
+        return rc;
+    }
+
+    // Open output file
+    DISK_DEV out;
+    if (output_open(&out, outFile)) {
+        printf("Failed to open output file %s. Error: %lu\n", outFile, dev_last_error());
+        dev_close(&disk);
+        return 1;
+    }
+
+    if (g_opts.rescue) {
+        char mapPath[600];
+        ULONGLONG bad;
+        rescue_map_path(outFile, mapPath, sizeof(mapPath));
+        int rc = rescue_run(&disk, &out, 0, diskSize, NULL, 0, mapPath, &bad) == COPY_OK ? 0 : 1;
+        if (rc == 0) {
+            printf("Image created: %s (%.2f GB)%s\n", outFile, diskSize / (1024.0 * 1024 * 1024),
+                   bad ? ", with unreadable sectors" : "");
+            image_hash_readback(&out, outFile, diskSize);
+        }
+        dev_close(&out);
+        dev_close(&disk);
+        return rc;
+    }
+
+    // Read and write data, hashing it on the way through, with a checkpoint every JOURNAL_STEP
+    tune_device(&disk, diskPath, 0, diskSize, FALSE);
+    HASHER hasher;
+    BOOL hashing = hasher_init(&hasher, 0, diskSize, HASH_CHUNK_SIZE) == 0;
+    COPY_JOB job, run;
+    copy_job_init(&job, &disk, 0, &out, 0, diskSize);
+    job.hasher = hashing ? &hasher : NULL;
+    JOURNAL journal;
+    char journalPath[600];
+    journal_path(outFile, NULL, journalPath, sizeof(journalPath));
+    journal_open(&journal, journalPath, diskPath, diskSize, outFile, &out, 0, diskSize, job.hasher);
+    int status = journal_run(&journal, &out, 0, diskSize, FALSE, copy_segment, &job, &run);
+    if (status == COPY_OK && run.bytesDone < diskSize) {
+        status = COPY_READ_ERROR;
+        run.failOffset = run.bytesDone;
+    }
+    if (hashing) {
+        hashing = hasher_finish(&hasher) == 0 && status == COPY_OK;
+    }
+    if (status == COPY_READ_ERROR) {
+        printf("\nRead error at offset %llu. Error: %lu\n", run.failOffset, run.error);
+    } else if (status == COPY_WRITE_ERROR) {
+        printf("\nWrite error at offset %llu. Error: %lu\n", run.failOffset, run.error);
+    } else if (status == COPY_NO_MEMORY) {
+        printf("Memory allocation failed\n");
+    }
+    journal_close(&journal, status == COPY_OK);
+
+    // Free resources
+    dev_close(&out);
+    dev_close(&disk);
+    if (status != COPY_OK) {
+        hasher_free(&hasher);
+        return 1;
+    }
+
+    printf("\nImage created: %s (%.2f GB)\n", outFile, diskSize / (1024.0 * 1024 * 1024));
+    image_hash_report(outFile, diskSize, hashing ? &hasher : NULL);
+    hasher_free(&hasher);
+    return 0;
+}
+
+
+
+
+//================================================================================================================
+// Partition tables.
+// part_locate finds the partition a --part argument names, in an MBR (primary entries 0-3, logical drives 4 and up
+// in the order of the EBR chain) or a GPT (entry index 0-127, or the partition's unique GUID), and lays out a
+// partition image: the table sectors it carries ahead of the data and the data's byte range, all at the offsets
+// they have on the disk.
+
+#define GPT_SIGNATURE  "EFI PART"
+#define GPT_MAX_TABLE  (1024 * 1024)    // entry array bytes accepted; the usual 128 x 128 bytes is 16 KB
+#define MBR_FIRST_LOGICAL 4             // index of the first logical drive
+#define MBR_MAX_LOGICAL   124           // EBRs followed before a chain is taken to be looping
+
+#pragma pack(push, 1)
+typedef struct {
+    char signature[8];
+    DWORD revision;
+    DWORD headerSize;
+    DWORD headerCrc;            // crc32 of headerSize bytes with this field zero
+    DWORD reserved;
+    ULONGLONG myLBA;
+    ULONGLONG alternateLBA;
+    ULONGLONG firstUsableLBA;
+    ULONGLONG lastUsableLBA;
+    BYTE diskGuid[16];
+    ULONGLONG entriesLBA;
+    DWORD entryCount;
+    DWORD entrySize;
+    DWORD entriesCrc;           // crc32 of the entry array
+} GPT_HEADER;
+
+typedef struct {
+    BYTE typeGuid[16];          // all zero: unused entry
+    BYTE uniqueGuid[16];
+    ULONGLONG firstLBA;
+    ULONGLONG lastLBA;          // inclusive
+    ULONGLONG attributes;
+    WORD name[36];              // UTF-16LE
+} GPT_ENTRY;
+#pragma pack(pop)
+
+typedef struct {
+    BYTE sector[SECTOR_SIZE];   // the primary header sector; GPT_HEADER at its start
+    BYTE* entries;
+    size_t entriesBytes;        // entryCount * entrySize, rounded up to whole sectors
+} GPT_TABLE;
+
+// One link of the EBR chain: the EBR sector and where it is. Its first entry is the logical drive, relative to
+// the EBR; its second points at the next EBR, relative to the start of the extended partition.
+typedef struct {
+    ULONGLONG ebrLBA;
+    EBR ebr;
+} MBR_LOGICAL;
+
+typedef struct {
+    int index;
+    BOOL isGpt;
+    BOOL isLogical;
+    ULONGLONG offset;           // partition data, bytes from the start of the disk
+    ULONGLONG size;
+    SECTOR_PATCH* meta;         // table sectors the image carries ahead of the data, in offset order
+    int metaCount;
+    GPT_TABLE gpt;
+} PART_LAYOUT;
+
+// Reads len bytes at offset of a disk or an image; part_locate works on either.
+typedef long long (*PART_READ)(void* src, void* buf, size_t len, ULONGLONG offset);
+
+static long long part_read_dev(void* src, void* buf, size_t len, ULONGLONG offset) {
+    return dev_pread((DISK_DEV*)src, buf, len, offset);
+}
+
+static long long part_read_image(void* src, void* buf, size_t len, ULONGLONG offset) {
+    return image_pread((IMAGE_IN*)src, buf, len, offset);
+}
+
+// GUIDs are printed and parsed in the usual mixed-endian text form, 01234567-89AB-CDEF-0123-456789ABCDEF.
+void guid_string(const BYTE g[16], char out[37]) {
+    snprintf(out, 37, "%02X%02X%02X%02X-%02X%02X-%02X%02X-%02X%02X-%02X%02X%02X%02X%02X%02X", g[3], g[2], g[1], g[0],
+             g[5], g[4], g[7], g[6], g[8], g[9], g[10], g[11], g[12], g[13], g[14], g[15]);
+}
+
+int guid_parse(const char* s, BYTE g[16]) {
+    static const int order[16] = { 3, 2, 1, 0, 5, 4, 7, 6, 8, 9, 10, 11, 12, 13, 14, 15 };
+    if (strlen(s) != 36 || s[8] != '-' || s[13] != '-' || s[18] != '-' || s[23] != '-') return 1;
+    for (int i = 0, at = 0; i < 16; i++, at += 2) {
+        if (s[at] == '-') at++;
+        unsigned v;
+        char hex[3] = { s[at], s[at + 1], 0 };
+        char* end;
+        v = (unsigned)strtoul(hex, &end, 16);
+        if (*end || hex[0] == '-' || hex[0] == '+' || hex[0] == ' ') return 1;
+        g[order[i]] = (BYTE)v;
     }
+    return 0;
+}
 
-    // Allocate buffer
-    BYTE* buffer = (BYTE*)malloc(BUFFER_SIZE);
-    if (!buffer) {
-        printf("Memory allocation failed\n");
-        fclose(f);
-        CloseHandle(hDisk);
-        return;
+static const char* gpt_type_name(const BYTE type[16]) {
+    static const struct { const char* guid; const char* name; } types[] = {
+        { "C12A7328-F81F-11D2-BA4B-00A0C93EC93B", "EFI System" },
+        { "E3C9E316-0B5C-4DB8-817D-F92DF00215AE", "Microsoft reserved" },
+        { "EBD0A0A2-B9E5-4433-87C0-68B6B72699C7", "Microsoft basic data" },
+        { "DE94BBA4-06D1-4D40-A16A-BFD50179D6AC", "Windows recovery" },
+        { "0FC63DAF-8483-4772-8E79-3D69D8477DE4", "Linux filesystem" },
+        { "0657FD6D-A4AB-43C4-84E5-0933C84B4F4F", "Linux swap" },
+        { "E6D6D379-F507-44C2-A23C-238F2A3DF928", "Linux LVM" },
+        { "21686148-6449-6E6F-744E-656564454649", "BIOS boot" },
+    };
+    char text[37];
+    guid_string(type, text);
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        if (strcmp(text, types[i].guid) == 0) return types[i].name;
     }
+    return "Unknown";
+}
 
-    // Read and write data
-    ULONGLONG totalRead = 0;
-    DWORD bytesRead, bytesWritten;
-    while (totalRead < diskSize) {
-        ULONGLONG toRead = (diskSize - totalRead) > BUFFER_SIZE ? BUFFER_SIZE : (diskSize - totalRead);
+static BOOL mbr_is_extended(BYTE systemID) {
+    return systemID == 0x05 || systemID == 0x0F || systemID == 0x85;
+}
 
-        if (!ReadFile(hDisk, buffer, (DWORD)toRead, &bytesRead, NULL) || bytesRead == 0) {
-            printf("Read error at offset %llu. Error: %lu\n", totalRead, GetLastError());
-            free(buffer);
-            fclose(f);
-            CloseHandle(hDisk);
-            return;
+// Walks the EBR chain of the extended partition of mbr. Returns the number of links, each a logical drive whose
+// index is MBR_FIRST_LOGICAL plus its position, with *links malloc'd; 0 without an extended partition, -1 when
+// the chain is unreadable or loops. A chain that breaks off after some valid links is cut there with a warning.
+int mbr_logicals(PART_READ read, void* src, const MBR* mbr, MBR_LOGICAL** links) {
+    *links = NULL;
+    const PARTITION_ENTRY* ext = NULL;
+    for (int p = 0; p < 4 && !ext; p++) {
+        if (mbr_is_extended(mbr->partitions[p].systemID) && mbr->partitions[p].totalSectors) ext = &mbr->partitions[p];
+    }
+    if (!ext) return 0;
+
+    ULONGLONG extStart = ext->StartingLBA, extEnd = extStart + ext->totalSectors;
+    ULONGLONG ebrLBA = extStart;
+    int count = 0;
+    for (;;) {
+        if (count == MBR_MAX_LOGICAL) {
+            printf("EBR chain longer than %d links, taken to be looping\n", MBR_MAX_LOGICAL);
+            free(*links);
+            *links = NULL;
+            return -1;
         }
-
-        if (fwrite(buffer, 1, bytesRead, f) != bytesRead) {
-            printf("Write error at offset %llu. Error: %d\n", totalRead, errno);
-            free(buffer);
-            fclose(f);
-            CloseHandle(hDisk);
-            return;
+        MBR_LOGICAL* grown = (MBR_LOGICAL*)realloc(*links, (count + 1) * sizeof(MBR_LOGICAL));
+        if (!grown) {
+            free(*links);
+            *links = NULL;
+            return -1;
         }
+        *links = grown;
+        MBR_LOGICAL* l = &grown[count];
+        l->ebrLBA = ebrLBA;
+        long long got = read(src, &l->ebr, sizeof(EBR), ebrLBA * SECTOR_SIZE);
+        if (got != sizeof(EBR) && count > 0) return count;    // a partition image ends before the next EBR
+        if (got != sizeof(EBR) || l->ebr.signature != 0xAA55) {
+            if (count == 0) {
+                printf("Invalid EBR at LBA %llu\n", ebrLBA);
+                free(*links);
+                *links = NULL;
+                return -1;
+            }
+            printf("Warning: EBR chain broken at LBA %llu, %d logical drives found before it\n", ebrLBA, count);
+            return count;
+        }
+        count++;
+        const PARTITION_ENTRY* next = &l->ebr.nextPartition;
+        if (next->totalSectors == 0 || next->StartingLBA == 0) return count;
+        ebrLBA = extStart + next->StartingLBA;
+        if (ebrLBA <= l->ebrLBA || ebrLBA >= extEnd) {      // links only ever go forward inside the container
+            printf("Warning: EBR at LBA %llu links outside the extended partition, chain cut there\n", l->ebrLBA);
+            return count;
+        }
+    }
+}
 
-        totalRead += bytesRead;
-        printf("\rProgress: %.2f MB", totalRead / (1024.0 * 1024.0));
-        fflush(stdout);     // Ensures correct progress output
+static BOOL mbr_is_protective(const MBR* mbr) {
+    for (int p = 0; p < 4; p++) {
+        if (mbr->partitions[p].systemID == 0xEE) return TRUE;
     }
+    return FALSE;
+}
 
-    // Free resources
-    free(buffer);
-    fclose(f);
-    CloseHandle(hDisk);
+// Whether a boot sector is unpartitioned: no signature and four empty entries.
+static BOOL mbr_is_blank(const MBR* mbr) {
+    static const PARTITION_ENTRY empty;
+    if (mbr->signature == 0xAA55) return FALSE;
+    for (int p = 0; p < 4; p++) {
+        if (memcmp(&mbr->partitions[p], &empty, sizeof(empty)) != 0) return FALSE;
+    }
+    return TRUE;
+}
 
-    printf("\nImage created: %s (%.2f GB)\n", outFile, diskSize / (1024.0 * 1024 * 1024));
+// Reads and checks the GPT header at lba and its entry array. Returns 0 when both CRCs match.
+static int gpt_read_at(PART_READ read, void* src, ULONGLONG lba, GPT_TABLE* t) {
+    GPT_HEADER* h = (GPT_HEADER*)t->sector;
+    if (read(src, t->sector, SECTOR_SIZE, lba * SECTOR_SIZE) != SECTOR_SIZE ||
+        memcmp(h->signature, GPT_SIGNATURE, 8) != 0 || h->headerSize < sizeof(GPT_HEADER) ||
+        h->headerSize > SECTOR_SIZE || h->myLBA != lba) {
+        return 1;
+    }
+    DWORD crc = h->headerCrc;
+    h->headerCrc = 0;
+    DWORD actual = (DWORD)crc32(0L, t->sector, h->headerSize);
+    h->headerCrc = crc;
+    if (actual != crc || h->entrySize < sizeof(GPT_ENTRY) || h->entrySize % 8 != 0 || h->entryCount == 0 ||
+        (ULONGLONG)h->entryCount * h->entrySize > GPT_MAX_TABLE) {
+        return 1;
+    }
+    size_t bytes = (size_t)h->entryCount * h->entrySize;
+    free(t->entries);
+    t->entriesBytes = (bytes + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+    t->entries = (BYTE*)calloc(1, t->entriesBytes);
+    if (!t->entries || read(src, t->entries, t->entriesBytes, h->entriesLBA * SECTOR_SIZE) != (long long)t->entriesBytes) {
+        return 1;
+    }
+    return (DWORD)crc32(0L, t->entries, (uInt)bytes) == h->entriesCrc ? 0 : 1;
+}
+
+static void gpt_seal(GPT_HEADER* h, const BYTE* entries) {
+    h->entriesCrc = (DWORD)crc32(0L, entries, (uInt)((size_t)h->entryCount * h->entrySize));
+    h->headerCrc = 0;
+    h->headerCrc = (DWORD)crc32(0L, (const BYTE*)h, h->headerSize);
 }
 
+// Loads the GPT of a disk of diskSectors sectors (0 when unknown, as for an image, which has no backup table).
+// A damaged primary table is replaced by the backup, rewritten as a primary so it can go into an image as is. The
+// backup is looked for where the damaged primary says it is, then in the last sector, where it belongs.
+int gpt_load(PART_READ read, void* src, ULONGLONG diskSectors, GPT_TABLE* t) {
+    memset(t, 0, sizeof(*t));
+    if (gpt_read_at(read, src, 1, t) == 0) return 0;
+    GPT_HEADER* h = (GPT_HEADER*)t->sector;
+    ULONGLONG alternate = memcmp(h->signature, GPT_SIGNATURE, 8) == 0 && h->alternateLBA > 1 ? h->alternateLBA : 0;
+    ULONGLONG last = diskSectors > 2 ? diskSectors - 1 : 0;
+    if ((alternate == 0 || gpt_read_at(read, src, alternate, t)) &&
+        (last == 0 || last == alternate || gpt_read_at(read, src, last, t))) {
+        free(t->entries);
+        t->entries = NULL;
+        return 1;
+    }
+    printf("Warning: the primary GPT is damaged, using the backup table\n");
+    h->alternateLBA = h->myLBA;
+    h->myLBA = 1;
+    h->entriesLBA = 2;
+    gpt_seal(h, t->entries);
+    return 0;
+}
 
+const GPT_ENTRY* gpt_entry(const GPT_TABLE* t, DWORD i) {
+    return (const GPT_ENTRY*)(t->entries + (size_t)i * ((const GPT_HEADER*)t->sector)->entrySize);
+}
 
+static BOOL gpt_entry_used(const GPT_ENTRY* e) {
+    static const BYTE unused[16];
+    return memcmp(e->typeGuid, unused, 16) != 0 && e->lastLBA >= e->firstLBA;
+}
 
-int crtPartImage(int driveNumber, int partitionNum, const char* outputPath) {
-    printf("\n--------------crtPartImage----------------\n Disk=%d  Part=%d  %s\n", driveNumber, partitionNum, outputPath);
+void part_free(PART_LAYOUT* p) {
+    free(p->meta);
+    free(p->gpt.entries);
+    memset(p, 0, sizeof(*p));
+}
 
-    char diskPath[64];
-    sprintf(diskPath, "\\\\.\\PhysicalDrive%d", driveNumber);
+static int part_add_meta(PART_LAYOUT* p, const void* data, size_t bytes, ULONGLONG offset) {
+    int sectors = (int)(bytes / SECTOR_SIZE);
+    SECTOR_PATCH* grown = (SECTOR_PATCH*)realloc(p->meta, (p->metaCount + sectors) * sizeof(SECTOR_PATCH));
+    if (!grown) return 1;
+    p->meta = grown;
+    for (int i = 0; i < sectors; i++) {
+        p->meta[p->metaCount].offset = offset + (ULONGLONG)i * SECTOR_SIZE;
+        memcpy(p->meta[p->metaCount].data, (const BYTE*)data + (size_t)i * SECTOR_SIZE, SECTOR_SIZE);
+        p->metaCount++;
+    }
+    return 0;
+}
 
-    HANDLE hDrive = CreateFileA(diskPath,  GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0,  NULL   );
+// GPT: the partition at index spec, or with the unique GUID spec.
+static int part_locate_gpt(PART_READ read, void* src, ULONGLONG diskSectors, const char* spec, const MBR* mbr,
+                           PART_LAYOUT* p) {
+    if (gpt_load(read, src, diskSectors, &p->gpt)) {
+        printf("The disk has a protective MBR but no valid GPT (header or entry CRC mismatch)\n");
+        return 1;
+    }
+    const GPT_HEADER* h = (const GPT_HEADER*)p->gpt.sector;
+    BYTE guid[16];
+    char* end;
+    long n = strtol(spec, &end, 10);
+    p->index = -1;
+    if (guid_parse(spec, guid) == 0) {
+        for (DWORD i = 0; i < h->entryCount && p->index < 0; i++) {
+            if (memcmp(gpt_entry(&p->gpt, i)->uniqueGuid, guid, 16) == 0) p->index = (int)i;
+        }
+        if (p->index < 0) {
+            printf("No GPT partition with GUID %s\n", spec);
+            return 1;
+        }
+    } else if (*spec && *end == '\0' && n >= 0 && n < (long)h->entryCount) {
+        p->index = (int)n;
+    } else {
+        printf("Invalid partition number. Must be 0-%lu or a partition GUID\n", (unsigned long)h->entryCount - 1);
+        return 1;
+    }
 
-    if (hDrive == INVALID_HANDLE_VALUE) {
-        perror("Failed to open physical drive");
+    const GPT_ENTRY* e = gpt_entry(&p->gpt, (DWORD)p->index);
+    if (!gpt_entry_used(e)) {
+        printf("Selected partition is empty or not valid.\n");
+        return 1;
+    }
+    if (e->firstLBA < h->entriesLBA + p->gpt.entriesBytes / SECTOR_SIZE || e->firstLBA < h->firstUsableLBA ||
+        e->lastLBA > h->lastUsableLBA || e->lastLBA < e->firstLBA || (diskSectors && e->lastLBA >= diskSectors)) {
+        printf("GPT partition %d lies outside the usable area of the disk\n", p->index);
         return 1;
     }
+    char text[37];
+    guid_string(e->uniqueGuid, text);
+    printf("GPT partition %d: %s, LBA %llu-%llu, GUID %s\n", p->index, gpt_type_name(e->typeGuid), e->firstLBA,
+           e->lastLBA, text);
+    p->isGpt = TRUE;
+    p->offset = e->firstLBA * SECTOR_SIZE;
+    p->size = (e->lastLBA - e->firstLBA + 1) * SECTOR_SIZE;
+    return part_add_meta(p, mbr, SECTOR_SIZE, 0) || part_add_meta(p, p->gpt.sector, SECTOR_SIZE, SECTOR_SIZE) ||
+           part_add_meta(p, p->gpt.entries, p->gpt.entriesBytes, h->entriesLBA * SECTOR_SIZE);
+}
 
-    DWORD bytesRead;
+// Finds the partition spec names on a disk or disk-shaped image of diskSectors sectors (0 if unknown). With
+// markActive the copy of its MBR/EBR entry in the layout is flagged bootable. Returns 0 and fills p, which
+// part_free releases.
+int part_locate(PART_READ read, void* src, ULONGLONG diskSectors, const char* spec, BOOL markActive, PART_LAYOUT* p) {
+    memset(p, 0, sizeof(*p));
     MBR mbr;
-
-    if (!ReadFile(hDrive, &mbr, sizeof(MBR), &bytesRead, NULL)) {
+    if (read(src, &mbr, sizeof(MBR), 0) != sizeof(MBR)) {
         perror("Failed to read MBR");
-        CloseHandle(hDrive);
         return 1;
     }
-
     if (mbr.signature != 0xAA55) {
         printf("Invalid MBR signature: 0x%04X\n", mbr.signature);
-        CloseHandle(hDrive);
         return 1;
     }
-
-    if (partitionNum < 0 || partitionNum > 3) {
-        printf("Invalid partition number. Must be 0-3\n");
-        CloseHandle(hDrive);
-        return 1;
+    if (mbr_is_protective(&mbr)) return part_locate_gpt(read, src, diskSectors, spec, &mbr, p);
+
+    // The EBR chain is only walked for a logical drive: an image of a primary partition does not carry it.
+    char* end;
+    long n = strtol(spec, &end, 10);
+    MBR_LOGICAL* links = NULL;
+    int logicals = 0;
+    if (*spec && !*end && (n >= MBR_FIRST_LOGICAL || (n >= 0 && mbr_is_extended(mbr.partitions[n].systemID)))) {
+        logicals = mbr_logicals(read, src, &mbr, &links);
+        if (logicals < 0) return 1;
     }
-
-    PARTITION_ENTRY partition = mbr.partitions[partitionNum];
-
-    if (partition.totalSectors == 0) {
-        printf("Selected partition is empty or not valid.\n");
-        CloseHandle(hDrive);
+    if (!*spec || *end || n < 0 || (n >= MBR_FIRST_LOGICAL && n >= MBR_FIRST_LOGICAL + logicals)) {
+        if (logicals) {
+            printf("Invalid partition number. Must be 0-3, or %d-%d for the logical drives\n", MBR_FIRST_LOGICAL,
+                   MBR_FIRST_LOGICAL + logicals - 1);
+        } else {
+            printf("Invalid partition number. Must be 0-3\n");
+        }
+        free(links);
         return 1;
     }
-
-    LARGE_INTEGER partitionOffset;
-    EBR ebr;
-    BOOL isLogical = (partition.systemID == 0x05 || partition.systemID == 0x0F);
-    if (isLogical) {
-        printf("Selected partition is part of an extended partition. Checking EBR...\n");
-
-        partitionOffset.QuadPart = (LONGLONG)partition.StartingLBA * SECTOR_SIZE;
-        if (!SetFilePointerEx(hDrive, partitionOffset, NULL, FILE_BEGIN)) {
-            perror("Failed to set file pointer to EBR");
-            CloseHandle(hDrive);
+    if (n < MBR_FIRST_LOGICAL && mbr_is_extended(mbr.partitions[n].systemID) && logicals) {
+        printf("Partition %ld is the extended partition, using its first logical drive (%d)\n", n, MBR_FIRST_LOGICAL);
+        n = MBR_FIRST_LOGICAL;
+    }
+    p->index = (int)n;
+
+    int rc = 0;
+    if (p->index < MBR_FIRST_LOGICAL) {
+        PARTITION_ENTRY* e = &mbr.partitions[p->index];
+        if (e->totalSectors == 0 || mbr_is_extended(e->systemID)) {
+            printf("Selected partition is empty or not valid.\n");
+            free(links);
             return 1;
         }
-
-        if (!ReadFile(hDrive, &ebr, sizeof(EBR), &bytesRead, NULL)) {
-            perror("Failed to read EBR");
-            CloseHandle(hDrive);
+        if (markActive) e->bootIndicator = 0x80;
+        p->offset = (ULONGLONG)e->StartingLBA * SECTOR_SIZE;
+        p->size = (ULONGLONG)e->totalSectors * SECTOR_SIZE;
+        rc = part_add_meta(p, &mbr, SECTOR_SIZE, 0);
+    } else {
+        // A logical drive: the image carries every EBR of the chain up to its own, so it can be found again.
+        MBR_LOGICAL* l = &links[p->index - MBR_FIRST_LOGICAL];
+        if (l->ebr.partition.totalSectors == 0) {
+            printf("Selected partition is empty or not valid.\n");
+            free(links);
             return 1;
         }
-
-        if (ebr.signature != 0xAA55) {
-            printf("Invalid EBR signature: 0x%04X\n", ebr.signature);
-            CloseHandle(hDrive);
-            return 1;
+        if (markActive) l->ebr.partition.bootIndicator = 0x80;
+        p->isLogical = TRUE;
+        p->offset = (l->ebrLBA + l->ebr.partition.StartingLBA) * SECTOR_SIZE;
+        p->size = (ULONGLONG)l->ebr.partition.totalSectors * SECTOR_SIZE;
+        printf("Logical drive %d: EBR at LBA %llu, data at LBA %llu, %llu sectors\n", p->index, l->ebrLBA,
+               p->offset / SECTOR_SIZE, p->size / SECTOR_SIZE);
+        rc = part_add_meta(p, &mbr, SECTOR_SIZE, 0);
+        for (int i = 0; rc == 0 && i <= p->index - MBR_FIRST_LOGICAL; i++) {
+            rc = part_add_meta(p, &links[i].ebr, SECTOR_SIZE, links[i].ebrLBA * SECTOR_SIZE);
         }
-
-        ebr.partition.bootIndicator = 0x80;
-        partition = ebr.partition;
-        partitionOffset.QuadPart += SECTOR_SIZE;
-    } else {
-        mbr.partitions[partitionNum].bootIndicator = 0x80;
-        partitionOffset.QuadPart = (LONGLONG)partition.StartingLBA * SECTOR_SIZE;
     }
+    free(links);
+    return rc;
+}
 
-    LARGE_INTEGER partitionSize;
-    partitionSize.QuadPart = (LONGLONG)partition.totalSectors * SECTOR_SIZE;
+// Writes the table sectors of a partition image to out and zeros the gaps up to the partition data. sparse lets the
+// gaps of an image file become holes.
+int part_write_meta(DISK_DEV* out, const PART_LAYOUT* p, BOOL sparse) {
+    ULONGLONG pos = 0;
+    for (int i = 0; i <= p->metaCount; i++) {
+        ULONGLONG next = i < p->metaCount ? p->meta[i].offset : p->offset;
+        if (next > pos && dev_zero_fill(out, pos, next - pos, sparse)) return 1;
+        if (i == p->metaCount) break;
+        if (dev_pwrite(out, p->meta[i].data, SECTOR_SIZE, next) != SECTOR_SIZE) return 1;
+        pos = next + SECTOR_SIZE;
+    }
+    return 0;
+}
 
-    HANDLE hOut = CreateFileA( outputPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,  FILE_ATTRIBUTE_NORMAL, NULL );
+// Feeds what part_write_meta wrote to hasher. Done only once a journal has restored the hasher, since chunks it
+// restores must not have been fed.
+void part_hash_meta(const PART_LAYOUT* p, HASHER* hasher) {
+    ULONGLONG pos = 0;
+    for (int i = 0; i <= p->metaCount; i++) {
+        ULONGLONG next = i < p->metaCount ? p->meta[i].offset : p->offset;
+        if (next > pos) hasher_zero(hasher, pos, next - pos);
+        if (i == p->metaCount) break;
+        hasher_add(hasher, p->meta[i].data, SECTOR_SIZE, next);
+        pos = next + SECTOR_SIZE;
+    }
+}
 
-    if (hOut == INVALID_HANDLE_VALUE) {
-        perror("Failed to open output image file");
-        CloseHandle(hDrive);
+// Puts the GPT of a partition image on a blank disk of diskSectors sectors: the protective MBR, the primary table
+// and a backup table at the end of this disk, which need not be the size of the one the image came from.
+int gpt_write_table(DISK_DEV* disk, ULONGLONG diskSectors, const PART_LAYOUT* p) {
+    GPT_HEADER primary, backup;
+    memcpy(&primary, p->gpt.sector, sizeof(primary));
+    ULONGLONG entrySectors = p->gpt.entriesBytes / SECTOR_SIZE;
+    ULONGLONG lastUsable = diskSectors - 2 - entrySectors;
+    const GPT_HEADER* h = (const GPT_HEADER*)p->gpt.sector;
+    for (DWORD i = 0; i < h->entryCount; i++) {
+        const GPT_ENTRY* e = gpt_entry(&p->gpt, i);
+        if (gpt_entry_used(e) && e->lastLBA > lastUsable) {
+            printf("Partition %lu of the image does not fit on this disk\n", (unsigned long)i);
+            return 1;
+        }
+    }
+    // The protective MBR keeps the image's boot code but covers this disk, not the one the image came from.
+    MBR mbr;
+    memcpy(&mbr, p->meta[0].data, sizeof(mbr));
+    memset(mbr.partitions, 0, sizeof(mbr.partitions));
+    mbr.partitions[0].startSector = 2;
+    mbr.partitions[0].systemID = 0xEE;
+    mbr.partitions[0].endHead = 0xFF;
+    mbr.partitions[0].endSector = 0xFF;
+    mbr.partitions[0].endCylinder = 0xFF;
+    mbr.partitions[0].StartingLBA = 1;
+    mbr.partitions[0].totalSectors = diskSectors - 1 > 0xFFFFFFFFULL ? 0xFFFFFFFFu : (DWORD)(diskSectors - 1);
+    mbr.signature = 0xAA55;
+
+    BYTE sector[SECTOR_SIZE];
+    memcpy(sector, p->gpt.sector, SECTOR_SIZE);
+    if (primary.lastUsableLBA > lastUsable) primary.lastUsableLBA = lastUsable;
+    primary.alternateLBA = diskSectors - 1;
+    gpt_seal(&primary, p->gpt.entries);
+    backup = primary;
+    backup.myLBA = diskSectors - 1;
+    backup.alternateLBA = 1;
+    backup.entriesLBA = diskSectors - 1 - entrySectors;
+    gpt_seal(&backup, p->gpt.entries);
+
+    if (dev_pwrite(disk, &mbr, SECTOR_SIZE, 0) != SECTOR_SIZE) return 1;
+    memcpy(sector, &primary, sizeof(primary));
+    if (dev_pwrite(disk, sector, SECTOR_SIZE, SECTOR_SIZE) != SECTOR_SIZE ||
+        dev_pwrite(disk, p->gpt.entries, p->gpt.entriesBytes, primary.entriesLBA * SECTOR_SIZE) !=
+            (long long)p->gpt.entriesBytes ||
+        dev_pwrite(disk, p->gpt.entries, p->gpt.entriesBytes, backup.entriesLBA * SECTOR_SIZE) !=
+            (long long)p->gpt.entriesBytes) {
         return 1;
     }
+    memcpy(sector, &backup, sizeof(backup));
+    return dev_pwrite(disk, sector, SECTOR_SIZE, backup.myLBA * SECTOR_SIZE) == SECTOR_SIZE ? 0 : 1;
+}
 
-    DWORD bytesWritten;
-    if (!WriteFile(hOut, &mbr, SECTOR_SIZE, &bytesWritten, NULL)) {
-        perror("Failed to write MBR to output file");
-        CloseHandle(hDrive);
-        CloseHandle(hOut);
-        return 1;
+// Lists the used entries of a GPT disk.
+void print_gpt_partitions(DISK_DEV* disk) {
+    GPT_TABLE t;
+    if (gpt_load(part_read_dev, disk, disk->size / SECTOR_SIZE, &t)) {
+        printf("  GPT: no valid header or entry array\n");
+        return;
+    }
+    const GPT_HEADER* h = (const GPT_HEADER*)t.sector;
+    printf("  Partition Table Type: GPT (%lu entries)\n", (unsigned long)h->entryCount);
+    for (DWORD i = 0; i < h->entryCount; i++) {
+        const GPT_ENTRY* e = gpt_entry(&t, i);
+        if (!gpt_entry_used(e)) continue;
+        char guid[37], name[37];
+        guid_string(e->uniqueGuid, guid);
+        int k = 0;
+        for (; k < 36 && e->name[k]; k++) name[k] = e->name[k] < 0x80 ? (char)e->name[k] : '?';
+        name[k] = '\0';
+        printf("    Partition %lu: Offset = %llu bytes, Size = %llu MB, Type = %s, GUID = %s%s%s\n", (unsigned long)i,
+               e->firstLBA * SECTOR_SIZE, (e->lastLBA - e->firstLBA + 1) * SECTOR_SIZE / (1024ULL * 1024ULL),
+               gpt_type_name(e->typeGuid), guid, name[0] ? ", Name = " : "", name);
+    }
+    free(t.entries);
+}
+
+// Lists the logical drives of an MBR disk under the indices --part takes for them.
+void print_mbr_logicals(DISK_DEV* disk, const MBR* mbr) {
+    MBR_LOGICAL* links;
+    int count = mbr_logicals(part_read_dev, disk, mbr, &links);
+    for (int i = 0; i < count; i++) {
+        const PARTITION_ENTRY* e = &links[i].ebr.partition;
+        if (e->totalSectors == 0) continue;
+        printf("    Partition %d: Offset = %llu bytes, Size = %llu MB, Type = %s (0x%02X), logical\n",
+               MBR_FIRST_LOGICAL + i, (links[i].ebrLBA + e->StartingLBA) * SECTOR_SIZE,
+               (ULONGLONG)e->totalSectors * SECTOR_SIZE / (1024ULL * 1024ULL), get_fs_type_mbr(e->systemID),
+               e->systemID);
     }
+    free(links);
+}
 
-    BYTE zeroBuffer[SECTOR_SIZE] = {0};
-    LONGLONG sectorsToPartition = isLogical ? (partition.StartingLBA - 1) : (partition.StartingLBA - 1);
-    while (sectorsToPartition > 0) {
-        if (!WriteFile(hOut, zeroBuffer, SECTOR_SIZE, &bytesWritten, NULL)) {
-            perror("Failed to write zero sectors to output file");
-            CloseHandle(hDrive);
-            CloseHandle(hOut);
-            return 1;
+#ifdef __linux__
+// Hashes [offset, offset+length) of an extracted partition image into hasher. Chunks that lie wholly inside a
+// copied range are the source image's chunks byte for byte, so they take its sidecar digest (srcDigests, NULL
+// without a current one); the rest are read back from out, with the ranges that were not copied counted as zeros.
+static int extract_hash(DISK_DEV* out, HASHER* h, ULONGLONG offset, ULONGLONG length, const EXTENT* ranges,
+                        int rangeCount, const BYTE (*srcDigests)[32]) {
+    BYTE* buf = (BYTE*)malloc(h->chunkSize);
+    if (!buf) return 1;
+    ULONGLONG end = offset + length;
+    int r = 0;
+    for (ULONGLONG c = offset / h->chunkSize; c * h->chunkSize < end; c++) {
+        ULONGLONG cs = c * h->chunkSize, ce = cs + hasher_chunk_len(h, c);
+        while (r < rangeCount && ranges[r].offset + ranges[r].length <= cs) r++;
+        if (srcDigests && ce - cs == h->chunkSize && r < rangeCount && ranges[r].offset <= cs &&
+            ranges[r].offset + ranges[r].length >= ce) {
+            hasher_digest(h, c, srcDigests[c]);
+            continue;
+        }
+        ULONGLONG pos = cs > offset ? cs : offset;
+        if (ce > end) ce = end;
+        for (int i = r; pos < ce; i++) {
+            ULONGLONG rs = i < rangeCount ? ranges[i].offset : ce, re = i < rangeCount ? rs + ranges[i].length : ce;
+            if (rs > ce) rs = re = ce;
+            if (rs > pos) {
+                hasher_zero(h, pos, rs - pos);
+                pos = rs;
+            }
+            if (re > ce) re = ce;
+            if (re > pos) {
+                size_t n = (size_t)(re - pos);
+                if (dev_pread(out, buf, n, pos) != (long long)n) {
+                    free(buf);
+                    return 1;
+                }
+                hasher_add(h, buf, n, pos);
+                pos = re;
+            }
         }
-        sectorsToPartition--;
     }
+    free(buf);
+    return 0;
+}
 
-    if (isLogical) {
-        if (!WriteFile(hOut, &ebr, SECTOR_SIZE, &bytesWritten, NULL)) {
-            perror("Failed to write EBR to output file");
-            CloseHandle(hDrive);
-            CloseHandle(hOut);
+// Extracts a partition of an image file in the kernel: each range (the whole partition, or the extents in use) is
+// reflinked or copied to the same offset of out, which has to be a new file. Returns 0, 1 on an error, or -1 when
+// the kernel cannot copy between the two files and the caller should copy through user space instead.
+int extract_partition(DISK_DEV* drive, const char* imagePath, DISK_DEV* out, ULONGLONG partitionOffset,
+                      ULONGLONG partitionSize, const EXTENT_LIST* used, HASHER* hasher) {
+    if (!drive->isFile || !out->isFile || !out->fresh) return -1;
+    EXTENT whole = { partitionOffset, partitionSize };
+    EXTENT* ranges = &whole;
+    int rangeCount = 1;
+    if (used) {
+        ranges = (EXTENT*)malloc(used->count * sizeof(EXTENT) + 1);
+        if (!ranges) {
+            printf("Memory allocation failed\n");
             return 1;
         }
+        for (int i = 0; i < used->count; i++) {
+            ranges[i].offset = partitionOffset + used->items[i].offset;
+            ranges[i].length = used->items[i].length;
+        }
+        rangeCount = used->count;
     }
 
-    BYTE vbr[SECTOR_SIZE];
-    if (!SetFilePointerEx(hDrive, partitionOffset, NULL, FILE_BEGIN)) {
-        perror("Failed to set file pointer to partition start");
-        CloseHandle(hDrive);
-        CloseHandle(hOut);
+    KERNEL_COPY k;
+    memset(&k, 0, sizeof(k));
+    int rc = 0;
+    ULONGLONG at = partitionOffset;
+    for (int i = 0; i < rangeCount && rc == 0; i++) {
+        rc = kernel_copy(&k, drive, out, ranges[i].offset, ranges[i].length);
+        if (rc > 0) printf("\nError copying partition data at offset %llu. Error: %lu\n", ranges[i].offset, dev_last_error());
+        // out is new, so the ranges skipped read back as zeros already; --no-sparse wants them written all the same.
+        if (rc == 0 && !g_opts.sparse && dev_write_zeros(out, at, ranges[i].offset - at)) {
+            printf("\nError writing to output file at offset %llu. Error: %lu\n", at, dev_last_error());
+            rc = 1;
+        }
+        at = ranges[i].offset + ranges[i].length;
+    }
+    if (rc == 0 && !g_opts.sparse && dev_write_zeros(out, at, partitionOffset + partitionSize - at)) {
+        printf("\nError writing to output file at offset %llu. Error: %lu\n", at, dev_last_error());
+        rc = 1;
+    }
+    if (rc == 0) {
+        progress_print();
+        printf("\nExtracted in the kernel: %.2f MB shared by reflink, %.2f MB copied\n", k.cloned / (1024.0 * 1024.0),
+               k.copied / (1024.0 * 1024.0));
+    }
+    if (rc == 0 && hasher) {
+        ULONGLONG chunkSize = hasher->chunkSize;
+        BYTE (*srcDigests)[32] = NULL;
+        if (hash_sidecar_current(imagePath)) hash_sidecar_load(imagePath, drive->size, &chunkSize, &srcDigests);
+        if (extract_hash(out, hasher, partitionOffset, partitionSize, ranges, rangeCount,
+                         (const BYTE (*)[32])srcDigests)) {
+            printf("Error reading the extracted partition back for hashing. Error: %lu\n", dev_last_error());
+            rc = 1;
+        }
+        free(srcDigests);
+    }
+    if (ranges != &whole) free(ranges);
+    return rc;
+}
+#endif
+
+// Partition images are disk-shaped: the partition table sectors (the MBR and, for a logical partition, its EBRs; or
+// the protective MBR, GPT header and entry array) at their disk offsets, zeros up to the partition, then the
+// partition data at the same byte offset it has on the disk. wrtImg_Disk_part relies on this.
+int crtPartImage(const char* diskPath, const char* partSpec, const char* outputPath) {
+    printf("\n--------------crtPartImage----------------\n Disk=%s  Part=%s  %s\n", diskPath, partSpec, outputPath);
+
+    DISK_DEV drive;
+    if (dev_open(&drive, diskPath, DEV_READ | DEV_DIRECT)) {
+        perror("Failed to open physical drive");
         return 1;
     }
 
-    if (!ReadFile(hDrive, vbr, SECTOR_SIZE, &bytesRead, NULL)) {
+    PART_LAYOUT part;
+    if (part_locate(part_read_dev, &drive, drive.size / SECTOR_SIZE, partSpec, TRUE, &part)) {
+        part_free(&part);
+        dev_close(&drive);
+        return 1;
+    }
+    ULONGLONG partitionOffset = part.offset;
+    ULONGLONG partitionSize = part.size;
+
+    BYTE vbr[SECTOR_SIZE];
+    if (dev_pread(&drive, vbr, SECTOR_SIZE, partitionOffset) != SECTOR_SIZE) {
         perror("Failed to read VBR");
-        CloseHandle(hDrive);
-        CloseHandle(hOut);
+        part_free(&part);
+        dev_close(&drive);
         return 1;
     }
 
     printf("VBR first bytes: %02X %02X %02X %02X\n", vbr[0], vbr[1], vbr[2], vbr[3]);
     if (vbr[3] == 'N' && vbr[4] == 'T' && vbr[5] == 'F' && vbr[6] == 'S') {
         printf("Detected NTFS partition.\n");
+    } else if (memcmp(vbr + 3, "EXFAT   ", 8) == 0) {
+        printf("Detected exFAT partition.\n");
     } else if (vbr[0] == 0xEB && vbr[2] == 0x90) {
         printf("Detected FAT32 or similar partition (bootable VBR).\n");
     } else {
         printf("Warning: VBR signature not recognized.\n");
     }
 
-    if (!WriteFile(hOut, vbr, SECTOR_SIZE, &bytesWritten, NULL)) {
-        perror("Failed to write VBR to output file");
-        CloseHandle(hDrive);
-        CloseHandle(hOut);
-        return 1;
-    }
-
-    BYTE buffer[SECTOR_SIZE * 1024];
-    DWORD chunkSize = sizeof(buffer);
-    LONGLONG bytesToCopy = partitionSize.QuadPart - SECTOR_SIZE;
-    while (bytesToCopy > 0) {
-        DWORD toRead = (DWORD)(bytesToCopy > chunkSize ? chunkSize : bytesToCopy);
-        if (!ReadFile(hDrive, buffer, toRead, &bytesRead, NULL)) {
-            perror("Error reading partition data");
-            CloseHandle(hDrive);
-            CloseHandle(hOut);
-            return 1;
-        }
-        if (bytesRead != toRead) {
-            printf("Warning: Read %u bytes, expected %u bytes\n", bytesRead, toRead);
-            break;
-        }
-
-        if (!WriteFile(hOut, buffer, bytesRead, &bytesWritten, NULL)) {
-            perror("Error writing to output file");
-            CloseHandle(hDrive);
-            CloseHandle(hOut);
-            return 1;
-        }
-        if (bytesWritten != bytesRead) {
-            printf("Warning: Wrote %u bytes, expected %u bytes\n", bytesWritten, bytesRead);
-            break;
+    EXTENT_LIST used;
+    memset(&used, 0, sizeof(used));
+    BOOL haveMap = FALSE;
+    if (g_opts.usedOnly) {
+        if (fs_used_extents(&drive, partitionOffset, partitionSize, vbr, &used) == 0 && used.count > 0) {
+            haveMap = TRUE;
+            printf("In use: %.2f MB of %.2f MB in %d extents\n", extent_total(&used) / (1024.0 * 1024.0),
+                   partitionSize / (1024.0 * 1024.0), used.count);
+        } else {
+            printf("Warning: no allocation map for this filesystem, copying the whole partition.\n");
+            extent_free(&used);
         }
-
-        bytesToCopy -= bytesRead;
-        printf("\rProgress: %.2f MB", bytesToCopy / (1024.0 * 1024.0));
     }
 
-    if (bytesToCopy > 0) {
-        printf("Warning: Not all data was copied. Remaining: %lld bytes\n", bytesToCopy);
+    if (g_opts.format != FORMAT_RAW || g_opts.base) {
+        // Same layout as the raw image: the table sectors as sector patches, the partition (or the parts of it in
+        // use) read at its disk offset, zeros everywhere else.
+        EXTENT whole = { partitionOffset, partitionSize };
+        for (int i = 0; haveMap && i < used.count; i++) used.items[i].offset += partitionOffset;
+
+        IMAGE_SRC src;
+        image_src_init(&src, &drive, partitionOffset + partitionSize);
+        src.extents = haveMap ? used.items : &whole;
+        src.extentCount = haveMap ? used.count : 1;
+        src.patches = part.meta;
+        src.patchCount = part.metaCount;
+        progress_begin(src.size);
+        int rc = image_create(&src, outputPath);
+        extent_free(&used);
+        part_free(&part);
+        dev_close(&drive);
+        if (rc == 0) {
+            printf("Disk image created successfully: %s\n", outputPath);
+        }
+        return rc;
     }
 
-    CloseHandle(hDrive);
-    CloseHandle(hOut);
-
-    printf("Disk image created successfully: %s\n", outputPath);
-    return 0;
-}
-
-
-
-int DumpBootToBin(int driveNumber, int partitionNumber, const char* bootFilename) {
-    printf("\n--------------DumpBootToBin----------------\n Disk=%d  Part=%d  %s\n", driveNumber, partitionNumber, bootFilename);
-
-    char physicalDrivePath[64];
-    sprintf(physicalDrivePath, "\\\\.\\PhysicalDrive%d", driveNumber);
-
-    HANDLE hDrive = CreateFileA( physicalDrivePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL  );
-
-    if (hDrive == INVALID_HANDLE_VALUE) {
-        perror("Failed to open physical drive");
+    DISK_DEV out;
+    if (output_open(&out, outputPath)) {
+        perror("Failed to open output image file");
+        part_free(&part);
+        dev_close(&drive);
+        extent_free(&used);
         return 1;
     }
 
-    DWORD bytesRead;
-    MBR mbr;
-
-    if (!ReadFile(hDrive, &mbr, sizeof(MBR), &bytesRead, NULL)) {
-        perror("Failed to read MBR");
-        CloseHandle(hDrive);
+    progress_begin(haveMap ? extent_total(&used) : partitionSize);
+
+    // The sidecar covers the whole image, so the table sectors are hashed along with the partition.
+    ULONGLONG imageSize = partitionOffset + partitionSize;
+    HASHER hasher;
+    BOOL hashing = !g_opts.rescue && hasher_init(&hasher, 0, imageSize, HASH_CHUNK_SIZE) == 0;
+    if (part_write_meta(&out, &part, g_opts.sparse)) {
+        perror("Failed to write the partition table to output file");
+        if (hashing) hasher_free(&hasher);
+        part_free(&part);
+        dev_close(&drive);
+        dev_close(&out);
+        extent_free(&used);
         return 1;
     }
 
-    if (mbr.signature != 0xAA55) {
-        printf("Invalid MBR signature: 0x%04X\n", mbr.signature);
-        CloseHandle(hDrive);
-        return 1;
+    if (g_opts.rescue) {
+        part_free(&part);
+        char mapPath[600];
+        ULONGLONG bad;
+        rescue_map_path(outputPath, mapPath, sizeof(mapPath));
+        int status = rescue_run(&drive, &out, partitionOffset, partitionSize, haveMap ? used.items : NULL,
+                                haveMap ? used.count : 0, mapPath, &bad);
+        extent_free(&used);
+        if (status == COPY_OK) {
+            printf("Disk image created successfully: %s%s\n", outputPath, bad ? ", with unreadable sectors" : "");
+            image_hash_readback(&out, outputPath, imageSize);
+        }
+        dev_close(&drive);
+        dev_close(&out);
+        return status == COPY_OK ? 0 : 1;
     }
-
-    if (partitionNumber < 0 || partitionNumber > 3) {
-        printf("Invalid partition number. Must be 0-3\n");
-        CloseHandle(hDrive);
-        return 1;
+    BOOL metaHashed = FALSE;
+#ifdef __linux__
+    // From an image file the partition can be copied without the data passing through user space at all.
+    metaHashed = !g_opts.resume && hashing;
+    if (metaHashed) part_hash_meta(&part, &hasher);
+    int kernel = g_opts.resume ? -1 : extract_partition(&drive, diskPath, &out, partitionOffset, partitionSize,
+                                                          haveMap ? &used : NULL, hashing ? &hasher : NULL);
+    if (kernel >= 0) {
+        extent_free(&used);
+        part_free(&part);
+        if (hashing) hashing = hasher_finish(&hasher) == 0;
+        if (kernel == 0 && dev_extend(&out, imageSize)) {
+            printf("Error extending output file to %llu bytes. Error: %lu\n", imageSize, dev_last_error());
+            kernel = 1;
+        }
+        dev_close(&drive);
+        dev_close(&out);
+        if (kernel == 0) {
+            printf("\nDisk image created successfully: %s\n", outputPath);
+            image_hash_report(outputPath, imageSize, hashing ? &hasher : NULL);
+        }
+        hasher_free(&hasher);
+        return kernel;
     }
-
-    PARTITION_ENTRY partition = mbr.partitions[partitionNumber];
-
-    if (partition.totalSectors == 0) {
-        printf("Selected partition is empty or not valid.\n");
-        CloseHandle(hDrive);
+#endif
+    tune_device(&drive, diskPath, partitionOffset, partitionSize, FALSE);
+    COPY_JOB job, run;
+    copy_job_init(&job, &drive, partitionOffset, &out, partitionOffset, partitionSize);
+    job.hasher = hashing ? &hasher : NULL;
+    if (haveMap) {
+        job.extents = used.items;
+        job.extentCount = used.count;
+    }
+    JOURNAL journal;
+    char journalPath[600];
+    journal_path(outputPath, NULL, journalPath, sizeof(journalPath));
+    journal_open(&journal, journalPath, diskPath, partitionSize, outputPath, &out, partitionOffset, partitionSize,
+                 job.hasher);
+    if (hashing && !metaHashed) part_hash_meta(&part, &hasher);
+    part_free(&part);
+    int status = journal_run(&journal, &out, partitionOffset, partitionSize, FALSE, copy_segment, &job, &run);
+    extent_free(&used);
+    if (status == COPY_OK && run.bytesDone < partitionSize) {
+        status = COPY_READ_ERROR;
+        run.failOffset = run.bytesDone;
+    }
+    if (hashing) {
+        hashing = hasher_finish(&hasher) == 0 && status == COPY_OK;
+    }
+    if (status == COPY_READ_ERROR) {
+        printf("\nError reading partition data at offset %llu. Error: %lu\n", partitionOffset + run.failOffset, run.error);
+    } else if (status == COPY_WRITE_ERROR) {
+        printf("\nError writing to output file at offset %llu. Error: %lu\n", partitionOffset + run.failOffset, run.error);
+    } else if (status == COPY_NO_MEMORY) {
+        printf("Memory allocation failed\n");
+    }
+    journal_close(&journal, status == COPY_OK);
+    if (status != COPY_OK) {
+        hasher_free(&hasher);
+        dev_close(&drive);
+        dev_close(&out);
         return 1;
     }
+    dev_close(&drive);
+    dev_close(&out);
 
-    LARGE_INTEGER partitionOffset;
-    EBR ebr;
-    BOOL isLogical = (partition.systemID == 0x05 || partition.systemID == 0x0F);
-    if (isLogical) {
-        printf("Selected partition is part of an extended partition. Checking EBR...\n");
-
-        partitionOffset.QuadPart = (LONGLONG)partition.StartingLBA * SECTOR_SIZE;
-        if (!SetFilePointerEx(hDrive, partitionOffset, NULL, FILE_BEGIN)) {
-            perror("Failed to set file pointer to EBR");
-            CloseHandle(hDrive);
-            return 1;
-        }
+    printf("\nDisk image created successfully: %s\n", outputPath);
+    image_hash_report(outputPath, imageSize, hashing ? &hasher : NULL);
+    hasher_free(&hasher);
+    return 0;
+}
 
-        if (!ReadFile(hDrive, &ebr, sizeof(EBR), &bytesRead, NULL)) {
-            perror("Failed to read EBR");
-            CloseHandle(hDrive);
-            return 1;
-        }
 
-        if (ebr.signature != 0xAA55) {
-            printf("Invalid EBR signature: 0x%04X\n", ebr.signature);
-            CloseHandle(hDrive);
-            return 1;
-        }
 
-        partition = ebr.partition;
-        partitionOffset.QuadPart += SECTOR_SIZE;
-    } else {
-        partitionOffset.QuadPart = (LONGLONG)partition.StartingLBA * SECTOR_SIZE;
+int DumpBootToBin(const char* diskPath, const char* partSpec, const char* bootFilename) {
+    printf("\n--------------DumpBootToBin----------------\n Disk=%s  Part=%s  %s\n", diskPath, partSpec, bootFilename);
+
+    DISK_DEV drive;
+    if (dev_open(&drive, diskPath, DEV_READ)) {
+        perror("Failed to open physical drive");
+        return 1;
     }
 
-    BYTE vbr[SECTOR_SIZE];
-    if (!SetFilePointerEx(hDrive, partitionOffset, NULL, FILE_BEGIN)) {
-        perror("Failed to set file pointer to VBR");
-        CloseHandle(hDrive);
+    PART_LAYOUT part;
+    int rc = part_locate(part_read_dev, &drive, drive.size / SECTOR_SIZE, partSpec, FALSE, &part);
+    ULONGLONG partitionOffset = part.offset;
+    part_free(&part);
+    if (rc) {
+        dev_close(&drive);
         return 1;
     }
 
-    if (!ReadFile(hDrive, vbr, SECTOR_SIZE, &bytesRead, NULL)) {
+    BYTE vbr[SECTOR_SIZE];
+    if (dev_pread(&drive, vbr, SECTOR_SIZE, partitionOffset) != SECTOR_SIZE) {
         perror("Failed to read VBR");
-        CloseHandle(hDrive);
+        dev_close(&drive);
         return 1;
     }
 
     printf("VBR first bytes: %02X %02X %02X %02X\n", vbr[0], vbr[1], vbr[2], vbr[3]);
     if (vbr[3] == 'N' && vbr[4] == 'T' && vbr[5] == 'F' && vbr[6] == 'S') {
         printf("Detected NTFS partition.\n");
+    } else if (memcmp(vbr + 3, "EXFAT   ", 8) == 0) {
+        printf("Detected exFAT partition.\n");
     } else if (vbr[0] == 0xEB && vbr[2] == 0x90) {
         printf("Detected FAT32 or similar partition.\n");
     } else {
         printf("Warning: VBR signature not recognized.\n");
     }
 
-    HANDLE hOut = CreateFileA( bootFilename, GENERIC_WRITE, 0, NULL,  CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL,  NULL  );
-
-    if (hOut == INVALID_HANDLE_VALUE) {
+    DISK_DEV out;
+    if (dev_open(&out, bootFilename, DEV_WRITE | DEV_CREATE)) {
         perror("Failed to open output boot file");
-        CloseHandle(hDrive);
+        dev_close(&drive);
         return 1;
     }
 
-    DWORD bytesWritten;
-    if (!WriteFile(hOut, vbr, SECTOR_SIZE, &bytesWritten, NULL)) {
+    if (dev_pwrite(&out, vbr, SECTOR_SIZE, 0) != SECTOR_SIZE) {
         perror("Failed to write VBR to file");
-        CloseHandle(hDrive);
-        CloseHandle(hOut);
+        dev_close(&drive);
+        dev_close(&out);
         return 1;
     }
 
-    CloseHandle(hDrive);
-    CloseHandle(hOut);
+    dev_close(&drive);
+    dev_close(&out);
     return 0;
 }
 
-int DumpMBRToBin( int driveNumber, const char* mbrFilename) {
-    printf("\n--------------DumpMBRToBin----------------\n Disk=%d  %s\n", driveNumber,  mbrFilename);
-
-    char physicalDrivePath[64];
-    sprintf(physicalDrivePath, "\\\\.\\PhysicalDrive%d", driveNumber);
+int DumpMBRToBin(const char* diskPath, const char* mbrFilename) {
+    printf("\n--------------DumpMBRToBin----------------\n Disk=%s  %s\n", diskPath,  mbrFilename);
 
-    HANDLE hDrive = CreateFileA(
-        physicalDrivePath,
-        GENERIC_READ,
-        FILE_SHARE_READ | FILE_SHARE_WRITE,
-        NULL,
-        OPEN_EXISTING,
-        0,
-        NULL
-    );
-
-    if (hDrive == INVALID_HANDLE_VALUE) {
+    DISK_DEV drive;
+    if (dev_open(&drive, diskPath, DEV_READ)) {
         perror("Failed to open physical drive");
         return 1;
     }
 
-    DWORD bytesRead;
     MBR mbr;
 
-    if (!ReadFile(hDrive, &mbr, sizeof(MBR), &bytesRead, NULL)) {
+    if (dev_pread(&drive, &mbr, sizeof(MBR), 0) != sizeof(MBR)) {
         perror("Failed to read MBR");
-        CloseHandle(hDrive);
+        dev_close(&drive);
         return 1;
     }
 
     if (mbr.signature != 0xAA55) {
         printf("Invalid MBR signature: 0x%04X\n", mbr.signature);
-        CloseHandle(hDrive);
+        dev_close(&drive);
         return 1;
     }
 
-    HANDLE hOut = CreateFileA(
-        mbrFilename,
-        GENERIC_WRITE,
-        0,
-        NULL,
-        CREATE_ALWAYS,
-        FILE_ATTRIBUTE_NORMAL,
-        NULL
-    );
-
-    if (hOut == INVALID_HANDLE_VALUE) {
+    DISK_DEV out;
+    if (dev_open(&out, mbrFilename, DEV_WRITE | DEV_CREATE)) {
         perror("Failed to open output MBR file");
-        CloseHandle(hDrive);
+        dev_close(&drive);
         return 1;
     }
 
-    DWORD bytesWritten;
-    if (!WriteFile(hOut, &mbr, SECTOR_SIZE, &bytesWritten, NULL)) {
+    if (dev_pwrite(&out, &mbr, SECTOR_SIZE, 0) != SECTOR_SIZE) {
         perror("Failed to write MBR to file");
-        CloseHandle(hDrive);
-        CloseHandle(hOut);
+        dev_close(&drive);
+        dev_close(&out);
         return 1;
     }
 
-    CloseHandle(hDrive);
-    CloseHandle(hOut);
+    dev_close(&drive);
+    dev_close(&out);
     return 0;
 }
 
@@ -505,278 +8040,375 @@ int DumpMBRToBin( int driveNumber, const char* mbrFilename) {
 
 
 
-void wrtImg_Disk(int diskNum, const char* inFile) {
-    printf("\n--------------wrtImg_Disk----------------\n Disk=%d  %s\n", diskNum, inFile);
-
-    char diskPath[64];
-    sprintf(diskPath, "\\\\.\\PhysicalDrive%d", diskNum);
-
-    HANDLE hDisk = CreateFileA(diskPath, GENERIC_WRITE | GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
-    if (hDisk == INVALID_HANDLE_VALUE) {
-        printf("Failed to open disk %d. Error: %lu\n", diskNum, GetLastError());
-        return;
-    }
+// Returns 0 once the image is on the disk and checked.
+int wrtImg_Disk(const char* diskPath, const char* inFile) {
+    printf("\n--------------wrtImg_Disk----------------\n Disk=%s  %s\n", diskPath, inFile);
 
-    // Get disk size
-    GET_LENGTH_INFORMATION info;
-    DWORD bytesReturned;
-    if (!DeviceIoControl(hDisk, IOCTL_DISK_GET_LENGTH_INFO, NULL, 0, &info, sizeof(info), &bytesReturned, NULL)) {
-        printf("Failed to get disk size. Error: %lu\n", GetLastError());
-        CloseHandle(hDisk);
-        return;
+    DISK_DEV disk;
+    if (dev_open(&disk, diskPath, DEV_READ | DEV_WRITE | DEV_DIRECT)) {
+        printf("Failed to open disk %s. Error: %lu\n", diskPath, dev_last_error());
+        return 1;
     }
-    ULONGLONG diskSize = info.Length.QuadPart;
+    ULONGLONG diskSize = disk.size;
 
     // Open the input file
-    FILE* f = fopen(inFile, "rb");
-    if (!f) {
-        printf("Failed to open input file %s. Error: %d\n", inFile, errno);
-        CloseHandle(hDisk);
-        return;
+    IMAGE_IN in;
+    if (image_open(&in, inFile)) {
+        printf("Failed to open input file %s. Error: %lu\n", inFile, dev_last_error());
+        dev_close(&disk);
+        return 1;
     }
 
-    // Check file size
-    fseek(f, 0, SEEK_END);
-    ULONGLONG fileSize = _ftelli64(f);
-    fseek(f, 0, SEEK_SET);
-    if (fileSize > diskSize) {
+    // Check file size (a regular-file target grows as needed)
+    ULONGLONG fileSize = in.size;
+    progress_begin(fileSize);
+    if (fileSize > diskSize && !disk.isFile) {
         printf("Error: Image file (%.2f GB) is larger than disk (%.2f GB)\n",
                fileSize / (1024.0 * 1024 * 1024), diskSize / (1024.0 * 1024 * 1024));
-        fclose(f);
-        CloseHandle(hDisk);
-        return;
+        image_close(&in);
+        dev_close(&disk);
+        return 1;
     }
 
-    // Allocate a buffer
-    BYTE* buffer = (BYTE*)malloc(BUFFER_SIZE);
-    if (!buffer) {
+    // The digests recorded when the image was made, if it has a sidecar, check what is read out of it.
+    ULONGLONG hashChunk = 0;
+    BYTE (*expected)[32] = NULL;
+    if (hash_sidecar_load(inFile, fileSize, &hashChunk, &expected)) {
+        hashChunk = HASH_CHUNK_SIZE;
+    }
+    HASHER hasher;
+    BOOL hashing = hasher_init(&hasher, 0, fileSize, (size_t)hashChunk) == 0;
+
+    // Reading and writing data, with a checkpoint every JOURNAL_STEP
+    if (in.format == FORMAT_RAW) tune_device(&disk, diskPath, 0, fileSize, TRUE);
+    COPY_JOB job;
+    RESTORE_SEGMENT seg = { &in, &disk, hashing ? &hasher : NULL };
+    JOURNAL journal;
+    char journalPath[600];
+    journal_path(inFile, diskPath, journalPath, sizeof(journalPath));
+    journal_open(&journal, journalPath, inFile, fileSize, diskPath, &disk, 0, fileSize, seg.hasher);
+    int status = journal_run(&journal, &disk, 0, fileSize, FALSE, restore_segment, &seg, &job);
+    if (status == COPY_OK && job.bytesDone < fileSize) {
+        status = COPY_READ_ERROR;
+        job.failOffset = job.bytesDone;
+    }
+    if (hashing) {
+        hashing = hasher_finish(&hasher) == 0 && status == COPY_OK;
+    }
+    if (status == COPY_READ_ERROR) {
+        printf("\nRead error at offset %llu. Error: %lu\n", job.failOffset, job.error);
+    } else if (status == COPY_WRITE_ERROR) {
+        printf("\nWrite error at offset %llu. Error: %lu\n", job.failOffset, job.error);
+    } else if (status == COPY_NO_MEMORY) {
         printf("Memory allocation failed\n");
-        fclose(f);
-        CloseHandle(hDisk);
-        return;
     }
-
-    // Reading and writing data
-    ULONGLONG totalWritten = 0;
-    DWORD bytesRead, bytesWritten;
-    while (totalWritten < fileSize) {
-        ULONGLONG toRead = (fileSize - totalWritten) > BUFFER_SIZE ? BUFFER_SIZE : (fileSize - totalWritten);
-
-        bytesRead = fread(buffer, 1, (size_t)toRead, f);
-        if (bytesRead == 0) {
-            printf("Read error at offset %llu. Error: %d\n", totalWritten, errno);
-            free(buffer);
-            fclose(f);
-            CloseHandle(hDisk);
-            return;
-        }
-
-        if (!WriteFile(hDisk, buffer, bytesRead, &bytesWritten, NULL) || bytesWritten != bytesRead) {
-            printf("Write error at offset %llu. Error: %lu\n", totalWritten, GetLastError());
-            free(buffer);
-            fclose(f);
-            CloseHandle(hDisk);
-            return;
-        }
-
-        totalWritten += bytesWritten;
-        printf("\rProgress: %.2f MB", totalWritten / (1024.0 * 1024.0));
-        fflush(stdout);
+    dev_flush(&disk);
+    journal_close(&journal, status == COPY_OK);
+
+    int rc = status == COPY_OK ? 0 : 1;
+    if (status == COPY_OK) {
+        printf("\nImage written to disk %s: %s (%.2f GB)\n", diskPath, inFile, fileSize / (1024.0 * 1024 * 1024));
+        restore_compare_report(&job);
+        rc = write_hash_check(&disk, hashing ? &hasher : NULL, (const BYTE (*)[32])expected, inFile);
     }
 
     // Freeing up resources
-    free(buffer);
-    fclose(f);
-    CloseHandle(hDisk);
-
-    printf("\nImage written to disk %d: %s (%.2f GB)\n", diskNum, inFile, fileSize / (1024.0 * 1024 * 1024));
+    free(expected);
+    hasher_free(&hasher);
+    image_close(&in);
+    dev_close(&disk);
+    return rc;
 }
 
-//===========================================================================================================================
-int wrtImg_Disk_part(int driveNumber, int partitionNumber, const char* inputFilename ) {
-    printf("\n--------------wrtImg_Disk_part----------------\n Disk=%d  Part=%d  %s\n", driveNumber, partitionNumber, inputFilename);
-
-    char physicalDrivePath[64];
-    sprintf(physicalDrivePath, "\\\\.\\PhysicalDrive%d", driveNumber);
+// Writes one image to several disks in a single pass; see fanout_run(). Returns 0 when every disk got it.
+int wrtImg_Disks(const char* const* diskPaths, int count, const char* inFile) {
+    printf("\n--------------wrtImg_Disks----------------\n Disks=%d  %s\n", count, inFile);
 
-    HANDLE hDrive = CreateFileA( physicalDrivePath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0,  NULL  );
-
-    if (hDrive == INVALID_HANDLE_VALUE) {
-        perror("Failed to open physical drive");
+    IMAGE_IN in;
+    if (image_open(&in, inFile)) {
+        printf("Failed to open input file %s. Error: %lu\n", inFile, dev_last_error());
         return 1;
     }
-
-    HANDLE hIn = CreateFileA(inputFilename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL  );
-
-    if (hIn == INVALID_HANDLE_VALUE) {
-        perror("Failed to open input image file");
-        CloseHandle(hDrive);
+    ULONGLONG fileSize = in.size;
+
+    FANOUT f;
+    memset(&f, 0, sizeof(f));
+    f.img = &in;
+    f.length = fileSize;
+    f.blockSize = g_opts.blockSize ? g_opts.blockSize : FANOUT_BLOCK_SIZE;
+    f.count = g_opts.queueDepth ? g_opts.queueDepth : FANOUT_BUFFERS;
+    f.eject = g_opts.eject;
+    f.targetCount = count;
+    f.targets = (FANOUT_TARGET*)calloc(count, sizeof(FANOUT_TARGET));
+    if (!f.targets) {
+        printf("Memory allocation failed\n");
+        image_close(&in);
         return 1;
     }
 
-    DWORD bytesRead, bytesWritten;
-    MBR mbr;
-
-    if (!ReadFile(hIn, &mbr, sizeof(MBR), &bytesRead, NULL)) {
-        perror("Failed to read MBR from image");
-        CloseHandle(hDrive);
-        CloseHandle(hIn);
-        return 1;
+    // Open every target up front; with --eject one that cannot take the image is left out, otherwise nothing is written.
+    BOOL ready = TRUE;
+    for (int i = 0; i < count; i++) {
+        FANOUT_TARGET* t = &f.targets[i];
+        t->path = diskPaths[i];
+        if (dev_open(&t->dev, t->path, DEV_READ | DEV_WRITE | DEV_DIRECT)) {
+            printf("Failed to open disk %s. Error: %lu\n", t->path, dev_last_error());
+        } else if (fileSize > t->dev.size && !t->dev.isFile) {
+            printf("Error: Image file (%.2f GB) is larger than disk %s (%.2f GB)\n", fileSize / (1024.0 * 1024 * 1024),
+                   t->path, t->dev.size / (1024.0 * 1024 * 1024));
+            dev_close(&t->dev);
+        } else {
+            t->open = TRUE;
+            copy_job_init(&t->job, NULL, 0, &t->dev, 0, fileSize);
+            if (g_opts.changedOnly) {
+                t->job.compare = TRUE;
+                t->job.sparse = FALSE;      // an unchanged hole already reads as zeros
+            }
+            f.active++;
+            continue;
+        }
+        t->ejected = TRUE;
+        t->status = COPY_WRITE_ERROR;
+        if (!f.eject) ready = FALSE;
     }
-
-    if (mbr.signature != 0xAA55) {
-        printf("Invalid MBR signature in image: 0x%04X\n", mbr.signature);
-        CloseHandle(hDrive);
-        CloseHandle(hIn);
+    if (!ready || f.active == 0) {
+        printf("Nothing written\n");
+        for (int i = 0; i < count; i++) {
+            if (f.targets[i].open) dev_close(&f.targets[i].dev);
+        }
+        free(f.targets);
+        image_close(&in);
         return 1;
     }
 
-    if (partitionNumber < 0 || partitionNumber > 3) {
-        printf("Invalid partition number. Must be 0-3\n");
-        CloseHandle(hDrive);
-        CloseHandle(hIn);
-        return 1;
+    // The digests recorded when the image was made, if it has a sidecar, check what is read out of it.
+    ULONGLONG hashChunk = 0;
+    BYTE (*expected)[32] = NULL;
+    if (hash_sidecar_load(inFile, fileSize, &hashChunk, &expected)) {
+        hashChunk = HASH_CHUNK_SIZE;
     }
+    HASHER hasher;
+    BOOL hashing = hasher_init(&hasher, 0, fileSize, (size_t)hashChunk) == 0;
 
-    PARTITION_ENTRY partition = mbr.partitions[partitionNumber];
-
-    if (partition.totalSectors == 0) {
-        printf("Selected partition is empty or not valid.\n");
-        CloseHandle(hDrive);
-        CloseHandle(hIn);
-        return 1;
+    progress_begin(fileSize);
+    int status = fanout_run(&f, hashing ? &hasher : NULL);
+    if (hashing) {
+        hashing = hasher_finish(&hasher) == 0 && status == COPY_OK;
+    }
+    if (status == COPY_READ_ERROR) {
+        printf("\nRead error at offset %llu. Error: %lu\n", f.failOffset, f.error);
+    } else if (status == COPY_NO_MEMORY) {
+        printf("Memory allocation failed\n");
     }
 
-    LARGE_INTEGER partitionOffset;
-    EBR ebr;
-    BOOL isLogical = (partition.systemID == 0x05 || partition.systemID == 0x0F);
-    if (isLogical) {
-        printf("Writing to logical partition. Checking EBR...\n");
-
-        if (!ReadFile(hIn, &ebr, sizeof(EBR), &bytesRead, NULL)) {
-            perror("Failed to read EBR from image");
-            CloseHandle(hDrive);
-            CloseHandle(hIn);
-            return 1;
+    // Trailing holes are not backed by any write, so file targets are grown to the full length explicitly.
+    printf("\n");
+    int written = 0;
+    for (int i = 0; i < count; i++) {
+        FANOUT_TARGET* t = &f.targets[i];
+        if (!t->open) {
+            printf("  %s: not written\n", t->path);
+            continue;
         }
-
-        if (ebr.signature != 0xAA55) {
-            printf("Invalid EBR signature: 0x%04X\n", ebr.signature);
-            CloseHandle(hDrive);
-            CloseHandle(hIn);
-            return 1;
+        if (status == COPY_OK && t->status == COPY_OK && t->job.bytesDone == fileSize &&
+            ((t->job.sparse && dev_extend(&t->dev, fileSize)) || dev_flush(&t->dev))) {
+            t->status = COPY_WRITE_ERROR;
+            t->job.failOffset = fileSize;
+            t->job.error = dev_last_error();
+        }
+        if (t->status != COPY_OK) {
+            printf("  %s: FAILED, %s at offset %llu. Error: %lu\n", t->path, t->ejected ? "ejected after a write error" :
+                   "write error", t->job.failOffset, t->job.error);
+        } else if (status != COPY_OK || t->job.bytesDone < fileSize) {
+            printf("  %s: incomplete, %.2f MB written\n", t->path, t->job.bytesDone / (1024.0 * 1024.0));
+            t->status = COPY_WRITE_ERROR;
+        } else {
+            printf("  %s: written\n", t->path);
+            restore_compare_report(&t->job);
+            written++;
+        }
+    }
+    if (written > 0) {
+        printf("Image written to %d of %d disks: %s (%.2f GB)\n", written, count, inFile, fileSize / (1024.0 * 1024 * 1024));
+        if (!hashing) {
+            printf("Warning: the data could not be hashed%s\n", g_opts.verify ? ", nothing verified" : "");
+            if (g_opts.verify) written = 0;
+        } else if (image_hash_check(&hasher, (const BYTE (*)[32])expected, inFile)) {
+            written = 0;                                // what was read out of the image is not what was put in it
+        } else if (g_opts.verify) {
+            for (int i = 0; i < count; i++) {
+                if (f.targets[i].status != COPY_OK || !f.targets[i].open) continue;
+                printf("Verifying %s\n", f.targets[i].path);
+                if (verify_range(&f.targets[i].dev, 0, fileSize, hasher.chunkSize, (const BYTE (*)[32])hasher.digests)) {
+                    printf("  %s: FAILED verification\n", f.targets[i].path);
+                    f.targets[i].status = COPY_WRITE_ERROR;
+                    written--;
+                }
+            }
         }
+    }
 
-        partition = ebr.partition;
-        partitionOffset.QuadPart = (LONGLONG)(partition.StartingLBA + 1) * SECTOR_SIZE;
-    } else {
-        partitionOffset.QuadPart = (LONGLONG)partition.StartingLBA * SECTOR_SIZE;
+    for (int i = 0; i < count; i++) {
+        if (f.targets[i].open) dev_close(&f.targets[i].dev);
     }
+    free(f.targets);
+    free(expected);
+    hasher_free(&hasher);
+    image_close(&in);
+    return written == count ? 0 : 1;
+}
+
+//===========================================================================================================================
+int wrtImg_Disk_part(const char* diskPath, const char* partSpec, const char* inputFilename) {
+    printf("\n--------------wrtImg_Disk_part----------------\n Disk=%s  Part=%s  %s\n", diskPath, partSpec, inputFilename);
 
-    LARGE_INTEGER partitionSize;
-    partitionSize.QuadPart = (LONGLONG)partition.totalSectors * SECTOR_SIZE;
+    DISK_DEV drive;
+    if (dev_open(&drive, diskPath, DEV_READ | DEV_WRITE | DEV_DIRECT)) {
+        perror("Failed to open physical drive");
+        return 1;
+    }
 
-    if (!WriteFile(hDrive, &mbr, SECTOR_SIZE, &bytesWritten, NULL)) {
-        perror("Failed to write MBR to disk");
-        CloseHandle(hDrive);
-        CloseHandle(hIn);
+    IMAGE_IN in;
+    if (image_open(&in, inputFilename)) {
+        perror("Failed to open input image file");
+        dev_close(&drive);
         return 1;
     }
 
-    BYTE zeroBuffer[SECTOR_SIZE] = {0};
-    LONGLONG sectorsToPartition = isLogical ? (partition.StartingLBA - 1) : (partition.StartingLBA - 1);
-    while (sectorsToPartition > 0) {
-        if (!WriteFile(hDrive, zeroBuffer, SECTOR_SIZE, &bytesWritten, NULL)) {
-            perror("Failed to write zero sectors to disk");
-            CloseHandle(hDrive);
-            CloseHandle(hIn);
-            return 1;
-        }
-        sectorsToPartition--;
+    // The image mirrors the disk layout (see crtPartImage), so both sides use the same offsets.
+    PART_LAYOUT part;
+    if (part_locate(part_read_image, &in, 0, partSpec, FALSE, &part)) {
+        part_free(&part);
+        dev_close(&drive);
+        image_close(&in);
+        return 1;
+    }
+    ULONGLONG partitionOffset = part.offset;
+    ULONGLONG partitionSize = part.size;
+    if (partitionOffset + partitionSize > drive.size && !drive.isFile) {
+        printf("Error: the partition ends at %.2f GB, past the end of the disk (%.2f GB)\n",
+               (partitionOffset + partitionSize) / (1024.0 * 1024 * 1024), drive.size / (1024.0 * 1024 * 1024));
+        part_free(&part);
+        dev_close(&drive);
+        image_close(&in);
+        return 1;
     }
 
-    if (isLogical) {
-        if (!WriteFile(hDrive, &ebr, SECTOR_SIZE, &bytesWritten, NULL)) {
-            perror("Failed to write EBR to disk");
-            CloseHandle(hDrive);
-            CloseHandle(hIn);
-            return 1;
+    int rc = 0;
+    if (part.isGpt) {
+        // Only the partition's own LBA range is written, into a GPT that has the same partition; a blank disk gets
+        // the image's table. A disk partitioned differently, or with an MBR, is left alone.
+        GPT_TABLE target;
+        const GPT_ENTRY* want = gpt_entry(&part.gpt, (DWORD)part.index);
+        ULONGLONG diskSectors = drive.size / SECTOR_SIZE;
+        ULONGLONG sourceSectors = ((const GPT_HEADER*)part.gpt.sector)->alternateLBA + 1;
+        if (drive.isFile && diskSectors < sourceSectors) diskSectors = sourceSectors;   // a file grows to fit
+        if (gpt_load(part_read_dev, &drive, drive.size / SECTOR_SIZE, &target) == 0) {
+            const GPT_HEADER* th = (const GPT_HEADER*)target.sector;
+            const GPT_ENTRY* have = (DWORD)part.index < th->entryCount ? gpt_entry(&target, (DWORD)part.index) : NULL;
+            if (!have || !gpt_entry_used(have) || have->firstLBA != want->firstLBA || have->lastLBA != want->lastLBA) {
+                printf("The GPT on %s has no partition %d at LBA %llu-%llu; restore the whole disk or recreate the "
+                       "partition first\n", diskPath, part.index, want->firstLBA, want->lastLBA);
+                rc = 1;
+            }
+            free(target.entries);
+        } else {
+            MBR have;
+            memset(&have, 0, sizeof(have));
+            if (dev_pread(&drive, &have, sizeof(have), 0) < 0 || !mbr_is_blank(&have)) {
+                printf("%s has no valid GPT but is not blank either (it has an MBR or a damaged GPT); restore the "
+                       "whole disk or clear it first\n", diskPath);
+                rc = 1;
+            } else {
+                printf("No partition table on %s, writing the image's GPT\n", diskPath);
+                if (gpt_write_table(&drive, diskSectors, &part)) {
+                    perror("Failed to write the partition table to disk");
+                    rc = 1;
+                }
+            }
+        }
+    } else {
+        // The MBR and the EBRs up to this partition go back in place; the sectors between them belong to other
+        // partitions (or other logical drives) and are left as they are.
+        for (int i = 0; i < part.metaCount && rc == 0; i++) {
+            if (dev_pwrite(&drive, part.meta[i].data, SECTOR_SIZE, part.meta[i].offset) != SECTOR_SIZE) {
+                perror("Failed to write the partition table to disk");
+                rc = 1;
+            }
         }
     }
+    part_free(&part);
+    if (rc) {
+        dev_close(&drive);
+        image_close(&in);
+        return 1;
+    }
 
     BYTE vbr[SECTOR_SIZE];
-    if (!ReadFile(hIn, vbr, SECTOR_SIZE, &bytesRead, NULL)) {
+    if (image_pread(&in, vbr, SECTOR_SIZE, partitionOffset) != SECTOR_SIZE) {
         perror("Failed to read VBR from image");
-        CloseHandle(hDrive);
-        CloseHandle(hIn);
+        dev_close(&drive);
+        image_close(&in);
         return 1;
     }
 
     printf("VBR first bytes: %02X %02X %02X %02X\n", vbr[0], vbr[1], vbr[2], vbr[3]);
     if (vbr[3] == 'N' && vbr[4] == 'T' && vbr[5] == 'F' && vbr[6] == 'S') {
         printf("Detected NTFS partition.\n");
+    } else if (memcmp(vbr + 3, "EXFAT   ", 8) == 0) {
+        printf("Detected exFAT partition.\n");
     } else if (vbr[0] == 0xEB && vbr[2] == 0x90) {
         printf("Detected FAT32 or similar partition.\n");
     } else {
         printf("Warning: VBR signature not recognized.\n");
     }
 
-    if (!SetFilePointerEx(hDrive, partitionOffset, NULL, FILE_BEGIN)) {
-        perror("Failed to set file pointer to partition start");
-        CloseHandle(hDrive);
-        CloseHandle(hIn);
-        return 1;
+    progress_begin(partitionSize);
+    if (in.format == FORMAT_RAW) tune_device(&drive, diskPath, partitionOffset, partitionSize, TRUE);
+    COPY_JOB job;
+    HASHER hasher;
+    BOOL hashing = hasher_init(&hasher, partitionOffset, partitionSize, HASH_CHUNK_SIZE) == 0;
+    RESTORE_SEGMENT seg = { &in, &drive, hashing ? &hasher : NULL };
+    JOURNAL journal;
+    char journalPath[600];
+    journal_path(inputFilename, diskPath, journalPath, sizeof(journalPath));
+    journal_open(&journal, journalPath, inputFilename, in.size, diskPath, &drive, partitionOffset, partitionSize, seg.hasher);
+    int status = journal_run(&journal, &drive, partitionOffset, partitionSize, TRUE, restore_segment, &seg, &job);
+    if (status == COPY_OK && job.bytesDone < partitionSize) {
+        status = COPY_READ_ERROR;
+        job.failOffset = job.bytesDone;
     }
-
-    if (!WriteFile(hDrive, vbr, SECTOR_SIZE, &bytesWritten, NULL)) {
-        perror("Failed to write VBR to disk");
-        CloseHandle(hDrive);
-        CloseHandle(hIn);
-        return 1;
+    if (hashing) {
+        hashing = hasher_finish(&hasher) == 0 && status == COPY_OK;
     }
-
-    BYTE buffer[SECTOR_SIZE * 1024];
-    DWORD chunkSize = sizeof(buffer);
-    LONGLONG bytesToCopy = partitionSize.QuadPart - SECTOR_SIZE;
-    while (bytesToCopy > 0) {
-        DWORD toRead = (DWORD)(bytesToCopy > chunkSize ? chunkSize : bytesToCopy);
-        if (!ReadFile(hIn, buffer, toRead, &bytesRead, NULL)) {
-            perror("Error reading image data");
-            CloseHandle(hDrive);
-            CloseHandle(hIn);
-            return 1;
-        }
-        if (bytesRead != toRead) {
-            printf("Warning: Read %u bytes, expected %u bytes\n", bytesRead, toRead);
-            break;
-        }
-
-        if (!WriteFile(hDrive, buffer, bytesRead, &bytesWritten, NULL)) {
-            perror("Error writing to disk");
-            CloseHandle(hDrive);
-            CloseHandle(hIn);
-            return 1;
-        }
-        if (bytesWritten != bytesRead) {
-            printf("Warning: Wrote %u bytes, expected %u bytes\n", bytesWritten, bytesRead);
-            break;
-        }
-
-        bytesToCopy -= bytesRead;
+    if (status == COPY_READ_ERROR) {
+        printf("\nError reading image data at offset %llu. Error: %lu\n", partitionOffset + job.failOffset, job.error);
+    } else if (status == COPY_WRITE_ERROR) {
+        printf("\nError writing to disk at offset %llu. Error: %lu\n", partitionOffset + job.failOffset, job.error);
+    } else if (status == COPY_NO_MEMORY) {
+        printf("Memory allocation failed\n");
     }
-
-    if (bytesToCopy > 0) {
-        printf("Warning: Not all data was copied. Remaining: %lld bytes\n", bytesToCopy);
+    dev_flush(&drive);
+    journal_close(&journal, status == COPY_OK);
+    if (status != COPY_OK) {
+        hasher_free(&hasher);
+        dev_close(&drive);
+        image_close(&in);
+        return 1;
     }
+    restore_compare_report(&job);
 
-    CloseHandle(hDrive);
-    CloseHandle(hIn);
-    return 0;
+    rc = write_hash_check(&drive, hashing ? &hasher : NULL, NULL, inputFilename);
+    hasher_free(&hasher);
+    dev_close(&drive);
+    image_close(&in);
+    return rc;
 }
 
 
 
 //++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+#ifdef _WIN32
 void safe_print_string_at_offset(const BYTE* buf, DWORD bufSize, DWORD offset, char* out, size_t outSize) {
     if (offset == 0 || offset >= bufSize) {
         out[0] = '\0';
@@ -787,7 +8419,28 @@ void safe_print_string_at_offset(const BYTE* buf, DWORD bufSize, DWORD offset, c
     strncpy(out, src, maxcopy);
     out[maxcopy] = '\0';
 }
+#endif
+
+void print_mbr_partitions(const BYTE* sector) {
+    const MBR* mbr = (const MBR*)sector;
+    if (mbr->signature == 0xAA55) {
+        printf("  Partition Table Type: MBR\n");
+        for (int p = 0; p < 4; p++) {
+            const PARTITION_ENTRY* part = &mbr->partitions[p];
+            if (part->totalSectors == 0) continue;
+            unsigned long long offset_bytes = (unsigned long long)part->StartingLBA * SECTOR_SIZE;
+            unsigned long long size_bytes = (unsigned long long)part->totalSectors * SECTOR_SIZE;
+            unsigned long long size_mb = size_bytes / (1024ULL * 1024ULL);
+            const char* fsType = get_fs_type_mbr(part->systemID);
+            printf("    Partition %d: Offset = %llu bytes, Size = %llu MB, Type = %s (0x%02X)\n",
+                   p, offset_bytes, size_mb, fsType, part->systemID);
+        }
+    } else {
+        printf("  Partition Table Type: Unknown (no MBR signature)\n");
+    }
+}
 
+#ifdef _WIN32
 void list_disks() {
     printf("----------------------------------------------------------\n");
     for (int i = 0; i < 32; i++) {
@@ -856,21 +8509,15 @@ void list_disks() {
         } else {
             DWORD br = 0;
             if (ReadFile(hDevice, sector, SECTOR_SIZE, &br, NULL) && br == SECTOR_SIZE) {
-                MBR* mbr = (MBR*)sector;
-                if (mbr->signature == 0xAA55) {
-                    printf("  Partition Table Type: MBR\n");
-                    for (int p = 0; p < 4; p++) {
-                        PARTITION_ENTRY* part = &mbr->partitions[p];
-                        if (part->totalSectors == 0) continue;
-                        unsigned long long offset_bytes = (unsigned long long)part->StartingLBA * SECTOR_SIZE;
-                        unsigned long long size_bytes = (unsigned long long)part->totalSectors * SECTOR_SIZE;
-                        unsigned long long size_mb = size_bytes / (1024ULL * 1024ULL);
-                        const char* fsType = get_fs_type_mbr(part->systemID);
-                        printf("    Partition %d: Offset = %llu bytes, Size = %llu MB, Type = %s (0x%02X)\n",
-                               p, offset_bytes, size_mb, fsType, part->systemID);
+                print_mbr_partitions(sector);
+                DISK_DEV disk;
+                if (((const MBR*)sector)->signature == 0xAA55 && dev_open(&disk, diskPath, DEV_READ) == 0) {
+                    if (mbr_is_protective((const MBR*)sector)) {
+                        print_gpt_partitions(&disk);
+                    } else {
+                        print_mbr_logicals(&disk, (const MBR*)sector);
                     }
-                } else {
-                    printf("  Partition Table Type: Unknown (no MBR signature)\n");
+                    dev_close(&disk);
                 }
             } else {
                 DWORD err = GetLastError();
@@ -925,6 +8572,949 @@ void list_disks() {
         printf("----------------------------------------------------------\n");
     }
 }
+#else
+void list_disks() {
+    printf("----------------------------------------------------------\n");
+    DIR* dir = opendir("/sys/block");
+    if (!dir) {
+        printf("  Cannot enumerate /sys/block (error %d).\n", errno);
+        return;
+    }
+    struct dirent* de;
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.' || strncmp(de->d_name, "ram", 3) == 0) continue;
+
+        char diskPath[300];
+        snprintf(diskPath, sizeof(diskPath), "/dev/%s", de->d_name);
+
+        DISK_DEV disk;
+        if (dev_open(&disk, diskPath, DEV_READ)) {
+            unsigned long err = dev_last_error();
+            printf("%s:\n  Cannot open %s (error %lu).", diskPath, diskPath, err);
+            if (err == EACCES) {
+                printf(" Access denied (need root?).");
+            }
+            printf("\n----------------------------------------------------------\n");
+            continue;
+        }
+        if (disk.size == 0) {       // unbound loop devices, empty card readers
+            dev_close(&disk);
+            continue;
+        }
+        printf("%s:\n", diskPath);
+        printf("  Size: %llu MB\n", (unsigned long long)(disk.size / (1024ULL * 1024ULL)));
+
+        BYTE sector[SECTOR_SIZE];
+        if (dev_pread(&disk, sector, SECTOR_SIZE, 0) == SECTOR_SIZE) {
+            print_mbr_partitions(sector);
+            if (((const MBR*)sector)->signature == 0xAA55 && mbr_is_protective((const MBR*)sector)) {
+                print_gpt_partitions(&disk);
+            } else if (((const MBR*)sector)->signature == 0xAA55) {
+                print_mbr_logicals(&disk, (const MBR*)sector);
+            }
+        } else {
+            printf("  Read MBR failed (error %lu). Device may be removable or not ready.\n", dev_last_error());
+        }
+
+        char modelPath[300], model[128] = "";
+        snprintf(modelPath, sizeof(modelPath), "/sys/block/%s/device/model", de->d_name);
+        FILE* mf = fopen(modelPath, "r");
+        if (mf) {
+            if (fgets(model, sizeof(model), mf)) model[strcspn(model, "\n")] = '\0';
+            fclose(mf);
+        }
+        if (model[0]) {
+            printf("  Model: %s\n", model);
+        } else {
+            printf("  Model info: unavailable.\n");
+        }
+
+        dev_close(&disk);
+        printf("----------------------------------------------------------\n");
+    }
+    closedir(dir);
+}
+#endif
+
+//================================================================================================================
+// Benchmark.
+// bench builds synthetic source disks in a scratch directory (the same bytes for the same --size on every host),
+// runs the create and write paths over them across I/O engines, block sizes and queue depths, and appends one
+// JSON object per run to a results file: throughput, CPU seconds per GB, syscalls and request latency percentiles.
+// A run's engine is the one its raw copy actually ran on, null when the data went another way (containers, or a
+// partition extracted in the kernel).
+//
+//   zero, random, mixed    whole-disk images of that content (mixed: 64 KB runs of zeros, noise and text)
+//   fat32, ntfs, ext4      an MBR disk with one partition holding that filesystem's allocation structures, about
+//                          half of it allocated to mixed data and the free space full of stale noise
+//
+// With --disk each source is also put on that device (a loop device or a spare drive; it is overwritten), which
+// then serves as a create source and as a write target.
+
+#define BENCH_PART_LBA  2048
+#define BENCH_UNIT      4096            // allocation unit of the synthetic filesystems
+#define BENCH_REGION    (64 * 1024)     // content of a mixed source changes every region
+#define BENCH_RUN_MAX   256             // longest allocated or free run, in units
+#define BENCH_MIN_SIZE  (64ULL * 1024 * 1024)
+#define BENCH_MAX_BUFS  (256ULL * 1024 * 1024)     // block size x queue depth above this is skipped
+
+#define BENCH_ZERO    0
+#define BENCH_RANDOM  1
+#define BENCH_MIXED   2
+#define BENCH_FAT32   3
+#define BENCH_NTFS    4
+#define BENCH_EXT4    5
+#define BENCH_SOURCES 6
+
+static const char* const bench_sources[BENCH_SOURCES] = { "zero", "random", "mixed", "fat32", "ntfs", "ext4" };
+static const char* const bench_formats[] = { "raw", "wdx", "dedup", "qcow2", "vhd", "vhdx", "vmdk" };
+
+typedef struct {
+    int kind;
+    ULONGLONG size;
+    ULONGLONG partSectors;
+    ULONGLONG units;            // BENCH_UNITs in the partition
+    ULONGLONG fsUnits;          // units the filesystem covers
+    BYTE* used;                 // one bit per unit: allocated (mixed data) or free (stale noise)
+    BYTE* meta;                 // one bit per unit: filesystem structures, zeros until written over
+} BENCH_DISK;
+
+typedef struct {
+    const char* op;             // "create" or "write"
+    int source;
+    BOOL onDevice;              // the device given with --disk is the source (create) or the target (write)
+    const char* part;           // --part, NULL for the whole disk
+    int format;
+    BOOL usedOnly;
+    int engine;
+    size_t blockSize;           // 0: the engine's defaults
+    int queueDepth;
+} BENCH_CASE;
+
+typedef struct {
+    const char* dir;
+    const char* device;         // --disk, NULL without
+    ULONGLONG size;
+    int runs;
+    BOOL quick;
+    int only;                   // --source, -1 for all of them
+    FILE* out;
+    IMAGE_OPTS opts;            // g_opts as given on the command line, restored before every run
+    int total;
+    int failed;
+} BENCH;
+
+typedef struct {
+    double cpu;                 // user + system seconds of the whole process
+    LONGLONG syscalls;          // read/write system calls, -1 where the OS does not count them
+} BENCH_USAGE;
+
+static void bit_set(BYTE* map, ULONGLONG i) { map[i >> 3] |= (BYTE)(1 << (i & 7)); }
+static BOOL bit_get(const BYTE* map, ULONGLONG i) { return (map[i >> 3] >> (i & 7)) & 1; }
+static void put_le16(BYTE* p, WORD v) { p[0] = (BYTE)v; p[1] = (BYTE)(v >> 8); }
+static void put_le32(BYTE* p, DWORD v) { put_le16(p, (WORD)v); put_le16(p + 2, (WORD)(v >> 16)); }
+static void put_le64(BYTE* p, ULONGLONG v) { put_le32(p, (DWORD)v); put_le32(p + 4, (DWORD)(v >> 32)); }
+
+static ULONGLONG bench_next(ULONGLONG* s) {
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+static ULONGLONG bench_seed(ULONGLONG n) {
+    return (n + 1) * 0x9E3779B97F4A7C15ULL;
+}
+
+static void bench_noise(BYTE* p, size_t len, ULONGLONG offset) {
+    ULONGLONG s = bench_seed(offset);
+    for (size_t at = 0; at < len; at += 8) {
+        ULONGLONG v = bench_next(&s);
+        memcpy(p + at, &v, 8);
+    }
+}
+
+static void bench_text(BYTE* p, size_t len, ULONGLONG offset) {
+    static const char* const words[] = {
+        "the ", "disk ", "image ", "sector ", "partition ", "volume ", "record ", "\r\n", "0x00000000 ",
+        "C:\\Windows\\System32\\", "config ", "<value name=\"", "\"/>", "user ", "1970-01-01 ", "error ",
+    };
+    ULONGLONG s = bench_seed(offset);
+    size_t at = 0;
+    while (at < len) {
+        const char* w = words[bench_next(&s) % (sizeof(words) / sizeof(words[0]))];
+        size_t n = strlen(w);
+        if (n > len - at) n = len - at;
+        memcpy(p + at, w, n);
+        at += n;
+    }
+}
+
+// Content of the unit at offset of a mixed source or of allocated filesystem space.
+static void bench_mixed(BYTE* p, ULONGLONG offset) {
+    ULONGLONG s = bench_seed(offset / BENCH_REGION);
+    switch (bench_next(&s) % 4) {
+        case 0:  memset(p, 0, BENCH_UNIT); break;
+        case 1:  bench_noise(p, BENCH_UNIT, offset); break;
+        default: bench_text(p, BENCH_UNIT, offset); break;
+    }
+}
+
+// Marks units [first, first+count) as filesystem structures.
+static void bench_meta(BENCH_DISK* d, ULONGLONG first, ULONGLONG count) {
+    for (ULONGLONG u = first; u < first + count && u < d->units; u++) {
+        bit_set(d->used, u);
+        bit_set(d->meta, u);
+    }
+}
+
+// Allocates alternating runs of units from first up to the end of the filesystem, about half of them.
+static void bench_allocate(BENCH_DISK* d, ULONGLONG first) {
+    ULONGLONG s = bench_seed(d->kind);
+    ULONGLONG u = first;
+    while (u < d->fsUnits) {
+        ULONGLONG run = 1 + bench_next(&s) % BENCH_RUN_MAX;
+        for (ULONGLONG i = 0; i < run && u < d->fsUnits; i++) bit_set(d->used, u++);
+        u += 1 + bench_next(&s) % BENCH_RUN_MAX;
+    }
+}
+
+// FAT32 with 512-byte sectors: the cluster size is the largest (up to one unit) that keeps the volume FAT32, and
+// the FATs are padded so the data area starts on a unit.
+static void bench_fat32_geometry(const BENCH_DISK* d, DWORD* spc, DWORD* fatSectors, ULONGLONG* clusters) {
+    *spc = BENCH_UNIT / SECTOR_SIZE;
+    while (*spc > 1 && d->partSectors / *spc < 70000) *spc /= 2;
+    *fatSectors = (DWORD)(((d->partSectors / *spc + 2) * 4 + SECTOR_SIZE - 1) / SECTOR_SIZE);
+    while ((32 + 2 * *fatSectors) % (BENCH_UNIT / SECTOR_SIZE)) (*fatSectors)++;
+    *clusters = (d->partSectors - 32 - 2ULL * *fatSectors) / *spc;
+}
+
+static void bench_fat32_plan(BENCH_DISK* d) {
+    DWORD spc, fatSectors;
+    ULONGLONG clusters;
+    bench_fat32_geometry(d, &spc, &fatSectors, &clusters);
+    ULONGLONG dataUnit = (32 + 2ULL * fatSectors) * SECTOR_SIZE / BENCH_UNIT;
+    d->fsUnits = dataUnit + clusters * spc * SECTOR_SIZE / BENCH_UNIT;
+    bench_meta(d, 0, dataUnit + 1);     // reserved sectors, both FATs and the root directory (cluster 2)
+    bench_allocate(d, dataUnit + 1);
+}
+
+static int bench_fat32_write(const BENCH_DISK* d, DISK_DEV* dev, ULONGLONG part) {
+    DWORD spc, fatSectors;
+    ULONGLONG clusters;
+    bench_fat32_geometry(d, &spc, &fatSectors, &clusters);
+    ULONGLONG dataSector = 32 + 2ULL * fatSectors;
+
+    BYTE vbr[SECTOR_SIZE], info[SECTOR_SIZE];
+    memset(vbr, 0, sizeof(vbr));
+    memcpy(vbr, "\xEB\x58\x90MSWIN4.1", 11);
+    put_le16(vbr + 0x0B, SECTOR_SIZE);
+    vbr[0x0D] = (BYTE)spc;
+    put_le16(vbr + 0x0E, 32);
+    vbr[0x10] = 2;
+    vbr[0x15] = 0xF8;
+    put_le16(vbr + 0x18, 63);
+    put_le16(vbr + 0x1A, 255);
+    put_le32(vbr + 0x1C, BENCH_PART_LBA);
+    put_le32(vbr + 0x20, (DWORD)d->partSectors);
+    put_le32(vbr + 0x24, fatSectors);
+    put_le32(vbr + 0x2C, 2);
+    put_le16(vbr + 0x30, 1);
+    put_le16(vbr + 0x32, 6);
+    vbr[0x40] = 0x80;
+    vbr[0x42] = 0x29;
+    memcpy(vbr + 0x47, "BENCH      FAT32   ", 19);
+    put_le16(vbr + 510, 0xAA55);
+    memset(info, 0, sizeof(info));
+    put_le32(info, 0x41615252);
+    put_le32(info + 484, 0x61417272);
+    put_le32(info + 488, 0xFFFFFFFF);
+    put_le32(info + 492, 0xFFFFFFFF);
+    put_le32(info + 508, 0xAA550000);
+    if (dev_pwrite(dev, vbr, SECTOR_SIZE, part) != SECTOR_SIZE ||
+        dev_pwrite(dev, info, SECTOR_SIZE, part + SECTOR_SIZE) != SECTOR_SIZE ||
+        dev_pwrite(dev, vbr, SECTOR_SIZE, part + 6 * SECTOR_SIZE) != SECTOR_SIZE) {
+        return 1;
+    }
+
+    // Every run of allocated clusters is one file: each entry points at the next, the last one ends the chain.
+    size_t fatBytes = (size_t)fatSectors * SECTOR_SIZE;
+    BYTE* fat = (BYTE*)calloc(1, fatBytes);
+    if (!fat) return 1;
+    ULONGLONG clustersPerUnit = BENCH_UNIT / SECTOR_SIZE / spc;
+    ULONGLONG firstUnit = dataSector * SECTOR_SIZE / BENCH_UNIT;
+    put_le32(fat, 0x0FFFFFF8);
+    put_le32(fat + 4, 0x0FFFFFFF);
+    for (ULONGLONG n = 2; n < clusters + 2; n++) {
+        if (!bit_get(d->used, firstUnit + (n - 2) / clustersPerUnit)) continue;
+        BOOL next = n + 1 < clusters + 2 && bit_get(d->used, firstUnit + (n - 1) / clustersPerUnit);
+        put_le32(fat + n * 4, next ? (DWORD)(n + 1) : 0x0FFFFFFF);
+    }
+    int rc = 0;
+    for (int f = 0; f < 2 && rc == 0; f++) {
+        ULONGLONG at = part + (32 + (ULONGLONG)f * fatSectors) * SECTOR_SIZE;
+        if (dev_pwrite(dev, fat, fatBytes, at) != (long long)fatBytes) rc = 1;
+    }
+    free(fat);
+    return rc;
+}
+
+// NTFS with 4 KB clusters and 1 KB file records: the boot sector, $MFT at cluster 4 and $Bitmap right after the
+// MFT zone. Only what ntfs_used_extents reads is filled in.
+#define BENCH_NTFS_MFT      4
+#define BENCH_NTFS_MFTZONE  64
+#define BENCH_NTFS_RECORD   1024
+
+static void bench_ntfs_plan(BENCH_DISK* d) {
+    d->fsUnits = (d->partSectors - 1) * SECTOR_SIZE / BENCH_UNIT;
+    ULONGLONG bitmapUnits = ((d->fsUnits + 7) / 8 + BENCH_UNIT - 1) / BENCH_UNIT;
+    ULONGLONG first = BENCH_NTFS_MFT + BENCH_NTFS_MFTZONE + bitmapUnits;
+    bench_meta(d, 0, first);
+    bench_allocate(d, first);
+}
+
+static int bench_ntfs_write(const BENCH_DISK* d, DISK_DEV* dev, ULONGLONG part) {
+    ULONGLONG bitmapLcn = BENCH_NTFS_MFT + BENCH_NTFS_MFTZONE;
+    ULONGLONG bitmapBytes = (d->fsUnits + 7) / 8;
+    ULONGLONG bitmapUnits = (bitmapBytes + BENCH_UNIT - 1) / BENCH_UNIT;
+
+    BYTE vbr[SECTOR_SIZE];
+    memset(vbr, 0, sizeof(vbr));
+    memcpy(vbr, "\xEB\x52\x90NTFS    ", 11);
+    put_le16(vbr + 0x0B, SECTOR_SIZE);
+    vbr[0x0D] = BENCH_UNIT / SECTOR_SIZE;
+    vbr[0x15] = 0xF8;
+    put_le16(vbr + 0x18, 63);
+    put_le16(vbr + 0x1A, 255);
+    put_le32(vbr + 0x1C, BENCH_PART_LBA);
+    put_le64(vbr + 0x28, d->partSectors - 1);
+    put_le64(vbr + 0x30, BENCH_NTFS_MFT);
+    put_le64(vbr + 0x38, 2);
+    vbr[0x40] = 0xF6;           // 2^10-byte file records
+    vbr[0x44] = 1;
+    put_le16(vbr + 510, 0xAA55);
+
+    // $Bitmap (record 6): one non-resident unnamed $DATA attribute with a single run, then the end marker.
+    BYTE rec[BENCH_NTFS_RECORD];
+    memset(rec, 0, sizeof(rec));
+    memcpy(rec, "FILE", 4);
+    put_le16(rec + 0x04, 0x30);
+    put_le16(rec + 0x06, BENCH_NTFS_RECORD / SECTOR_SIZE + 1);
+    put_le16(rec + 0x10, 1);
+    put_le16(rec + 0x12, 1);
+    put_le16(rec + 0x14, 0x38);
+    put_le16(rec + 0x16, 1);
+    put_le32(rec + 0x18, 0x38 + 0x50 + 8);
+    put_le32(rec + 0x1C, BENCH_NTFS_RECORD);
+    put_le32(rec + 0x2C, 6);
+    BYTE* a = rec + 0x38;
+    put_le32(a, 0x80);
+    put_le32(a + 0x04, 0x50);
+    a[0x08] = 1;
+    put_le16(a + 0x0A, 0x40);
+    put_le64(a + 0x18, bitmapUnits - 1);
+    put_le16(a + 0x20, 0x40);
+    put_le64(a + 0x28, bitmapUnits * BENCH_UNIT);
+    put_le64(a + 0x30, bitmapBytes);
+    put_le64(a + 0x38, bitmapBytes);
+    a[0x40] = 0x44;
+    put_le32(a + 0x41, (DWORD)bitmapUnits);
+    put_le32(a + 0x45, (DWORD)bitmapLcn);
+    put_le32(a + 0x50, 0xFFFFFFFF);
+    // Update sequence: the last two bytes of each sector move into the array and carry the sequence number.
+    put_le16(rec + 0x30, 1);
+    for (int i = 1; i <= BENCH_NTFS_RECORD / SECTOR_SIZE; i++) {
+        memcpy(rec + 0x30 + i * 2, rec + i * SECTOR_SIZE - 2, 2);
+        put_le16(rec + i * SECTOR_SIZE - 2, 1);
+    }
+
+    size_t bytes = (size_t)(bitmapUnits * BENCH_UNIT);
+    BYTE* bitmap = (BYTE*)calloc(1, bytes);
+    if (!bitmap) return 1;
+    for (ULONGLONG u = 0; u < d->fsUnits; u++) {
+        if (bit_get(d->used, u)) bit_set(bitmap, u);
+    }
+    int rc = dev_pwrite(dev, vbr, SECTOR_SIZE, part) != SECTOR_SIZE ||
+             dev_pwrite(dev, vbr, SECTOR_SIZE, part + (d->partSectors - 1) * SECTOR_SIZE) != SECTOR_SIZE ||
+             dev_pwrite(dev, rec, sizeof(rec), part + BENCH_NTFS_MFT * BENCH_UNIT + 6 * BENCH_NTFS_RECORD) !=
+                 (long long)sizeof(rec) ||
+             dev_pwrite(dev, bitmap, bytes, part + bitmapLcn * BENCH_UNIT) != (long long)bytes;
+    free(bitmap);
+    return rc;
+}
+
+// ext4-style layout with 4 KB blocks, 32768 blocks and 2048 inodes per group and sparse superblock backups.
+#define BENCH_EXT_PER_GROUP 32768
+#define BENCH_EXT_INODES    2048
+#define BENCH_EXT_ITABLE    (BENCH_EXT_INODES * 256 / BENCH_UNIT)
+
+static void bench_ext4_super(const BENCH_DISK* d, BYTE sb[1024]) {
+    ULONGLONG groups = (d->fsUnits + BENCH_EXT_PER_GROUP - 1) / BENCH_EXT_PER_GROUP;
+    memset(sb, 0, 1024);
+    put_le32(sb + 0x00, (DWORD)(groups * BENCH_EXT_INODES));
+    put_le32(sb + 0x04, (DWORD)d->fsUnits);
+    put_le32(sb + 0x10, (DWORD)(groups * BENCH_EXT_INODES - 11));
+    put_le32(sb + 0x18, 2);
+    put_le32(sb + 0x1C, 2);
+    put_le32(sb + 0x20, BENCH_EXT_PER_GROUP);
+    put_le32(sb + 0x24, BENCH_EXT_PER_GROUP);
+    put_le32(sb + 0x28, BENCH_EXT_INODES);
+    put_le16(sb + 0x38, EXT_MAGIC);
+    put_le16(sb + 0x3A, 1);
+    put_le16(sb + 0x3C, 1);
+    put_le32(sb + 0x4C, 1);
+    put_le32(sb + 0x54, 11);
+    put_le16(sb + 0x58, 256);
+    put_le32(sb + 0x60, 0x0002 | 0x0040);      // filetype, extents
+    put_le32(sb + 0x64, EXT_RO_COMPAT_SPARSE_SUPER);
+    memcpy(sb + 0x68, "wddx32-bench-ext", 16);
+    memcpy(sb + 0x78, "bench", 5);
+}
+
+// First block after the superblock and descriptor copy group g starts with, if it has one.
+static ULONGLONG bench_ext4_group_meta(const BYTE* sb, ULONGLONG g, ULONGLONG gdtBlocks) {
+    return g * BENCH_EXT_PER_GROUP + (ext_group_has_super(sb, g) ? 1 + gdtBlocks : 0);
+}
+
+static void bench_ext4_plan(BENCH_DISK* d) {
+    d->fsUnits = d->units;
+    if (d->fsUnits % BENCH_EXT_PER_GROUP && d->fsUnits % BENCH_EXT_PER_GROUP < 1024) {
+        d->fsUnits -= d->fsUnits % BENCH_EXT_PER_GROUP;        // mke2fs drops a group too small to be useful
+    }
+    BYTE sb[1024];
+    bench_ext4_super(d, sb);
+    ULONGLONG groups = (d->fsUnits + BENCH_EXT_PER_GROUP - 1) / BENCH_EXT_PER_GROUP;
+    ULONGLONG gdtBlocks = (groups * 32 + BENCH_UNIT - 1) / BENCH_UNIT;
+    for (ULONGLONG g = 0; g < groups; g++) {
+        ULONGLONG at = bench_ext4_group_meta(sb, g, gdtBlocks);
+        bench_meta(d, g * BENCH_EXT_PER_GROUP, at - g * BENCH_EXT_PER_GROUP + 2 + BENCH_EXT_ITABLE);
+    }
+    bench_allocate(d, bench_ext4_group_meta(sb, 0, gdtBlocks) + 2 + BENCH_EXT_ITABLE);
+}
+
+static int bench_ext4_write(const BENCH_DISK* d, DISK_DEV* dev, ULONGLONG part) {
+    BYTE sb[1024];
+    bench_ext4_super(d, sb);
+    ULONGLONG groups = (d->fsUnits + BENCH_EXT_PER_GROUP - 1) / BENCH_EXT_PER_GROUP;
+    ULONGLONG gdtBlocks = (groups * 32 + BENCH_UNIT - 1) / BENCH_UNIT;
+    size_t gdtBytes = (size_t)(gdtBlocks * BENCH_UNIT);
+    BYTE* gdt = (BYTE*)calloc(1, gdtBytes);
+    BYTE* block = (BYTE*)malloc(BENCH_UNIT);
+    if (!gdt || !block) {
+        free(gdt);
+        free(block);
+        return 1;
+    }
+    int rc = 0;
+    for (ULONGLONG g = 0; g < groups && rc == 0; g++) {
+        ULONGLONG start = g * BENCH_EXT_PER_GROUP;
+        ULONGLONG count = d->fsUnits - start < BENCH_EXT_PER_GROUP ? d->fsUnits - start : BENCH_EXT_PER_GROUP;
+        ULONGLONG at = bench_ext4_group_meta(sb, g, gdtBlocks);
+        ULONGLONG free_ = 0;
+        memset(block, 0xFF, BENCH_UNIT);            // bits past the end of the group read as in use
+        for (ULONGLONG b = 0; b < count; b++) {
+            if (bit_get(d->used, start + b)) continue;
+            block[b >> 3] &= (BYTE)~(1 << (b & 7));
+            free_++;
+        }
+        BYTE* desc = gdt + g * 32;
+        put_le32(desc + 0x00, (DWORD)at);
+        put_le32(desc + 0x04, (DWORD)(at + 1));
+        put_le32(desc + 0x08, (DWORD)(at + 2));
+        put_le16(desc + 0x0C, (WORD)free_);
+        put_le16(desc + 0x0E, BENCH_EXT_INODES);
+        if (dev_pwrite(dev, block, BENCH_UNIT, part + at * BENCH_UNIT) != BENCH_UNIT) rc = 1;
+        memset(block, 0xFF, BENCH_UNIT);
+        memset(block, 0, BENCH_EXT_INODES / 8);
+        if (rc == 0 && dev_pwrite(dev, block, BENCH_UNIT, part + (at + 1) * BENCH_UNIT) != BENCH_UNIT) rc = 1;
+    }
+    for (ULONGLONG g = 0; g < groups && rc == 0; g++) {
+        if (!ext_group_has_super(sb, g)) continue;
+        ULONGLONG start = g * BENCH_EXT_PER_GROUP * BENCH_UNIT;
+        put_le16(sb + 0x5A, (WORD)g);
+        // Group 0's superblock sits 1024 bytes into the volume, the backups at the start of their group.
+        if (dev_pwrite(dev, sb, sizeof(sb), part + (g == 0 ? 1024 : start)) != (long long)sizeof(sb) ||
+            dev_pwrite(dev, gdt, gdtBytes, part + start + BENCH_UNIT) != (long long)gdtBytes) {
+            rc = 1;
+        }
+    }
+    free(gdt);
+    free(block);
+    return rc;
+}
+
+// Writes source kind to path: the data pass a megabyte at a time, then the partition table and the filesystem.
+static int bench_generate(const BENCH* b, int kind, const char* path) {
+    BENCH_DISK d;
+    memset(&d, 0, sizeof(d));
+    d.kind = kind;
+    d.size = b->size;
+    BOOL layout = kind >= BENCH_FAT32;
+    if (layout) {
+        d.partSectors = d.size / SECTOR_SIZE - BENCH_PART_LBA;
+        d.units = d.partSectors * SECTOR_SIZE / BENCH_UNIT;
+        d.used = (BYTE*)calloc(1, (size_t)(d.units + 7) / 8);
+        d.meta = (BYTE*)calloc(1, (size_t)(d.units + 7) / 8);
+        if (!d.used || !d.meta) {
+            free(d.used);
+            free(d.meta);
+            return 1;
+        }
+        if (kind == BENCH_FAT32) bench_fat32_plan(&d);
+        else if (kind == BENCH_NTFS) bench_ntfs_plan(&d);
+        else bench_ext4_plan(&d);
+    }
+
+    DISK_DEV dev;
+    BYTE* buf = (BYTE*)alloc_aligned(1024 * 1024);
+    if (!buf || dev_open(&dev, path, DEV_READ | DEV_WRITE | DEV_CREATE)) {
+        if (buf) free_aligned(buf);
+        free(d.used);
+        free(d.meta);
+        return 1;
+    }
+    ULONGLONG part = (ULONGLONG)BENCH_PART_LBA * SECTOR_SIZE;
+    int rc = 0;
+    for (ULONGLONG pos = 0; pos < d.size && rc == 0; pos += 1024 * 1024) {
+        for (size_t at = 0; at < 1024 * 1024; at += BENCH_UNIT) {
+            ULONGLONG o = pos + at;
+            BYTE* p = buf + at;
+            if (kind == BENCH_ZERO) {
+                memset(p, 0, BENCH_UNIT);
+            } else if (kind == BENCH_RANDOM) {
+                bench_noise(p, BENCH_UNIT, o);
+            } else if (kind == BENCH_MIXED) {
+                bench_mixed(p, o);
+            } else if (o < part || (o - part) / BENCH_UNIT >= d.units || bit_get(d.meta, (o - part) / BENCH_UNIT)) {
+                memset(p, 0, BENCH_UNIT);
+            } else if (bit_get(d.used, (o - part) / BENCH_UNIT)) {
+                bench_mixed(p, o);
+            } else {
+                bench_noise(p, BENCH_UNIT, o ^ 0x5A5A5A5A);       // stale data of deleted files
+            }
+        }
+        if (dev_pwrite(&dev, buf, 1024 * 1024, pos) != 1024 * 1024) rc = 1;
+    }
+
+    if (rc == 0 && layout) {
+        static const BYTE types[] = { 0x0C, 0x07, 0x83 };
+        MBR mbr;
+        memset(&mbr, 0, sizeof(mbr));
+        PARTITION_ENTRY* e = &mbr.partitions[0];
+        e->systemID = types[kind - BENCH_FAT32];
+        e->StartingLBA = BENCH_PART_LBA;
+        e->totalSectors = (DWORD)d.partSectors;
+        mbr.signature = 0xAA55;
+        if (dev_pwrite(&dev, &mbr, sizeof(mbr), 0) != sizeof(mbr)) rc = 1;
+        else if (kind == BENCH_FAT32) rc = bench_fat32_write(&d, &dev, part);
+        else if (kind == BENCH_NTFS) rc = bench_ntfs_write(&d, &dev, part);
+        else rc = bench_ext4_write(&d, &dev, part);
+    }
+    if (rc == 0) rc = dev_flush(&dev);
+    dev_close(&dev);
+    free_aligned(buf);
+    free(d.used);
+    free(d.meta);
+    return rc;
+}
+
+// Writes back and evicts a file or device from the page cache so every run starts cold. Windows reads the
+// sources unbuffered already.
+static void bench_drop_cache(const char* path) {
+#if defined(__linux__)
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+#else
+    (void)path;
+#endif
+}
+
+static void bench_usage(BENCH_USAGE* u) {
+#ifdef _WIN32
+    FILETIME created, exited, kernel, user;
+    GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user);
+    ULONGLONG k = ((ULONGLONG)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime;
+    ULONGLONG us = ((ULONGLONG)user.dwHighDateTime << 32) | user.dwLowDateTime;
+    u->cpu = (k + us) / 1e7;
+    IO_COUNTERS io;
+    u->syscalls = GetProcessIoCounters(GetCurrentProcess(), &io)
+                      ? (LONGLONG)(io.ReadOperationCount + io.WriteOperationCount + io.OtherOperationCount) : -1;
+#else
+    struct rusage r;
+    getrusage(RUSAGE_SELF, &r);
+    u->cpu = r.ru_utime.tv_sec + r.ru_stime.tv_sec + (r.ru_utime.tv_usec + r.ru_stime.tv_usec) / 1e6;
+    u->syscalls = -1;
+    FILE* f = fopen("/proc/self/io", "r");
+    if (f) {
+        char line[128];
+        unsigned long long n;
+        u->syscalls = 0;
+        while (fgets(line, sizeof(line), f)) {
+            if (sscanf(line, "syscr: %llu", &n) == 1 || sscanf(line, "syscw: %llu", &n) == 1) u->syscalls += (LONGLONG)n;
+        }
+        fclose(f);
+    }
+#endif
+}
+
+// Sends stdout to the null device for the duration of a run; the paths under test print their own progress.
+static int bench_mute(void) {
+    fflush(stdout);
+#ifdef _WIN32
+    int saved = _dup(_fileno(stdout));
+    int nul = _open("NUL", _O_WRONLY);
+    if (nul >= 0) {
+        _dup2(nul, _fileno(stdout));
+        _close(nul);
+    }
+#else
+    int saved = dup(STDOUT_FILENO);
+    int nul = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (nul >= 0) {
+        dup2(nul, STDOUT_FILENO);
+        close(nul);
+    }
+#endif
+    return saved;
+}
+
+static void bench_unmute(int saved) {
+    fflush(stdout);
+    if (saved < 0) return;
+#ifdef _WIN32
+    _dup2(saved, _fileno(stdout));
+    _close(saved);
+#else
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+#endif
+}
+
+static void bench_path(const BENCH* b, const char* name, char* out, size_t size) {
+    snprintf(out, size, "%s/%s", b->dir, name);
+}
+
+// Removes an image and everything create leaves next to it.
+static void bench_remove_image(const char* path) {
+    static const char* const suffixes[] = { "", ".wdh", ".wdj", ".wdm" };
+    char p[600];
+    for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+        snprintf(p, sizeof(p), "%s%s", path, suffixes[i]);
+        remove(p);
+    }
+}
+
+// Empties and removes a dedup store so the next run stores every chunk again.
+static void bench_remove_store(const char* store) {
+    char path[700];
+    for (int i = 0; i < 256; i++) {
+        snprintf(path, sizeof(path), "%s/chunks/%02x", store, i);
+#ifdef _WIN32
+        char pattern[720], file[1000];
+        WIN32_FIND_DATAA fd;
+        snprintf(pattern, sizeof(pattern), "%s/*", path);
+        HANDLE h = FindFirstFileA(pattern, &fd);
+        if (h != INVALID_HANDLE_VALUE) {
+            do {
+                if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) continue;
+                snprintf(file, sizeof(file), "%s/%s", path, fd.cFileName);
+                DeleteFileA(file);
+            } while (FindNextFileA(h, &fd));
+            FindClose(h);
+        }
+        RemoveDirectoryA(path);
+#else
+        DIR* dir = opendir(path);
+        if (dir) {
+            struct dirent* de;
+            char file[1000];
+            while ((de = readdir(dir)) != NULL) {
+                if (de->d_name[0] == '.') continue;
+                snprintf(file, sizeof(file), "%s/%s", path, de->d_name);
+                unlink(file);
+            }
+            closedir(dir);
+        }
+        rmdir(path);
+#endif
+    }
+    snprintf(path, sizeof(path), "%s/chunks", store);
+#ifdef _WIN32
+    RemoveDirectoryA(path);
+    RemoveDirectoryA(store);
+#else
+    rmdir(path);
+    rmdir(store);
+#endif
+}
+
+// Writes s as a JSON string.
+void json_string(FILE* f, const char* s) {
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') fprintf(f, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20) fprintf(f, "\\u%04x", *s);
+        else fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+static ULONGLONG bench_file_size(const char* path) {
+    DISK_DEV dev;
+    if (dev_open(&dev, path, DEV_READ)) return 0;
+    ULONGLONG size = dev.size;
+    dev_close(&dev);
+    return size;
+}
+
+// Runs one case --runs times: input is the source disk (create) or the image (write), output the image (create)
+// or the target (write). bytes is what the case moves, for the throughput figures.
+static void bench_case(BENCH* b, const BENCH_CASE* c, const char* input, const char* output, ULONGLONG bytes) {
+    if (c->blockSize && (ULONGLONG)c->blockSize * c->queueDepth > BENCH_MAX_BUFS) return;
+    char store[600];
+    bench_path(b, "store", store, sizeof(store));
+    BOOL create = strcmp(c->op, "create") == 0;
+
+    for (int run = 1; run <= b->runs; run++) {
+        g_opts = b->opts;
+        g_opts.format = c->format;
+        g_opts.usedOnly = c->usedOnly;
+        g_opts.engine = c->engine;
+        g_opts.blockSize = c->blockSize;
+        g_opts.queueDepth = c->blockSize ? c->queueDepth : 0;
+        if (g_opts.tune == TUNE_AUTO) g_opts.tune = TUNE_OFF;     // default runs measure the defaults
+        if (c->format == FORMAT_DEDUP) g_opts.store = store;
+        if (!create && !c->onDevice) {          // a fresh, empty target file every run
+            DISK_DEV t;
+            if (dev_open(&t, output, DEV_WRITE | DEV_CREATE) == 0) dev_close(&t);
+        }
+        bench_drop_cache(input);
+
+        BENCH_USAGE u0, u1;
+        iostat_reset();
+        bench_usage(&u0);
+        ULONGLONG t0 = now_ns();
+        int saved = bench_mute();
+        int rc;
+        if (create) {
+            rc = c->part ? crtPartImage(input, c->part, output) : crtFullDiskImage(input, output);
+        } else {
+            rc = c->part ? wrtImg_Disk_part(output, c->part, input) : wrtImg_Disk(output, input);
+        }
+        bench_unmute(saved);
+        double seconds = (now_ns() - t0) / 1e9;
+        bench_usage(&u1);
+        if (create) bench_remove_image(output);
+        if (c->format == FORMAT_DEDUP) bench_remove_store(store);
+
+        double mbps = seconds > 0 ? bytes / (1024.0 * 1024.0) / seconds : 0;
+        double cpuPerGB = bytes ? (u1.cpu - u0.cpu) / (bytes / (1024.0 * 1024 * 1024)) : 0;
+        LONGLONG syscalls = u0.syscalls < 0 || u1.syscalls < 0 ? -1 : u1.syscalls - u0.syscalls;
+        const char* engine = iostat_engine();     // what actually ran: uring may have fallen back, or no raw copy ran
+        b->total++;
+        if (rc) b->failed++;
+
+        fprintf(b->out, "{\"type\":\"run\",\"op\":\"%s\",\"source\":\"%s\",\"on\":\"%s\",\"part\":", c->op,
+                bench_sources[c->source], c->onDevice ? "device" : "file");
+        if (c->part) json_string(b->out, c->part);
+        else fputs("null", b->out);
+        fprintf(b->out, ",\"format\":\"%s\",\"usedOnly\":%s,\"engine\":", bench_formats[c->format],
+                c->usedOnly ? "true" : "false");
+        if (engine) fprintf(b->out, "\"%s\"", engine);
+        else fputs("null", b->out);
+        fprintf(b->out, ",\"bs\":%llu,\"qd\":%d,\"run\":%d,"
+                "\"ok\":%s,\"bytes\":%llu,\"seconds\":%.6f,\"mbps\":%.1f,\"cpuSecPerGB\":%.3f,\"syscalls\":%lld,"
+                "\"uringEnters\":%lld,", (ULONGLONG)c->blockSize, g_opts.queueDepth, run, rc ? "false" : "true", bytes, seconds, mbps,
+                cpuPerGB, syscalls, (LONGLONG)g_iostat.submits);
+        const LAT_HIST* h[2] = { &g_iostat.read, &g_iostat.write };
+        const char* names[2] = { "read", "write" };
+        for (int i = 0; i < 2; i++) {
+            fprintf(b->out, "\"%ss\":%lld,\"%sBytes\":%lld,\"%sP50Us\":%.1f,\"%sP99Us\":%.1f,\"%sP999Us\":%.1f,"
+                    "\"%sMaxUs\":%.1f%s", names[i], (LONGLONG)h[i]->requests, names[i], (LONGLONG)h[i]->bytes,
+                    names[i], lat_percentile(h[i], 0.5) / 1e3, names[i], lat_percentile(h[i], 0.99) / 1e3,
+                    names[i], lat_percentile(h[i], 0.999) / 1e3, names[i], lat_percentile(h[i], 1.0) / 1e3,
+                    i == 0 ? "," : "}\n");
+        }
+        fflush(b->out);
+
+        char io[40] = "default";
+        if (c->blockSize) snprintf(io, sizeof(io), "%s bs %lluK qd %d", engine ? engine : "-", (ULONGLONG)c->blockSize / 1024, c->queueDepth);
+        printf("%-6s %-6s %-6s %-5s %-3s %-9s %-24s %9.1f MB/s %7.2f cpu-s/GB  p99 read %8.1f us  write %8.1f us%s\n",
+               c->op, bench_sources[c->source], c->onDevice ? "device" : "file", bench_formats[c->format],
+               c->part ? c->part : "-", c->usedOnly ? "used-only" : "", io, mbps, cpuPerGB,
+               lat_percentile(&g_iostat.read, 0.99) / 1e3, lat_percentile(&g_iostat.write, 0.99) / 1e3,
+               rc ? "  FAILED" : "");
+    }
+    g_opts = b->opts;
+}
+
+// Runs case c once for every engine, block size and queue depth of the matrix.
+static void bench_matrix(BENCH* b, BENCH_CASE c, const char* input, const char* output, ULONGLONG bytes) {
+    static const size_t sizes[] = { 256 * 1024, 1024 * 1024, 4 * 1024 * 1024, 16 * 1024 * 1024 };
+    static const int depths[] = { 4, 32 };
+#ifdef __linux__
+    static const int engines[] = { ENGINE_URING, ENGINE_THREADED };
+#else
+    static const int engines[] = { ENGINE_THREADED };
+#endif
+    for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            for (size_t q = 0; q < sizeof(depths) / sizeof(depths[0]); q++) {
+                if (b->quick && (sizes[s] != 1024 * 1024 || depths[q] != 32)) continue;
+                c.engine = engines[e];
+                c.blockSize = sizes[s];
+                c.queueDepth = depths[q];
+                bench_case(b, &c, input, output, bytes);
+            }
+        }
+    }
+}
+
+// Makes an input image for the write runs, unmeasured. Returns 0 on success.
+static int bench_prepare(BENCH* b, const char* disk, const char* part, int format, const char* image) {
+    g_opts = b->opts;
+    g_opts.format = format;
+    g_opts.tune = TUNE_OFF;
+    int saved = bench_mute();
+    int rc = part ? crtPartImage(disk, part, image) : crtFullDiskImage(disk, image);
+    bench_unmute(saved);
+    g_opts = b->opts;
+    return rc;
+}
+
+static void bench_source(BENCH* b, int kind) {
+    char source[600], image[600], target[600], input[600];
+    bench_path(b, "source.img", source, sizeof(source));
+    bench_path(b, "out.img", image, sizeof(image));
+    bench_path(b, "target.img", target, sizeof(target));
+    BOOL layout = kind >= BENCH_FAT32;
+    ULONGLONG partBytes = layout ? b->size - (ULONGLONG)BENCH_PART_LBA * SECTOR_SIZE : 0;
+
+    printf("Generating %s source (%.0f MB)\n", bench_sources[kind], b->size / (1024.0 * 1024.0));
+    if (bench_generate(b, kind, source)) {
+        printf("Failed to generate %s in %s. Error: %lu\n", source, b->dir, dev_last_error());
+        b->failed++;
+        return;
+    }
+    int places = 1;
+    if (b->device) {
+        g_opts = b->opts;
+        int saved = bench_mute();
+        int rc = wrtImg_Disk(b->device, source);
+        bench_unmute(saved);
+        g_opts = b->opts;
+        if (rc) printf("Failed to put the %s source on %s; device runs skipped\n", bench_sources[kind], b->device);
+        else places = 2;
+    }
+
+    BENCH_CASE c;
+    memset(&c, 0, sizeof(c));
+    c.source = kind;
+    c.engine = b->opts.engine;
+    for (int on = 0; on < places; on++) {
+        const char* disk = on ? b->device : source;
+        ULONGLONG bytes = on ? bench_file_size(b->device) : b->size;
+        c.op = "create";
+        c.onDevice = on;
+        c.part = NULL;
+        c.format = FORMAT_RAW;
+        c.usedOnly = FALSE;
+        bench_matrix(b, c, disk, image, bytes);
+        if (on) continue;
+        static const int formats[] = { FORMAT_WDX, FORMAT_DEDUP, FORMAT_QCOW2, FORMAT_VHDX, FORMAT_VMDK };
+        for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+            c.format = formats[f];
+            bench_case(b, &c, disk, image, bytes);
+        }
+        if (layout) {
+            c.part = "0";
+            c.format = FORMAT_RAW;
+            bench_case(b, &c, disk, image, partBytes);
+            c.usedOnly = TRUE;
+            bench_case(b, &c, disk, image, partBytes);
+            c.format = FORMAT_WDX;
+            bench_case(b, &c, disk, image, partBytes);
+        }
+    }
+
+    // Writes: the raw image across the matrix, the containers at their defaults, a partition image on its own.
+    memset(&c, 0, sizeof(c));
+    c.op = "write";
+    c.source = kind;
+    c.engine = b->opts.engine;
+    bench_path(b, "in.img", input, sizeof(input));
+    if (bench_prepare(b, source, NULL, FORMAT_RAW, input) == 0) {
+        for (int on = 0; on < places; on++) {
+            c.onDevice = on;
+            bench_matrix(b, c, input, on ? b->device : target, b->size);
+        }
+    } else {
+        b->failed++;
+    }
+    bench_remove_image(input);
+    static const int containers[] = { FORMAT_WDX, FORMAT_QCOW2 };
+    for (size_t f = 0; f < sizeof(containers) / sizeof(containers[0]); f++) {
+        snprintf(input, sizeof(input), "%s/in.%s", b->dir, bench_formats[containers[f]]);
+        c.format = containers[f];
+        if (bench_prepare(b, source, NULL, containers[f], input) == 0) {
+            bench_case(b, &c, input, target, b->size);
+        } else {
+            b->failed++;
+        }
+        bench_remove_image(input);
+    }
+    if (layout) {
+        bench_path(b, "in-part.img", input, sizeof(input));
+        c.format = FORMAT_RAW;
+        c.part = "0";
+        if (bench_prepare(b, source, "0", FORMAT_RAW, input) == 0) {
+            bench_case(b, &c, input, target, partBytes);
+        } else {
+            b->failed++;
+        }
+        bench_remove_image(input);
+    }
+    remove(target);
+    remove(source);
+}
+
+int bench_run(BENCH* b) {
+    if (make_dir(b->dir)) {
+        printf("Cannot create %s. Error: %lu\n", b->dir, dev_last_error());
+        return 1;
+    }
+    char results[600];
+    if (!b->out) {
+        bench_path(b, "bench.jsonl", results, sizeof(results));
+        b->out = fopen(results, "a");
+        if (!b->out) {
+            printf("Cannot open %s\n", results);
+            return 1;
+        }
+    }
+    b->opts = g_opts;
+    g_iostat.enabled = TRUE;
+
+    fprintf(b->out, "{\"type\":\"host\",\"tool\":\"wddx32\",\"time\":%lld,\"cpus\":%d,\"zeroIsa\":\"%s\",\"size\":%llu,"
+            "\"runs\":%d,\"quick\":%s,\"dir\":", (long long)time(NULL), cpu_count(), zero_detect_isa(), b->size,
+            b->runs, b->quick ? "true" : "false");
+    json_string(b->out, b->dir);
+    fputs(",\"device\":", b->out);
+    if (b->device) json_string(b->out, b->device);
+    else fputs("null", b->out);
+    fputs("}\n", b->out);
+
+    for (int kind = 0; kind < BENCH_SOURCES; kind++) {
+        if (b->only < 0 || b->only == kind) bench_source(b, kind);
+    }
+    g_iostat.enabled = FALSE;
+    printf("\n%d runs, %d failed\n", b->total, b->failed);
+    fclose(b->out);
+    return b->failed ? 1 : 0;
+}
 
 
 
@@ -934,17 +9524,63 @@ int main(int argc, char* argv[]) {
      printf("  %d:  %s  \n", i, argv[i]            )   ;
   }
 //return 0;
+    if (argc < 2) {
+        printf("error <command>  (see: wddx32 help)\n");
+        return 1;
+    }
+
     if (strcmp(argv[1], "help") == 0) {      //=====================================
         printf("  wddx32 help \n"    );
         printf("  wddx32 list \n"    );
         //          0       1         2   3     4      5         6         7           8       9
         printf("  wddx32 create    --disk 0  --output disk0.img                                               \n"   );
         printf("  wddx32 create    --disk 0  --part   0        --output  part0.img                            \n"   );
+        printf("  wddx32 create    --disk 0  --part   0        --output  part0.img      --used-only           \n"   );
+        printf("  wddx32 create    --input disk0.img   --part 1     --output  part1.img   (reflink/copy_file_range)  \n"   );
+        printf("  wddx32 create    --disk 0  --output disk0.wdx     --format wdx   --threads 8   --level 3        \n"   );
+        printf("  wddx32 create    --disk 0  --output disk0.man     --format dedup --store D:\\store              \n"   );
+        printf("  wddx32 create    --disk 0  --output disk0.qcow2   --format qcow2                               \n"   );
+        printf("  wddx32 create    --disk 0  --output disk0.vhdx    --format vhdx      (or vhd)                  \n"   );
+        printf("  wddx32 create    --disk 0  --output disk0.vmdk    --format vmdk  --threads 8                   \n"   );
+        printf("  wddx32 create    --disk 0  --output night2.wdx    --base night1.wdx                            \n"   );
+        printf("  wddx32 create    --disk 0  --output rescue.img    --rescue   [--fill 0]   [--resume]             \n"   );
 
         printf("  wddx32 dumpmeta  --disk 0  --type   mbr      --output  mbr0.bin                             \n"   );
         printf("  wddx32 dumpmeta  --disk 0  --type   boot     --part    0         --output   bootsector.bin  \n"   );
 
         printf("  wddx32 write     --disk 0  --part   0        --input   part0.img                            \n"   );
+        printf("  wddx32 write     --disk 0  --input  disk0.img    --verify                                        \n"   );
+        printf("  wddx32 write     --disk 0  --input  disk0.img    --changed-only                                  \n"   );
+        printf("  wddx32 write     --disk 0  --input  disk0.img    --resume                                        \n"   );
+        printf("  wddx32 write     --disk 1  --disk 2  --disk 3    --input  disk0.img    [--eject]                 \n"   );
+
+        printf("  wddx32 diff      --input night1.img  --input night2.wdx                                     \n"   );
+        printf("  wddx32 diff      --input disk0.img   --disk  0                                              \n"   );
+        printf("  wddx32 bench     --dir   /tmp/wbench --size  256M  [--runs 3] [--quick] [--disk /dev/loop0]     \n"   );
+        printf("                                                                                              \n"   );
+        printf("  --disk takes a drive number or a path (/dev/sdb, /dev/nvme0n1, /dev/loop0, disk.img)        \n"   );
+        printf("  --part takes 0-3 on MBR disks, 4 and up for the logical drives (see list); on GPT disks an     \n"   );
+        printf("  entry index 0-127 or the partition GUID                                                    \n"   );
+        printf("  create/write options:  --engine auto|uring|threaded   --bs 1M   --qd 32   --no-sparse         \n"   );
+        printf("  every image gets a <image>.wdh sidecar of chunk SHA-256s; write checks against it           \n"   );
+        printf("  diff walks the Merkle trees of two sidecars and prints the LBA ranges that differ; exit code  \n"   );
+        printf("  0 = identical, 1 = different, 2 = error. Operands without a current sidecar are hashed first \n"   );
+        printf("  write accepts .img, .wdx, dedup manifests and qcow2; --threads sets the (de)compression workers\n"   );
+        printf("  qcow2, vhd, vhdx and vmdk (streamOptimized) output store only clusters/blocks with data and \n"   );
+        printf("  open directly in QEMU/KVM, Hyper-V, ESXi or VirtualBox; vhd, vhdx and vmdk are output only  \n"   );
+        printf("  write --changed-only reads the target alongside the image and rewrites only 4K grains that differ\n"   );
+        printf("  raw create/write checkpoint to a .wdj journal; after a failure rerun with --resume           \n"   );
+        printf("  raw create/write on a drive first probe block sizes and queue depths and keep the fastest;  \n"   );
+        printf("  the result is cached per drive in ~/.wddx32.tune. --retune probes again, --tune probes image \n"   );
+        printf("  files too, --no-tune keeps the defaults                                                     \n"   );
+        printf("  --telemetry fd:3 | unix:/run/wddx32.sock | file streams JSON lines of progress, throughput, \n"   );
+        printf("  ETA, read/compute/write latency and per-stage queue occupancy; --telemetry-interval 1000 (ms)\n"   );
+        printf("  create --rescue copies past read errors: large blocks first, then the failed ones bisected   \n"   );
+        printf("  down to sectors; progress and bad areas go to a <image>.wdm map, unreadable sectors are filled\n"   );
+        printf("  write to several --disk reads the image once for all of them; --eject drops a failing disk   \n"   );
+        printf("  bench generates zero/random/mixed/fat32/ntfs/ext4 sources in --dir, times create and write   \n"   );
+        printf("  across --engine, --bs and --qd and appends JSON lines to --output (default <dir>/bench.jsonl);\n"   );
+        printf("  --source picks one source; --disk is overwritten with each source and used as a target too  \n"   );
         return 0;
 
     }else if (strcmp(argv[1], "list")   == 0) {      //=====================================
@@ -952,43 +9588,64 @@ int main(int argc, char* argv[]) {
         return 0;
 
     }else if (strcmp(argv[1], "create") == 0) {      //=====================================
-        int diskNum = -1;
-        int partNum = -1;
+        char diskPath[512];
+        const char *disk = NULL;
+        const char *inpFile = NULL;
+        const char *part = NULL;
         char *outFile = NULL;
 
-        for(int i = 2; i < argc-1; ++i) {
-            if (strcmp(argv[i], "--disk") == 0) {       diskNum = atoi(argv[++i]);      }
-            if (strcmp(argv[i], "--part") == 0) {       partNum = atoi(argv[++i]);      }
-            if (strcmp(argv[i], "--output") == 0) {     outFile = argv[++i];            }
-        }
-        //printf("\tCreate %d  %d  %s\n", diskNum, partNum, outFile);
-        if (diskNum >=0 && partNum >= 0 && outFile!=NULL) {
-            crtPartImage(diskNum, partNum, outFile);
-        }else if (diskNum >= 0 && outFile!=NULL) {
-            crtFullDiskImage(diskNum, outFile);
+        for(int i = 2; i < argc; ++i) {
+            if (strcmp(argv[i], "--disk") == 0 && i + 1 < argc) {
+                if ((disk = disk_path(argv[++i], diskPath, sizeof(diskPath))) == NULL) return 1;
+            }
+            if (strcmp(argv[i], "--input") == 0 && i + 1 < argc) {      inpFile = argv[++i];            }
+            if (strcmp(argv[i], "--part") == 0 && i + 1 < argc) {       part = argv[++i];               }
+            if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {     outFile = argv[++i];            }
+            int used = parse_io_option(argc, argv, i);
+            if (used < 0) return 1;
+            i += used;
+        }
+        //printf("\tCreate %s  %s  %s\n", disk, part, outFile);
+        if (disk && inpFile) {
+            printf("--disk and --input both name the source, give one\n");
+            return 1;
+        }
+        if (inpFile) disk = inpFile;        // an image file read as a disk: its own partition table, its own offsets
+        if (g_opts.rescue && (g_opts.format != FORMAT_RAW || g_opts.base)) {
+            printf("--rescue writes raw images only\n");
+            return 1;
+        }
+        if (disk!=NULL && part!=NULL && outFile!=NULL) {
+            if (telemetry_start("create")) return 1;
+            return telemetry_stop(crtPartImage(disk, part, outFile));
+        }else if (disk!=NULL && outFile!=NULL) {
+            if (telemetry_start("create")) return 1;
+            return telemetry_stop(crtFullDiskImage(disk, outFile));
         }else{
-            printf("error <options> Create %d   %d  %s\n", diskNum, partNum, outFile);
+            printf("error <options> Create %s   %s  %s\n", disk ? disk : "-", part ? part : "-", outFile ? outFile : "-");
             return 1;
         }
-        return 0;
 
     } else if (strcmp(argv[1], "dumpmeta") == 0) {      //=====================================
-        int diskNum = -1;
-        int partNum = -1;
+        char diskPath[512];
+        const char *disk = NULL;
+        const char *part = NULL;
         char *type = NULL;
         char *outFile = NULL;
 
         for(int i = 2; i < argc-1; ++i) {
-            if (strcmp(argv[i], "--disk") == 0) {      diskNum = atoi(argv[++i]);       }
+            if (strcmp(argv[i], "--disk") == 0) {
+                if ((disk = disk_path(argv[++i], diskPath, sizeof(diskPath))) == NULL) return 1;
+            }
             if (strcmp(argv[i], "--type") == 0) {      type = argv[++i];                }
-            if (strcmp(argv[i], "--part") == 0) {      partNum = atoi(argv[++i]);       }
+            if (strcmp(argv[i], "--part") == 0) {      part = argv[++i];                }
             if (strcmp(argv[i], "--output") == 0) {    outFile = argv[++i];             }
         }
 
-        if (strcmp(type, "mbr") == 0 && partNum < 0 && outFile!=NULL) {
-            DumpMBRToBin(diskNum, outFile);
-        }else if (strcmp(type, "boot") == 0 && partNum >= 0 && outFile!=NULL) {
-            DumpBootToBin(diskNum, partNum, outFile);
+        if (disk!=NULL && type!=NULL && strcmp(type, "mbr") == 0 && part == NULL && outFile!=NULL) {
+            DumpMBRToBin(disk, outFile);
+        }else if (disk!=NULL && type!=NULL && strcmp(type, "boot") == 0 && part != NULL && outFile!=NULL) {
+            DumpBootToBin(disk, part, outFile);
         }else{
             printf("error <options> Dumpmeta \n");
             return 1;
@@ -996,26 +9653,120 @@ int main(int argc, char* argv[]) {
         return 0;
 
     }else if (strcmp(argv[1], "write") == 0  ) {      //=====================================
-        int diskNum = -1;
-        int partNum = -1;
+        char diskPath[FANOUT_MAX][512];
+        const char *disks[FANOUT_MAX];
+        int diskCount = 0;
+        const char *disk = NULL;
+        const char *part = NULL;
         char *inpFile = NULL;
 
-        for(int i = 2; i < argc-1; ++i) {
-            if (strcmp(argv[i], "--disk") == 0) {    diskNum = atoi(argv[++i]);      }
-            if (strcmp(argv[i], "--part") == 0) {     partNum = atoi(argv[++i]);      }
-            if (strcmp(argv[i], "--input") == 0) {    inpFile = argv[++i];            }
+        for(int i = 2; i < argc; ++i) {
+            if (strcmp(argv[i], "--disk") == 0 && i + 1 < argc) {
+                if (diskCount == FANOUT_MAX) {
+                    printf("At most %d --disk targets\n", FANOUT_MAX);
+                    return 1;
+                }
+                disk = disks[diskCount] = disk_path(argv[++i], diskPath[diskCount], sizeof(diskPath[diskCount]));
+                if (!disk) return 1;
+                for (int j = 0; j < diskCount; j++) {
+                    if (strcmp(disks[j], disk) == 0) {
+                        printf("%s is given twice\n", disk);
+                        return 1;
+                    }
+                }
+                diskCount++;
+            }
+            if (strcmp(argv[i], "--part") == 0 && i + 1 < argc) {     part = argv[++i];               }
+            if (strcmp(argv[i], "--input") == 0 && i + 1 < argc) {    inpFile = argv[++i];            }
+            int used = parse_io_option(argc, argv, i);
+            if (used < 0) return 1;
+            i += used;
         }
 
-        if (diskNum >=0 &&  partNum >= 0 && inpFile!=NULL) {
-            wrtImg_Disk_part(diskNum, partNum, inpFile);
-        }else if (diskNum >=0 && inpFile!=NULL) {
-            wrtImg_Disk(diskNum, inpFile);
+        if (diskCount > 1 && (part != NULL || g_opts.resume)) {
+            printf("--part and --resume take a single --disk\n");
+            return 1;
+        }else if (diskCount > 1 && inpFile!=NULL) {
+            if (telemetry_start("write")) return 1;
+            return telemetry_stop(wrtImg_Disks(disks, diskCount, inpFile));
+        }else if (disk!=NULL && part != NULL && inpFile!=NULL) {
+            if (telemetry_start("write")) return 1;
+            return telemetry_stop(wrtImg_Disk_part(disk, part, inpFile));
+        }else if (disk!=NULL && inpFile!=NULL) {
+            if (telemetry_start("write")) return 1;
+            return telemetry_stop(wrtImg_Disk(disk, inpFile));
         }else{
             printf("error <options> Write \n");
             return 1;
         }
 
-        return 0;
+    }else if (strcmp(argv[1], "diff") == 0  ) {      //=====================================
+        char diskPath[2][512];
+        const char *paths[2] = { NULL, NULL };
+        int count = 0;
+
+        for(int i = 2; i < argc; ++i) {
+            if (strcmp(argv[i], "--input") == 0 && i + 1 < argc && count < 2) {   paths[count++] = argv[++i];     }
+            else if (strcmp(argv[i], "--disk") == 0 && i + 1 < argc && count < 2) {
+                paths[count] = disk_path(argv[++i], diskPath[count], sizeof(diskPath[count]));
+                if (!paths[count]) return 1;
+                count++;
+            }
+            int used = parse_io_option(argc, argv, i);
+            if (used < 0) return 2;
+            i += used;
+        }
+
+        if (count == 2) {
+            return diff_images(paths[0], paths[1]);
+        }
+        printf("error <options> Diff \n");
+        return 2;
+
+    }else if (strcmp(argv[1], "bench") == 0  ) {      //=====================================
+        char diskPath[512];
+        BENCH b;
+        memset(&b, 0, sizeof(b));
+        b.size = 256ULL * 1024 * 1024;
+        b.runs = 1;
+        b.only = -1;
+
+        for(int i = 2; i < argc; ++i) {
+            if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc) {      b.dir = argv[++i];              }
+            else if (strcmp(argv[i], "--disk") == 0 && i + 1 < argc) {
+                if ((b.device = disk_path(argv[++i], diskPath, sizeof(diskPath))) == NULL) return 1;
+            }
+            else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {    b.size = parse_size(argv[++i]);   }
+            else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {    b.runs = atoi(argv[++i]);         }
+            else if (strcmp(argv[i], "--quick") == 0) {                   b.quick = TRUE;                   }
+            else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+                b.out = fopen(argv[++i], "a");
+                if (!b.out) {
+                    printf("Cannot open %s\n", argv[i]);
+                    return 1;
+                }
+            }
+            else if (strcmp(argv[i], "--source") == 0 && i + 1 < argc) {
+                ++i;
+                for (int k = 0; k < BENCH_SOURCES; k++) {
+                    if (strcmp(argv[i], bench_sources[k]) == 0) b.only = k;
+                }
+                if (b.only < 0) {
+                    printf("Unknown source %s (zero, random, mixed, fat32, ntfs, ext4)\n", argv[i]);
+                    return 1;
+                }
+            }
+            int used = parse_io_option(argc, argv, i);
+            if (used < 0) return 1;
+            i += used;
+        }
+
+        if (b.size < BENCH_MIN_SIZE || b.size % (1024 * 1024) || b.runs < 1 || !b.dir) {
+            printf("error <options> Bench: --dir is required, --size a multiple of 1M from 64M, --runs 1 or more\n");
+            if (b.out) fclose(b.out);
+            return 1;
+        }
+        return bench_run(&b);
     }
 
     return 1;